@@ -21,13 +21,48 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <conio.h>
+#include <math.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#include <immintrin.h>
+#define PATTERN_SIMD
+#endif
 
 #include "lusb0_usb.h"
 
 #define _BENCHMARK_VER_ONLY
 #include "benchmark_rc.rc"
 
-#define MAX_OUTSTANDING_TRANSFERS 10
+// The transfer handles are allocated with the transfer param, this is only a
+// sanity limit.
+#define MAX_OUTSTANDING_TRANSFERS 256
+
+// Maximum number of buffer sizes and buffer counts in a sweep grid.
+#define MAX_SWEEP_VALUES 16
+
+// Limits of a concurrent test, see CreateTestStreams().
+#define MAX_TEST_DEVICES 16
+#define MAX_TEST_ENDPOINTS 8
+#define MAX_TEST_THREADS 16
+#define MAX_TEST_STREAMS 64
+
+// Size of the buffer verifybench checks per pass.
+#define VERIFY_BENCH_BUFFER_SIZE (16 * 1024 * 1024)
+
+// USBD packet status of iso packets the host controller didn't get to in
+// time, see IsoRecordTransfer().
+#define ISO_STATUS_NOT_ACCESSED_BY_HW	0xC0020000
+#define ISO_STATUS_NA_LATE_USBPORT		0xC0040000
+#define ISO_STATUS_NOT_ACCESSED_LATE	0xC0050000
+
+// Latency histogram layout. Values below LATENCY_SUB_BUCKET_COUNT ns get
+// their own bucket, above that every power of two range is split into
+// LATENCY_SUB_BUCKET_COUNT/2 buckets. This keeps the error below 1/64 up
+// to 2^40 ns (about 18 minutes), like an HDR histogram.
+#define LATENCY_SUB_BUCKET_BITS 7
+#define LATENCY_SUB_BUCKET_COUNT (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKET_COUNT ((40 - LATENCY_SUB_BUCKET_BITS + 1) * (LATENCY_SUB_BUCKET_COUNT / 2) + LATENCY_SUB_BUCKET_COUNT / 2)
 
 // This is used only in VerifyData() for display information
 // about data validation mismatches.
@@ -35,7 +70,7 @@
 
 // All output is directed through these macros.
 //
-#define LOG(LogTypeString,format,...)  printf("%s[" __FUNCTION__ "] "format, LogTypeString, __VA_ARGS__)
+#define LOG(LogTypeString,format,...)  fprintf(LogStream, "%s[" __FUNCTION__ "] "format, LogTypeString, __VA_ARGS__)
 #define CONERR(format,...) LOG("Error:",format,__VA_ARGS__)
 #define CONMSG(format,...) LOG("",format,__VA_ARGS__)
 #define CONWRN(format,...) LOG("Warn:",format,__VA_ARGS__)
@@ -68,6 +103,33 @@ enum BENCHMARK_DEVICE_TEST_TYPE
     TestTypeLoop	= TestTypeRead|TestTypeWrite,
 };
 
+// Format of the results. The json and csv formats go to stdout, the console
+// messages move to stderr.
+enum BENCHMARK_OUTPUT_FORMAT
+{
+	OUTPUT_FORMAT_TEXT,
+	OUTPUT_FORMAT_JSON,
+	OUTPUT_FORMAT_CSV,
+};
+
+// Tests of the non-data paths, see RunControlTest().
+enum BENCHMARK_CONTROL_TEST
+{
+	CONTROL_TEST_NONE,
+
+	// Vendor control request round trips.
+	CONTROL_TEST_VENDOR,
+
+	// GET_DESCRIPTOR requests answered from the driver cache and by the device.
+	CONTROL_TEST_DESCRIPTOR,
+
+	// usb_open() and usb_close() of the test device.
+	CONTROL_TEST_OPENCLOSE,
+
+	// usb_find_busses() and usb_find_devices().
+	CONTROL_TEST_ENUMERATE,
+};
+
 // This software was mainly created for testing the libusb-win32 kernel & user driver.
 enum BENCHMARK_TRANSFER_MODE
 {
@@ -78,6 +140,27 @@ enum BENCHMARK_TRANSFER_MODE
     TRANSFER_MODE_ASYNC,
 };
 
+// Compare functions for VerifyData(), see PatternSelect().
+enum PATTERN_LEVEL
+{
+	PATTERN_LEVEL_SCALAR,
+	PATTERN_LEVEL_SSE2,
+	PATTERN_LEVEL_AVX2,
+
+	// Only measured by verifybench.
+	PATTERN_LEVEL_MEMCMP,
+};
+
+// Returns the offset of the first byte that differs or -1.
+typedef INT (*PATTERN_COMPARE)(const BYTE* data, const BYTE* expected, INT length);
+
+// User and kernel time in 100ns units, see GetProcessCpuTime().
+struct BENCHMARK_CPU_TIME
+{
+	LONGLONG User;
+	LONGLONG Kernel;
+};
+
 // Holds all of the information about a test.
 struct BENCHMARK_TEST_PARAM
 {
@@ -88,6 +171,11 @@ struct BENCHMARK_TEST_PARAM
     INT Intf;			// Interface number
 	INT	Altf;			// Alt Interface number
     INT Ep;				// Endpoint number (1-15)
+	INT Eps[MAX_TEST_ENDPOINTS];	// Endpoint numbers from eps=, Ep is used if EpCount is 0.
+	INT EpCount;
+	INT Threads;		// Transfer threads per endpoint.
+	INT MaxDevices;		// Number of Vid/Pid devices to test at the same time.
+	CHAR* Serial;		// Serial number of the device(s), NULL for any.
     INT Refresh;		// Refresh interval (ms)
     INT Timeout;		// Transfer timeout (ms)
     INT Retry;			// Number for times to retry a timed out transfer before aborting
@@ -98,16 +186,36 @@ struct BENCHMARK_TEST_PARAM
 	INT IsoPacketSize; // Isochronous packet size (defaults to the endpoints max packet size)
     INT Priority;		// Priority to run this thread at.
 	BOOL Verify;		// Only for loop and read test. If true, verifies data integrity. 
+	BOOL ShowHistogram;	// If true, prints the latency distribution with the transfer info.
+	INT Duration;		// Seconds to run without user input. 0 runs until 'Q' is pressed.
+	enum BENCHMARK_OUTPUT_FORMAT OutputFormat;
+	CHAR* BaselineFile;	// json results of an earlier run to compare against.
+	INT Tolerance;		// Allowed regression against the baseline in percent.
 	BOOL VerifyDetails;	// If true, prints detailed information for each invalid byte.
+	BOOL Sweep;			// If true, runs the test for every SweepSizes x SweepCounts configuration.
+	INT SweepSizes[MAX_SWEEP_VALUES];
+	INT SweepSizeCount;
+	INT SweepCounts[MAX_SWEEP_VALUES];
+	INT SweepCountCount;
+	INT Warmup;			// Seconds a sweep configuration runs before it is measured.
+	INT SimdLevel;		// Highest PATTERN_LEVEL VerifyData() may use, -1 for the best the cpu has.
+	BOOL VerifyBench;	// If true, only measures the pattern compare functions.
     enum BENCHMARK_DEVICE_TEST_TYPE TestType;	// The benchmark test type.
+	enum BENCHMARK_CONTROL_TEST ControlTest;	// Replaces the data test if set.
 	enum BENCHMARK_TRANSFER_MODE TransferMode;	// Sync or Async
 
     // Internal value use during the test.
     //
-    usb_dev_handle* DeviceHandle;
+    usb_dev_handle* DeviceHandle;	// The first of DeviceHandles.
 	struct usb_device* Device;
+	usb_dev_handle* DeviceHandles[MAX_TEST_DEVICES];
+	struct usb_device* Devices[MAX_TEST_DEVICES];
+	INT DeviceCount;
     BOOL IsCancelled;
     BOOL IsUserAborted;
+	LONGLONG StartTime;		// Performance counter when the transfer threads were started.
+	struct BENCHMARK_CPU_TIME StartCpuTime;	// Process CPU time at StartTime.
+	INT SampleCount;		// Number of samples written, see OutputSample().
 
 	BYTE* VerifyBuffer;		// Stores the verify test pattern for 1 packet.
 	WORD VerifyBufferSize;	// Size of VerifyBuffer
@@ -121,6 +229,38 @@ struct BENCHMARK_TRANSFER_HANDLE
 	CHAR* Data;
 	INT DataMaxLength;
 	INT ReturnCode;
+	LONGLONG SubmitTime;	// Performance counter when the transfer was submitted.
+};
+
+// Completion latency of the transfers on an endpoint, all values in ns.
+struct BENCHMARK_LATENCY
+{
+	LONGLONG Count;
+	LONGLONG Min;
+	LONGLONG Max;
+	DOUBLE Sum;
+	DOUBLE SumSquares;
+	LONG Buckets[LATENCY_BUCKET_COUNT];
+};
+
+// Packet results of an isochronous endpoint, see IsoRecordTransfer().
+struct BENCHMARK_ISO_STATS
+{
+	LONGLONG Packets;
+	LONGLONG ShortPackets;		// IN packets with less than IsoPacketSize bytes.
+	LONGLONG MissedPackets;		// IN packets the device didn't send any data for.
+	LONGLONG LatePackets;		// Packets the host controller scheduled too late.
+	LONGLONG ErrorPackets;		// Packets with any other USBD error.
+	LONGLONG PatternGaps;		// Jumps in the packet keys of a verified read.
+	LONGLONG GapPackets;		// Packets lost in PatternGaps.
+	LONGLONG Underruns;			// Transfers the endpoint had to wait for.
+
+	// Deviation of the completion interval from the frame cadence.
+	struct BENCHMARK_LATENCY Jitter;
+
+	LONGLONG LastCompleteTick;
+	BOOL KeyValid;
+	BYTE NextKey;
 };
 
 // Holds all of the information about a transfer.
@@ -128,19 +268,34 @@ struct BENCHMARK_TRANSFER_PARAM
 {
     struct BENCHMARK_TEST_PARAM* Test;
 
+	// Device of this transfer, one of the test DeviceHandles.
+	usb_dev_handle* DeviceHandle;
+	INT DeviceIndex;
+	INT ThreadIndex;	// Index of this transfer thread on the endpoint.
+
     HANDLE ThreadHandle;
     DWORD ThreadID;
 	struct usb_endpoint_descriptor Ep;
 	INT IsoPacketSize;
+	INT IsoPacketCount;		// Packets per transfer, 0 if Ep isn't isochronous.
+	INT IsoPacketPeriodUs;	// Time between two packets of Ep.
+	LONGLONG IsoTransferTicks;	// Expected time between two transfer completions.
+	INT BufferStride;		// Distance between two transfer buffers.
     BOOL IsRunning;
 
     LONGLONG TotalTransferred;
 	LONG LastTransferred;
 
     LONG Packets;
-    DWORD StartTick;
-    DWORD LastTick;
-    DWORD LastStartTick;
+    LONGLONG StartTick;		// Performance counter values, see GetPerfCounter().
+    LONGLONG LastTick;
+    LONGLONG LastStartTick;
+
+	struct BENCHMARK_LATENCY Latency;
+	struct BENCHMARK_ISO_STATS Iso;
+
+	// Thread CPU time when the statistics were reset, see GetTransferCpuSeconds().
+	struct BENCHMARK_CPU_TIME StartCpuTime;
 
     INT TotalTimeoutCount;
     INT RunningTimeoutCount;
@@ -154,7 +309,8 @@ struct BENCHMARK_TRANSFER_PARAM
 	INT TransferHandleWaitIndex;
 	INT OutstandingTransferCount;
 
-	struct BENCHMARK_TRANSFER_HANDLE TransferHandles[MAX_OUTSTANDING_TRANSFERS];
+	// BufferCount transfer handles, allocated by CreateTransferParam().
+	struct BENCHMARK_TRANSFER_HANDLE* TransferHandles;
 
 	// Placeholder for end of structure; this is where the raw data for the
 	// transfer buffer is allocated.
@@ -162,6 +318,35 @@ struct BENCHMARK_TRANSFER_PARAM
     BYTE Buffer[0];
 };
 
+// Holds the information about a thread of a control test, see RunControlTest().
+struct BENCHMARK_CONTROL_PARAM
+{
+    struct BENCHMARK_TEST_PARAM* Test;
+
+    HANDLE ThreadHandle;
+    DWORD ThreadID;
+    BOOL IsRunning;
+
+	LONGLONG Count;		// Completed requests.
+	INT ErrorCount;
+
+	// [0] for all tests, [1] for the descriptor requests that go to the device.
+	struct BENCHMARK_LATENCY Latency[2];
+};
+
+// Result of one buffer size and buffer count of a sweep, see RunSweep().
+struct BENCHMARK_SWEEP_RESULT
+{
+	INT BufferSize;
+	INT BufferCount;
+	BOOL Valid;				// False if the configuration failed.
+	DOUBLE BytesSec;
+	LONGLONG LatencyP50;	// ns
+	LONGLONG LatencyP99;	// ns
+	INT ErrorCount;			// Timeouts and other errors.
+	DOUBLE CpuPerGB;		// Process CPU seconds per GB transferred by all endpoints.
+};
+
 // Benchmark device api.
 struct usb_dev_handle* Bench_Open(WORD vid,	WORD pid, INT interfaceNumber, INT altInterfaceNumber, struct usb_device** deviceForHandle);
 int Bench_SetTestType(struct usb_dev_handle* dev, enum BENCHMARK_DEVICE_TEST_TYPE testType, int intf);
@@ -170,6 +355,15 @@ int Bench_GetTestType(struct usb_dev_handle* dev, enum BENCHMARK_DEVICE_TEST_TYP
 // Critical section for running status. 
 CRITICAL_SECTION DisplayCriticalSection;
 
+// Performance counter ticks per second.
+LARGE_INTEGER PerfFrequency;
+
+// Where the console messages go, stderr when json or csv results are written.
+FILE* LogStream;
+
+// The compare VerifyData() uses, set by PatternSelect().
+PATTERN_COMPARE PatternCompare;
+
 // Finds the interface for [interface_number] in a libusb-win32 config descriptor.
 // If first_interface is not NULL, it is set to the first interface in the config.
 //
@@ -184,19 +378,64 @@ void ShowCopyright(void);
 void SetTestDefaults(struct BENCHMARK_TEST_PARAM* test);
 char* GetParamStrValue(const char* src, const char* paramName);
 BOOL GetParamIntValue(const char* src, const char* paramName, INT* returnValue);
+BOOL GetParamIntList(const char* src, const char* paramName, INT* values, INT* count, INT maxCount);
 int ValidateBenchmarkArgs(struct BENCHMARK_TEST_PARAM* testParam);
 int ParseBenchmarkArgs(struct BENCHMARK_TEST_PARAM* testParams, int argc, char **argv);
 void FreeTransferParam(struct BENCHMARK_TRANSFER_PARAM** testTransferRef);
-struct BENCHMARK_TRANSFER_PARAM* CreateTransferParam(struct BENCHMARK_TEST_PARAM* test, int endpointID);
+struct BENCHMARK_TRANSFER_PARAM* CreateTransferParam(struct BENCHMARK_TEST_PARAM* test, int deviceIndex, int endpointID);
+INT CreateTestStreams(struct BENCHMARK_TEST_PARAM* test, struct BENCHMARK_TRANSFER_PARAM** transferParams, INT maxCount);
+void StartTestStreams(struct BENCHMARK_TRANSFER_PARAM** transferParams, INT count);
+void FreeTestStreams(struct BENCHMARK_TRANSFER_PARAM** transferParams, INT count);
+INT OpenTestDevices(struct BENCHMARK_TEST_PARAM* test);
+INT PrepareTestDevice(struct BENCHMARK_TEST_PARAM* test, usb_dev_handle* deviceHandle);
 void GetAverageBytesSec(struct BENCHMARK_TRANSFER_PARAM* transferParam, DOUBLE* bps);
 void GetCurrentBytesSec(struct BENCHMARK_TRANSFER_PARAM* transferParam, DOUBLE* bps);
 void ShowRunningStatus(struct BENCHMARK_TRANSFER_PARAM* transferParam);
 void ShowTestInfo(struct BENCHMARK_TEST_PARAM* testParam);
 void ShowTransferInfo(struct BENCHMARK_TRANSFER_PARAM* transferParam);
+void ShowAggregateStatus(struct BENCHMARK_TRANSFER_PARAM** transferParams, INT count);
+void ShowAggregateInfo(struct BENCHMARK_TRANSFER_PARAM** transferParams, INT count);
+void GetProcessCpuTime(struct BENCHMARK_CPU_TIME* cpuTime);
+void GetThreadCpuTime(HANDLE threadHandle, struct BENCHMARK_CPU_TIME* cpuTime);
+void GetCpuSeconds(struct BENCHMARK_CPU_TIME* start, struct BENCHMARK_CPU_TIME* end, DOUBLE* userSeconds, DOUBLE* kernelSeconds);
+void GetTransferCpuSeconds(struct BENCHMARK_TRANSFER_PARAM* transferParam, DOUBLE* userSeconds, DOUBLE* kernelSeconds);
+void ShowCpuInfo(DOUBLE userSeconds, DOUBLE kernelSeconds, LONGLONG totalTransferred, LONGLONG transfers);
+void ShowIsoInfo(struct BENCHMARK_TRANSFER_PARAM* transferParam);
+INT IsoSetup(struct BENCHMARK_TRANSFER_PARAM** transferParamRef);
+void IsoRecordTransfer(struct BENCHMARK_TRANSFER_PARAM* transferParam, struct BENCHMARK_TRANSFER_HANDLE* handle, LONGLONG completeTime);
+void PatternFill(BYTE* buffer, INT length, WORD packetSize, BYTE key);
+PATTERN_COMPARE PatternCompareByLevel(INT level);
+INT PatternSelect(INT maxLevel);
+INT PatternComparePacket(const BYTE* data, const BYTE* pattern, INT size, BYTE key, PATTERN_COMPARE compare);
+INT PatternFindMismatch(const BYTE* data, INT length, const BYTE* pattern, WORD packetSize, PATTERN_COMPARE compare);
+INT RunVerifyBench(struct BENCHMARK_TEST_PARAM* testParam);
 
 void WaitForTestTransfer(struct BENCHMARK_TRANSFER_PARAM* transferParam);
+void StopTestTransfers(struct BENCHMARK_TRANSFER_PARAM** transferParams, INT count);
 void ResetRunningStatus(struct BENCHMARK_TRANSFER_PARAM* transferParam);
 
+LONGLONG GetPerfCounter(void);
+void LatencyReset(struct BENCHMARK_LATENCY* latency);
+void LatencyRecord(struct BENCHMARK_LATENCY* latency, LONGLONG ticks);
+LONGLONG LatencyPercentile(struct BENCHMARK_LATENCY* latency, DOUBLE percentile);
+DOUBLE LatencyStdDev(struct BENCHMARK_LATENCY* latency);
+void LatencyMerge(struct BENCHMARK_LATENCY* latency, struct BENCHMARK_LATENCY* source);
+void ShowLatencyInfo(struct BENCHMARK_LATENCY* latency, BOOL showHistogram);
+
+void OutputBegin(struct BENCHMARK_TEST_PARAM* testParam);
+void OutputSample(struct BENCHMARK_TRANSFER_PARAM* transferParam, DOUBLE bpsAverage, DOUBLE bpsCurrent);
+void OutputSummary(struct BENCHMARK_TRANSFER_PARAM** transferParams, INT count);
+INT CheckBaseline(struct BENCHMARK_TEST_PARAM* testParam, struct BENCHMARK_TRANSFER_PARAM** transferParams, INT count);
+
+INT RunSweep(struct BENCHMARK_TEST_PARAM* testParam);
+void ShowSweepResults(struct BENCHMARK_TEST_PARAM* testParam, struct BENCHMARK_SWEEP_RESULT* results, struct BENCHMARK_SWEEP_RESULT* recommended);
+void OutputSweep(struct BENCHMARK_TEST_PARAM* testParam, struct BENCHMARK_SWEEP_RESULT* results, struct BENCHMARK_SWEEP_RESULT* recommended);
+
+INT RunControlTest(struct BENCHMARK_TEST_PARAM* testParam);
+DWORD ControlThreadProc(struct BENCHMARK_CONTROL_PARAM* controlParam);
+void ShowControlResults(struct BENCHMARK_TEST_PARAM* testParam, struct BENCHMARK_LATENCY* latency, INT threadCount, INT errorCount, DOUBLE elapsedSeconds, DOUBLE cpuSeconds);
+void OutputControl(struct BENCHMARK_TEST_PARAM* testParam, struct BENCHMARK_LATENCY* latency, INT threadCount, INT errorCount, DOUBLE elapsedSeconds, DOUBLE cpuSeconds);
+
 // The thread transfer routine.
 DWORD TransferThreadProc(struct BENCHMARK_TRANSFER_PARAM* transferParams);
 
@@ -206,8 +445,19 @@ DWORD TransferThreadProc(struct BENCHMARK_TRANSFER_PARAM* transferParams);
 #define INC_ROLL(IncField, RollOverValue) if ((++IncField) >= RollOverValue) IncField = 0
 
 #define ENDPOINT_TYPE(TransferParam) (TransferParam->Ep.bmAttributes & 3)
+
+// CPU seconds per GB and CPU microseconds per transfer, 0 if nothing was transferred.
+#define CPU_PER_GB(CpuSeconds, Bytes) ((Bytes) > 0 ? (CpuSeconds) * 1000000000.0 / (Bytes) : 0.0)
+#define CPU_PER_TRANSFER(CpuSeconds, Transfers) ((Transfers) > 0 ? (CpuSeconds) * 1000000.0 / (Transfers) : 0.0)
+
 const char* TestDisplayString[] = {"None", "Read", "Write", "Loop", NULL};
 const char* EndpointTypeDisplayString[] = {"Control", "Isochronous", "Bulk", "Interrupt", NULL};
+const char* PatternLevelDisplayString[] = {"scalar", "sse2", "avx2", "memcmp", NULL};
+const char* ControlTestDisplayString[] = {"None", "Vendor Control", "Get Descriptor", "Open/Close", "Find Devices", NULL};
+
+// The sweep grid used when sweepsizes= or sweepcounts= are not given.
+const INT DefaultSweepSizes[] = {4096, 8192, 16384, 32768, 65536, 131072};
+const INT DefaultSweepCounts[] = {1, 2, 4, 8, 16, 32};
 
 void SetTestDefaults(struct BENCHMARK_TEST_PARAM* test)
 {
@@ -222,6 +472,16 @@ void SetTestDefaults(struct BENCHMARK_TEST_PARAM* test)
     test->BufferSize	= 4096;
     test->BufferCount   = 1;
     test->Priority		= THREAD_PRIORITY_NORMAL;
+    test->Tolerance		= 10;
+    test->Warmup		= 1;
+    test->Threads		= 1;
+    test->MaxDevices	= 1;
+    test->SimdLevel		= -1;
+
+    memcpy(test->SweepSizes, DefaultSweepSizes, sizeof(DefaultSweepSizes));
+    test->SweepSizeCount = _countof(DefaultSweepSizes);
+    memcpy(test->SweepCounts, DefaultSweepCounts, sizeof(DefaultSweepCounts));
+    test->SweepCountCount = _countof(DefaultSweepCounts);
 }
 
 struct usb_interface_descriptor* usb_find_interface(struct usb_config_descriptor* config_descriptor,
@@ -324,6 +584,221 @@ enum TRANSFER_VERIFY_STATE
 
 };
 
+// Fills [buffer] with benchmark packets of [packetSize] bytes. The key of the
+// first packet is [key], it is incremented for every packet.
+//
+// Data Format:
+// [0][KeyByte] 2 3 4 5 ..to.. packetSize (if data byte rolls it is incremented to 1)
+// Increment KeyByte and repeat
+//
+void PatternFill(BYTE* buffer, INT length, WORD packetSize, BYTE key)
+{
+	BYTE indexC = 2;
+	INT offset;
+
+	if (length <= 0 || !packetSize) return;
+
+	// The first packet is the template for the others.
+	for (offset = 0; offset < packetSize && offset < length; offset++)
+	{
+		if (offset == 0)			// Start
+			buffer[offset] = 0;
+		else if (offset == 1)		// Key
+			buffer[offset] = key++;
+		else						// Data
+			buffer[offset] = indexC++;
+
+		// if packetSize is > 255, indexC resets to 1.
+		if (indexC == 0) indexC = 1;
+	}
+
+	for (; offset < length; offset += packetSize)
+	{
+		memcpy(buffer + offset, buffer, (length - offset) < packetSize ? (length - offset) : packetSize);
+		if (offset + 1 < length)
+			buffer[offset + 1] = key++;
+	}
+}
+
+// Byte at a time compare, the fallback for cpus without SSE2.
+static INT PatternCompareScalar(const BYTE* data, const BYTE* expected, INT length)
+{
+	INT offset;
+
+	for (offset = 0; offset < length; offset++)
+	{
+		if (data[offset] != expected[offset])
+			return offset;
+	}
+	return -1;
+}
+
+// The memcmp() that was used before, only measured by verifybench.
+static INT PatternCompareMemcmp(const BYTE* data, const BYTE* expected, INT length)
+{
+	if (!memcmp(data, expected, length))
+		return -1;
+
+	return PatternCompareScalar(data, expected, length);
+}
+
+#ifdef PATTERN_SIMD
+
+static INT PatternFirstBit(unsigned long mask)
+{
+	unsigned long index;
+
+	_BitScanForward(&index, mask);
+	return (INT)index;
+}
+
+static INT PatternCompareSse2(const BYTE* data, const BYTE* expected, INT length)
+{
+	INT offset, ret;
+	unsigned long mask;
+
+	for (offset = 0; offset + 16 <= length; offset += 16)
+	{
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i*)(data + offset)),
+			_mm_loadu_si128((const __m128i*)(expected + offset))));
+
+		if (mask != 0xFFFF)
+			return offset + PatternFirstBit(~mask & 0xFFFF);
+	}
+
+	ret = PatternCompareScalar(data + offset, expected + offset, length - offset);
+	return ret < 0 ? ret : offset + ret;
+}
+
+static INT PatternCompareAvx2(const BYTE* data, const BYTE* expected, INT length)
+{
+	INT offset = 0, ret;
+	unsigned long mask;
+	__m256i equal0, equal1;
+
+	// Two vectors per test while everything matches.
+	for (; offset + 64 <= length; offset += 64)
+	{
+		equal0 = _mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i*)(data + offset)),
+			_mm256_loadu_si256((const __m256i*)(expected + offset)));
+		equal1 = _mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i*)(data + offset + 32)),
+			_mm256_loadu_si256((const __m256i*)(expected + offset + 32)));
+
+		if ((unsigned int)_mm256_movemask_epi8(_mm256_and_si256(equal0, equal1)) != 0xFFFFFFFF)
+			break;
+	}
+
+	for (; offset + 32 <= length; offset += 32)
+	{
+		mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i*)(data + offset)),
+			_mm256_loadu_si256((const __m256i*)(expected + offset))));
+
+		if (mask != 0xFFFFFFFF)
+			return offset + PatternFirstBit(~mask);
+	}
+
+	ret = PatternCompareSse2(data + offset, expected + offset, length - offset);
+	return ret < 0 ? ret : offset + ret;
+}
+
+// Highest PATTERN_LEVEL the cpu and the os support.
+static INT PatternCpuLevel(void)
+{
+	int info[4];
+
+	__cpuid(info, 0);
+	if (info[0] >= 7)
+	{
+		// AVX2 needs the os to save the ymm registers.
+		__cpuid(info, 1);
+		if ((info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6)
+		{
+			__cpuidex(info, 7, 0);
+			if (info[1] & (1 << 5))
+				return PATTERN_LEVEL_AVX2;
+		}
+	}
+
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) ? PATTERN_LEVEL_SSE2 : PATTERN_LEVEL_SCALAR;
+}
+
+#else
+
+static INT PatternCpuLevel(void)
+{
+	return PATTERN_LEVEL_SCALAR;
+}
+
+#endif
+
+// Compare function of a PATTERN_LEVEL.
+PATTERN_COMPARE PatternCompareByLevel(INT level)
+{
+	switch (level)
+	{
+#ifdef PATTERN_SIMD
+	case PATTERN_LEVEL_AVX2:
+		return PatternCompareAvx2;
+	case PATTERN_LEVEL_SSE2:
+		return PatternCompareSse2;
+#endif
+	case PATTERN_LEVEL_MEMCMP:
+		return PatternCompareMemcmp;
+	default:
+		return PatternCompareScalar;
+	}
+}
+
+// Selects the fastest compare up to [maxLevel] and returns its level.
+INT PatternSelect(INT maxLevel)
+{
+	INT level = PatternCpuLevel();
+
+	if (maxLevel >= 0 && maxLevel < level)
+		level = maxLevel;
+
+	PatternCompare = PatternCompareByLevel(level);
+	return level;
+}
+
+// Compares one packet with the pattern of CreateVerifyBuffer(). Byte 0 is
+// always 0, byte 1 must be [key]. Returns the offset of the first byte that
+// differs or -1.
+INT PatternComparePacket(const BYTE* data, const BYTE* pattern, INT size, BYTE key, PATTERN_COMPARE compare)
+{
+	INT offset;
+
+	if (data[0] != 0) return 0;
+	if (size > 1 && data[1] != key) return 1;
+	if (size <= 2) return -1;
+
+	offset = compare(data + 2, pattern + 2, size - 2);
+	return offset < 0 ? -1 : offset + 2;
+}
+
+// Checks a buffer of packets from a benchmark device. The key of the first
+// packet is taken as is, every following packet must have the next one.
+// Returns the offset of the first byte that differs or -1.
+INT PatternFindMismatch(const BYTE* data, INT length, const BYTE* pattern, WORD packetSize, PATTERN_COMPARE compare)
+{
+	INT offset, size, ret;
+	BYTE key = length > 1 ? data[1] : 0;
+
+	for (offset = 0; offset < length; offset += packetSize)
+	{
+		size = (length - offset) < packetSize ? (length - offset) : packetSize;
+		ret = PatternComparePacket(data + offset, pattern, size, key++, compare);
+		if (ret >= 0)
+			return offset + ret;
+	}
+	return -1;
+}
+
 INT VerifyData(struct BENCHMARK_TRANSFER_PARAM* transferParam, BYTE* data, INT dataLength)
 {
 
@@ -335,6 +810,7 @@ INT VerifyData(struct BENCHMARK_TRANSFER_PARAM* transferParam, BYTE* data, INT d
 	INT dataIndex = 0;
 	INT packetIndex = 0;
 	INT verifyIndex = 0;
+	INT mismatchIndex;
 
 	while(dataLeft > 1)
 	{
@@ -356,26 +832,29 @@ INT VerifyData(struct BENCHMARK_TRANSFER_PARAM* transferParam, BYTE* data, INT d
 		seedKey = FALSE;
 		// Index 0 is always 0.
 		// The key is always at index 1
-		verifyData[1] = keyC;
-		if (memcmp(&data[dataIndex],verifyData,verifyDataSize) != 0)
+		mismatchIndex = PatternComparePacket(&data[dataIndex], verifyData, verifyDataSize, keyC, PatternCompare);
+		if (mismatchIndex >= 0)
 		{
 			// Packet verification failed.
 
 			// Reset the key byte on the next packet.
 			seedKey = TRUE;
 
-			CONVDAT("data mismatch packet-index=%d data-index=%d\n", packetIndex, dataIndex);
+			CONVDAT("data mismatch packet-index=%d data-index=%d packet-offset=%d\n",
+				packetIndex, dataIndex, mismatchIndex);
 
 			if (transferParam->Test->VerifyDetails)
 			{
-				for (verifyIndex=0; verifyIndex<verifyDataSize; verifyIndex++)
+				for (verifyIndex=mismatchIndex; verifyIndex<verifyDataSize; verifyIndex++)
 				{
-					if (verifyData[verifyIndex] == data[dataIndex + verifyIndex])
+					BYTE expected = verifyIndex == 1 ? keyC : verifyData[verifyIndex];
+
+					if (expected == data[dataIndex + verifyIndex])
 						continue;
 
 					CONVDAT("packet-offset=%d expected %02Xh got %02Xh\n",
 						verifyIndex,
-						verifyData[verifyIndex],
+						expected,
 						data[dataIndex+verifyIndex]);
 
 				}
@@ -393,20 +872,149 @@ INT VerifyData(struct BENCHMARK_TRANSFER_PARAM* transferParam, BYTE* data, INT d
 	return 0;
 }
 
+// Prepares an isochronous endpoint for transfers with packet results, see
+// usb_submit_async_iso(). The results of the packets follow each transfer
+// buffer, so the transfer param is reallocated with room for them. The time
+// between two packets comes from bInterval and the bus speed.
+INT IsoSetup(struct BENCHMARK_TRANSFER_PARAM** transferParamRef)
+{
+	struct BENCHMARK_TRANSFER_PARAM* transferParam = *transferParamRef;
+	struct BENCHMARK_TEST_PARAM* test = transferParam->Test;
+	struct usb_endpoint_info endpointInfo;
+	INT interval = transferParam->Ep.bInterval;
+	INT stride;
+
+	if (test->BufferSize % transferParam->IsoPacketSize)
+	{
+		CONERR("buffer size %d is not an interval of the iso packet size %d!\n",
+			test->BufferSize, transferParam->IsoPacketSize);
+		return -1;
+	}
+	transferParam->IsoPacketCount = test->BufferSize / transferParam->IsoPacketSize;
+
+	// One packet every 2^(bInterval-1) frames at full speed, microframes
+	// at high speed and above.
+	if (interval < 1) interval = 1;
+	if (interval > 16) interval = 16;
+	transferParam->IsoPacketPeriodUs = 1000 << (interval - 1);
+	if (usb_get_endpoint_info(transferParam->DeviceHandle, transferParam->Ep.bEndpointAddress, &endpointInfo) == 0 &&
+		endpointInfo.speed >= 3)
+	{
+		transferParam->IsoPacketPeriodUs = 125 << (interval - 1);
+	}
+	transferParam->IsoTransferTicks = (LONGLONG)transferParam->IsoPacketCount *
+		transferParam->IsoPacketPeriodUs * PerfFrequency.QuadPart / 1000000;
+
+	stride = USB_ISO_BUFFER_SIZE(transferParam->IsoPacketSize, transferParam->IsoPacketCount);
+	transferParam = realloc(transferParam, sizeof(struct BENCHMARK_TRANSFER_PARAM) + stride * test->BufferCount);
+	if (!transferParam)
+	{
+		CONERR("memory allocation failure at line %d!\n",__LINE__);
+		return -1;
+	}
+	*transferParamRef = transferParam;
+
+	memset(transferParam->Buffer, 0, stride * test->BufferCount);
+	transferParam->BufferStride = stride;
+
+	return 0;
+}
+
+// Counts the packet results of a completed isochronous transfer. Called with
+// the display critical section held.
+void IsoRecordTransfer(struct BENCHMARK_TRANSFER_PARAM* transferParam, struct BENCHMARK_TRANSFER_HANDLE* handle, LONGLONG completeTime)
+{
+	struct BENCHMARK_ISO_STATS* iso = &transferParam->Iso;
+	struct usb_iso_packet_desc* packets;
+	BYTE* packetData;
+	LONGLONG deviation;
+	INT i, size, mismatchIndex;
+	BOOL isRead = (transferParam->Ep.bEndpointAddress & USB_ENDPOINT_DIR_MASK) ? TRUE : FALSE;
+	BOOL verify = transferParam->Test->Verify && isRead && transferParam->Test->VerifyBuffer ? TRUE : FALSE;
+
+	packets = USB_ISO_PACKETS(handle->Data, transferParam->IsoPacketSize, transferParam->IsoPacketCount);
+
+	for (i = 0; i < transferParam->IsoPacketCount; i++)
+	{
+		iso->Packets++;
+
+		switch (packets[i].status)
+		{
+		case 0:
+			break;
+		case ISO_STATUS_NOT_ACCESSED_BY_HW:
+		case ISO_STATUS_NA_LATE_USBPORT:
+		case ISO_STATUS_NOT_ACCESSED_LATE:
+			iso->LatePackets++;
+			continue;
+		default:
+			iso->ErrorPackets++;
+			continue;
+		}
+
+		// Only IN packets have a received length and data to check.
+		if (!isRead)
+			continue;
+
+		if (!packets[i].length)
+		{
+			iso->MissedPackets++;
+			continue;
+		}
+		if (packets[i].length < (unsigned int)transferParam->IsoPacketSize)
+			iso->ShortPackets++;
+
+		if (!verify || packets[i].length < 2)
+			continue;
+
+		// Every packet of the device has the next key, a jump means packets
+		// were lost on the way. A key of 0 restarts the pattern, see VerifyData().
+		packetData = (BYTE*)handle->Data + packets[i].offset;
+		if (iso->KeyValid && packetData[1] && packetData[1] != iso->NextKey)
+		{
+			iso->PatternGaps++;
+			iso->GapPackets += (BYTE)(packetData[1] - iso->NextKey);
+		}
+		iso->NextKey = packetData[1] + 1;
+		iso->KeyValid = TRUE;
+
+		size = (INT)packets[i].length < transferParam->Test->VerifyBufferSize ?
+			(INT)packets[i].length : transferParam->Test->VerifyBufferSize;
+		mismatchIndex = PatternComparePacket(packetData, transferParam->Test->VerifyBuffer, size, packetData[1], PatternCompare);
+		if (mismatchIndex >= 0)
+		{
+			CONVDAT("data mismatch iso-packet-index=%d packet-offset=%d\n", i, mismatchIndex);
+		}
+	}
+
+	if (iso->LastCompleteTick)
+	{
+		// The transfer was submitted after the one before it completed, the
+		// endpoint had nothing queued in between.
+		if (handle->SubmitTime > iso->LastCompleteTick)
+			iso->Underruns++;
+
+		// Transfers of IsoPacketCount packets should complete IsoTransferTicks apart.
+		deviation = completeTime - iso->LastCompleteTick - transferParam->IsoTransferTicks;
+		LatencyRecord(&iso->Jitter, deviation < 0 ? -deviation : deviation);
+	}
+	iso->LastCompleteTick = completeTime;
+}
+
 int TransferSync(struct BENCHMARK_TRANSFER_PARAM* transferParam)
 {
 	int ret;
 	if (transferParam->Ep.bEndpointAddress & USB_ENDPOINT_DIR_MASK)
 	{
 		ret = usb_bulk_read(
-				  transferParam->Test->DeviceHandle, transferParam->Ep.bEndpointAddress,
+				  transferParam->DeviceHandle, transferParam->Ep.bEndpointAddress,
 				  transferParam->Buffer, transferParam->Test->BufferSize,
 				  transferParam->Test->Timeout);
 	}
 	else
 	{
 		ret = usb_bulk_write(
-				  transferParam->Test->DeviceHandle, transferParam->Ep.bEndpointAddress,
+				  transferParam->DeviceHandle, transferParam->Ep.bEndpointAddress,
 				  transferParam->Buffer, transferParam->Test->BufferSize,
 				  transferParam->Test->Timeout);
 	}
@@ -433,25 +1041,25 @@ int TransferAsync(struct BENCHMARK_TRANSFER_PARAM* transferParam, struct BENCHMA
 		if (!handle->Context)
 		{
 			// Data buffer(s) are located at the end of the transfer param.
-			handle->Data = transferParam->Buffer + (transferParam->TransferHandleNextIndex * transferParam->Test->BufferSize);
+			handle->Data = transferParam->Buffer + (transferParam->TransferHandleNextIndex * transferParam->BufferStride);
 			handle->DataMaxLength = transferParam->Test->BufferSize;
 
 			
 			switch (ENDPOINT_TYPE(transferParam))
 			{
 			case USB_ENDPOINT_TYPE_ISOCHRONOUS:
-				ret = usb_isochronous_setup_async(transferParam->Test->DeviceHandle, 
+				ret = usb_isochronous_setup_async(transferParam->DeviceHandle, 
 					&handle->Context,
 					transferParam->Ep.bEndpointAddress,
 					transferParam->IsoPacketSize ? transferParam->IsoPacketSize : transferParam->Ep.wMaxPacketSize);
 				break;
 			case USB_ENDPOINT_TYPE_BULK:
-				ret = usb_bulk_setup_async(transferParam->Test->DeviceHandle,
+				ret = usb_bulk_setup_async(transferParam->DeviceHandle,
 					&handle->Context,
 					transferParam->Ep.bEndpointAddress);
 				break;
 			case USB_ENDPOINT_TYPE_INTERRUPT:
-				ret = usb_interrupt_setup_async(transferParam->Test->DeviceHandle,
+				ret = usb_interrupt_setup_async(transferParam->DeviceHandle,
 					&handle->Context,
 					transferParam->Ep.bEndpointAddress);
 				break;
@@ -469,7 +1077,11 @@ int TransferAsync(struct BENCHMARK_TRANSFER_PARAM* transferParam, struct BENCHMA
 
 
 		// Submit this transfer now.
-		handle->ReturnCode = ret = usb_submit_async(handle->Context, handle->Data, handle->DataMaxLength);
+		handle->SubmitTime = GetPerfCounter();
+		if (transferParam->IsoPacketCount)
+			handle->ReturnCode = ret = usb_submit_async_iso(handle->Context, handle->Data, transferParam->IsoPacketCount);
+		else
+			handle->ReturnCode = ret = usb_submit_async(handle->Context, handle->Data, handle->DataMaxLength);
 		if (ret < 0) goto Done;
 
 		// Mark this handle has InUse.
@@ -518,16 +1130,20 @@ DWORD TransferThreadProc(struct BENCHMARK_TRANSFER_PARAM* transferParam)
 {
     int ret, i;
 	struct BENCHMARK_TRANSFER_HANDLE* handle;
+	struct BENCHMARK_TRANSFER_HANDLE* isoHandle;
 	char* data;
+	LONGLONG submitTime, completeTime;
     transferParam->IsRunning = TRUE;
 
     while (!transferParam->Test->IsCancelled)
     {
 		data = NULL;
 		handle = NULL;
+		isoHandle = NULL;
 
 		if (transferParam->Test->TransferMode == TRANSFER_MODE_SYNC)
 		{
+			submitTime = GetPerfCounter();
 			ret = TransferSync(transferParam);
 			if (ret >= 0) data = transferParam->Buffer;
 		}
@@ -535,12 +1151,15 @@ DWORD TransferThreadProc(struct BENCHMARK_TRANSFER_PARAM* transferParam)
 		{
 			ret = TransferAsync(transferParam, &handle);
 			if ((handle) && ret >= 0) data = handle->Data;
+			submitTime = handle ? handle->SubmitTime : 0;
 		}
 		else
 		{
             CONERR("invalid transfer mode %d\n",transferParam->Test->TransferMode);
 			goto Done;
 		}
+		completeTime = GetPerfCounter();
+
         if (ret < 0)
         {
 			// The user pressed 'Q'.
@@ -563,9 +1182,8 @@ DWORD TransferThreadProc(struct BENCHMARK_TRANSFER_PARAM* transferParam)
             {
 				// An error (other than a timeout) occured.
 
-				// usb_strerror()is not thread safe and should not be used
-				// in a multi-threaded app.  It's used here because
-				// this is a test program.
+				// usb_strerror() returns the last error of this thread,
+				// the other endpoint threads do not overwrite it.
 				//
 
 				transferParam->TotalErrorCount++;
@@ -577,7 +1195,7 @@ DWORD TransferThreadProc(struct BENCHMARK_TRANSFER_PARAM* transferParam)
 					ret,
 					usb_strerror());
 
-				usb_resetep(transferParam->Test->DeviceHandle, transferParam->Ep.bEndpointAddress);
+				usb_resetep(transferParam->DeviceHandle, transferParam->Ep.bEndpointAddress);
 
                 if (transferParam->RunningErrorCount > transferParam->Test->Retry)
                     break;
@@ -585,6 +1203,13 @@ DWORD TransferThreadProc(struct BENCHMARK_TRANSFER_PARAM* transferParam)
             }
 			ret = 0;
         }
+        else if (transferParam->IsoPacketCount && handle)
+        {
+			// Missing iso data is counted per packet, see IsoRecordTransfer().
+			transferParam->RunningErrorCount = 0;
+			transferParam->RunningTimeoutCount = 0;
+			isoHandle = handle;
+        }
         else
         {
 			if (ret < transferParam->Test->BufferSize && !transferParam->Test->IsCancelled)
@@ -607,7 +1232,7 @@ DWORD TransferThreadProc(struct BENCHMARK_TRANSFER_PARAM* transferParam)
 					transferParam->RunningErrorCount++;
 					if (transferParam->RunningErrorCount > transferParam->Test->Retry)
 						break;
-					usb_resetep(transferParam->Test->DeviceHandle, transferParam->Ep.bEndpointAddress);
+					usb_resetep(transferParam->DeviceHandle, transferParam->Ep.bEndpointAddress);
 				}
 			}
 			else
@@ -627,7 +1252,7 @@ DWORD TransferThreadProc(struct BENCHMARK_TRANSFER_PARAM* transferParam)
 
         if (!transferParam->StartTick && transferParam->Packets >= 0)
         {
-            transferParam->StartTick = GetTickCount();
+            transferParam->StartTick = completeTime;
 			transferParam->LastStartTick	= transferParam->StartTick;
             transferParam->LastTick			= transferParam->StartTick;
 
@@ -642,11 +1267,18 @@ DWORD TransferThreadProc(struct BENCHMARK_TRANSFER_PARAM* transferParam)
 				transferParam->LastStartTick	= transferParam->LastTick;
 				transferParam->LastTransferred = 0;
 			}
-            transferParam->LastTick			= GetTickCount();
+            transferParam->LastTick			= completeTime;
  
 			transferParam->LastTransferred  += ret;
             transferParam->TotalTransferred += ret;
             transferParam->Packets++;
+
+			// Failed transfers and the ones used for synchronizing are not timed.
+			if (transferParam->StartTick && ret > 0 && submitTime)
+				LatencyRecord(&transferParam->Latency, completeTime - submitTime);
+
+			if (transferParam->StartTick && isoHandle)
+				IsoRecordTransfer(transferParam, isoHandle, completeTime);
         }
 
         LeaveCriticalSection(&DisplayCriticalSection);
@@ -690,8 +1322,33 @@ BOOL GetParamIntValue(const char* src, const char* paramName, INT* returnValue)
     return FALSE;
 }
 
+// Parses a comma separated list of numbers, i.e. "sweepcounts=1,4,16".
+BOOL GetParamIntList(const char* src, const char* paramName, INT* values, INT* count, INT maxCount)
+{
+    char* value = GetParamStrValue(src, paramName);
+    char* next;
+
+    if (!value) return FALSE;
+
+    *count = 0;
+    while (*value && *count < maxCount)
+    {
+        values[(*count)++] = strtol(value, &next, 0);
+        if (next == value || (*next && *next != ','))
+        {
+            // Not a number, ValidateBenchmarkArgs() rejects the list.
+            *count = 0;
+            break;
+        }
+        value = *next ? next + 1 : next;
+    }
+    return TRUE;
+}
+
 int ValidateBenchmarkArgs(struct BENCHMARK_TEST_PARAM* testParam)
 {
+    int i;
+
     if (testParam->BufferCount < 1 || testParam->BufferCount > MAX_OUTSTANDING_TRANSFERS)
     {
 		CONERR("Invalid BufferCount argument %d. BufferCount must be greater than 0 and less than or equal to %d.\n",
@@ -699,6 +1356,77 @@ int ValidateBenchmarkArgs(struct BENCHMARK_TEST_PARAM* testParam)
         return -1;
     }
 
+    if (testParam->Threads < 1 || testParam->Threads > MAX_TEST_THREADS)
+    {
+		CONERR("Invalid Threads argument %d. Threads must be greater than 0 and less than or equal to %d.\n",
+			testParam->Threads, MAX_TEST_THREADS);
+        return -1;
+    }
+
+    if (testParam->MaxDevices < 1 || testParam->MaxDevices > MAX_TEST_DEVICES)
+    {
+		CONERR("Invalid Devices argument %d. Devices must be greater than 0 and less than or equal to %d.\n",
+			testParam->MaxDevices, MAX_TEST_DEVICES);
+        return -1;
+    }
+
+    if (testParam->ControlTest != CONTROL_TEST_NONE &&
+        (testParam->Sweep || testParam->EpCount > 1 || testParam->MaxDevices > 1))
+    {
+		CONERR0("control, descriptor, openclose and enumerate run on one device without sweep.\n");
+        return -1;
+    }
+
+    // The data of several threads on one endpoint arrives out of order.
+    if (testParam->Verify && testParam->Threads > 1)
+    {
+		CONERR0("verify can't be used with more than one thread per endpoint.\n");
+        return -1;
+    }
+
+    if (testParam->Sweep)
+    {
+        if (!testParam->SweepSizeCount || !testParam->SweepCountCount)
+        {
+            CONERR("Invalid sweep grid. sweepsizes and sweepcounts take up to %d comma separated values.\n",
+                MAX_SWEEP_VALUES);
+            return -1;
+        }
+        for (i = 0; i < testParam->SweepSizeCount; i++)
+        {
+            if (testParam->SweepSizes[i] < 1)
+            {
+                CONERR("Invalid sweep buffer size %d.\n", testParam->SweepSizes[i]);
+                return -1;
+            }
+        }
+        for (i = 0; i < testParam->SweepCountCount; i++)
+        {
+            if (testParam->SweepCounts[i] < 1 || testParam->SweepCounts[i] > MAX_OUTSTANDING_TRANSFERS)
+            {
+                CONERR("Invalid sweep buffer count %d. It must be greater than 0 and less than or equal to %d.\n",
+                    testParam->SweepCounts[i], MAX_OUTSTANDING_TRANSFERS);
+                return -1;
+            }
+        }
+        if (testParam->BaselineFile)
+        {
+            CONERR0("A sweep can't be compared against a baseline.\n");
+            return -1;
+        }
+        if (testParam->EpCount > 1 || testParam->Threads > 1 || testParam->MaxDevices > 1)
+        {
+            CONERR0("A sweep runs on one device, endpoint pair and thread.\n");
+            return -1;
+        }
+
+        // Every configuration runs for the duration, without key prompts.
+        if (testParam->Duration < 1)
+            testParam->Duration = 3;
+        if (testParam->Warmup < 0)
+            testParam->Warmup = 0;
+    }
+
     return 0;
 }
 
@@ -707,7 +1435,7 @@ int ParseBenchmarkArgs(struct BENCHMARK_TEST_PARAM* testParams, int argc, char *
 #define GET_INT_VAL
     char arg[128];
     char* value;
-    int iarg;
+    int iarg, i;
 
     for (iarg=1; iarg < argc; iarg++)
     {
@@ -735,22 +1463,96 @@ int ParseBenchmarkArgs(struct BENCHMARK_TEST_PARAM* testParams, int argc, char *
 		}
         else if (GetParamIntValue(arg, "refresh=", &testParams->Refresh)) {}
         else if (GetParamIntValue(arg, "isopacketsize=", &testParams->IsoPacketSize)) {}
-        else if ((value=GetParamStrValue(arg,"mode=")))
+        else if (GetParamIntValue(arg, "packetsize=", &testParams->IsoPacketSize)) {}
+        else if (GetParamIntValue(arg, "duration=", &testParams->Duration)) {}
+        else if (GetParamIntValue(arg, "tolerance=", &testParams->Tolerance)) {}
+        else if (GetParamIntValue(arg, "warmup=", &testParams->Warmup)) {}
+        else if (GetParamIntValue(arg, "threads=", &testParams->Threads)) {}
+        else if (GetParamIntList(arg, "eps=", testParams->Eps, &testParams->EpCount, MAX_TEST_ENDPOINTS))
         {
-            if (GetParamStrValue(value,"sync"))
+            if (!testParams->EpCount)
             {
-				testParams->TransferMode = TRANSFER_MODE_SYNC;
+                CONERR("invalid endpoint list! %s\n",argv[iarg]);
+                return -1;
             }
-            else if (GetParamStrValue(value,"async"))
+            for (i = 0; i < testParams->EpCount; i++)
+                testParams->Eps[i] &= 0xf;
+        }
+        else if ((value=GetParamStrValue(arg, "devices=")))
+        {
+            if (!stricmp(value, "all"))
+                testParams->MaxDevices = MAX_TEST_DEVICES;
+            else
+                testParams->MaxDevices = strtol(value, NULL, 0);
+        }
+        else if (GetParamStrValue(arg, "serial="))
+        {
+            // arg is lower case, keep the serial number as it was given.
+            testParams->Serial = argv[iarg] + strlen("serial=");
+        }
+        else if (GetParamIntList(arg, "sweepsizes=", testParams->SweepSizes, &testParams->SweepSizeCount, MAX_SWEEP_VALUES)) {}
+        else if (GetParamIntList(arg, "sweepcounts=", testParams->SweepCounts, &testParams->SweepCountCount, MAX_SWEEP_VALUES)) {}
+        else if (GetParamStrValue(arg, "baseline="))
+        {
+            // arg is lower case, keep the file name as it was given.
+            testParams->BaselineFile = argv[iarg] + strlen("baseline=");
+        }
+        else if ((value=GetParamStrValue(arg,"format=")))
+        {
+            if (GetParamStrValue(value,"text"))
             {
-				testParams->TransferMode = TRANSFER_MODE_ASYNC;
+                testParams->OutputFormat = OUTPUT_FORMAT_TEXT;
             }
-             else
+            else if (GetParamStrValue(value,"json"))
             {
-                // Invalid EndpointType argument.
-                CONERR("invalid transfer mode argument! %s\n",argv[iarg]);
-                return -1;
-
+                testParams->OutputFormat = OUTPUT_FORMAT_JSON;
+            }
+            else if (GetParamStrValue(value,"csv"))
+            {
+                testParams->OutputFormat = OUTPUT_FORMAT_CSV;
+            }
+            else
+            {
+                CONERR("invalid output format argument! %s\n",argv[iarg]);
+                return -1;
+            }
+        }
+        else if ((value=GetParamStrValue(arg,"simd=")))
+        {
+            if (GetParamStrValue(value,"scalar"))
+            {
+                testParams->SimdLevel = PATTERN_LEVEL_SCALAR;
+            }
+            else if (GetParamStrValue(value,"sse2"))
+            {
+                testParams->SimdLevel = PATTERN_LEVEL_SSE2;
+            }
+            else if (GetParamStrValue(value,"avx2"))
+            {
+                testParams->SimdLevel = PATTERN_LEVEL_AVX2;
+            }
+            else
+            {
+                CONERR("invalid simd argument! %s\n",argv[iarg]);
+                return -1;
+            }
+        }
+        else if ((value=GetParamStrValue(arg,"mode=")))
+        {
+            if (GetParamStrValue(value,"sync"))
+            {
+				testParams->TransferMode = TRANSFER_MODE_SYNC;
+            }
+            else if (GetParamStrValue(value,"async"))
+            {
+				testParams->TransferMode = TRANSFER_MODE_ASYNC;
+            }
+             else
+            {
+                // Invalid EndpointType argument.
+                CONERR("invalid transfer mode argument! %s\n",argv[iarg]);
+                return -1;
+
             }
         }
         else if ((value=GetParamStrValue(arg,"priority=")))
@@ -809,6 +1611,34 @@ int ParseBenchmarkArgs(struct BENCHMARK_TEST_PARAM* testParams, int argc, char *
         else if (!stricmp(arg,"verify"))
         {
             testParams->Verify = TRUE;
+        }
+        else if (!stricmp(arg,"histogram"))
+        {
+            testParams->ShowHistogram = TRUE;
+        }
+        else if (!stricmp(arg,"sweep"))
+        {
+            testParams->Sweep = TRUE;
+        }
+        else if (!stricmp(arg,"control"))
+        {
+            testParams->ControlTest = CONTROL_TEST_VENDOR;
+        }
+        else if (!stricmp(arg,"descriptor"))
+        {
+            testParams->ControlTest = CONTROL_TEST_DESCRIPTOR;
+        }
+        else if (!stricmp(arg,"openclose"))
+        {
+            testParams->ControlTest = CONTROL_TEST_OPENCLOSE;
+        }
+        else if (!stricmp(arg,"enumerate"))
+        {
+            testParams->ControlTest = CONTROL_TEST_ENUMERATE;
+        }
+        else if (!stricmp(arg,"verifybench"))
+        {
+            testParams->VerifyBench = TRUE;
         }
 		else
         {
@@ -821,8 +1651,6 @@ int ParseBenchmarkArgs(struct BENCHMARK_TEST_PARAM* testParams, int argc, char *
 
 INT CreateVerifyBuffer(struct BENCHMARK_TEST_PARAM* testParam, WORD endpointMaxPacketSize)
 {
-	int i;
-	BYTE indexC = 0;
 	testParam->VerifyBuffer = malloc(endpointMaxPacketSize);
 	if (!testParam->VerifyBuffer)
 	{
@@ -832,11 +1660,7 @@ INT CreateVerifyBuffer(struct BENCHMARK_TEST_PARAM* testParam, WORD endpointMaxP
 
 	testParam->VerifyBufferSize = endpointMaxPacketSize;
 
-	for(i=0; i < endpointMaxPacketSize; i++)
-	{
-	   testParam->VerifyBuffer[i] = indexC++;
-	   if (indexC == 0) indexC = 1;
-	}
+	PatternFill(testParam->VerifyBuffer, endpointMaxPacketSize, endpointMaxPacketSize, 1);
 
 	return 0;
 }
@@ -854,12 +1678,14 @@ void FreeTransferParam(struct BENCHMARK_TRANSFER_PARAM** testTransferRef)
         pTransferParam->ThreadHandle = NULL;
     }
 
+    if (pTransferParam->TransferHandles)
+        free(pTransferParam->TransferHandles);
     free(pTransferParam);
 
     *testTransferRef = NULL;
 }
 
-struct BENCHMARK_TRANSFER_PARAM* CreateTransferParam(struct BENCHMARK_TEST_PARAM* test, int endpointID)
+struct BENCHMARK_TRANSFER_PARAM* CreateTransferParam(struct BENCHMARK_TEST_PARAM* test, int deviceIndex, int endpointID)
 {
     struct BENCHMARK_TRANSFER_PARAM* transferParam;
 	struct usb_interface_descriptor* testInterface;
@@ -872,7 +1698,19 @@ struct BENCHMARK_TRANSFER_PARAM* CreateTransferParam(struct BENCHMARK_TEST_PARAM
     {
         memset(transferParam, 0, allocSize);
         transferParam->Test = test;
-		if (!(testInterface = usb_find_interface(&test->Device->config[0], test->Intf, test->Altf, NULL)))
+        transferParam->DeviceHandle = test->DeviceHandles[deviceIndex];
+        transferParam->DeviceIndex = deviceIndex;
+		transferParam->BufferStride = test->BufferSize;
+
+        transferParam->TransferHandles = calloc(test->BufferCount, sizeof(struct BENCHMARK_TRANSFER_HANDLE));
+        if (!transferParam->TransferHandles)
+        {
+            CONERR("memory allocation failure at line %d!\n",__LINE__);
+            FreeTransferParam(&transferParam);
+            goto Done;
+        }
+
+		if (!(testInterface = usb_find_interface(&test->Devices[deviceIndex]->config[0], test->Intf, test->Altf, NULL)))
 		{
             CONERR("failed locating interface %02Xh!\n", test->Intf);
             FreeTransferParam(&transferParam);
@@ -923,7 +1761,14 @@ struct BENCHMARK_TRANSFER_PARAM* CreateTransferParam(struct BENCHMARK_TEST_PARAM
 			transferParam->IsoPacketSize = transferParam->Ep.wMaxPacketSize;
 
 		if (ENDPOINT_TYPE(transferParam) == USB_ENDPOINT_TYPE_ISOCHRONOUS)
+		{
 			transferParam->Test->TransferMode = TRANSFER_MODE_ASYNC;
+			if (IsoSetup(&transferParam) < 0)
+			{
+				FreeTransferParam(&transferParam);
+				goto Done;
+			}
+		}
 
         ResetRunningStatus(transferParam);
 
@@ -949,32 +1794,15 @@ struct BENCHMARK_TRANSFER_PARAM* CreateTransferParam(struct BENCHMARK_TEST_PARAM
 			transferParam->Test->TestType == TestTypeLoop &&
 			!(transferParam->Ep.bEndpointAddress & USB_ENDPOINT_DIR_MASK))
 		{
-			// Data Format:
-			// [0][KeyByte] 2 3 4 5 ..to.. wMaxPacketSize (if data byte rolls it is incremented to 1)
-			// Increment KeyByte and repeat
-			//
-			BYTE indexC=0;
-			INT bufferIndex = 0;
-			WORD dataIndex;
-			INT packetIndex;
-			INT packetCount = ((transferParam->Test->BufferCount*transferParam->Test->BufferSize) / transferParam->Ep.wMaxPacketSize);
-			for(packetIndex = 0; packetIndex < packetCount; packetIndex++)
+			// The key of the first packet is 0, see PatternFill(). Iso buffers
+			// are BufferStride apart, so every buffer starts with the key
+			// following the last packet of the buffer before it.
+			for (i = 0; i < transferParam->Test->BufferCount; i++)
 			{
-				indexC = 2;
-				for (dataIndex=0; dataIndex < transferParam->Ep.wMaxPacketSize; dataIndex++)
-				{
-					if (dataIndex == 0)			// Start
-						transferParam->Buffer[bufferIndex] = 0;
-					else if (dataIndex == 1)	// Key
-						transferParam->Buffer[bufferIndex] = packetIndex & 0xFF;
-					else						// Data
-						transferParam->Buffer[bufferIndex] = indexC++;
-
-					// if wMaxPacketSize is > 255, indexC resets to 1.
-					if (indexC == 0) indexC = 1;
-
-					bufferIndex++;
-				}
+				PatternFill(transferParam->Buffer + i * transferParam->BufferStride,
+					transferParam->Test->BufferSize,
+					transferParam->Ep.wMaxPacketSize,
+					(BYTE)(i * (transferParam->Test->BufferSize / transferParam->Ep.wMaxPacketSize)));
 			}
 		}
     }
@@ -986,6 +1814,88 @@ Done:
     return transferParam;
 }
 
+// Creates the transfer params for every device, endpoint pair and thread of
+// the test. Read params come before the write params of an endpoint pair, so
+// the first param is the read of a read or loop test. Returns the number of
+// params or -1.
+INT CreateTestStreams(struct BENCHMARK_TEST_PARAM* test, struct BENCHMARK_TRANSFER_PARAM** transferParams, INT maxCount)
+{
+	INT epCount = test->EpCount ? test->EpCount : 1;
+	INT deviceIndex, epIndex, direction, threadIndex, ep;
+	INT count = 0;
+
+	for (deviceIndex = 0; deviceIndex < test->DeviceCount; deviceIndex++)
+	{
+		for (epIndex = 0; epIndex < epCount; epIndex++)
+		{
+			ep = test->EpCount ? test->Eps[epIndex] : test->Ep;
+
+			for (direction = 0; direction < 2; direction++)
+			{
+				if (!(test->TestType & (direction ? TestTypeWrite : TestTypeRead)))
+					continue;
+
+				for (threadIndex = 0; threadIndex < test->Threads; threadIndex++)
+				{
+					if (count == maxCount)
+					{
+						CONERR("more than %d transfer threads!\n", maxCount);
+						goto Error;
+					}
+
+					transferParams[count] = CreateTransferParam(test, deviceIndex,
+						direction ? ep : ep | USB_ENDPOINT_DIR_MASK);
+					if (!transferParams[count])
+						goto Error;
+
+					transferParams[count++]->ThreadIndex = threadIndex;
+				}
+			}
+		}
+	}
+
+	// The verify pattern is one packet of the first endpoint.
+	if (test->Verify && !test->VerifyBuffer && (test->TestType & TestTypeRead))
+	{
+		if (CreateVerifyBuffer(test, transferParams[0]->Ep.wMaxPacketSize) < 0)
+			goto Error;
+	}
+
+	return count;
+
+Error:
+	// The threads are suspended, let them exit before they are freed.
+	test->IsCancelled = TRUE;
+	StopTestTransfers(transferParams, count);
+	FreeTestStreams(transferParams, count);
+	test->IsCancelled = FALSE;
+	return -1;
+}
+
+// Starts the transfer threads created by CreateTestStreams().
+void StartTestStreams(struct BENCHMARK_TRANSFER_PARAM** transferParams, INT count)
+{
+	INT i;
+
+	for (i = 0; i < count; i++)
+	{
+		// Set here so a thread that has not been scheduled yet isn't taken
+		// for one that stopped.
+		transferParams[i]->IsRunning = TRUE;
+
+		SetThreadPriority(transferParams[i]->ThreadHandle, transferParams[i]->Test->Priority);
+		ResumeThread(transferParams[i]->ThreadHandle);
+	}
+}
+
+void FreeTestStreams(struct BENCHMARK_TRANSFER_PARAM** transferParams, INT count)
+{
+	INT i;
+
+	for (i = 0; i < count; i++)
+		FreeTransferParam(&transferParams[i]);
+}
+
 void GetAverageBytesSec(struct BENCHMARK_TRANSFER_PARAM* transferParam, DOUBLE* bps)
 {
 	DOUBLE ticksSec;
@@ -997,7 +1907,7 @@ void GetAverageBytesSec(struct BENCHMARK_TRANSFER_PARAM* transferParam, DOUBLE*
     }
     else
     {
-		ticksSec = (transferParam->LastTick - transferParam->StartTick) / 1000.0;
+		ticksSec = (DOUBLE)(transferParam->LastTick - transferParam->StartTick) / PerfFrequency.QuadPart;
 		*bps = (transferParam->TotalTransferred / ticksSec);
     }
 }
@@ -1014,7 +1924,7 @@ void GetCurrentBytesSec(struct BENCHMARK_TRANSFER_PARAM* transferParam, DOUBLE*
     }
     else
     {
-		ticksSec = (transferParam->LastTick - transferParam->LastStartTick) / 1000.0;
+		ticksSec = (DOUBLE)(transferParam->LastTick - transferParam->LastStartTick) / PerfFrequency.QuadPart;
 		*bps = transferParam->LastTransferred / ticksSec;
     }
 }
@@ -1042,8 +1952,15 @@ void ShowRunningStatus(struct BENCHMARK_TRANSFER_PARAM* transferParam)
         GetAverageBytesSec(&temp,&bpsOverall);
         GetCurrentBytesSec(&temp,&bpsLastTransfer);
 		transferParam->LastStartTick = 0;
-		CONMSG("Avg. Bytes/s: %.2f Transfers: %d Bytes/s: %.2f\n",
-			bpsOverall, temp.Packets, bpsLastTransfer);
+		if (transferParam->Test->OutputFormat != OUTPUT_FORMAT_TEXT)
+			OutputSample(&temp, bpsOverall, bpsLastTransfer);
+		else if (temp.IsoPacketCount)
+			CONMSG("Avg. Bytes/s: %.2f Transfers: %d Bytes/s: %.2f Missed: %I64d Late: %I64d Errors: %I64d Underruns: %I64d\n",
+				bpsOverall, temp.Packets, bpsLastTransfer,
+				temp.Iso.MissedPackets, temp.Iso.LatePackets, temp.Iso.ErrorPackets, temp.Iso.Underruns);
+		else
+			CONMSG("Avg. Bytes/s: %.2f Transfers: %d Bytes/s: %.2f\n",
+				bpsOverall, temp.Packets, bpsLastTransfer);
     }
 
 }
@@ -1052,6 +1969,7 @@ void ShowTransferInfo(struct BENCHMARK_TRANSFER_PARAM* transferParam)
     DOUBLE bpsAverage;
     DOUBLE bpsCurrent;
     DOUBLE elapsedSeconds;
+	DOUBLE userSeconds, kernelSeconds;
 
 	if (!transferParam) return;
 
@@ -1061,6 +1979,12 @@ void ShowTransferInfo(struct BENCHMARK_TRANSFER_PARAM* transferParam)
 		transferParam->Ep.bEndpointAddress,
 		transferParam->Ep.wMaxPacketSize);
 
+	if (transferParam->Test->DeviceCount > 1 || transferParam->Test->Threads > 1)
+	{
+		CONMSG("\tDevice / Thread : #%d / #%d\n",
+			transferParam->DeviceIndex + 1, transferParam->ThreadIndex + 1);
+	}
+
 	if (transferParam->StartTick)
     {
         GetAverageBytesSec(transferParam,&bpsAverage);
@@ -1085,32 +2009,186 @@ void ShowTransferInfo(struct BENCHMARK_TRANSFER_PARAM* transferParam)
 
 		if (transferParam->StartTick && transferParam->StartTick < transferParam->LastTick)
 		{
-			elapsedSeconds = (transferParam->LastTick - transferParam->StartTick) / 1000.0;
+			elapsedSeconds = (DOUBLE)(transferParam->LastTick - transferParam->StartTick) / PerfFrequency.QuadPart;
 
 			CONMSG("\tElapsed Time    : %.2f seconds\n", elapsedSeconds);
 		}
 
+		GetTransferCpuSeconds(transferParam, &userSeconds, &kernelSeconds);
+		ShowCpuInfo(userSeconds, kernelSeconds, transferParam->TotalTransferred, transferParam->Packets);
+
+		if (transferParam->IsoPacketCount)
+			ShowIsoInfo(transferParam);
+
+		ShowLatencyInfo(&transferParam->Latency, transferParam->Test->ShowHistogram);
+
 	    CONMSG0("\n");
     }
 
 }
 
+// Running status of all transfers of a concurrent test.
+void ShowAggregateStatus(struct BENCHMARK_TRANSFER_PARAM** transferParams, INT count)
+{
+	DOUBLE bpsOverall = 0;
+	DOUBLE bpsLastTransfer = 0;
+	DOUBLE bps;
+	LONG packets = 0;
+	INT i, synchronizing = 0;
+
+	// LOCK the display critical section
+    EnterCriticalSection(&DisplayCriticalSection);
+
+	for (i = 0; i < count; i++)
+	{
+		if ((!transferParams[i]->StartTick) || (transferParams[i]->StartTick >= transferParams[i]->LastTick))
+		{
+			synchronizing++;
+			continue;
+		}
+		GetAverageBytesSec(transferParams[i], &bps);
+		bpsOverall += bps;
+		GetCurrentBytesSec(transferParams[i], &bps);
+		bpsLastTransfer += bps;
+		packets += transferParams[i]->Packets;
+		transferParams[i]->LastStartTick = 0;
+	}
+
+	// UNLOCK the display critical section
+    LeaveCriticalSection(&DisplayCriticalSection);
+
+	if (synchronizing)
+	{
+		CONMSG("Synchronizing %d of %d transfers..\n", synchronizing, count);
+	}
+	else
+	{
+		CONMSG("Avg. Bytes/s: %.2f Transfers: %d Bytes/s: %.2f (%d transfers)\n",
+			bpsOverall, packets, bpsLastTransfer, count);
+	}
+}
+
+// Totals of all transfers and the CPU time of the process. The transfers run
+// at the same time, so the aggregate rate is the sum of their average rates.
+void ShowAggregateInfo(struct BENCHMARK_TRANSFER_PARAM** transferParams, INT count)
+{
+	struct BENCHMARK_TEST_PARAM* testParam;
+	struct BENCHMARK_CPU_TIME cpuTime;
+	LONGLONG totalTransferred = 0;
+	DOUBLE bpsAggregate = 0;
+	DOUBLE bps, userSeconds, kernelSeconds;
+	LONG packets = 0;
+	INT i, errors = 0;
+
+	if (!count) return;
+	testParam = transferParams[0]->Test;
+
+	for (i = 0; i < count; i++)
+	{
+		GetAverageBytesSec(transferParams[i], &bps);
+		bpsAggregate += bps;
+		totalTransferred += transferParams[i]->TotalTransferred;
+		packets += transferParams[i]->Packets;
+		errors += transferParams[i]->TotalTimeoutCount + transferParams[i]->TotalErrorCount;
+	}
+
+	// Includes the time spent starting and stopping the threads.
+	GetProcessCpuTime(&cpuTime);
+	GetCpuSeconds(&testParam->StartCpuTime, &cpuTime, &userSeconds, &kernelSeconds);
+
+	CONMSG("Aggregate of %d transfers on %d device(s)\n", count, testParam->DeviceCount);
+	CONMSG("\tTotal Bytes     : %I64d\n", totalTransferred);
+	CONMSG("\tTotal Transfers : %d\n", packets);
+	if (errors)
+	{
+		CONMSG("\tErrors          : %d\n", errors);
+	}
+	CONMSG("\tAvg. Bytes/sec  : %.2f\n", bpsAggregate);
+	ShowCpuInfo(userSeconds, kernelSeconds, totalTransferred, packets);
+	CONMSG0("\n");
+}
+
+// Isochronous packet lines of the transfer information.
+void ShowIsoInfo(struct BENCHMARK_TRANSFER_PARAM* transferParam)
+{
+	struct BENCHMARK_ISO_STATS* iso = &transferParam->Iso;
+
+	CONMSG("\tIso Packets     : %I64d, %d per transfer, %.2f per frame (%d us apart)\n",
+		iso->Packets, transferParam->IsoPacketCount,
+		1000.0 / transferParam->IsoPacketPeriodUs, transferParam->IsoPacketPeriodUs);
+
+	if (transferParam->Ep.bEndpointAddress & USB_ENDPOINT_DIR_MASK)
+	{
+		CONMSG("\tMissed Packets  : %I64d\n", iso->MissedPackets);
+		CONMSG("\tShort Packets   : %I64d\n", iso->ShortPackets);
+		if (transferParam->Test->Verify)
+		{
+			CONMSG("\tPattern Gaps    : %I64d (%I64d packets lost)\n", iso->PatternGaps, iso->GapPackets);
+		}
+	}
+	CONMSG("\tLate Packets    : %I64d\n", iso->LatePackets);
+	CONMSG("\tError Packets   : %I64d\n", iso->ErrorPackets);
+	CONMSG("\tUnderruns       : %I64d\n", iso->Underruns);
+
+	if (iso->Jitter.Count)
+	{
+		CONMSG("\tFrame Jitter    : p50 %.1f us, p99 %.1f us, max %.1f us (expected every %.1f us)\n",
+			LatencyPercentile(&iso->Jitter, 50.0) / 1000.0,
+			LatencyPercentile(&iso->Jitter, 99.0) / 1000.0,
+			iso->Jitter.Max / 1000.0,
+			(DOUBLE)transferParam->IsoPacketCount * transferParam->IsoPacketPeriodUs);
+	}
+}
+
+// CPU time lines of the transfer and aggregate information.
+void ShowCpuInfo(DOUBLE userSeconds, DOUBLE kernelSeconds, LONGLONG totalTransferred, LONGLONG transfers)
+{
+	DOUBLE cpuSeconds = userSeconds + kernelSeconds;
+
+	CONMSG("\tCPU Time        : %.3f seconds (user %.3f, kernel %.3f)\n",
+		cpuSeconds, userSeconds, kernelSeconds);
+	if (totalTransferred)
+	{
+		CONMSG("\tCPU Time / GB   : %.3f seconds\n", cpuSeconds * 1000000000.0 / totalTransferred);
+	}
+	if (transfers > 0)
+	{
+		CONMSG("\tCPU / Transfer  : %.1f us\n", cpuSeconds * 1000000.0 / transfers);
+	}
+}
+
 void ShowTestInfo(struct BENCHMARK_TEST_PARAM* testParam)
 {
     if (!testParam) return;
 
-    CONMSG("%s Test Information\n",TestDisplayString[testParam->TestType & 3]);
+    if (testParam->ControlTest != CONTROL_TEST_NONE)
+        CONMSG("%s Test Information\n",ControlTestDisplayString[testParam->ControlTest]);
+    else
+        CONMSG("%s Test Information\n",TestDisplayString[testParam->TestType & 3]);
     CONMSG("\tVid / Pid       : %04Xh / %04Xh\n", testParam->Vid,  testParam->Pid);
     CONMSG("\tInterface #     : %02Xh\n", testParam->Intf);
+	if (testParam->DeviceCount > 1 || testParam->EpCount > 1 || testParam->Threads > 1)
+	{
+		CONMSG("\tConcurrent      : %d device(s), %d endpoint pair(s), %d thread(s) per endpoint\n",
+			testParam->DeviceCount, testParam->EpCount ? testParam->EpCount : 1, testParam->Threads);
+	}
     CONMSG("\tPriority        : %d\n", testParam->Priority);
     CONMSG("\tBuffer Size     : %d\n", testParam->BufferSize);
     CONMSG("\tBuffer Count    : %d\n", testParam->BufferCount);
+	if (testParam->Sweep)
+	{
+		CONMSG("\tSweep           : %d sizes x %d counts, %d s warm-up, %d s each\n",
+			testParam->SweepSizeCount, testParam->SweepCountCount,
+			testParam->Warmup, testParam->Duration);
+	}
     CONMSG("\tDisplay Refresh : %d (ms)\n", testParam->Refresh);
     CONMSG("\tTransfer Timeout: %d (ms)\n", testParam->Timeout);
     CONMSG("\tRetry Count     : %d\n", testParam->Retry);
     CONMSG("\tVerify Data     : %s%s\n",
 		testParam->Verify ? "On" : "Off",
 		(testParam->Verify && testParam->VerifyDetails) ? " (Detailed)" : "");
+	if (testParam->Verify)
+		CONMSG("\tVerify Compare  : %s\n", PatternLevelDisplayString[testParam->SimdLevel]);
 
     CONMSG0("\n");
 }
@@ -1141,6 +2219,41 @@ void WaitForTestTransfer(struct BENCHMARK_TRANSFER_PARAM* transferParam)
         CONMSG("waiting for Ep%02Xh thread..\n", transferParam->Ep.bEndpointAddress);
     }
 }
+
+// Stops the transfer threads of a test that was cancelled.
+void StopTestTransfers(struct BENCHMARK_TRANSFER_PARAM** transferParams, INT count)
+{
+	INT i;
+
+	// Threads that were never started exit right away.
+	for (i = 0; i < count; i++)
+	{
+		if (!transferParams[i]->IsRunning)
+			ResumeThread(transferParams[i]->ThreadHandle);
+	}
+
+	// Wait for the transfer threads to complete gracefully if it
+	// can be done in 10ms. All of the code from this point to
+	// WaitForTestTransfer() is not required.  It is here only to
+	// improve response time when the test is cancelled.
+	//
+    Sleep(10);
+
+	// If the thread is still running, abort and reset the endpoint.
+	for (i = 0; i < count; i++)
+	{
+		if (transferParams[i]->IsRunning)
+			usb_resetep(transferParams[i]->DeviceHandle, transferParams[i]->Ep.bEndpointAddress);
+	}
+
+    // Small delay incase usb_resetep() was called.
+    Sleep(10);
+
+    // WaitForTestTransfer will not return until the thread
+	// has exited.
+	for (i = 0; i < count; i++)
+		WaitForTestTransfer(transferParams[i]);
+}
 void ResetRunningStatus(struct BENCHMARK_TRANSFER_PARAM* transferParam)
 {
     if (!transferParam) return;
@@ -1150,79 +2263,1262 @@ void ResetRunningStatus(struct BENCHMARK_TRANSFER_PARAM* transferParam)
     transferParam->Packets=-2;
     transferParam->LastTick=0;
     transferParam->RunningTimeoutCount=0;
+	LatencyReset(&transferParam->Latency);
+	memset(&transferParam->Iso, 0, sizeof(transferParam->Iso));
+	GetThreadCpuTime(transferParam->ThreadHandle, &transferParam->StartCpuTime);
 }
 
-int GetTestDeviceFromList(struct BENCHMARK_TEST_PARAM* testParam)
+LONGLONG GetPerfCounter(void)
 {
-    const int LINE_MAX_SIZE   = 1024;
-    const int STRING_MAX_SIZE = 256;
-    const int NUM_STRINGS = 3;
-    const int ALLOC_SIZE = LINE_MAX_SIZE + (STRING_MAX_SIZE * NUM_STRINGS);
+	LARGE_INTEGER counter;
 
-    int userInput;
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart;
+}
 
-    char* buffer;
-    char* line;
-    char* product;
-    char* manufacturer;
-    char* serial;
+static LONGLONG FileTimeToLongLong(const FILETIME* fileTime)
+{
+	return ((LONGLONG)fileTime->dwHighDateTime << 32) | fileTime->dwLowDateTime;
+}
 
-    struct usb_bus* bus;
-    struct usb_device* dev;
-    usb_dev_handle* udev;
-    struct usb_device* validDevices[256];
+// User and kernel time of this process.
+void GetProcessCpuTime(struct BENCHMARK_CPU_TIME* cpuTime)
+{
+	FILETIME creationTime, exitTime, kernelTime, userTime;
 
-    int deviceIndex=0;
-	struct usb_interface_descriptor* firstInterface;
+	memset(cpuTime, 0, sizeof(*cpuTime));
+	if (!GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime))
+		return;
 
-    int ret = -1;
+	cpuTime->User = FileTimeToLongLong(&userTime);
+	cpuTime->Kernel = FileTimeToLongLong(&kernelTime);
+}
 
-    buffer = malloc(ALLOC_SIZE);
-    if (!buffer)
-    {
-        CONERR0("failed allocating memory!\n");
-        return ret;
-    }
+// User and kernel time of a thread. The times can still be read after the
+// thread exited, as long as its handle is open.
+void GetThreadCpuTime(HANDLE threadHandle, struct BENCHMARK_CPU_TIME* cpuTime)
+{
+	FILETIME creationTime, exitTime, kernelTime, userTime;
 
-    line = buffer;
-    product = buffer + LINE_MAX_SIZE;
-    manufacturer = product + STRING_MAX_SIZE;
-    serial = manufacturer + STRING_MAX_SIZE;
+	memset(cpuTime, 0, sizeof(*cpuTime));
+	if (!threadHandle || !GetThreadTimes(threadHandle, &creationTime, &exitTime, &kernelTime, &userTime))
+		return;
 
-    for (bus = usb_get_busses(); bus; bus = bus->next)
-    {
-        for (dev = bus->devices; dev; dev = dev->next)
-        {
+	cpuTime->User = FileTimeToLongLong(&userTime);
+	cpuTime->Kernel = FileTimeToLongLong(&kernelTime);
+}
 
-            udev = usb_open(dev);
-            if (udev)
-            {
-                memset(buffer, 0, ALLOC_SIZE);
-                line = buffer;
-                if (dev->descriptor.iManufacturer)
-                {
-                    if (usb_get_string_simple(udev, dev->descriptor.iManufacturer, manufacturer, STRING_MAX_SIZE - 1) > 0)
-                    {
-                        strcat(line,"(");
-                        strcat(line,manufacturer);
-                        strcat(line,") ");
-                    }
-                }
+void GetCpuSeconds(struct BENCHMARK_CPU_TIME* start, struct BENCHMARK_CPU_TIME* end, DOUBLE* userSeconds, DOUBLE* kernelSeconds)
+{
+	*userSeconds = (end->User - start->User) / 10000000.0;
+	*kernelSeconds = (end->Kernel - start->Kernel) / 10000000.0;
+}
 
-                if (dev->descriptor.iProduct)
-                {
-                    if (usb_get_string_simple(udev, dev->descriptor.iProduct, product, STRING_MAX_SIZE - 1) > 0)
-                    {
-                        strcat(line,product);
-                        strcat(line," ");
-                    }
-                }
+// CPU time of the transfer thread since its statistics were reset. Kernel
+// work that completes asynchronous transfers outside of the thread is only
+// in the process time.
+void GetTransferCpuSeconds(struct BENCHMARK_TRANSFER_PARAM* transferParam, DOUBLE* userSeconds, DOUBLE* kernelSeconds)
+{
+	struct BENCHMARK_CPU_TIME cpuTime;
 
-                if (dev->descriptor.iSerialNumber)
-                {
-                    if (usb_get_string_simple(udev, dev->descriptor.iSerialNumber, serial, STRING_MAX_SIZE - 1) > 0)
-                    {
-                        strcat(line,"[");
+	GetThreadCpuTime(transferParam->ThreadHandle, &cpuTime);
+	GetCpuSeconds(&transferParam->StartCpuTime, &cpuTime, userSeconds, kernelSeconds);
+}
+
+// Bucket index of a latency value, see LATENCY_SUB_BUCKET_BITS.
+static INT LatencyBucketIndex(LONGLONG ns)
+{
+	INT shift = 0;
+
+	while ((ns >> shift) >= LATENCY_SUB_BUCKET_COUNT)
+		shift++;
+
+	if (!shift)
+		return (INT)ns;
+
+	return shift * (LATENCY_SUB_BUCKET_COUNT / 2) + (INT)(ns >> shift);
+}
+
+// Highest value that lands in a bucket.
+static LONGLONG LatencyBucketValue(INT index)
+{
+	INT shift;
+
+	if (index < LATENCY_SUB_BUCKET_COUNT)
+		return index;
+
+	shift = index / (LATENCY_SUB_BUCKET_COUNT / 2) - 1;
+	index -= shift * (LATENCY_SUB_BUCKET_COUNT / 2);
+
+	return (((LONGLONG)index + 1) << shift) - 1;
+}
+
+void LatencyReset(struct BENCHMARK_LATENCY* latency)
+{
+	memset(latency, 0, sizeof(*latency));
+}
+
+void LatencyRecord(struct BENCHMARK_LATENCY* latency, LONGLONG ticks)
+{
+	LONGLONG ns = (LONGLONG)((DOUBLE)ticks * 1000000000.0 / PerfFrequency.QuadPart);
+	INT index;
+
+	if (ns < 0) return;
+
+	index = LatencyBucketIndex(ns);
+	if (index >= LATENCY_BUCKET_COUNT)
+		index = LATENCY_BUCKET_COUNT - 1;
+
+	if (!latency->Count || ns < latency->Min)
+		latency->Min = ns;
+	if (ns > latency->Max)
+		latency->Max = ns;
+
+	latency->Count++;
+	latency->Sum += (DOUBLE)ns;
+	latency->SumSquares += (DOUBLE)ns * (DOUBLE)ns;
+	latency->Buckets[index]++;
+}
+
+// Returns the latency in ns below which [percentile] percent of the transfers
+// completed. The result is accurate to the bucket width.
+LONGLONG LatencyPercentile(struct BENCHMARK_LATENCY* latency, DOUBLE percentile)
+{
+	LONGLONG target, count = 0;
+	LONGLONG value;
+	INT index;
+
+	if (!latency->Count) return 0;
+
+	target = (LONGLONG)((percentile / 100.0) * latency->Count + 0.5);
+	if (target < 1) target = 1;
+
+	for (index = 0; index < LATENCY_BUCKET_COUNT; index++)
+	{
+		count += latency->Buckets[index];
+		if (count >= target)
+		{
+			value = LatencyBucketValue(index);
+			return value > latency->Max ? latency->Max : value;
+		}
+	}
+
+	return latency->Max;
+}
+
+// The jitter reported for an endpoint, in ns.
+DOUBLE LatencyStdDev(struct BENCHMARK_LATENCY* latency)
+{
+	DOUBLE mean, variance;
+
+	if (!latency->Count) return 0;
+
+	mean = latency->Sum / latency->Count;
+	variance = latency->SumSquares / latency->Count - mean * mean;
+
+	return variance > 0 ? sqrt(variance) : 0;
+}
+
+// Adds the values of [source] to [latency].
+void LatencyMerge(struct BENCHMARK_LATENCY* latency, struct BENCHMARK_LATENCY* source)
+{
+	INT index;
+
+	if (!source->Count) return;
+
+	if (!latency->Count || source->Min < latency->Min)
+		latency->Min = source->Min;
+	if (source->Max > latency->Max)
+		latency->Max = source->Max;
+
+	latency->Count += source->Count;
+	latency->Sum += source->Sum;
+	latency->SumSquares += source->SumSquares;
+	for (index = 0; index < LATENCY_BUCKET_COUNT; index++)
+		latency->Buckets[index] += source->Buckets[index];
+}
+
+void ShowLatencyInfo(struct BENCHMARK_LATENCY* latency, BOOL showHistogram)
+{
+	LONGLONG count = 0;
+	INT index;
+
+	if (!latency->Count) return;
+
+	CONMSG("\tLatency (us)    : min %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+		latency->Min / 1000.0,
+		LatencyPercentile(latency, 50.0) / 1000.0,
+		LatencyPercentile(latency, 90.0) / 1000.0,
+		LatencyPercentile(latency, 99.0) / 1000.0,
+		LatencyPercentile(latency, 99.9) / 1000.0,
+		latency->Max / 1000.0);
+	CONMSG("\tJitter (us)     : %.1f (std. deviation, mean %.1f)\n",
+		LatencyStdDev(latency) / 1000.0, latency->Sum / latency->Count / 1000.0);
+
+	if (!showHistogram) return;
+
+	// One line per non empty bucket with the running percentile, in the
+	// layout of the HdrHistogram percentile distribution.
+	CONMSG0("\t      Value (us)   Percentile   TotalCount\n");
+	for (index = 0; index < LATENCY_BUCKET_COUNT; index++)
+	{
+		if (!latency->Buckets[index]) continue;
+
+		count += latency->Buckets[index];
+		CONMSG("\t%16.3f %12.6f %12I64d\n",
+			LatencyBucketValue(index) / 1000.0,
+			(DOUBLE)count / latency->Count, count);
+	}
+}
+
+void OutputBegin(struct BENCHMARK_TEST_PARAM* testParam)
+{
+	const char* type = TestDisplayString[testParam->TestType & 3];
+	const char* mode = testParam->TransferMode == TRANSFER_MODE_SYNC ? "Sync" : "Async";
+
+	if (testParam->OutputFormat == OUTPUT_FORMAT_JSON)
+	{
+		printf("{\n  \"test\": {\"vid\": \"0x%04X\", \"pid\": \"0x%04X\", \"intf\": %d, \"altf\": %d, "
+			"\"type\": \"%s\", \"mode\": \"%s\", \"buffersize\": %d, \"buffercount\": %d, "
+			"\"timeout\": %d, \"refresh\": %d, \"priority\": %d, \"verify\": %s, \"duration\": %d},\n"
+			"  \"samples\": [\n",
+			testParam->Vid, testParam->Pid, testParam->Intf, testParam->Altf,
+			type, mode, testParam->BufferSize, testParam->BufferCount,
+			testParam->Timeout, testParam->Refresh, testParam->Priority,
+			testParam->Verify ? "true" : "false", testParam->Duration);
+	}
+	else if (testParam->OutputFormat == OUTPUT_FORMAT_CSV)
+	{
+		// Every kind of record is preceded by a "record" line naming its columns.
+		printf("record,vid,pid,intf,altf,type,mode,buffersize,buffercount,timeout,refresh,priority,verify,duration\n");
+		printf("test,0x%04X,0x%04X,%d,%d,%s,%s,%d,%d,%d,%d,%d,%d,%d\n",
+			testParam->Vid, testParam->Pid, testParam->Intf, testParam->Altf,
+			type, mode, testParam->BufferSize, testParam->BufferCount,
+			testParam->Timeout, testParam->Refresh, testParam->Priority,
+			testParam->Verify ? 1 : 0, testParam->Duration);
+		printf("record,time,ep,device,thread,avg_bytes_per_sec,bytes_per_sec,transfers,cpu_user,cpu_kernel\n");
+	}
+	fflush(stdout);
+}
+
+void OutputSample(struct BENCHMARK_TRANSFER_PARAM* transferParam, DOUBLE bpsAverage, DOUBLE bpsCurrent)
+{
+	struct BENCHMARK_TEST_PARAM* testParam = transferParam->Test;
+	DOUBLE time = (DOUBLE)(transferParam->LastTick - testParam->StartTime) / PerfFrequency.QuadPart;
+	DOUBLE userSeconds, kernelSeconds;
+
+	// CPU seconds of the transfer thread since the statistics were reset.
+	GetTransferCpuSeconds(transferParam, &userSeconds, &kernelSeconds);
+
+	if (testParam->OutputFormat == OUTPUT_FORMAT_JSON)
+	{
+		printf("%s    {\"time\": %.3f, \"ep\": \"0x%02X\", \"device\": %d, \"thread\": %d, \"avg_bytes_per_sec\": %.2f, \"bytes_per_sec\": %.2f, \"transfers\": %d, "
+			"\"cpu_user\": %.3f, \"cpu_kernel\": %.3f}",
+			testParam->SampleCount ? ",\n" : "",
+			time, transferParam->Ep.bEndpointAddress,
+			transferParam->DeviceIndex + 1, transferParam->ThreadIndex + 1,
+			bpsAverage, bpsCurrent, transferParam->Packets,
+			userSeconds, kernelSeconds);
+	}
+	else if (testParam->OutputFormat == OUTPUT_FORMAT_CSV)
+	{
+		printf("sample,%.3f,0x%02X,%d,%d,%.2f,%.2f,%d,%.3f,%.3f\n",
+			time, transferParam->Ep.bEndpointAddress,
+			transferParam->DeviceIndex + 1, transferParam->ThreadIndex + 1,
+			bpsAverage, bpsCurrent, transferParam->Packets,
+			userSeconds, kernelSeconds);
+	}
+	testParam->SampleCount++;
+	fflush(stdout);
+}
+
+void OutputSummary(struct BENCHMARK_TRANSFER_PARAM** transferParams, INT count)
+{
+	struct BENCHMARK_TRANSFER_PARAM* transferParam;
+	struct BENCHMARK_LATENCY* latency;
+	struct BENCHMARK_ISO_STATS* iso;
+	struct BENCHMARK_CPU_TIME cpuTime;
+	enum BENCHMARK_OUTPUT_FORMAT format;
+	DOUBLE bpsAverage, elapsedSeconds;
+	DOUBLE userSeconds, kernelSeconds;
+	LONGLONG totalTransferred = 0, transfers = 0;
+	INT i, written = 0;
+
+	if (!count || !transferParams[0]) return;
+	format = transferParams[0]->Test->OutputFormat;
+
+	if (format == OUTPUT_FORMAT_JSON)
+		printf("\n  ],\n  \"summary\": [\n");
+	else if (format == OUTPUT_FORMAT_CSV)
+		printf("record,ep,device,thread,type,direction,max_packet_size,total_bytes,transfers,short_transfers,timeouts,errors,"
+			"elapsed,bytes_per_sec,latency_min,latency_p50,latency_p90,latency_p99,latency_p999,latency_max,jitter,"
+			"cpu_user,cpu_kernel,cpu_per_gb,cpu_per_transfer,"
+			"iso_packets,iso_missed,iso_short,iso_late,iso_errors,iso_gaps,iso_gap_packets,iso_underruns,"
+			"iso_jitter_p50,iso_jitter_p99,iso_jitter_max\n");
+	else
+		return;
+
+	for (i = 0; i < count; i++)
+	{
+		if (!(transferParam = transferParams[i])) continue;
+
+		latency = &transferParam->Latency;
+		iso = &transferParam->Iso;
+		GetAverageBytesSec(transferParam, &bpsAverage);
+		elapsedSeconds = transferParam->StartTick && transferParam->StartTick < transferParam->LastTick
+			? (DOUBLE)(transferParam->LastTick - transferParam->StartTick) / PerfFrequency.QuadPart : 0;
+		GetTransferCpuSeconds(transferParam, &userSeconds, &kernelSeconds);
+
+		totalTransferred += transferParam->TotalTransferred;
+		if (transferParam->Packets > 0)
+			transfers += transferParam->Packets;
+
+		// Latency and CPU time per transfer values are in microseconds.
+		if (format == OUTPUT_FORMAT_JSON)
+		{
+			printf("%s    {\"ep\": \"0x%02X\", \"device\": %d, \"thread\": %d, \"type\": \"%s\", \"direction\": \"%s\", \"max_packet_size\": %d, "
+				"\"total_bytes\": %I64d, \"transfers\": %d, \"short_transfers\": %d, \"timeouts\": %d, \"errors\": %d, "
+				"\"elapsed\": %.3f, \"bytes_per_sec\": %.2f, "
+				"\"latency\": {\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f, \"jitter\": %.1f}, "
+				"\"cpu\": {\"user\": %.3f, \"kernel\": %.3f, \"per_gb\": %.3f, \"per_transfer\": %.1f}",
+				written ? ",\n" : "",
+				transferParam->Ep.bEndpointAddress,
+				transferParam->DeviceIndex + 1, transferParam->ThreadIndex + 1,
+				EndpointTypeDisplayString[ENDPOINT_TYPE(transferParam)],
+				TRANSFER_DISPLAY(transferParam, "Read", "Write"),
+				transferParam->Ep.wMaxPacketSize,
+				transferParam->TotalTransferred, transferParam->Packets,
+				transferParam->ShortTransferCount, transferParam->TotalTimeoutCount,
+				transferParam->TotalErrorCount, elapsedSeconds, bpsAverage,
+				latency->Min / 1000.0,
+				LatencyPercentile(latency, 50.0) / 1000.0,
+				LatencyPercentile(latency, 90.0) / 1000.0,
+				LatencyPercentile(latency, 99.0) / 1000.0,
+				LatencyPercentile(latency, 99.9) / 1000.0,
+				latency->Max / 1000.0,
+				LatencyStdDev(latency) / 1000.0,
+				userSeconds, kernelSeconds,
+				CPU_PER_GB(userSeconds + kernelSeconds, transferParam->TotalTransferred),
+				CPU_PER_TRANSFER(userSeconds + kernelSeconds, transferParam->Packets));
+
+			// Jitter values are in microseconds.
+			if (transferParam->IsoPacketCount)
+			{
+				printf(", \"iso\": {\"packets\": %I64d, \"missed\": %I64d, \"short\": %I64d, \"late\": %I64d, \"errors\": %I64d, "
+					"\"gaps\": %I64d, \"gap_packets\": %I64d, \"underruns\": %I64d, "
+					"\"jitter_p50\": %.1f, \"jitter_p99\": %.1f, \"jitter_max\": %.1f}",
+					iso->Packets, iso->MissedPackets, iso->ShortPackets, iso->LatePackets, iso->ErrorPackets,
+					iso->PatternGaps, iso->GapPackets, iso->Underruns,
+					LatencyPercentile(&iso->Jitter, 50.0) / 1000.0,
+					LatencyPercentile(&iso->Jitter, 99.0) / 1000.0,
+					iso->Jitter.Max / 1000.0);
+			}
+			printf("}");
+		}
+		else
+		{
+			printf("summary,0x%02X,%d,%d,%s,%s,%d,%I64d,%d,%d,%d,%d,%.3f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.3f,%.3f,%.3f,%.1f,"
+				"%I64d,%I64d,%I64d,%I64d,%I64d,%I64d,%I64d,%I64d,%.1f,%.1f,%.1f\n",
+				transferParam->Ep.bEndpointAddress,
+				transferParam->DeviceIndex + 1, transferParam->ThreadIndex + 1,
+				EndpointTypeDisplayString[ENDPOINT_TYPE(transferParam)],
+				TRANSFER_DISPLAY(transferParam, "Read", "Write"),
+				transferParam->Ep.wMaxPacketSize,
+				transferParam->TotalTransferred, transferParam->Packets,
+				transferParam->ShortTransferCount, transferParam->TotalTimeoutCount,
+				transferParam->TotalErrorCount, elapsedSeconds, bpsAverage,
+				latency->Min / 1000.0,
+				LatencyPercentile(latency, 50.0) / 1000.0,
+				LatencyPercentile(latency, 90.0) / 1000.0,
+				LatencyPercentile(latency, 99.0) / 1000.0,
+				LatencyPercentile(latency, 99.9) / 1000.0,
+				latency->Max / 1000.0,
+				LatencyStdDev(latency) / 1000.0,
+				userSeconds, kernelSeconds,
+				CPU_PER_GB(userSeconds + kernelSeconds, transferParam->TotalTransferred),
+				CPU_PER_TRANSFER(userSeconds + kernelSeconds, transferParam->Packets),
+				iso->Packets, iso->MissedPackets, iso->ShortPackets, iso->LatePackets, iso->ErrorPackets,
+				iso->PatternGaps, iso->GapPackets, iso->Underruns,
+				LatencyPercentile(&iso->Jitter, 50.0) / 1000.0,
+				LatencyPercentile(&iso->Jitter, 99.0) / 1000.0,
+				iso->Jitter.Max / 1000.0);
+		}
+		written++;
+	}
+
+	// The process CPU time includes the kernel work of the async transfers
+	// that isn't charged to the transfer threads.
+	GetProcessCpuTime(&cpuTime);
+	GetCpuSeconds(&transferParams[0]->Test->StartCpuTime, &cpuTime, &userSeconds, &kernelSeconds);
+
+	if (format == OUTPUT_FORMAT_JSON)
+	{
+		printf("\n  ],\n  \"process\": {\"total_bytes\": %I64d, \"transfers\": %I64d, "
+			"\"cpu\": {\"user\": %.3f, \"kernel\": %.3f, \"per_gb\": %.3f, \"per_transfer\": %.1f}}\n}\n",
+			totalTransferred, transfers, userSeconds, kernelSeconds,
+			CPU_PER_GB(userSeconds + kernelSeconds, totalTransferred),
+			CPU_PER_TRANSFER(userSeconds + kernelSeconds, transfers));
+	}
+	else
+	{
+		printf("record,total_bytes,transfers,cpu_user,cpu_kernel,cpu_per_gb,cpu_per_transfer\n");
+		printf("process,%I64d,%I64d,%.3f,%.3f,%.3f,%.1f\n",
+			totalTransferred, transfers, userSeconds, kernelSeconds,
+			CPU_PER_GB(userSeconds + kernelSeconds, totalTransferred),
+			CPU_PER_TRANSFER(userSeconds + kernelSeconds, transfers));
+	}
+	fflush(stdout);
+}
+
+// Compares the results with the summary of a json file written by an earlier
+// run with format=json. Returns the number of regressions or -1 if the file
+// can't be read.
+INT CheckBaseline(struct BENCHMARK_TEST_PARAM* testParam, struct BENCHMARK_TRANSFER_PARAM** transferParams, INT count)
+{
+	struct BENCHMARK_TRANSFER_PARAM* transferParam;
+	FILE* file;
+	char* baseline;
+	char* summary;
+	char* entry;
+	char* value;
+	char key[32];
+	long size;
+	DOUBLE bpsAverage, bpsBaseline, p99, p99Baseline;
+	DOUBLE tolerance = testParam->Tolerance / 100.0;
+	INT i, regressions = 0;
+
+	if (!testParam->BaselineFile) return 0;
+
+	if (!(file = fopen(testParam->BaselineFile, "rb")))
+	{
+		CONERR("failed opening baseline %s!\n", testParam->BaselineFile);
+		return -1;
+	}
+
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	if (size <= 0 || !(baseline = malloc(size + 1)))
+	{
+		CONERR("failed reading baseline %s!\n", testParam->BaselineFile);
+		fclose(file);
+		return -1;
+	}
+	size = (long)fread(baseline, 1, size, file);
+	baseline[size] = 0;
+	fclose(file);
+
+	if (!(summary = strstr(baseline, "\"summary\"")))
+	{
+		CONERR("%s has no summary, it must be the json output of a finished run!\n", testParam->BaselineFile);
+		free(baseline);
+		return -1;
+	}
+
+	CONMSG("Baseline %s (tolerance %d%%)\n", testParam->BaselineFile, testParam->Tolerance);
+
+	for (i = 0; i < count; i++)
+	{
+		if (!(transferParam = transferParams[i])) continue;
+
+		sprintf(key, "\"ep\": \"0x%02X\"", transferParam->Ep.bEndpointAddress);
+		if (!(entry = strstr(summary, key)))
+		{
+			CONWRN("no baseline for Ep%02Xh\n", transferParam->Ep.bEndpointAddress);
+			continue;
+		}
+
+		GetAverageBytesSec(transferParam, &bpsAverage);
+		p99 = LatencyPercentile(&transferParam->Latency, 99.0) / 1000.0;
+
+		value = strstr(entry, "\"bytes_per_sec\": ");
+		bpsBaseline = value ? strtod(value + strlen("\"bytes_per_sec\": "), NULL) : 0;
+		value = strstr(entry, "\"p99\": ");
+		p99Baseline = value ? strtod(value + strlen("\"p99\": "), NULL) : 0;
+
+		CONMSG("\tEp%02Xh Bytes/sec : %.2f (baseline %.2f)\n",
+			transferParam->Ep.bEndpointAddress, bpsAverage, bpsBaseline);
+		CONMSG("\tEp%02Xh p99 (us)   : %.1f (baseline %.1f)\n",
+			transferParam->Ep.bEndpointAddress, p99, p99Baseline);
+
+		if (bpsAverage < bpsBaseline * (1.0 - tolerance))
+		{
+			CONERR("Ep%02Xh throughput regressed by %.1f%%!\n",
+				transferParam->Ep.bEndpointAddress, (1.0 - bpsAverage / bpsBaseline) * 100.0);
+			regressions++;
+		}
+		if (p99Baseline > 0 && p99 > p99Baseline * (1.0 + tolerance))
+		{
+			CONERR("Ep%02Xh p99 latency regressed by %.1f%%!\n",
+				transferParam->Ep.bEndpointAddress, (p99 / p99Baseline - 1.0) * 100.0);
+			regressions++;
+		}
+	}
+
+	free(baseline);
+	return regressions;
+}
+
+// Lets the transfers run for [milliseconds]. Returns FALSE if a transfer
+// thread stopped or the user pressed 'Q'.
+static BOOL SweepWait(struct BENCHMARK_TEST_PARAM* testParam,
+					  struct BENCHMARK_TRANSFER_PARAM** transferParams,
+					  INT count,
+					  INT milliseconds)
+{
+	LONGLONG endTime = GetPerfCounter() + (LONGLONG)milliseconds * PerfFrequency.QuadPart / 1000;
+	int key, i;
+
+	do
+	{
+		Sleep(milliseconds < 100 ? milliseconds : 100);
+
+		if (_kbhit())
+		{
+			key = _getch();
+			if (key == 'Q' || key == 'q')
+			{
+				testParam->IsUserAborted = TRUE;
+				return FALSE;
+			}
+		}
+
+		for (i = 0; i < count; i++)
+		{
+			if (!transferParams[i]->IsRunning)
+				return FALSE;
+		}
+
+	} while (GetPerfCounter() < endTime);
+
+	return TRUE;
+}
+
+// Runs the test for every buffer size and buffer count of the sweep grid.
+// Each configuration runs for Warmup seconds, then its statistics are reset
+// and it is measured for Duration seconds. The reported values are the ones
+// of the read endpoint if the test reads, otherwise the ones of the write
+// endpoint.
+INT RunSweep(struct BENCHMARK_TEST_PARAM* testParam)
+{
+	struct BENCHMARK_SWEEP_RESULT* results;
+	struct BENCHMARK_SWEEP_RESULT* result;
+	struct BENCHMARK_SWEEP_RESULT* best = NULL;
+	struct BENCHMARK_SWEEP_RESULT* recommended = NULL;
+	struct BENCHMARK_TRANSFER_PARAM* transferParams[2];
+	enum BENCHMARK_TRANSFER_MODE transferMode = testParam->TransferMode;
+	INT resultCount = testParam->SweepSizeCount * testParam->SweepCountCount;
+	INT sizeIndex, countIndex, transferCount, i;
+	struct BENCHMARK_CPU_TIME cpuTime;
+	LONGLONG totalTransferred;
+	DOUBLE userSeconds, kernelSeconds;
+	BOOL completed;
+
+	results = calloc(resultCount, sizeof(struct BENCHMARK_SWEEP_RESULT));
+	if (!results)
+	{
+        CONERR("memory allocation failure at line %d!\n",__LINE__);
+        return -1;
+	}
+
+	for (sizeIndex = 0; sizeIndex < testParam->SweepSizeCount && !testParam->IsUserAborted; sizeIndex++)
+	{
+		for (countIndex = 0; countIndex < testParam->SweepCountCount && !testParam->IsUserAborted; countIndex++)
+		{
+			result = &results[sizeIndex * testParam->SweepCountCount + countIndex];
+			result->BufferSize = testParam->SweepSizes[sizeIndex];
+			result->BufferCount = testParam->SweepCounts[countIndex];
+
+			testParam->BufferSize = result->BufferSize;
+			testParam->BufferCount = result->BufferCount;
+			testParam->TransferMode = result->BufferCount > 1 ? TRANSFER_MODE_ASYNC : transferMode;
+			testParam->IsCancelled = FALSE;
+
+			CONMSG("buffersize=%d buffercount=%d..\n", result->BufferSize, result->BufferCount);
+
+			// Buffer sizes that don't fit the endpoints fail here.
+			transferCount = CreateTestStreams(testParam, transferParams, 2);
+			if (transferCount < 0)
+			{
+				CONWRN("buffersize=%d buffercount=%d failed.\n", result->BufferSize, result->BufferCount);
+				continue;
+			}
+
+			completed = FALSE;
+			StartTestStreams(transferParams, transferCount);
+
+			if (SweepWait(testParam, transferParams, transferCount, testParam->Warmup * 1000))
+			{
+				EnterCriticalSection(&DisplayCriticalSection);
+				for (i = 0; i < transferCount; i++)
+					ResetRunningStatus(transferParams[i]);
+				LeaveCriticalSection(&DisplayCriticalSection);
+				GetProcessCpuTime(&testParam->StartCpuTime);
+
+				completed = SweepWait(testParam, transferParams, transferCount, testParam->Duration * 1000);
+
+				// Measured before the threads are stopped.
+				GetProcessCpuTime(&cpuTime);
+				GetCpuSeconds(&testParam->StartCpuTime, &cpuTime, &userSeconds, &kernelSeconds);
+				for (i = 0, totalTransferred = 0; i < transferCount; i++)
+					totalTransferred += transferParams[i]->TotalTransferred;
+				result->CpuPerGB = CPU_PER_GB(userSeconds + kernelSeconds, totalTransferred);
+			}
+
+			testParam->IsCancelled = TRUE;
+			StopTestTransfers(transferParams, transferCount);
+
+			if (completed)
+			{
+				GetAverageBytesSec(transferParams[0], &result->BytesSec);
+				result->LatencyP50 = LatencyPercentile(&transferParams[0]->Latency, 50.0);
+				result->LatencyP99 = LatencyPercentile(&transferParams[0]->Latency, 99.0);
+				result->Valid = result->BytesSec > 0;
+			}
+			for (i = 0; i < transferCount; i++)
+				result->ErrorCount += transferParams[i]->TotalTimeoutCount + transferParams[i]->TotalErrorCount;
+
+			if (result->Valid)
+				CONMSG("buffersize=%d buffercount=%d: %.2f Bytes/s p99 %.1f us CPU/GB %.3f s\n",
+					result->BufferSize, result->BufferCount, result->BytesSec, result->LatencyP99 / 1000.0,
+					result->CpuPerGB);
+			else
+				CONWRN("buffersize=%d buffercount=%d failed.\n", result->BufferSize, result->BufferCount);
+
+			FreeTestStreams(transferParams, transferCount);
+		}
+	}
+
+	for (i = 0; i < resultCount; i++)
+	{
+		if (results[i].Valid && (!best || results[i].BytesSec > best->BytesSec))
+			best = &results[i];
+	}
+
+	// The recommended configuration is the one that needs the least buffer
+	// memory for 95% of the best throughput, ties go to the lower p99 latency.
+	for (i = 0; best && i < resultCount; i++)
+	{
+		result = &results[i];
+		if (!result->Valid || result->BytesSec < best->BytesSec * 0.95)
+			continue;
+
+		if (!recommended ||
+			(LONGLONG)result->BufferSize * result->BufferCount < (LONGLONG)recommended->BufferSize * recommended->BufferCount ||
+			((LONGLONG)result->BufferSize * result->BufferCount == (LONGLONG)recommended->BufferSize * recommended->BufferCount &&
+			 result->LatencyP99 < recommended->LatencyP99))
+		{
+			recommended = result;
+		}
+	}
+
+	ShowSweepResults(testParam, results, recommended);
+	OutputSweep(testParam, results, recommended);
+
+	free(results);
+	return recommended ? 0 : -1;
+}
+
+void ShowSweepResults(struct BENCHMARK_TEST_PARAM* testParam,
+					  struct BENCHMARK_SWEEP_RESULT* results,
+					  struct BENCHMARK_SWEEP_RESULT* recommended)
+{
+	struct BENCHMARK_SWEEP_RESULT* result;
+	char line[32 + MAX_SWEEP_VALUES * 16];
+	INT sizeIndex, countIndex, table, pos;
+
+	for (table = 0; table < 3; table++)
+	{
+		CONMSG("\n%s by buffersize (rows) and buffercount (columns)\n",
+			table == 2 ? "CPU time per GB (s)" : table ? "p99 latency (us)" : "Throughput (MB/s)");
+
+		pos = sprintf(line, "%10s", "");
+		for (countIndex = 0; countIndex < testParam->SweepCountCount; countIndex++)
+			pos += sprintf(line + pos, " %10d", testParam->SweepCounts[countIndex]);
+		CONMSG("%s\n", line);
+
+		for (sizeIndex = 0; sizeIndex < testParam->SweepSizeCount; sizeIndex++)
+		{
+			pos = sprintf(line, "%10d", testParam->SweepSizes[sizeIndex]);
+			for (countIndex = 0; countIndex < testParam->SweepCountCount; countIndex++)
+			{
+				result = &results[sizeIndex * testParam->SweepCountCount + countIndex];
+				if (!result->Valid)
+					pos += sprintf(line + pos, " %10s", "-");
+				else if (table == 2)
+					pos += sprintf(line + pos, " %10.3f", result->CpuPerGB);
+				else if (table)
+					pos += sprintf(line + pos, " %10.1f", result->LatencyP99 / 1000.0);
+				else
+					pos += sprintf(line + pos, " %10.2f", result->BytesSec / (1024.0 * 1024.0));
+			}
+			CONMSG("%s\n", line);
+		}
+	}
+
+	CONMSG0("\n");
+	if (recommended)
+	{
+		CONMSG("Recommended: buffersize=%d buffercount=%d (%.2f Bytes/s, p99 %.1f us, CPU/GB %.3f s)\n",
+			recommended->BufferSize, recommended->BufferCount,
+			recommended->BytesSec, recommended->LatencyP99 / 1000.0, recommended->CpuPerGB);
+	}
+	else
+	{
+		CONERR0("no configuration of the sweep completed!\n");
+	}
+}
+
+void OutputSweep(struct BENCHMARK_TEST_PARAM* testParam,
+				 struct BENCHMARK_SWEEP_RESULT* results,
+				 struct BENCHMARK_SWEEP_RESULT* recommended)
+{
+	struct BENCHMARK_SWEEP_RESULT* result;
+	INT resultCount = testParam->SweepSizeCount * testParam->SweepCountCount;
+	INT i;
+
+	if (testParam->OutputFormat == OUTPUT_FORMAT_JSON)
+	{
+		printf("{\n  \"sweep\": {\"vid\": \"0x%04X\", \"pid\": \"0x%04X\", \"intf\": %d, \"altf\": %d, "
+			"\"type\": \"%s\", \"warmup\": %d, \"duration\": %d},\n"
+			"  \"results\": [\n",
+			testParam->Vid, testParam->Pid, testParam->Intf, testParam->Altf,
+			TestDisplayString[testParam->TestType & 3], testParam->Warmup, testParam->Duration);
+
+		for (i = 0; i < resultCount; i++)
+		{
+			result = &results[i];
+			printf("    {\"buffersize\": %d, \"buffercount\": %d, \"valid\": %s, \"bytes_per_sec\": %.2f, "
+				"\"p50\": %.1f, \"p99\": %.1f, \"errors\": %d, \"cpu_per_gb\": %.3f}%s\n",
+				result->BufferSize, result->BufferCount, result->Valid ? "true" : "false",
+				result->BytesSec, result->LatencyP50 / 1000.0, result->LatencyP99 / 1000.0,
+				result->ErrorCount, result->CpuPerGB, i + 1 < resultCount ? "," : "");
+		}
+
+		if (recommended)
+			printf("  ],\n  \"recommended\": {\"buffersize\": %d, \"buffercount\": %d}\n}\n",
+				recommended->BufferSize, recommended->BufferCount);
+		else
+			printf("  ],\n  \"recommended\": null\n}\n");
+	}
+	else if (testParam->OutputFormat == OUTPUT_FORMAT_CSV)
+	{
+		printf("record,buffersize,buffercount,valid,bytes_per_sec,latency_p50,latency_p99,errors,cpu_per_gb\n");
+		for (i = 0; i < resultCount; i++)
+		{
+			result = &results[i];
+			printf("sweep,%d,%d,%d,%.2f,%.1f,%.1f,%d,%.3f\n",
+				result->BufferSize, result->BufferCount, result->Valid ? 1 : 0,
+				result->BytesSec, result->LatencyP50 / 1000.0, result->LatencyP99 / 1000.0,
+				result->ErrorCount, result->CpuPerGB);
+		}
+		if (recommended)
+		{
+			printf("record,buffersize,buffercount\n");
+			printf("recommended,%d,%d\n", recommended->BufferSize, recommended->BufferCount);
+		}
+	}
+	fflush(stdout);
+}
+
+DWORD ControlThreadProc(struct BENCHMARK_CONTROL_PARAM* controlParam)
+{
+	struct BENCHMARK_TEST_PARAM* test = controlParam->Test;
+	enum BENCHMARK_DEVICE_TEST_TYPE testType;
+	usb_dev_handle* udev;
+	char buffer[USB_DT_DEVICE_SIZE];
+	LONGLONG submitTime, completeTime;
+	INT ret, index, runningErrorCount = 0;
+
+    controlParam->IsRunning = TRUE;
+
+	while (!test->IsCancelled)
+	{
+		index = 0;
+		submitTime = GetPerfCounter();
+
+		switch (test->ControlTest)
+		{
+		case CONTROL_TEST_VENDOR:
+			// Devices without the benchmark firmware get a GET_STATUS instead.
+			if (test->NoTestSelect)
+				ret = usb_control_msg(test->DeviceHandle, USB_RECIP_DEVICE | USB_ENDPOINT_IN,
+					USB_REQ_GET_STATUS, 0, 0, buffer, 2, test->Timeout);
+			else
+				ret = Bench_GetTestType(test->DeviceHandle, &testType, test->Intf);
+			break;
+
+		case CONTROL_TEST_DESCRIPTOR:
+			// The driver returns the complete device descriptor from its cache,
+			// the first 8 bytes are requested from the device.
+			index = (INT)(controlParam->Count & 1);
+			ret = usb_get_descriptor(test->DeviceHandle, USB_DT_DEVICE, 0,
+				buffer, index ? 8 : USB_DT_DEVICE_SIZE);
+			break;
+
+		case CONTROL_TEST_OPENCLOSE:
+			if ((udev = usb_open(test->Device)))
+				ret = usb_close(udev);
+			else
+				ret = -1;
+			break;
+
+		case CONTROL_TEST_ENUMERATE:
+			usb_find_busses();
+			ret = usb_find_devices();
+			break;
+
+		default:
+            CONERR("invalid control test %d\n", test->ControlTest);
+			goto Done;
+		}
+		completeTime = GetPerfCounter();
+
+		if (ret < 0)
+		{
+			// The user pressed 'Q'.
+			if (test->IsUserAborted) break;
+
+			controlParam->ErrorCount++;
+			CONERR("%s failed! %d of %d ret=%d: %s\n",
+				ControlTestDisplayString[test->ControlTest],
+				++runningErrorCount, test->Retry+1, ret, usb_strerror());
+
+			if (runningErrorCount > test->Retry)
+				break;
+			continue;
+		}
+		runningErrorCount = 0;
+
+        EnterCriticalSection(&DisplayCriticalSection);
+		controlParam->Count++;
+		LatencyRecord(&controlParam->Latency[index], completeTime - submitTime);
+        LeaveCriticalSection(&DisplayCriticalSection);
+	}
+
+Done:
+    controlParam->IsRunning = FALSE;
+    return 0;
+}
+
+// Measures the paths that don't move data: vendor control round trips,
+// cached and uncached descriptor requests, open/close and enumeration.
+// With threads= the control and descriptor requests are issued by several
+// threads at the same time; open/close and enumeration use one thread.
+INT RunControlTest(struct BENCHMARK_TEST_PARAM* testParam)
+{
+	struct BENCHMARK_CONTROL_PARAM* controlParams[MAX_TEST_THREADS];
+	struct BENCHMARK_LATENCY* latency = NULL;
+	INT threadCount = 1;
+	INT i, key, errorCount = 0;
+	LONGLONG lastCount = 0, count, lastTick, tick;
+	struct BENCHMARK_CPU_TIME cpuTime;
+	DOUBLE elapsedSeconds, cpuSeconds, userSeconds, kernelSeconds;
+	INT ret = -1;
+
+	if (testParam->ControlTest == CONTROL_TEST_VENDOR || testParam->ControlTest == CONTROL_TEST_DESCRIPTOR)
+		threadCount = testParam->Threads;
+
+	memset(controlParams, 0, sizeof(controlParams));
+	for (i = 0; i < threadCount; i++)
+	{
+		controlParams[i] = malloc(sizeof(struct BENCHMARK_CONTROL_PARAM));
+		if (!controlParams[i])
+		{
+			CONERR("memory allocation failure at line %d!\n",__LINE__);
+			goto Done;
+		}
+		memset(controlParams[i], 0, sizeof(struct BENCHMARK_CONTROL_PARAM));
+		controlParams[i]->Test = testParam;
+		controlParams[i]->ThreadHandle = CreateThread(
+			NULL,
+			0,
+			(LPTHREAD_START_ROUTINE)ControlThreadProc,
+			controlParams[i],
+			CREATE_SUSPENDED,
+			&controlParams[i]->ThreadID);
+
+		if (!controlParams[i]->ThreadHandle)
+		{
+			CONERR0("failed creating thread!\n");
+			goto Done;
+		}
+	}
+
+	if (!(latency = calloc(2, sizeof(struct BENCHMARK_LATENCY))))
+	{
+		CONERR("memory allocation failure at line %d!\n",__LINE__);
+		goto Done;
+	}
+
+	CONMSG("%s test with %d thread(s)..\n", ControlTestDisplayString[testParam->ControlTest], threadCount);
+	if (!testParam->Duration)
+		CONMSG0("Press 'Q' to quit\n");
+
+	testParam->StartTime = lastTick = GetPerfCounter();
+	GetProcessCpuTime(&testParam->StartCpuTime);
+	for (i = 0; i < threadCount; i++)
+	{
+		// Set here so a thread that has not been scheduled yet isn't taken
+		// for one that stopped.
+		controlParams[i]->IsRunning = TRUE;
+
+		SetThreadPriority(controlParams[i]->ThreadHandle, testParam->Priority);
+		ResumeThread(controlParams[i]->ThreadHandle);
+	}
+
+	while (!testParam->IsCancelled)
+	{
+		Sleep(testParam->Refresh);
+
+		if (_kbhit())
+		{
+			key = _getch();
+			if (key == 'Q' || key == 'q')
+			{
+				testParam->IsUserAborted = TRUE;
+				testParam->IsCancelled = TRUE;
+			}
+
+            // Only one key at a time.
+            while (_kbhit()) _getch();
+		}
+
+		count = 0;
+        EnterCriticalSection(&DisplayCriticalSection);
+		for (i = 0; i < threadCount; i++)
+		{
+			if (!controlParams[i]->IsRunning)
+				testParam->IsCancelled = TRUE;
+			count += controlParams[i]->Count;
+		}
+        LeaveCriticalSection(&DisplayCriticalSection);
+
+		tick = GetPerfCounter();
+		CONMSG("Requests: %I64d Requests/s: %.2f\n",
+			count, (DOUBLE)(count - lastCount) * PerfFrequency.QuadPart / (tick - lastTick));
+		lastCount = count;
+		lastTick = tick;
+
+		if (testParam->Duration &&
+			tick - testParam->StartTime >= testParam->Duration * PerfFrequency.QuadPart)
+		{
+			testParam->IsUserAborted = TRUE;
+			testParam->IsCancelled = TRUE;
+		}
+	}
+
+	for (i = 0; i < threadCount; i++)
+		WaitForSingleObject(controlParams[i]->ThreadHandle, INFINITE);
+
+	elapsedSeconds = (DOUBLE)(GetPerfCounter() - testParam->StartTime) / PerfFrequency.QuadPart;
+	GetProcessCpuTime(&cpuTime);
+	GetCpuSeconds(&testParam->StartCpuTime, &cpuTime, &userSeconds, &kernelSeconds);
+	cpuSeconds = userSeconds + kernelSeconds;
+
+	for (i = 0; i < threadCount; i++)
+	{
+		LatencyMerge(&latency[0], &controlParams[i]->Latency[0]);
+		LatencyMerge(&latency[1], &controlParams[i]->Latency[1]);
+		errorCount += controlParams[i]->ErrorCount;
+	}
+
+	ShowControlResults(testParam, latency, threadCount, errorCount, elapsedSeconds, cpuSeconds);
+	OutputControl(testParam, latency, threadCount, errorCount, elapsedSeconds, cpuSeconds);
+
+	ret = latency[0].Count ? 0 : -1;
+
+Done:
+	// Threads that were never started exit right away.
+	testParam->IsCancelled = TRUE;
+	for (i = 0; i < threadCount; i++)
+	{
+		if (!controlParams[i]) continue;
+
+		if (controlParams[i]->ThreadHandle)
+		{
+			ResumeThread(controlParams[i]->ThreadHandle);
+			WaitForSingleObject(controlParams[i]->ThreadHandle, INFINITE);
+			CloseHandle(controlParams[i]->ThreadHandle);
+		}
+		free(controlParams[i]);
+	}
+	if (latency)
+		free(latency);
+
+	return ret;
+}
+
+void ShowControlResults(struct BENCHMARK_TEST_PARAM* testParam,
+						struct BENCHMARK_LATENCY* latency,
+						INT threadCount,
+						INT errorCount,
+						DOUBLE elapsedSeconds,
+						DOUBLE cpuSeconds)
+{
+	LONGLONG count = latency[0].Count + latency[1].Count;
+	INT i;
+
+	CONMSG("%s Test Results\n", ControlTestDisplayString[testParam->ControlTest]);
+	CONMSG("\tThreads         : %d\n", threadCount);
+	CONMSG("\tElapsed Time    : %.2f seconds\n", elapsedSeconds);
+	if (errorCount)
+	{
+		CONMSG("\tErrors          : %d\n", errorCount);
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		if (!latency[i].Count) continue;
+
+		if (testParam->ControlTest == CONTROL_TEST_DESCRIPTOR)
+		{
+			CONMSG("\t%s\n", i ? "Uncached (8 bytes from the device)" : "Cached (device descriptor)");
+		}
+		CONMSG("\tRequests        : %I64d\n", latency[i].Count);
+		CONMSG("\tRequests/sec    : %.2f\n", latency[i].Count / elapsedSeconds);
+		ShowLatencyInfo(&latency[i], testParam->ShowHistogram);
+	}
+
+	CONMSG("\tCPU Time        : %.3f seconds\n", cpuSeconds);
+	if (count)
+	{
+		CONMSG("\tCPU / Request   : %.1f us\n", cpuSeconds * 1000000.0 / count);
+	}
+	CONMSG0("\n");
+}
+
+void OutputControl(struct BENCHMARK_TEST_PARAM* testParam,
+				   struct BENCHMARK_LATENCY* latency,
+				   INT threadCount,
+				   INT errorCount,
+				   DOUBLE elapsedSeconds,
+				   DOUBLE cpuSeconds)
+{
+	const char* kind[2] = {"all", "uncached"};
+	INT i, written = 0;
+
+	if (testParam->ControlTest == CONTROL_TEST_DESCRIPTOR)
+		kind[0] = "cached";
+
+	if (testParam->OutputFormat == OUTPUT_FORMAT_JSON)
+	{
+		printf("{\n  \"control\": {\"test\": \"%s\", \"threads\": %d, \"elapsed\": %.3f, \"errors\": %d, \"cpu\": %.3f},\n"
+			"  \"results\": [\n",
+			ControlTestDisplayString[testParam->ControlTest], threadCount, elapsedSeconds, errorCount, cpuSeconds);
+	}
+	else if (testParam->OutputFormat == OUTPUT_FORMAT_CSV)
+	{
+		printf("record,test,kind,threads,requests,requests_per_sec,errors,cpu,"
+			"latency_min,latency_p50,latency_p90,latency_p99,latency_p999,latency_max,jitter\n");
+	}
+	else
+	{
+		return;
+	}
+
+	// Latency values are in microseconds.
+	for (i = 0; i < 2; i++)
+	{
+		if (!latency[i].Count) continue;
+
+		if (testParam->OutputFormat == OUTPUT_FORMAT_JSON)
+		{
+			printf("%s    {\"kind\": \"%s\", \"requests\": %I64d, \"requests_per_sec\": %.2f, "
+				"\"latency\": {\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f, \"jitter\": %.1f}}",
+				written ? ",\n" : "", kind[i], latency[i].Count, latency[i].Count / elapsedSeconds,
+				latency[i].Min / 1000.0,
+				LatencyPercentile(&latency[i], 50.0) / 1000.0,
+				LatencyPercentile(&latency[i], 90.0) / 1000.0,
+				LatencyPercentile(&latency[i], 99.0) / 1000.0,
+				LatencyPercentile(&latency[i], 99.9) / 1000.0,
+				latency[i].Max / 1000.0,
+				LatencyStdDev(&latency[i]) / 1000.0);
+		}
+		else
+		{
+			printf("control,%s,%s,%d,%I64d,%.2f,%d,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+				ControlTestDisplayString[testParam->ControlTest], kind[i], threadCount,
+				latency[i].Count, latency[i].Count / elapsedSeconds, errorCount, cpuSeconds,
+				latency[i].Min / 1000.0,
+				LatencyPercentile(&latency[i], 50.0) / 1000.0,
+				LatencyPercentile(&latency[i], 90.0) / 1000.0,
+				LatencyPercentile(&latency[i], 99.0) / 1000.0,
+				LatencyPercentile(&latency[i], 99.9) / 1000.0,
+				latency[i].Max / 1000.0,
+				LatencyStdDev(&latency[i]) / 1000.0);
+		}
+		written++;
+	}
+
+	if (testParam->OutputFormat == OUTPUT_FORMAT_JSON)
+		printf("\n  ]\n}\n");
+	fflush(stdout);
+}
+
+// Opens up to MaxDevices devices with the Vid/Pid, test interface and
+// (optional) serial number of the test. Returns the number of devices.
+INT OpenTestDevices(struct BENCHMARK_TEST_PARAM* test)
+{
+    struct usb_bus* bus;
+    struct usb_device* dev;
+    struct usb_dev_handle* udev;
+    char serial[256];
+
+    for (bus = usb_get_busses(); bus; bus = bus->next)
+    {
+        for (dev = bus->devices; dev && test->DeviceCount < test->MaxDevices; dev = dev->next)
+        {
+            if (dev->descriptor.idVendor != test->Vid || dev->descriptor.idProduct != test->Pid)
+                continue;
+            if (!dev->descriptor.bNumConfigurations ||
+                !usb_find_interface(&dev->config[0], test->Intf, test->Altf, NULL))
+                continue;
+            if (!(udev = usb_open(dev)))
+                continue;
+
+            if (test->Serial)
+            {
+                if (!dev->descriptor.iSerialNumber ||
+                    usb_get_string_simple(udev, dev->descriptor.iSerialNumber, serial, sizeof(serial)) <= 0 ||
+                    strcmp(serial, test->Serial))
+                {
+                    usb_close(udev);
+                    continue;
+                }
+            }
+
+            test->Devices[test->DeviceCount] = dev;
+            test->DeviceHandles[test->DeviceCount++] = udev;
+        }
+    }
+
+    test->DeviceHandle = test->DeviceHandles[0];
+    test->Device = test->Devices[0];
+
+    return test->DeviceCount;
+}
+
+// Selects the test type and claims the test interface of an opened device.
+INT PrepareTestDevice(struct BENCHMARK_TEST_PARAM* test, usb_dev_handle* deviceHandle)
+{
+    // If "NoTestSelect" appears in the command line then don't send the control
+    // messages for selecting the test type.
+    //
+    if (!test->NoTestSelect)
+    {
+        if (Bench_SetTestType(deviceHandle, test->TestType, test->Intf) != 1)
+        {
+            CONERR("setting bechmark test type #%d!\n%s\n", test->TestType, usb_strerror());
+            return -1;
+        }
+    }
+
+    // Set configuration #1.
+    if (usb_set_configuration(deviceHandle, 1) < 0)
+    {
+        CONERR("setting configuration #%d!\n%s\n",1,usb_strerror());
+        return -1;
+    }
+
+    // Claim_interface Test.Intf (Default is #0)
+    if (usb_claim_interface(deviceHandle, test->Intf) < 0)
+    {
+        CONERR("claiming interface #%d!\n%s\n", test->Intf, usb_strerror());
+        return -1;
+    }
+
+    // Set the alternate setting (Default is #0)
+	if (usb_set_altinterface(deviceHandle, test->Altf) < 0)
+	{
+		CONERR("selecting alternate setting #%d on interface #%d!\n%s\n", test->Altf,  test->Intf, usb_strerror());
+        return -1;
+	}
+	else
+	{
+		if (test->Altf > 0)
+		{
+			CONDBG("selected alternate setting #%d on interface #%d\n",test->Altf,  test->Intf);
+		}
+	}
+
+    return 0;
+}
+
+int GetTestDeviceFromList(struct BENCHMARK_TEST_PARAM* testParam)
+{
+    const int LINE_MAX_SIZE   = 1024;
+    const int STRING_MAX_SIZE = 256;
+    const int NUM_STRINGS = 3;
+    const int ALLOC_SIZE = LINE_MAX_SIZE + (STRING_MAX_SIZE * NUM_STRINGS);
+
+    int userInput;
+    char selection[64];
+    char* next;
+
+    char* buffer;
+    char* line;
+    char* product;
+    char* manufacturer;
+    char* serial;
+
+    struct usb_bus* bus;
+    struct usb_device* dev;
+    usb_dev_handle* udev;
+    struct usb_device* validDevices[256];
+
+    int deviceIndex=0;
+	struct usb_interface_descriptor* firstInterface;
+
+    int ret = -1;
+
+    buffer = malloc(ALLOC_SIZE);
+    if (!buffer)
+    {
+        CONERR0("failed allocating memory!\n");
+        return ret;
+    }
+
+    line = buffer;
+    product = buffer + LINE_MAX_SIZE;
+    manufacturer = product + STRING_MAX_SIZE;
+    serial = manufacturer + STRING_MAX_SIZE;
+
+    for (bus = usb_get_busses(); bus; bus = bus->next)
+    {
+        for (dev = bus->devices; dev; dev = dev->next)
+        {
+
+            udev = usb_open(dev);
+            if (udev)
+            {
+                memset(buffer, 0, ALLOC_SIZE);
+                line = buffer;
+                if (dev->descriptor.iManufacturer)
+                {
+                    if (usb_get_string_simple(udev, dev->descriptor.iManufacturer, manufacturer, STRING_MAX_SIZE - 1) > 0)
+                    {
+                        strcat(line,"(");
+                        strcat(line,manufacturer);
+                        strcat(line,") ");
+                    }
+                }
+
+                if (dev->descriptor.iProduct)
+                {
+                    if (usb_get_string_simple(udev, dev->descriptor.iProduct, product, STRING_MAX_SIZE - 1) > 0)
+                    {
+                        strcat(line,product);
+                        strcat(line," ");
+                    }
+                }
+
+                if (dev->descriptor.iSerialNumber)
+                {
+                    if (usb_get_string_simple(udev, dev->descriptor.iSerialNumber, serial, STRING_MAX_SIZE - 1) > 0)
+                    {
+                        strcat(line,"[");
                         strcat(line,serial);
                         strcat(line,"] ");
                     }
@@ -1248,9 +3544,10 @@ int GetTestDeviceFromList(struct BENCHMARK_TEST_PARAM* testParam)
 		goto Done;
 	}
 
-    CONMSG("\nSelect device (1-%d) :",deviceIndex);
-	ret = _cscanf("%i",&userInput);
-    if (ret != 1 || userInput < 1)
+    // Several devices are tested at once if they are separated by commas.
+    CONMSG("\nSelect device(s) (1-%d, i.e. 1 or 1,3) :",deviceIndex);
+	ret = _cscanf("%63s",selection);
+    if (ret != 1)
 	{
         CONMSG0("\n");
         CONMSG0("Aborting..\n");
@@ -1258,12 +3555,27 @@ int GetTestDeviceFromList(struct BENCHMARK_TEST_PARAM* testParam)
 		goto Done;
 	}
     CONMSG0("\n");
-    userInput--;
-    if (userInput >= 0 && userInput < deviceIndex)
+
+    ret = -1;
+    for (next = selection; *next && testParam->DeviceCount < MAX_TEST_DEVICES; next += (*next == ','))
     {
-        testParam->DeviceHandle = usb_open(validDevices[userInput]);
-        if (testParam->DeviceHandle)
+        userInput = strtol(next, &next, 0) - 1;
+        if (userInput < 0 || userInput >= deviceIndex)
+        {
+            CONMSG0("Aborting..\n");
+            ret = -1;
+            goto Done;
+        }
+
+        testParam->DeviceHandles[testParam->DeviceCount] = usb_open(validDevices[userInput]);
+        if (!testParam->DeviceHandles[testParam->DeviceCount])
+            continue;
+        testParam->Devices[testParam->DeviceCount++] = validDevices[userInput];
+
+        // The first device selects the test interface.
+        if (testParam->DeviceCount == 1)
         {
+            testParam->DeviceHandle = testParam->DeviceHandles[0];
 			testParam->Device = validDevices[userInput];
             testParam->Vid = testParam->Device->descriptor.idVendor;
             testParam->Pid = testParam->Device->descriptor.idProduct;
@@ -1282,8 +3594,8 @@ int GetTestDeviceFromList(struct BENCHMARK_TEST_PARAM* testParam)
 					goto Done;
 				}
 			}
-            ret = 0;
         }
+        ret = 0;
 	}
 
 Done:
@@ -1293,13 +3605,102 @@ Done:
     return ret;
 }
 
+// Measures the pattern compare of every level the cpu supports against the
+// memcmp() compare. Doesn't need a benchmark device.
+INT RunVerifyBench(struct BENCHMARK_TEST_PARAM* testParam)
+{
+	const WORD packetSizes[] = {64, 512, 1024};
+	const INT levels[] = {PATTERN_LEVEL_MEMCMP, PATTERN_LEVEL_SCALAR, PATTERN_LEVEL_SSE2, PATTERN_LEVEL_AVX2};
+	BYTE* buffer;
+	BYTE* pattern;
+	INT sizeIndex, levelIndex, maxLevel, plantIndex, ret;
+	INT errorCount = 0;
+	LONGLONG startTick, endTick, passes;
+	DOUBLE seconds;
+	PATTERN_COMPARE compare;
+
+	maxLevel = PatternCpuLevel();
+	if (testParam->SimdLevel >= 0 && testParam->SimdLevel < maxLevel)
+		maxLevel = testParam->SimdLevel;
+
+	buffer = malloc(VERIFY_BENCH_BUFFER_SIZE);
+	pattern = malloc(packetSizes[_countof(packetSizes) - 1]);
+	if (!buffer || !pattern)
+	{
+		CONERR("memory allocation failure at line %d!\n",__LINE__);
+		errorCount = -1;
+		goto Done;
+	}
+
+	CONMSG("Pattern Verify Benchmark (%d MB buffer, cpu supports %s)\n",
+		VERIFY_BENCH_BUFFER_SIZE / (1024 * 1024), PatternLevelDisplayString[PatternCpuLevel()]);
+
+	for (sizeIndex = 0; sizeIndex < _countof(packetSizes); sizeIndex++)
+	{
+		PatternFill(pattern, packetSizes[sizeIndex], packetSizes[sizeIndex], 1);
+		PatternFill(buffer, VERIFY_BENCH_BUFFER_SIZE, packetSizes[sizeIndex], 0);
+
+		// Every compare must find the same byte in the middle of the last packet.
+		plantIndex = VERIFY_BENCH_BUFFER_SIZE - packetSizes[sizeIndex] / 2 - 3;
+
+		for (levelIndex = 0; levelIndex < _countof(levels); levelIndex++)
+		{
+			if (levels[levelIndex] != PATTERN_LEVEL_MEMCMP && levels[levelIndex] > maxLevel)
+				continue;
+
+			compare = PatternCompareByLevel(levels[levelIndex]);
+
+			passes = 0;
+			endTick = startTick = GetPerfCounter();
+			do
+			{
+				if (PatternFindMismatch(buffer, VERIFY_BENCH_BUFFER_SIZE, pattern, packetSizes[sizeIndex], compare) >= 0)
+				{
+					CONERR("%s found a mismatch in valid data!\n", PatternLevelDisplayString[levels[levelIndex]]);
+					errorCount++;
+					break;
+				}
+				passes++;
+				endTick = GetPerfCounter();
+			} while ((endTick - startTick) < PerfFrequency.QuadPart / 2);
+
+			seconds = (DOUBLE)(endTick - startTick) / PerfFrequency.QuadPart;
+
+			buffer[plantIndex] ^= 0x55;
+			ret = PatternFindMismatch(buffer, VERIFY_BENCH_BUFFER_SIZE, pattern, packetSizes[sizeIndex], compare);
+			buffer[plantIndex] ^= 0x55;
+
+			if (ret != plantIndex)
+			{
+				CONERR("%s reported offset %d, expected %d!\n",
+					PatternLevelDisplayString[levels[levelIndex]], ret, plantIndex);
+				errorCount++;
+			}
+
+			CONMSG("\tpacket-size=%-4d %-6s: %.2f MB/s\n",
+				packetSizes[sizeIndex], PatternLevelDisplayString[levels[levelIndex]],
+				seconds > 0 ? ((DOUBLE)passes * VERIFY_BENCH_BUFFER_SIZE) / (1024.0 * 1024.0) / seconds : 0.0);
+		}
+	}
+
+Done:
+	if (buffer) free(buffer);
+	if (pattern) free(pattern);
+	return errorCount;
+}
+
 int main(int argc, char** argv)
 {
     struct BENCHMARK_TEST_PARAM Test;
-    struct BENCHMARK_TRANSFER_PARAM* ReadTest	= NULL;
-    struct BENCHMARK_TRANSFER_PARAM* WriteTest	= NULL;
-    int key;
+    struct BENCHMARK_TRANSFER_PARAM* transferParams[MAX_TEST_STREAMS];
+    int transferCount = 0;
+    int key, i;
+    int exitCode = 0;
+    int regressions;
+	BOOL outputStarted = FALSE;
+	BOOL concurrent;
 
+	LogStream = stdout;
 
     if (argc == 1)
     {
@@ -1321,12 +3722,27 @@ int main(int argc, char** argv)
     if (ParseBenchmarkArgs(&Test, argc, argv) < 0)
         return -1;
 
+    if (Test.OutputFormat != OUTPUT_FORMAT_TEXT)
+        LogStream = stderr;
+
     // Initialize the critical section used for locking
     // the volatile members of the transfer params in order
     // to update/modify the running statistics.
     //
     InitializeCriticalSection(&DisplayCriticalSection);
 
+	QueryPerformanceFrequency(&PerfFrequency);
+
+	Test.SimdLevel = PatternSelect(Test.SimdLevel);
+
+	// The pattern compare benchmark doesn't need a device.
+	if (Test.VerifyBench)
+	{
+		if (RunVerifyBench(&Test) != 0)
+			exitCode = -1;
+		goto Done;
+	}
+
     // Initialize the library.
     usb_init();
 
@@ -1336,6 +3752,14 @@ int main(int argc, char** argv)
     // Find all connected devices.
     usb_find_devices();
 
+	// Enumeration doesn't need a benchmark device.
+	if (Test.ControlTest == CONTROL_TEST_ENUMERATE)
+	{
+		if (RunControlTest(&Test) < 0)
+			exitCode = -1;
+		goto Done;
+	}
+
     if (Test.UseList)
     {
         if (GetTestDeviceFromList(&Test) < 0)
@@ -1343,8 +3767,8 @@ int main(int argc, char** argv)
     }
     else
     {
-        // Open a benchmark device. see Bench_Open().
-        Test.DeviceHandle = Bench_Open(Test.Vid, Test.Pid, Test.Intf, Test.Altf, &Test.Device);
+        // Open the benchmark device(s). see OpenTestDevices().
+        OpenTestDevices(&Test);
     }
     if (!Test.DeviceHandle || !Test.Device)
     {
@@ -1352,108 +3776,91 @@ int main(int argc, char** argv)
         goto Done;
     }
 
-    // If "NoTestSelect" appears in the command line then don't send the control
-    // messages for selecting the test type.
+    // Select the test type, the configuration and the interface of
+    // every device. see PrepareTestDevice().
     //
-    if (!Test.NoTestSelect)
+    for (i = 0; i < Test.DeviceCount; i++)
     {
-        if (Bench_SetTestType(Test.DeviceHandle, Test.TestType, Test.Intf) != 1)
-        {
-            CONERR("setting bechmark test type #%d!\n%s\n", Test.TestType, usb_strerror());
+        if (PrepareTestDevice(&Test, Test.DeviceHandles[i]) < 0)
             goto Done;
-        }
     }
 
-    CONMSG("Benchmark device %04X:%04X opened..\n",Test.Vid, Test.Pid);
-
-    // If reading from the device create the read transfer param. This will also create
-    // a thread in a suspended state.
-    //
-    if (Test.TestType & TestTypeRead)
+    if (Test.DeviceCount > 1)
     {
-        ReadTest = CreateTransferParam(&Test, Test.Ep | USB_ENDPOINT_DIR_MASK);
-        if (!ReadTest) goto Done;
+        CONMSG("%d benchmark devices %04X:%04X opened..\n",Test.DeviceCount, Test.Vid, Test.Pid);
     }
-
-    // If writing to the device create the write transfer param. This will also create
-    // a thread in a suspended state.
-    //
-    if (Test.TestType & TestTypeWrite)
+    else
     {
-        WriteTest = CreateTransferParam(&Test, Test.Ep);
-        if (!WriteTest) goto Done;
+        CONMSG("Benchmark device %04X:%04X opened..\n",Test.Vid, Test.Pid);
     }
 
-    // Set configuration #1.
-    if (usb_set_configuration(Test.DeviceHandle, 1) < 0)
-    {
-        CONERR("setting configuration #%d!\n%s\n",1,usb_strerror());
-        goto Done;
-    }
+	concurrent = Test.DeviceCount > 1 || Test.EpCount > 1 || Test.Threads > 1;
 
-    // Claim_interface Test.Intf (Default is #0)
-    if (usb_claim_interface(Test.DeviceHandle, Test.Intf) < 0)
+	// The control tests replace the data transfers.
+	if (Test.ControlTest != CONTROL_TEST_NONE)
+	{
+		ShowTestInfo(&Test);
+		if (RunControlTest(&Test) < 0)
+			exitCode = -1;
+		goto Done;
+	}
+
+	// A sweep creates the transfer params for every configuration, see RunSweep().
+	if (Test.Sweep)
+	{
+		ShowTestInfo(&Test);
+		if (RunSweep(&Test) < 0)
+			exitCode = -1;
+		goto Done;
+	}
+
+    // Create the transfer params; one for reading and/or writing on every
+    // endpoint pair of every device, times the number of threads. This will
+    // also create the threads in a suspended state.
+    //
+    transferCount = CreateTestStreams(&Test, transferParams, MAX_TEST_STREAMS);
+    if (transferCount < 0)
     {
-        CONERR("claiming interface #%d!\n%s\n", Test.Intf, usb_strerror());
+        transferCount = 0;
         goto Done;
     }
 
-    // Set the alternate setting (Default is #0)
-	if (usb_set_altinterface(Test.DeviceHandle, Test.Altf) < 0)
-	{
-		CONERR("selecting alternate setting #%d on interface #%d!\n%s\n", Test.Altf,  Test.Intf, usb_strerror());
-        goto Done;
-	}
-	else
+	ShowTestInfo(&Test);
+	for (i = 0; i < transferCount; i++)
+		ShowTransferInfo(transferParams[i]);
+
+	// With a duration the test runs unattended.
+	if (!Test.Duration)
 	{
-		if (Test.Altf > 0)
+		CONMSG0("\nWhile the test is running:\n");
+		CONMSG0("Press 'Q' to quit\n");
+		CONMSG0("Press 'T' for test details\n");
+		CONMSG0("Press 'I' for status information\n");
+		CONMSG0("Press 'R' to reset averages\n");
+		CONMSG0("\nPress 'Q' to exit, any other key to begin..");
+		key = _getch();
+		CONMSG0("\n");
+
+		if (key=='Q' || key=='q')
 		{
-			CONDBG("selected alternate setting #%d on interface #%d\n",Test.Altf,  Test.Intf);
+			// Let the suspended threads exit.
+			Test.IsUserAborted = TRUE;
+			Test.IsCancelled = TRUE;
+			StopTestTransfers(transferParams, transferCount);
+			goto Done;
 		}
 	}
 
-	if (Test.Verify)
+	Test.StartTime = GetPerfCounter();
+	GetProcessCpuTime(&Test.StartCpuTime);
+	if (Test.OutputFormat != OUTPUT_FORMAT_TEXT)
 	{
-		if (ReadTest && WriteTest)
-		{
-			if (CreateVerifyBuffer(&Test, WriteTest->Ep.wMaxPacketSize) < 0)
-				goto Done;
-		}
-		else if (ReadTest)
-		{
-			if (CreateVerifyBuffer(&Test, ReadTest->Ep.wMaxPacketSize) < 0)
-				goto Done;
-		}
+		OutputBegin(&Test);
+		outputStarted = TRUE;
 	}
 
-	ShowTestInfo(&Test);
-	ShowTransferInfo(ReadTest);
-	ShowTransferInfo(WriteTest);
-
-	CONMSG0("\nWhile the test is running:\n");
-	CONMSG0("Press 'Q' to quit\n");
-	CONMSG0("Press 'T' for test details\n");
-	CONMSG0("Press 'I' for status information\n");
-	CONMSG0("Press 'R' to reset averages\n");
-    CONMSG0("\nPress 'Q' to exit, any other key to begin..");
-    key = _getch();
-    CONMSG0("\n");
-
-    if (key=='Q' || key=='q') goto Done;
-
-    // Set the thread priority and start it.
-    if (ReadTest)
-    {
-        SetThreadPriority(ReadTest->ThreadHandle, Test.Priority);
-        ResumeThread(ReadTest->ThreadHandle);
-    }
-
-    // Set the thread priority and start it.
-    if (WriteTest)
-    {
-        SetThreadPriority(WriteTest->ThreadHandle, Test.Priority);
-        ResumeThread(WriteTest->ThreadHandle);
-    }
+    // Set the thread priorities and start them.
+    StartTestStreams(transferParams, transferCount);
 
     while (!Test.IsCancelled)
     {
@@ -1480,8 +3887,8 @@ int main(int argc, char** argv)
                 EnterCriticalSection(&DisplayCriticalSection);
 
                 // Print benchmark test details.
-				ShowTransferInfo(ReadTest);
-				ShowTransferInfo(WriteTest);
+				for (i = 0; i < transferCount; i++)
+					ShowTransferInfo(transferParams[i]);
 
 
                 // UNLOCK the display critical section
@@ -1494,8 +3901,9 @@ int main(int argc, char** argv)
                 EnterCriticalSection(&DisplayCriticalSection);
 
                 // Reset the running status.
-                ResetRunningStatus(ReadTest);
-                ResetRunningStatus(WriteTest);
+				for (i = 0; i < transferCount; i++)
+					ResetRunningStatus(transferParams[i]);
+				GetProcessCpuTime(&Test.StartCpuTime);
 
                 // UNLOCK the display critical section
                 LeaveCriticalSection(&DisplayCriticalSection);
@@ -1506,79 +3914,88 @@ int main(int argc, char** argv)
             while (_kbhit()) _getch();
         }
 
-        // If the read test should be running and it isn't, cancel the test.
-        if ((ReadTest) && !ReadTest->IsRunning)
-        {
-            Test.IsCancelled = TRUE;
-            break;
-        }
-
-        // If the write test should be running and it isn't, cancel the test.
-        if ((WriteTest) && !WriteTest->IsRunning)
-        {
-            Test.IsCancelled = TRUE;
-            break;
-        }
+        // If a transfer thread should be running and it isn't, cancel the test.
+		for (i = 0; i < transferCount; i++)
+		{
+			if (!transferParams[i]->IsRunning)
+				Test.IsCancelled = TRUE;
+		}
+		if (Test.IsCancelled)
+			break;
 
-        // Print benchmark stats
-        if (ReadTest)
-            ShowRunningStatus(ReadTest);
-        else
-            ShowRunningStatus(WriteTest);
+        // Print benchmark stats. The json and csv samples cover all endpoints.
+		if (Test.OutputFormat != OUTPUT_FORMAT_TEXT)
+		{
+			for (i = 0; i < transferCount; i++)
+				ShowRunningStatus(transferParams[i]);
+		}
+		else if (concurrent)
+		{
+			ShowAggregateStatus(transferParams, transferCount);
+		}
+		else
+		{
+			ShowRunningStatus(transferParams[0]);
+		}
 
+		if (Test.Duration &&
+			GetPerfCounter() - Test.StartTime >= Test.Duration * PerfFrequency.QuadPart)
+		{
+			Test.IsUserAborted = TRUE;
+			Test.IsCancelled = TRUE;
+		}
     }
 
-	// Wait for the transfer threads to complete gracefully if it
-	// can be done in 10ms. All of the code from this point to
-	// WaitForTestTransfer() is not required.  It is here only to
-	// improve response time when the test is cancelled.
-	//
-    Sleep(10);
-
-	// If the thread is still running, abort and reset the endpoint.
-    if ((ReadTest) && ReadTest->IsRunning)
-        usb_resetep(Test.DeviceHandle, ReadTest->Ep.bEndpointAddress);
-
-    // If the thread is still running, abort and reset the endpoint.
-    if ((WriteTest) && WriteTest->IsRunning)
-        usb_resetep(Test.DeviceHandle, WriteTest->Ep.bEndpointAddress);
-
-    // Small delay incase usb_resetep() was called.
-    Sleep(10);
-
-    // WaitForTestTransfer will not return until the thread
-	// has exited.
-    WaitForTestTransfer(ReadTest);
-    WaitForTestTransfer(WriteTest);
+    StopTestTransfers(transferParams, transferCount);
 
     // Print benchmark detailed stats
 	ShowTestInfo(&Test);
-	if (ReadTest) ShowTransferInfo(ReadTest);
-	if (WriteTest) ShowTransferInfo(WriteTest);
+	for (i = 0; i < transferCount; i++)
+		ShowTransferInfo(transferParams[i]);
+	ShowAggregateInfo(transferParams, transferCount);
 
+	if (outputStarted)
+	{
+		OutputSummary(transferParams, transferCount);
+		outputStarted = FALSE;
+	}
+
+	// Exits with 2 when the results are worse than the baseline.
+	regressions = CheckBaseline(&Test, transferParams, transferCount);
+	if (regressions > 0)
+		exitCode = 2;
+	else if (regressions < 0)
+		exitCode = -1;
 
 Done:
-    if (Test.DeviceHandle)
+    for (i = 0; i < Test.DeviceCount; i++)
     {
-        usb_close(Test.DeviceHandle);
-        Test.DeviceHandle = NULL;
+        usb_close(Test.DeviceHandles[i]);
+        Test.DeviceHandles[i] = NULL;
     }
+    Test.DeviceHandle = NULL;
 	if (Test.VerifyBuffer)
 	{
 		free(Test.VerifyBuffer);
 		Test.VerifyBuffer = NULL;
 
 	}
-    FreeTransferParam(&ReadTest);
-    FreeTransferParam(&WriteTest);
+    FreeTestStreams(transferParams, transferCount);
 
     DeleteCriticalSection(&DisplayCriticalSection);
 
-    CONMSG0("Press any key to exit..");
-    _getch();
-    CONMSG0("\n");
+	// Keep the json document valid if the test failed after it was started.
+	if (outputStarted && Test.OutputFormat == OUTPUT_FORMAT_JSON)
+		printf("\n  ],\n  \"summary\": []\n}\n");
 
-    return 0;
+	if (!Test.Duration)
+	{
+		CONMSG0("Press any key to exit..");
+		_getch();
+		CONMSG0("\n");
+	}
+
+    return exitCode;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,432 @@
+/* Transfer trace decoder for libusb-win32
+ *
+ * Enables the binary transfer trace of the libusb0.sys driver for one
+ * device, drains it with usb_read_trace() and either prints the records or
+ * writes them to a pcap file that Wireshark opens with its USBPcap
+ * dissector. The trace holds no payload, so the pcap only shows setup
+ * packets, lengths and status codes.
+ *
+ * usage: trace <vid> <pid> [seconds] [file.pcap]
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <windows.h>
+#include <lusb0_usb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Records requested from the driver, rounded up to a power of two.
+#define TRACE_RECORDS 16384
+
+// Records drained per usb_read_trace() call.
+#define READ_RECORDS 1024
+
+// Time between two reads in milliseconds.
+#define POLL_INTERVAL 100
+
+// URB_FUNCTION_* codes found in the records.
+#define URB_FUNCTION_CONTROL_TRANSFER           0x0008
+#define URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER 0x0009
+#define URB_FUNCTION_ISOCH_TRANSFER             0x000A
+
+// USBPcap transfer types.
+#define USBPCAP_TRANSFER_ISOCHRONOUS 0
+#define USBPCAP_TRANSFER_INTERRUPT   1
+#define USBPCAP_TRANSFER_CONTROL     2
+#define USBPCAP_TRANSFER_BULK        3
+
+// USBPcap control stages.
+#define USBPCAP_CONTROL_STAGE_SETUP    0
+#define USBPCAP_CONTROL_STAGE_COMPLETE 3
+
+#define USBPCAP_INFO_PDO_TO_FDO 0x01
+
+#define LINKTYPE_USBPCAP 249
+
+#include <pshpack1.h>
+
+typedef struct
+{
+    unsigned int magic;
+    unsigned short version_major;
+    unsigned short version_minor;
+    int thiszone;
+    unsigned int sigfigs;
+    unsigned int snaplen;
+    unsigned int network;
+} pcap_file_header_t;
+
+typedef struct
+{
+    unsigned int ts_sec;
+    unsigned int ts_usec;
+    unsigned int incl_len;
+    unsigned int orig_len;
+} pcap_record_header_t;
+
+typedef struct
+{
+    unsigned short header_len;
+    ULONGLONG irp_id;
+    unsigned int status;
+    unsigned short function;
+    unsigned char info;
+    unsigned short bus;
+    unsigned short device;
+    unsigned char endpoint;
+    unsigned char transfer;
+    unsigned int data_length;
+} usbpcap_header_t;
+
+typedef struct
+{
+    usbpcap_header_t header;
+    unsigned char stage;
+} usbpcap_control_header_t;
+
+typedef struct
+{
+    usbpcap_header_t header;
+    unsigned int start_frame;
+    unsigned int number_of_packets;
+    unsigned int error_count;
+} usbpcap_iso_header_t;
+
+#include <poppack.h>
+
+static unsigned char endpoint_types[32];
+static ULONGLONG time_offset;
+
+static const char *event_name(int event)
+{
+    switch (event)
+    {
+    case USB_TRACE_SUBMIT:
+        return "submit";
+    case USB_TRACE_URB_SUBMIT:
+        return "urb-submit";
+    case USB_TRACE_URB_COMPLETE:
+        return "urb-complete";
+    case USB_TRACE_COMPLETE:
+        return "complete";
+    case USB_TRACE_LOST:
+        return "lost";
+    default:
+        return "unknown";
+    }
+}
+
+// The driver time stamps come from the same performance counter in 100ns
+// units. The offset converts them to FILETIME.
+static void init_time_offset(void)
+{
+    LARGE_INTEGER counter, frequency;
+    FILETIME now;
+    ULONGLONG file_time, counter_time;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    GetSystemTimeAsFileTime(&now);
+
+    counter_time = (ULONGLONG)(counter.QuadPart / frequency.QuadPart) * 10000000
+        + (ULONGLONG)(counter.QuadPart % frequency.QuadPart) * 10000000 / frequency.QuadPart;
+    file_time = ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+
+    time_offset = file_time - counter_time;
+}
+
+static int transfer_type(const struct usb_trace_record *record)
+{
+    switch (record->function)
+    {
+    case URB_FUNCTION_CONTROL_TRANSFER:
+        return USBPCAP_TRANSFER_CONTROL;
+    case URB_FUNCTION_ISOCH_TRANSFER:
+        return USBPCAP_TRANSFER_ISOCHRONOUS;
+    default:
+        if ((endpoint_types[(record->endpoint & 0x0F) | ((record->endpoint & 0x80) >> 3)]
+                & USB_ENDPOINT_TYPE_MASK) == USB_ENDPOINT_TYPE_INTERRUPT)
+            return USBPCAP_TRANSFER_INTERRUPT;
+        return USBPCAP_TRANSFER_BULK;
+    }
+}
+
+static void print_record(const struct usb_trace_record *record)
+{
+    ULONGLONG time = record->time + time_offset;
+    FILETIME file_time;
+    SYSTEMTIME system_time;
+
+    file_time.dwLowDateTime = (DWORD)time;
+    file_time.dwHighDateTime = (DWORD)(time >> 32);
+    FileTimeToSystemTime(&file_time, &system_time);
+
+    if (record->event == USB_TRACE_LOST)
+    {
+        printf("%02d:%02d:%02d.%07u %u records lost\n",
+               system_time.wHour, system_time.wMinute, system_time.wSecond,
+               (unsigned int)(time % 10000000), record->length);
+        return;
+    }
+
+    printf("%02d:%02d:%02d.%07u #%-8u ep=%02Xh fn=%04Xh %-12s len=%-8u",
+           system_time.wHour, system_time.wMinute, system_time.wSecond,
+           (unsigned int)(time % 10000000), record->sequence,
+           record->endpoint, record->function, event_name(record->event),
+           record->length);
+
+    if (record->event == USB_TRACE_URB_COMPLETE
+            || record->event == USB_TRACE_COMPLETE)
+    {
+        printf(" status=%08Xh usbd=%08Xh", record->status, record->urb_status);
+    }
+
+    if (record->function == URB_FUNCTION_CONTROL_TRANSFER
+            && record->event == USB_TRACE_SUBMIT)
+    {
+        printf(" setup=%02X %02X %02X%02X %02X%02X %02X%02X",
+               record->setup[0], record->setup[1], record->setup[3],
+               record->setup[2], record->setup[5], record->setup[4],
+               record->setup[7], record->setup[6]);
+    }
+
+    printf("\n");
+}
+
+static void write_pcap_header(FILE *file)
+{
+    pcap_file_header_t header;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = 0xA1B2C3D4;
+    header.version_major = 2;
+    header.version_minor = 4;
+    header.snaplen = 65535;
+    header.network = LINKTYPE_USBPCAP;
+
+    fwrite(&header, sizeof(header), 1, file);
+}
+
+// Only the request submit and complete events become packets, the urb
+// events have no USBPcap equivalent.
+static void write_pcap_record(FILE *file, const struct usb_trace_record *record,
+                              struct usb_device *device)
+{
+    pcap_record_header_t record_header;
+    union
+    {
+        usbpcap_header_t plain;
+        usbpcap_control_header_t control;
+        usbpcap_iso_header_t iso;
+    } header;
+    ULONGLONG time;
+    unsigned int header_len = sizeof(usbpcap_header_t);
+    unsigned int data_len = 0;
+    int complete;
+
+    if (record->event != USB_TRACE_SUBMIT
+            && record->event != USB_TRACE_COMPLETE)
+        return;
+
+    complete = record->event == USB_TRACE_COMPLETE;
+
+    memset(&header, 0, sizeof(header));
+    header.plain.irp_id = record->sequence;
+    header.plain.status = record->urb_status;
+    header.plain.function = record->function;
+    header.plain.info = complete ? USBPCAP_INFO_PDO_TO_FDO : 0;
+    header.plain.bus = (unsigned short)device->bus->location;
+    header.plain.device = device->devnum;
+    header.plain.endpoint = record->endpoint;
+    header.plain.transfer = (unsigned char)transfer_type(record);
+
+    switch (header.plain.transfer)
+    {
+    case USBPCAP_TRANSFER_CONTROL:
+        header_len = sizeof(usbpcap_control_header_t);
+        if (complete)
+        {
+            header.control.stage = USBPCAP_CONTROL_STAGE_COMPLETE;
+        }
+        else
+        {
+            header.control.stage = USBPCAP_CONTROL_STAGE_SETUP;
+            data_len = sizeof(record->setup);
+        }
+        break;
+    case USBPCAP_TRANSFER_ISOCHRONOUS:
+        header_len = sizeof(usbpcap_iso_header_t);
+        break;
+    default:
+        break;
+    }
+
+    header.plain.header_len = (unsigned short)header_len;
+    header.plain.data_length = data_len;
+
+    time = (record->time + time_offset - 116444736000000000ULL) / 10;
+    record_header.ts_sec = (unsigned int)(time / 1000000);
+    record_header.ts_usec = (unsigned int)(time % 1000000);
+    record_header.incl_len = header_len + data_len;
+    record_header.orig_len = header_len + data_len;
+
+    fwrite(&record_header, sizeof(record_header), 1, file);
+    fwrite(&header, header_len, 1, file);
+    if (data_len)
+        fwrite(record->setup, data_len, 1, file);
+}
+
+static void load_endpoint_types(struct usb_device *device)
+{
+    struct usb_interface_descriptor *altsetting;
+    struct usb_endpoint_descriptor *endpoint;
+    int c, i, a, e;
+
+    if (!device->config)
+        return;
+
+    for (c = 0; c < device->descriptor.bNumConfigurations; c++)
+    {
+        for (i = 0; i < device->config[c].bNumInterfaces; i++)
+        {
+            for (a = 0; a < device->config[c].interface[i].num_altsetting; a++)
+            {
+                altsetting = &device->config[c].interface[i].altsetting[a];
+                for (e = 0; e < altsetting->bNumEndpoints; e++)
+                {
+                    endpoint = &altsetting->endpoint[e];
+                    endpoint_types[(endpoint->bEndpointAddress & 0x0F)
+                                   | ((endpoint->bEndpointAddress & 0x80) >> 3)]
+                    = endpoint->bmAttributes;
+                }
+            }
+        }
+    }
+}
+
+static usb_dev_handle *open_dev(int vid, int pid, struct usb_device **device)
+{
+    struct usb_bus *bus;
+    struct usb_device *dev;
+
+    for (bus = usb_get_busses(); bus; bus = bus->next)
+    {
+        for (dev = bus->devices; dev; dev = dev->next)
+        {
+            if (dev->descriptor.idVendor == vid
+                    && dev->descriptor.idProduct == pid)
+            {
+                *device = dev;
+                return usb_open(dev);
+            }
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct usb_trace_record *records;
+    struct usb_device *device = NULL;
+    usb_dev_handle *dev;
+    FILE *file = NULL;
+    DWORD start, seconds = 10;
+    int vid, pid, count, i, ret = 0;
+
+    if (argc < 3)
+    {
+        printf("usage: trace <vid> <pid> [seconds] [file.pcap]\n");
+        return 1;
+    }
+
+    vid = strtol(argv[1], NULL, 16);
+    pid = strtol(argv[2], NULL, 16);
+    if (argc > 3)
+        seconds = strtoul(argv[3], NULL, 0);
+
+    usb_init();
+    usb_find_busses();
+    usb_find_devices();
+
+    if (!(dev = open_dev(vid, pid, &device)))
+    {
+        printf("error opening device %04X:%04X\n", vid, pid);
+        return 1;
+    }
+
+    if (argc > 4)
+    {
+        if (!(file = fopen(argv[4], "wb")))
+        {
+            printf("error creating %s\n", argv[4]);
+            usb_close(dev);
+            return 1;
+        }
+        write_pcap_header(file);
+    }
+
+    records = malloc(READ_RECORDS * sizeof(struct usb_trace_record));
+    if (!records)
+    {
+        printf("out of memory\n");
+        ret = 1;
+        goto done;
+    }
+
+    load_endpoint_types(device);
+    init_time_offset();
+
+    if (usb_set_trace(dev, TRACE_RECORDS) < 0)
+    {
+        printf("error enabling the trace:\n%s\n", usb_strerror());
+        ret = 1;
+        goto done;
+    }
+
+    printf("tracing %04X:%04X for %u seconds\n", vid, pid, seconds);
+
+    start = GetTickCount();
+    for (;;)
+    {
+        while ((count = usb_read_trace(dev, records, READ_RECORDS)) > 0)
+        {
+            for (i = 0; i < count; i++)
+            {
+                if (file && records[i].event == USB_TRACE_LOST)
+                    printf("%u records lost\n", records[i].length);
+                else if (file)
+                    write_pcap_record(file, &records[i], device);
+                else
+                    print_record(&records[i]);
+            }
+        }
+
+        if (count < 0)
+        {
+            printf("error reading the trace:\n%s\n", usb_strerror());
+            ret = 1;
+            break;
+        }
+
+        if (GetTickCount() - start >= seconds * 1000)
+            break;
+
+        Sleep(POLL_INTERVAL);
+    }
+
+    usb_set_trace(dev, 0);
+
+done:
+    if (records)
+        free(records);
+    if (file)
+        fclose(file);
+    usb_close(dev);
+
+    return ret;
+}
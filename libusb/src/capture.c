@@ -0,0 +1,634 @@
+/* libusb-win32, Generic Windows USB Library
+ * Copyright (c) 2002-2005 Stephan Meyer <ste_meyer@web.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <windows.h>
+
+#include "lusb0_usb.h"
+#include "error.h"
+#include "usbi.h"
+#include "driver_api.h"
+#include "thread_buffer.h"
+
+/* Packet capture of the transfers made through this dll.
+ *
+ * Every thread writes finished pcapng packet blocks into its own ring, see
+ * thread_buffer.h, so the transfer paths never take a lock and never touch
+ * the file. A background thread moves the rings to the file. When a ring
+ * is full the
+ * packet is dropped and counted, the count is stored in the interface
+ * statistics block written by usb_capture_stop().
+ *
+ * The packets use the USBPcap link type, Wireshark decodes them like a
+ * capture of the USBPcap filter driver. While the capture is off the
+ * transfer paths only test _usb_capture_enabled.
+ */
+
+#define CAPTURE_BUFFER_SIZE     (256 * 1024)    /* per thread, power of 2 */
+#define CAPTURE_BUFFER_MASK     (CAPTURE_BUFFER_SIZE - 1)
+#define CAPTURE_FLUSH_INTERVAL  50              /* ms */
+#define CAPTURE_DEFAULT_SNAPLEN 256
+#define CAPTURE_MAX_SNAPLEN     LIBUSB_MAX_READ_WRITE
+
+#define LINKTYPE_USBPCAP 249
+
+#define PCAPNG_SECTION_HEADER_BLOCK     0x0A0D0D0A
+#define PCAPNG_INTERFACE_BLOCK          0x00000001
+#define PCAPNG_INTERFACE_STATS_BLOCK    0x00000005
+#define PCAPNG_ENHANCED_PACKET_BLOCK    0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC         0x1A2B3C4D
+#define PCAPNG_OPT_ISB_IFDROP           5
+
+#define URB_FUNCTION_CONTROL_TRANSFER           0x0008
+#define URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER 0x0009
+#define URB_FUNCTION_ISOCH_TRANSFER             0x000A
+
+#define USBPCAP_TRANSFER_ISOCHRONOUS    0
+#define USBPCAP_TRANSFER_INTERRUPT      1
+#define USBPCAP_TRANSFER_CONTROL        2
+#define USBPCAP_TRANSFER_BULK           3
+
+#define USBPCAP_CONTROL_STAGE_SETUP     0
+#define USBPCAP_CONTROL_STAGE_COMPLETE  3
+
+#define USBPCAP_INFO_PDO_TO_FDO         0x01
+
+#define USBD_STATUS_SUCCESS             0x00000000
+#define USBD_STATUS_CANCELED            0xC0010000
+#define USBD_STATUS_ERROR_BITS          0xC0000000
+
+#include <pshpack1.h>
+
+typedef struct
+{
+    unsigned short header_len;
+    ULONGLONG irp_id;
+    unsigned int status;
+    unsigned short function;
+    unsigned char info;
+    unsigned short bus;
+    unsigned short device;
+    unsigned char endpoint;
+    unsigned char transfer;
+    unsigned int data_length;
+} usbpcap_header_t;
+
+typedef union
+{
+    usbpcap_header_t plain;
+    struct
+    {
+        usbpcap_header_t header;
+        unsigned char stage;
+    } control;
+    struct
+    {
+        usbpcap_header_t header;
+        unsigned int start_frame;
+        unsigned int number_of_packets;
+        unsigned int error_count;
+    } iso;
+} usbpcap_any_header_t;
+
+#include <poppack.h>
+
+typedef struct
+{
+    unsigned int type;
+    unsigned int length;
+    unsigned int interface_id;
+    unsigned int time_high;
+    unsigned int time_low;
+    unsigned int captured_length;
+    unsigned int original_length;
+} pcapng_packet_block_t;
+
+typedef struct
+{
+    usbi_thread_buffer_t header;    /* head and tail are byte positions */
+    unsigned char data[CAPTURE_BUFFER_SIZE];
+} capture_buffer_t;
+
+volatile LONG _usb_capture_enabled = 0;
+
+/* the lock also protects the file and the capture thread */
+static usbi_thread_buffers_t capture_buffers = { TLS_OUT_OF_INDEXES };
+static FILE *capture_file = NULL;
+static HANDLE capture_thread = NULL;
+static HANDLE capture_stop_event = NULL;
+static int capture_snaplen = CAPTURE_DEFAULT_SNAPLEN;
+static ULONGLONG capture_dropped = 0;
+static LONGLONG capture_frequency = 0;
+static LONGLONG capture_time_offset = 0;
+static volatile LONG capture_control_id = 0;
+
+static const unsigned char capture_zeros[4] = { 0, 0, 0, 0 };
+
+/* microseconds since 1970 */
+static ULONGLONG capture_time(void)
+{
+    LARGE_INTEGER counter;
+
+    QueryPerformanceCounter(&counter);
+
+    return (ULONGLONG)(counter.QuadPart / capture_frequency * 1000000
+                       + counter.QuadPart % capture_frequency * 1000000
+                       / capture_frequency + capture_time_offset);
+}
+
+static void capture_init_time(void)
+{
+    LARGE_INTEGER frequency;
+    FILETIME now;
+    ULONGLONG file_time;
+
+    QueryPerformanceFrequency(&frequency);
+    capture_frequency = frequency.QuadPart;
+    capture_time_offset = 0;
+
+    GetSystemTimeAsFileTime(&now);
+    file_time = ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+
+    /* 100ns since 1601 to us since 1970 */
+    capture_time_offset = (LONGLONG)((file_time - 116444736000000000ULL) / 10)
+                          - (LONGLONG)capture_time();
+}
+
+static ULONG capture_put(capture_buffer_t *buffer, ULONG pos,
+                         const void *src, ULONG length)
+{
+    ULONG offset = pos & CAPTURE_BUFFER_MASK;
+    ULONG first = CAPTURE_BUFFER_SIZE - offset;
+
+    if (first > length)
+        first = length;
+
+    memcpy(buffer->data + offset, src, first);
+    memcpy(buffer->data, (const unsigned char *)src + first, length - first);
+
+    return pos + length;
+}
+
+static void capture_packet(usb_dev_handle *dev, ULONGLONG id, int function,
+                           int transfer, int endpoint, int complete,
+                           unsigned int status, const unsigned char *setup,
+                           const void *data, int length)
+{
+    capture_buffer_t *buffer;
+    usbpcap_any_header_t header;
+    pcapng_packet_block_t block;
+    ULONG header_len, captured, padding, total, head;
+    ULONGLONG time;
+
+    buffer = (capture_buffer_t *)usbi_thread_buffer_get(&capture_buffers);
+    if (!buffer)
+        return;
+
+    if (length < 0 || !data)
+        length = 0;
+
+    memset(&header, 0, sizeof(header));
+    header.plain.irp_id = id;
+    header.plain.status = status;
+    header.plain.function = (unsigned short)function;
+    header.plain.info = complete ? USBPCAP_INFO_PDO_TO_FDO : 0;
+    header.plain.bus = (unsigned short)dev->bus->location;
+    header.plain.device = dev->device->devnum;
+    header.plain.endpoint = (unsigned char)endpoint;
+    header.plain.transfer = (unsigned char)transfer;
+    header.plain.data_length = length + (setup ? 8 : 0);
+
+    if (transfer == USBPCAP_TRANSFER_CONTROL)
+    {
+        header_len = sizeof(header.control);
+        header.control.stage = complete ? USBPCAP_CONTROL_STAGE_COMPLETE
+                               : USBPCAP_CONTROL_STAGE_SETUP;
+    }
+    else if (transfer == USBPCAP_TRANSFER_ISOCHRONOUS)
+    {
+        header_len = sizeof(header.iso);
+    }
+    else
+    {
+        header_len = sizeof(header.plain);
+    }
+    header.plain.header_len = (unsigned short)header_len;
+
+    captured = length > capture_snaplen ? capture_snaplen : length;
+    captured += header_len + (setup ? 8 : 0);
+    padding = (4 - (captured & 3)) & 3;
+    total = sizeof(block) + captured + padding + sizeof(ULONG);
+
+    head = buffer->header.head;
+    if (total > CAPTURE_BUFFER_SIZE - (head - buffer->header.tail))
+    {
+        buffer->header.dropped++;
+        return;
+    }
+
+    time = capture_time();
+
+    block.type = PCAPNG_ENHANCED_PACKET_BLOCK;
+    block.length = total;
+    block.interface_id = 0;
+    block.time_high = (unsigned int)(time >> 32);
+    block.time_low = (unsigned int)time;
+    block.captured_length = captured;
+    block.original_length = header_len + header.plain.data_length;
+
+    head = capture_put(buffer, head, &block, sizeof(block));
+    head = capture_put(buffer, head, &header, header_len);
+    if (setup)
+    {
+        head = capture_put(buffer, head, setup, 8);
+        captured -= 8;
+    }
+    if (captured > header_len)
+        head = capture_put(buffer, head, data, captured - header_len);
+    head = capture_put(buffer, head, capture_zeros, padding);
+    head = capture_put(buffer, head, &total, sizeof(total));
+
+    /* publish the block after its contents */
+    MemoryBarrier();
+    buffer->header.head = head;
+}
+
+static unsigned int capture_status(int ret)
+{
+    if (ret >= 0)
+        return USBD_STATUS_SUCCESS;
+    if (ret == -ETRANSFER_TIMEDOUT)
+        return USBD_STATUS_CANCELED;
+    return USBD_STATUS_ERROR_BITS;
+}
+
+/* the endpoint type of the active configuration, control and iso */
+/* transfers are known from the request */
+static int capture_transfer_type(usb_dev_handle *dev, int endpoint)
+{
+    struct usb_device *device = dev->device;
+    struct usb_interface_descriptor *altsetting;
+    int c, i, a, e;
+
+    if (!device->config)
+        return USBPCAP_TRANSFER_BULK;
+
+    for (c = 0; c < device->descriptor.bNumConfigurations; c++)
+    {
+        if (device->config[c].bConfigurationValue != dev->config)
+            continue;
+
+        for (i = 0; i < device->config[c].bNumInterfaces; i++)
+        {
+            for (a = 0; a < device->config[c].interface[i].num_altsetting; a++)
+            {
+                altsetting = &device->config[c].interface[i].altsetting[a];
+                for (e = 0; e < altsetting->bNumEndpoints; e++)
+                {
+                    if (altsetting->endpoint[e].bEndpointAddress != endpoint)
+                        continue;
+
+                    if ((altsetting->endpoint[e].bmAttributes
+                            & USB_ENDPOINT_TYPE_MASK)
+                            == USB_ENDPOINT_TYPE_INTERRUPT)
+                        return USBPCAP_TRANSFER_INTERRUPT;
+
+                    return USBPCAP_TRANSFER_BULK;
+                }
+            }
+        }
+    }
+
+    return USBPCAP_TRANSFER_BULK;
+}
+
+void _usb_capture_transfer(usb_dev_handle *dev, void *id,
+                           unsigned int control_code, int endpoint,
+                           int complete, int ret,
+                           const void *data, int length)
+{
+    int function = URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER;
+    int transfer;
+
+    switch (control_code)
+    {
+    case LIBUSB_IOCTL_ISOCHRONOUS_READ:
+    case LIBUSB_IOCTL_ISOCHRONOUS_WRITE:
+    case LIBUSB_IOCTL_ISOCHRONOUS_READ_PACKETS:
+    case LIBUSB_IOCTL_ISOCHRONOUS_WRITE_PACKETS:
+        function = URB_FUNCTION_ISOCH_TRANSFER;
+        transfer = USBPCAP_TRANSFER_ISOCHRONOUS;
+        break;
+    default:
+        transfer = capture_transfer_type(dev, endpoint);
+        break;
+    }
+
+    /* only the direction that carries data records it */
+    if (complete != ((endpoint & USB_ENDPOINT_IN) != 0))
+        data = NULL;
+
+    capture_packet(dev, (ULONGLONG)(ULONG_PTR)id, function, transfer,
+                   endpoint, complete, complete ? capture_status(ret) : 0,
+                   NULL, data, length);
+}
+
+int _usb_capture_control_id(void)
+{
+    return InterlockedIncrement(&capture_control_id);
+}
+
+void _usb_capture_control(usb_dev_handle *dev, int id, int requesttype,
+                          int request, int value, int index, int complete,
+                          int ret, const void *data, int length)
+{
+    unsigned char setup[8];
+
+    if (complete)
+    {
+        capture_packet(dev, (ULONGLONG)id, URB_FUNCTION_CONTROL_TRANSFER,
+                       USBPCAP_TRANSFER_CONTROL, requesttype & USB_ENDPOINT_IN,
+                       TRUE, capture_status(ret), NULL,
+                       (requesttype & USB_ENDPOINT_IN) ? data : NULL, length);
+        return;
+    }
+
+    setup[0] = (unsigned char)requesttype;
+    setup[1] = (unsigned char)request;
+    setup[2] = (unsigned char)(value & 0xFF);
+    setup[3] = (unsigned char)((value >> 8) & 0xFF);
+    setup[4] = (unsigned char)(index & 0xFF);
+    setup[5] = (unsigned char)((index >> 8) & 0xFF);
+    setup[6] = (unsigned char)(length & 0xFF);
+    setup[7] = (unsigned char)((length >> 8) & 0xFF);
+
+    capture_packet(dev, (ULONGLONG)id, URB_FUNCTION_CONTROL_TRANSFER,
+                   USBPCAP_TRANSFER_CONTROL, requesttype & USB_ENDPOINT_IN,
+                   FALSE, 0, setup,
+                   (requesttype & USB_ENDPOINT_IN) ? NULL : data, length);
+}
+
+static void capture_write(usbi_thread_buffer_t *header, ULONG tail,
+                          ULONG head)
+{
+    capture_buffer_t *buffer = (capture_buffer_t *)header;
+    ULONG offset, first;
+
+    if (!capture_file)
+        return;
+
+    offset = tail & CAPTURE_BUFFER_MASK;
+    first = CAPTURE_BUFFER_SIZE - offset;
+    if (first > head - tail)
+        first = head - tail;
+
+    fwrite(buffer->data + offset, 1, first, capture_file);
+    fwrite(buffer->data, 1, head - tail - first, capture_file);
+}
+
+/* the lock is held */
+static void capture_drain(void)
+{
+    capture_dropped += (ULONG)usbi_thread_buffers_drain(&capture_buffers,
+                                                        capture_write);
+}
+
+static DWORD WINAPI capture_thread_proc(LPVOID param)
+{
+    int stop;
+
+    (void)param;
+
+    do
+    {
+        stop = WaitForSingleObject(capture_stop_event, CAPTURE_FLUSH_INTERVAL)
+               == WAIT_OBJECT_0;
+
+        EnterCriticalSection(&capture_buffers.lock);
+        capture_drain();
+        fflush(capture_file);
+        LeaveCriticalSection(&capture_buffers.lock);
+    }
+    while (!stop);
+
+    return 0;
+}
+
+static void capture_write_headers(int snaplen)
+{
+    unsigned int section[7];
+    unsigned int intf[5];
+
+    section[0] = PCAPNG_SECTION_HEADER_BLOCK;
+    section[1] = sizeof(section);
+    section[2] = PCAPNG_BYTE_ORDER_MAGIC;
+    section[3] = 1;                 /* version 1.0 */
+    section[4] = 0xFFFFFFFF;        /* section length unknown */
+    section[5] = 0xFFFFFFFF;
+    section[6] = sizeof(section);
+    fwrite(section, sizeof(section), 1, capture_file);
+
+    intf[0] = PCAPNG_INTERFACE_BLOCK;
+    intf[1] = sizeof(intf);
+    intf[2] = LINKTYPE_USBPCAP;
+    intf[3] = snaplen + sizeof(usbpcap_any_header_t) + 8;
+    intf[4] = sizeof(intf);
+    fwrite(intf, sizeof(intf), 1, capture_file);
+}
+
+static void capture_write_stats(void)
+{
+    unsigned int stats[10];
+    ULONGLONG time = capture_time();
+
+    stats[0] = PCAPNG_INTERFACE_STATS_BLOCK;
+    stats[1] = sizeof(stats);
+    stats[2] = 0;
+    stats[3] = (unsigned int)(time >> 32);
+    stats[4] = (unsigned int)time;
+    stats[5] = PCAPNG_OPT_ISB_IFDROP | (8 << 16);
+    stats[6] = (unsigned int)capture_dropped;
+    stats[7] = (unsigned int)(capture_dropped >> 32);
+    stats[8] = 0;                   /* end of options */
+    stats[9] = sizeof(stats);
+    fwrite(stats, sizeof(stats), 1, capture_file);
+}
+
+int usb_capture_start(const char *filename, int snaplen)
+{
+    const char *win_error = NULL;
+    int running = FALSE;
+    int ret = 0;
+
+    if (!filename || snaplen < 0)
+    {
+        USBERR0("invalid parameter\n");
+        return -EINVAL;
+    }
+
+    if (!usbi_thread_buffers_available(&capture_buffers))
+    {
+        USBERR0("capture is not available\n");
+        return -ENOMEM;
+    }
+
+    if (!snaplen)
+        snaplen = CAPTURE_DEFAULT_SNAPLEN;
+    else if (snaplen > CAPTURE_MAX_SNAPLEN)
+        snaplen = CAPTURE_MAX_SNAPLEN;
+
+    EnterCriticalSection(&capture_buffers.lock);
+
+    if (capture_thread)
+    {
+        running = TRUE;
+        ret = -EBUSY;
+        goto done;
+    }
+
+    capture_file = fopen(filename, "wb");
+    if (!capture_file)
+    {
+        ret = -errno;
+        goto done;
+    }
+
+    capture_init_time();
+    capture_write_headers(snaplen);
+    capture_snaplen = snaplen;
+    capture_dropped = 0;
+
+    usbi_thread_buffers_reset(&capture_buffers);
+
+    capture_stop_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (capture_stop_event)
+    {
+        capture_thread = CreateThread(NULL, 0, capture_thread_proc,
+                                      NULL, 0, NULL);
+    }
+
+    if (!capture_thread)
+    {
+        win_error = usb_win_error_to_string();
+        ret = -usb_win_error_to_errno();
+        if (capture_stop_event)
+        {
+            CloseHandle(capture_stop_event);
+            capture_stop_event = NULL;
+        }
+        fclose(capture_file);
+        capture_file = NULL;
+        goto done;
+    }
+
+    InterlockedExchange(&_usb_capture_enabled, 1);
+
+done:
+    LeaveCriticalSection(&capture_buffers.lock);
+
+    /* the log handler is application code, it is not called while */
+    /* the lock is held */
+    if (running)
+        USBERR0("capture already running\n");
+    else if (win_error)
+        USBERR("failed starting capture thread, win error: %s\n", win_error);
+    else if (ret)
+        USBERR("failed creating capture file %s\n", filename);
+    else
+        USBMSG("capturing to %s, snaplen %d\n", filename, snaplen);
+
+    return ret;
+}
+
+int usb_capture_stop(void)
+{
+    HANDLE thread;
+    ULONGLONG dropped;
+
+    if (!usbi_thread_buffers_available(&capture_buffers))
+        return 0;
+
+    EnterCriticalSection(&capture_buffers.lock);
+    thread = capture_thread;
+    capture_thread = NULL;
+    InterlockedExchange(&_usb_capture_enabled, 0);
+    LeaveCriticalSection(&capture_buffers.lock);
+
+    if (!thread)
+        return 0;
+
+    /* the thread drains the buffers a last time */
+    SetEvent(capture_stop_event);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+
+    EnterCriticalSection(&capture_buffers.lock);
+
+    capture_write_stats();
+    fclose(capture_file);
+    capture_file = NULL;
+
+    CloseHandle(capture_stop_event);
+    capture_stop_event = NULL;
+
+    usbi_thread_buffers_reap(&capture_buffers);
+    dropped = capture_dropped;
+
+    LeaveCriticalSection(&capture_buffers.lock);
+
+    if (dropped)
+        USBWRN("%I64u packets dropped, reduce the snaplen\n", dropped);
+
+    return 0;
+}
+
+void _usb_capture_init(void)
+{
+    usbi_thread_buffers_init(&capture_buffers, sizeof(capture_buffer_t));
+}
+
+/* called from DllMain, the thread wrote its last packet */
+void _usb_capture_thread_exit(void)
+{
+    usbi_thread_buffer_exit(&capture_buffers);
+}
+
+/* the lock is held, the process exits */
+static void capture_flush(void)
+{
+    if (capture_file)
+    {
+        InterlockedExchange(&_usb_capture_enabled, 0);
+        capture_drain();
+        capture_write_stats();
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+}
+
+/* called from DllMain, usb_capture_stop() must be called before the dll */
+/* is unloaded while the process keeps running */
+void _usb_capture_deinit(void)
+{
+    usbi_thread_buffers_deinit(&capture_buffers, capture_flush);
+}
@@ -45,6 +45,13 @@ NTSTATUS abort_endpoint(libusb_device_t *dev, int endpoint, int timeout)
     urb.UrbHeader.Length = (USHORT) sizeof(struct _URB_PIPE_REQUEST);
     urb.UrbHeader.Function = URB_FUNCTION_ABORT_PIPE;
 
+    /* reads queued on the read-ahead ring are not known to the usb stack */
+    read_ahead_abort(dev, endpoint);
+    iso_stream_abort(dev, endpoint);
+
+    /* aborted urbs leave a gap, the next urb has to start a new chain */
+    frame_clock_reset_endpoint(dev, endpoint);
+
     status = call_usbd(dev, &urb, IOCTL_INTERNAL_USB_SUBMIT_URB, timeout);
 
     if (!NT_SUCCESS(status) || !USBD_SUCCESS(urb.UrbHeader.Status))
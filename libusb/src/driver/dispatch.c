@@ -74,7 +74,21 @@ NTSTATUS DDKAPI dispatch(DEVICE_OBJECT *device_object, IRP *irp)
                     /* completes */
                     power_set_device_state(dev, PowerDeviceD0, TRUE);
                 }
-                return complete_irp(irp, STATUS_SUCCESS, 0);
+                /* \\.\libusb0-0001\ep81 binds the file object to a pipe */
+                return complete_irp(irp,
+                    bind_endpoint_file(dev, stack_location->FileObject), 0);
+            }
+            else /* not started yet */
+            {
+                return complete_irp(irp, STATUS_INVALID_DEVICE_STATE, 0);
+            }
+
+        case IRP_MJ_READ:
+        case IRP_MJ_WRITE:
+
+            if (dev->is_started)
+            {
+                return dispatch_read_write(dev, irp);
             }
             else /* not started yet */
             {
@@ -93,6 +107,11 @@ NTSTATUS DDKAPI dispatch(DEVICE_OBJECT *device_object, IRP *irp)
 
         case IRP_MJ_CLEANUP:
 
+            /* stop polling and unlock all buffers set up through this */
+            /* file object */
+            read_ahead_stop_all(dev, stack_location->FileObject);
+            iso_stream_stop_all(dev, stack_location->FileObject);
+            unregister_all_buffers(dev, stack_location->FileObject);
             return complete_irp(irp, STATUS_SUCCESS, 0);
 
         default:
@@ -178,6 +178,83 @@ enum
 #define LIBUSB_IOCTL_RESET_DEVICE_EX CTL_CODE(FILE_DEVICE_UNKNOWN,\
 0x817, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
+/////////////////////////////////////////////////////////////////////////////
+// supported after 1.4.0.2 (libusb0.sys only)
+/////////////////////////////////////////////////////////////////////////////
+
+// pre-registered (pinned) transfer buffers. The buffer to register is the
+// output buffer, the I/O manager locks it with write access for reads and
+// read access for writes. The token is returned as the byte count.
+#define LIBUSB_IOCTL_REGISTER_READ_BUFFER CTL_CODE(FILE_DEVICE_UNKNOWN,\
+0x818, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+
+#define LIBUSB_IOCTL_REGISTER_WRITE_BUFFER CTL_CODE(FILE_DEVICE_UNKNOWN,\
+0x825, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+
+#define LIBUSB_IOCTL_UNREGISTER_BUFFER CTL_CODE(FILE_DEVICE_UNKNOWN,\
+0x819, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define LIBUSB_IOCTL_REGISTERED_BUFFER_WRITE CTL_CODE(FILE_DEVICE_UNKNOWN,\
+0x81A, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+
+#define LIBUSB_IOCTL_REGISTERED_BUFFER_READ CTL_CODE(FILE_DEVICE_UNKNOWN,\
+0x81B, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+
+// continuous interrupt IN polling
+#define LIBUSB_IOCTL_SET_READ_AHEAD CTL_CODE(FILE_DEVICE_UNKNOWN,\
+0x81C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// isochronous transfers returning the result of every packet. both
+// directions write the packet results back, so both are OUT_DIRECT.
+#define LIBUSB_IOCTL_ISOCHRONOUS_READ_PACKETS CTL_CODE(FILE_DEVICE_UNKNOWN,\
+0x81D, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+
+#define LIBUSB_IOCTL_ISOCHRONOUS_WRITE_PACKETS CTL_CODE(FILE_DEVICE_UNKNOWN,\
+0x81E, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+
+// the buffer of the *_PACKETS requests holds the packet data followed by
+// one libusb_iso_packet_t per packet, starting at the next 4 byte boundary
+#define LIBUSB_ISO_PACKETS_OFFSET(packet_size, packet_count) \
+	((((packet_size) * (packet_count)) + 3) & ~3)
+
+// isochronous IN streams run by the driver
+#define LIBUSB_IOCTL_SET_ISO_STREAM CTL_CODE(FILE_DEVICE_UNKNOWN,\
+0x81F, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// returns the packets in the layout of ISOCHRONOUS_READ_PACKETS
+#define LIBUSB_IOCTL_ISO_STREAM_READ CTL_CODE(FILE_DEVICE_UNKNOWN,\
+0x820, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+
+// pipe information of endpoint.endpoint, returns a libusb_endpoint_info_t
+#define LIBUSB_IOCTL_GET_ENDPOINT_INFO CTL_CODE(FILE_DEVICE_UNKNOWN,\
+0x821, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// transfer counters of statistics.endpoint, returns a libusb_endpoint_stats_t
+#define LIBUSB_IOCTL_GET_STATISTICS CTL_CODE(FILE_DEVICE_UNKNOWN,\
+0x822, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// statistics.flags
+#define LIBUSB_STATS_FLAG_RESET 1
+
+// binary transfer trace, trace.record_count 0 disables it
+#define LIBUSB_IOCTL_SET_TRACE CTL_CODE(FILE_DEVICE_UNKNOWN,\
+0x823, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// drains the trace into an array of libusb_trace_record_t
+#define LIBUSB_IOCTL_READ_TRACE CTL_CODE(FILE_DEVICE_UNKNOWN,\
+0x824, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+
+// libusb_trace_record_t.event
+#define LIBUSB_TRACE_SUBMIT        1	// request accepted, length requested
+#define LIBUSB_TRACE_URB_SUBMIT    2	// urb sent, length of the urb
+#define LIBUSB_TRACE_URB_COMPLETE  3	// urb done, length transferred
+#define LIBUSB_TRACE_COMPLETE      4	// request done, length transferred
+#define LIBUSB_TRACE_LOST          0xFF	// length records were overwritten
+
+// bucket n counts completions taking [2^n, 2^(n+1)) microseconds,
+// bucket 0 also counts faster ones and the last bucket all slower ones
+#define LIBUSB_STATS_LATENCY_BUCKETS 24
+
 #include <pshpack1.h>
 
 enum LIBUSB0_TRANSFER_FLAGS
@@ -273,6 +350,57 @@ typedef struct
 
 #pragma warning(disable:4201)
 
+typedef struct
+{
+	unsigned int offset;	// offset of the packet in the data
+	unsigned int length;	// bytes received (IN) or sent (OUT)
+	unsigned int status;	// USBD status of the packet
+} libusb_iso_packet_t;
+
+typedef struct
+{
+	unsigned int endpoint;
+	unsigned int pipe_type;		// USBD_PIPE_TYPE
+	unsigned int interval;
+	unsigned int maximum_packet_size;
+	unsigned int maximum_transfer_size;
+	// SuperSpeed endpoint companion descriptor, zero below SuperSpeed
+	unsigned int max_burst;
+	unsigned int mult;
+	unsigned int bytes_per_interval;
+	unsigned int speed;			// LowSpeed .. SuperSpeed
+} libusb_endpoint_info_t;
+
+typedef struct
+{
+	unsigned int endpoint;
+	unsigned int pending;		// requests in the driver right now
+	unsigned int max_pending;	// high-water mark of pending
+	unsigned int reserved;
+	ULONG64 irps;				// requests passed down
+	ULONG64 urbs;				// urbs sent, > irps if requests were split
+	ULONG64 bytes;
+	ULONG64 short_transfers;	// completed with less than requested
+	ULONG64 stalls;
+	ULONG64 cancels;			// cancelled or timed out
+	ULONG64 errors;				// other failures
+	ULONG64 latency[LIBUSB_STATS_LATENCY_BUCKETS];
+} libusb_endpoint_stats_t;
+
+typedef struct
+{
+	ULONG64 time;				// 100ns units
+	unsigned int sequence;		// of the request, shared by all its events
+	unsigned int length;
+	int status;					// NTSTATUS, completions only
+	unsigned int urb_status;	// USBD_STATUS, completions only
+	unsigned short function;	// URB_FUNCTION_*
+	unsigned char event;		// LIBUSB_TRACE_*
+	unsigned char endpoint;		// 0 for control transfers
+	unsigned char setup[8];		// setup packet of control transfers
+	unsigned int reserved;
+} libusb_trace_record_t;
+
 typedef struct
 {
 	unsigned int interface_number;
@@ -381,6 +509,59 @@ typedef struct
 		{
 			unsigned int reset_type;
 		} reset_ex;
+		struct
+		{
+			unsigned int token;
+		} buffer;
+		struct
+		{
+			// must stay at the same offset as endpoint.endpoint
+			unsigned int endpoint;
+			unsigned int token;
+			unsigned int offset;
+			unsigned int length;
+			unsigned int transfer_flags;
+		} registered;
+		struct
+		{
+			unsigned int endpoint;
+			// number of urbs kept posted, 0 disables read-ahead
+			unsigned int urb_count;
+			// number of reports buffered, 0 selects the default
+			unsigned int ring_count;
+		} read_ahead;
+		struct
+		{
+			// same layout as endpoint, packet_count replaces
+			// max_transfer_size which is not used for iso
+			unsigned int endpoint;
+			unsigned int packet_size;
+			unsigned int packet_count;
+			unsigned int transfer_flags;
+			unsigned int iso_start_frame_latency;
+		} iso_packets;
+		struct
+		{
+			unsigned int endpoint;
+			// 0 selects wMaxPacketSize
+			unsigned int packet_size;
+			// 0 selects 8 frames per urb
+			unsigned int packets_per_urb;
+			// number of urbs kept posted, 0 stops the stream
+			unsigned int urb_count;
+			// number of packets buffered, 0 selects the default
+			unsigned int ring_packets;
+		} iso_stream;
+		struct
+		{
+			unsigned int endpoint;
+			unsigned int flags;
+		} statistics;
+		struct
+		{
+			// 0 disables tracing
+			unsigned int record_count;
+		} trace;
 
 		// WDF_USB_CONTROL_SETUP_PACKET control;
 		struct
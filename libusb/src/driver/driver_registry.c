@@ -30,6 +30,12 @@
 #define LIBUSB_REG_INITIAL_CONFIG_VALUE	L"InitialConfigValue"
 #define LIBUSB_REG_DEVICE_INTERFACE_GUIDS L"DeviceInterfaceGUIDs"
 
+#define LIBUSB_REG_MAX_TRANSFER_SIZE	L"MaxTransferSize"
+#define LIBUSB_REG_MAX_PENDING_URBS		L"MaxPendingUrbs"
+#define LIBUSB_REG_READ_AHEAD_DEPTH		L"ReadAheadDepth"
+#define LIBUSB_REG_DEFAULT_TIMEOUT		L"DefaultTimeout"
+#define LIBUSB_REG_MAX_CONTROL_TIMEOUT	L"MaxControlTimeout"
+
 static bool_t reg_get_property(DEVICE_OBJECT *physical_device_object,
                                int property, char *data, int size);
 
@@ -256,6 +262,113 @@ bool_t reg_get_properties(libusb_device_t *dev)
     return TRUE;
 }
 
+static int reg_get_dword(HANDLE key, LPCWSTR name)
+{
+    UNICODE_STRING value_name;
+    UCHAR buffer[sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(ULONG)];
+    KEY_VALUE_PARTIAL_INFORMATION *info = (KEY_VALUE_PARTIAL_INFORMATION *)buffer;
+    ULONG length = sizeof(buffer);
+    NTSTATUS status;
+    ULONG val;
+
+    RtlInitUnicodeString(&value_name, name);
+    memset(buffer, 0, sizeof(buffer));
+
+    status = ZwQueryValueKey(key, &value_name, KeyValuePartialInformation,
+                             info, length, &length);
+
+    if (!NT_SUCCESS(status) || info->Type != REG_DWORD
+            || info->DataLength < sizeof(ULONG))
+    {
+        return 0;
+    }
+
+    val = *((ULONG *)info->Data);
+
+    /* negative values are treated as not set */
+    return (int)val > 0 ? (int)val : 0;
+}
+
+static void reg_get_tuning_values(HANDLE key, libusb_endpoint_tuning_t *tuning)
+{
+    tuning->max_transfer_size = reg_get_dword(key, LIBUSB_REG_MAX_TRANSFER_SIZE);
+    tuning->max_pending_urbs = reg_get_dword(key, LIBUSB_REG_MAX_PENDING_URBS);
+    tuning->read_ahead_reports = reg_get_dword(key, LIBUSB_REG_READ_AHEAD_DEPTH);
+}
+
+/* Reads the optional transfer parameter overrides from the device's
+ * hardware key. Device wide values are stored in the key itself, endpoint
+ * values in an "EPxx" subkey named after the endpoint address, e.g.
+ *
+ * HKR,,"MaxTransferSize",0x00010001,65536
+ * HKR,"EP81","MaxPendingUrbs",0x00010001,4
+ *
+ * Called on every IRP_MN_START_DEVICE, before the initial configuration
+ * is applied.
+ */
+void reg_get_tuning(libusb_device_t *dev)
+{
+    HANDLE key = NULL;
+    HANDLE endpoint_key;
+    OBJECT_ATTRIBUTES attributes;
+    UNICODE_STRING endpoint_name;
+    WCHAR tmp_name[8];
+    libusb_endpoint_tuning_t device_tuning;
+    NTSTATUS status;
+    int i, address;
+
+    memset(&dev->tuning, 0, sizeof(dev->tuning));
+
+    if (!dev->physical_device_object)
+        return;
+
+    status = IoOpenDeviceRegistryKey(dev->physical_device_object,
+                                     PLUGPLAY_REGKEY_DEVICE,
+                                     KEY_READ,
+                                     &key);
+    if (!NT_SUCCESS(status))
+        return;
+
+    reg_get_tuning_values(key, &device_tuning);
+    dev->tuning.max_transfer_size = device_tuning.max_transfer_size;
+    dev->tuning.max_pending_urbs = device_tuning.max_pending_urbs;
+    dev->tuning.read_ahead_reports = device_tuning.read_ahead_reports;
+    dev->tuning.default_timeout = reg_get_dword(key, LIBUSB_REG_DEFAULT_TIMEOUT);
+    dev->tuning.max_control_timeout = reg_get_dword(key, LIBUSB_REG_MAX_CONTROL_TIMEOUT);
+
+    USBDBG("max-transfer-size=%d max-pending-urbs=%d read-ahead-depth=%d default-timeout=%d max-control-timeout=%d\n",
+        dev->tuning.max_transfer_size, dev->tuning.max_pending_urbs,
+        dev->tuning.read_ahead_reports, dev->tuning.default_timeout,
+        dev->tuning.max_control_timeout);
+
+    for (i = 0; i < LIBUSB_ENDPOINT_SLOTS; i++)
+    {
+        address = (i & 0x0F) | ((i & 0x10) << 3);
+        if (!(address & USB_ENDPOINT_ADDRESS_MASK))
+            continue;
+
+        _snwprintf(tmp_name, sizeof(tmp_name)/sizeof(WCHAR), L"EP%02X", address);
+        tmp_name[sizeof(tmp_name)/sizeof(WCHAR) - 1] = 0;
+        RtlInitUnicodeString(&endpoint_name, tmp_name);
+
+        InitializeObjectAttributes(&attributes, &endpoint_name,
+            OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, key, NULL);
+
+        if (!NT_SUCCESS(ZwOpenKey(&endpoint_key, KEY_READ, &attributes)))
+            continue;
+
+        reg_get_tuning_values(endpoint_key, &dev->tuning.endpoints[i]);
+        ZwClose(endpoint_key);
+
+        USBDBG("EP%02Xh max-transfer-size=%d max-pending-urbs=%d read-ahead-depth=%d\n",
+            address, dev->tuning.endpoints[i].max_transfer_size,
+            dev->tuning.endpoints[i].max_pending_urbs,
+            dev->tuning.endpoints[i].read_ahead_reports);
+    }
+
+    ZwClose(key);
+}
+
 bool_t reg_get_hardware_id(DEVICE_OBJECT *physical_device_object,
                            char *data, int size)
 {
@@ -0,0 +1,212 @@
+/* libusb-win32, Generic Windows USB Library
+ * Copyright (c) 2002-2005 Stephan Meyer <ste_meyer@web.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "libusb_driver.h"
+
+/* ReadFile()/WriteFile() on a per-endpoint path.
+ *
+ * Opening \\.\libusb0-0001\ep81 binds the file object to endpoint 0x81 at
+ * create time. IRP_MJ_READ/IRP_MJ_WRITE on such a file object go straight
+ * to transfer(), without a libusb_request header to validate.
+ *
+ * FsContext2 holds the bound endpoint address, FsContext caches the pipe
+ * information. The cache is checked on every request because a new
+ * configuration or alternate setting re-uses the pipe information slots.
+ */
+
+#define ENDPOINT_FILE_BOUND 0x100
+
+#define ENDPOINT_FILE_ADDRESS(file_object) \
+	((int)((ULONG_PTR)(file_object)->FsContext2 & 0xFF))
+#define IS_ENDPOINT_FILE(file_object) \
+	((file_object) && ((ULONG_PTR)(file_object)->FsContext2 & ENDPOINT_FILE_BOUND))
+
+static int hex_digit(WCHAR c)
+{
+	if (c >= L'0' && c <= L'9')
+		return c - L'0';
+	if (c >= L'a' && c <= L'f')
+		return c - L'a' + 10;
+	if (c >= L'A' && c <= L'F')
+		return c - L'A' + 10;
+	return -1;
+}
+
+NTSTATUS bind_endpoint_file(libusb_device_t *dev, FILE_OBJECT *file_object)
+{
+	UNICODE_STRING *name;
+	WCHAR *p;
+	int count, digit, address = 0;
+	libusb_endpoint_t *pipe_info;
+
+	if (!file_object)
+		return STATUS_SUCCESS;
+
+	file_object->FsContext = NULL;
+	file_object->FsContext2 = NULL;
+
+	/* opening the device itself */
+	name = &file_object->FileName;
+	if (!name->Buffer || !name->Length)
+		return STATUS_SUCCESS;
+
+	/* expect "\epXX" with one or two hex digits */
+	p = name->Buffer;
+	count = name->Length / sizeof(WCHAR);
+
+	if (*p == L'\\')
+	{
+		p++;
+		count--;
+	}
+
+	if (count < 3 || count > 4
+		|| (p[0] != L'e' && p[0] != L'E')
+		|| (p[1] != L'p' && p[1] != L'P'))
+	{
+		USBERR("invalid endpoint file name %wZ\n", name);
+		return STATUS_OBJECT_NAME_INVALID;
+	}
+
+	for (p += 2, count -= 2; count; p++, count--)
+	{
+		if ((digit = hex_digit(*p)) < 0)
+		{
+			USBERR("invalid endpoint file name %wZ\n", name);
+			return STATUS_OBJECT_NAME_INVALID;
+		}
+		address = (address << 4) | digit;
+	}
+
+	if (!(address & USB_ENDPOINT_ADDRESS_MASK))
+	{
+		USBERR("the control endpoint can not be opened as a file\n");
+		return STATUS_OBJECT_NAME_INVALID;
+	}
+
+	file_object->FsContext2 = (PVOID)(ULONG_PTR)(ENDPOINT_FILE_BOUND | address);
+
+	/* the device may not be configured yet, the pipe is looked up again */
+	/* on the first request in that case */
+	if (get_pipe_info(dev, address, &pipe_info))
+		file_object->FsContext = pipe_info;
+
+	USBMSG("file object bound to endpoint %02Xh\n", address);
+
+	return STATUS_SUCCESS;
+}
+
+static libusb_endpoint_t *get_endpoint_file_pipe(libusb_device_t *dev,
+												 FILE_OBJECT *file_object)
+{
+	libusb_endpoint_t *pipe_info = file_object->FsContext;
+	int address = ENDPOINT_FILE_ADDRESS(file_object);
+
+	if (pipe_info && pipe_info->address == address && pipe_info->handle)
+		return pipe_info;
+
+	if (!get_pipe_info(dev, address, &pipe_info))
+		return NULL;
+
+	file_object->FsContext = pipe_info;
+	return pipe_info;
+}
+
+NTSTATUS dispatch_read_write(libusb_device_t *dev, IRP *irp)
+{
+	IO_STACK_LOCATION *stack_location = IoGetCurrentIrpStackLocation(irp);
+	FILE_OBJECT *file_object = stack_location->FileObject;
+	bool_t is_read = stack_location->MajorFunction == IRP_MJ_READ;
+	libusb_endpoint_t *pipe_info;
+	NTSTATUS status;
+	ULONG length;
+	int direction, urb_function, max_transfer_size;
+
+	status = remove_lock_acquire(dev);
+
+	if (!NT_SUCCESS(status))
+	{
+		status = complete_irp(irp, status, 0);
+		remove_lock_release(dev);
+		return status;
+	}
+
+	length = is_read ? stack_location->Parameters.Read.Length
+		: stack_location->Parameters.Write.Length;
+
+	if (!IS_ENDPOINT_FILE(file_object))
+	{
+		USBERR0("read/write requires a file object bound to an endpoint\n");
+		status = STATUS_INVALID_DEVICE_REQUEST;
+		goto read_write_done;
+	}
+
+	if (is_read != ((ENDPOINT_FILE_ADDRESS(file_object) & 0x80) ? TRUE : FALSE))
+	{
+		USBERR("%s is not allowed on endpoint %02Xh\n",
+			is_read ? "read" : "write", ENDPOINT_FILE_ADDRESS(file_object));
+		status = STATUS_INVALID_DEVICE_REQUEST;
+		goto read_write_done;
+	}
+
+	pipe_info = get_endpoint_file_pipe(dev, file_object);
+	if (!pipe_info)
+	{
+		USBERR("endpoint %02Xh is not part of the active configuration\n",
+			ENDPOINT_FILE_ADDRESS(file_object));
+		status = STATUS_INVALID_DEVICE_STATE;
+		goto read_write_done;
+	}
+
+	/* zero-length writes send a zero-length packet. the buffer has to be */
+	/* described by an MDL, which requires DO_DIRECT_IO */
+	if ((is_read && !length) || (length && !irp->MdlAddress))
+	{
+		USBERR("invalid %s buffer length=%d\n", is_read ? "read" : "write", length);
+		status = STATUS_INVALID_PARAMETER;
+		goto read_write_done;
+	}
+
+	direction = is_read ? USBD_TRANSFER_DIRECTION_IN : USBD_TRANSFER_DIRECTION_OUT;
+	urb_function = UrbFunctionFromEndpoint(pipe_info);
+
+	if (urb_function == URB_FUNCTION_ISOCH_TRANSFER)
+	{
+		// Do not use large transfers/splitting for ISO.
+		max_transfer_size = 0x7fffffff;
+	}
+	else
+	{
+		if (is_read && IS_INTR_PIPE(pipe_info)
+			&& read_ahead_read(dev, irp, pipe_info->address, &status))
+		{
+			return status;
+		}
+		max_transfer_size = pipe_info->maximum_transfer_size;
+	}
+
+	return transfer(dev, irp, direction, urb_function, pipe_info,
+		0, 0, 0, irp->MdlAddress, length, max_transfer_size, 0, 0);
+
+read_write_done:
+	status = complete_irp(irp, status, 0);
+	remove_lock_release(dev);
+
+	return status;
+}
@@ -82,7 +82,9 @@
 	request->endpoint.iso_start_frame_latency,		\
 	transfer_buffer_mdl,							\
 	transfer_buffer_length,						\
-	maxTransferSize);
+	maxTransferSize,								\
+	0,												\
+	0);
 
 NTSTATUS dispatch_ioctl(libusb_device_t *dev, IRP *irp)
 {
@@ -152,6 +154,13 @@ NTSTATUS dispatch_ioctl(libusb_device_t *dev, IRP *irp)
 		// read buffer length must be equal to or an interval of the max packet size
 		TRANSFER_IOCTL_CHECK_READ_BUFFER();
 
+		// satisfied from the read-ahead ring if the driver polls this pipe
+		if (IS_INTR_PIPE(pipe_info)
+			&& read_ahead_read(dev, irp, pipe_info->address, &status))
+		{
+			return status;
+		}
+
 		urbFunction = URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER;
 		usbdDirection = USBD_TRANSFER_DIRECTION_IN;
 		maxTransferSize = GetMaxTransferSize(pipe_info, request->endpoint.max_transfer_size);
@@ -286,6 +295,190 @@ IoctlIsochronousWrite:
 		TRANSFER_IOCTL_CHECK_FUNCTION_AND_DIRECTION();
 
 		TRANSFER_IOCTL_EXECUTE();
+
+	case LIBUSB_IOCTL_REGISTERED_BUFFER_READ:
+	case LIBUSB_IOCTL_REGISTERED_BUFFER_WRITE:
+
+		if (control_code == LIBUSB_IOCTL_REGISTERED_BUFFER_READ)
+		{
+			dispCtlCode = "REGISTERED_BUFFER_READ";
+			usbdDirection = USBD_TRANSFER_DIRECTION_IN;
+		}
+		else
+		{
+			dispCtlCode = "REGISTERED_BUFFER_WRITE";
+			usbdDirection = USBD_TRANSFER_DIRECTION_OUT;
+		}
+
+		// the data lives in a registered buffer, there is no irp buffer
+		if (!request || input_buffer_length < sizeof(libusb_request))
+		{
+			USBERR("%s: invalid transfer request\n", dispCtlCode);
+			status = STATUS_INVALID_PARAMETER;
+			goto IOCTL_Done;
+		}
+
+		// check if the pipe exists and get the pipe information
+		TRANSFER_IOCTL_GET_PIPEINFO();
+
+		// must be a bulk or interrupt pipe
+		if (!IS_BULK_PIPE(pipe_info) && !IS_INTR_PIPE(pipe_info))
+		{
+			USBERR("%s: incorrect pipe type: %02Xh\n", 
+				dispCtlCode, pipe_info->pipe_type);
+			status = STATUS_INVALID_PARAMETER;
+			goto IOCTL_Done;
+		}
+
+		if (usbdDirection == USBD_TRANSFER_DIRECTION_IN && !request->registered.length)
+		{
+			USBERR("%s: invalid transfer length 0\n", dispCtlCode);
+			status = STATUS_INVALID_PARAMETER;
+			goto IOCTL_Done;
+		}
+
+		urbFunction = URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER;
+		TRANSFER_IOCTL_CHECK_FUNCTION_AND_DIRECTION();
+
+		// takes a reference on the buffer which transfer() drops when done
+		status = reference_registered_buffer(dev, stack_location->FileObject,
+			request->registered.token,
+			usbdDirection,
+			request->registered.offset,
+			request->registered.length,
+			&transfer_buffer_mdl);
+		if (!NT_SUCCESS(status))
+		{
+			goto IOCTL_Done;
+		}
+
+		return transfer(dev, irp,
+			usbdDirection,
+			urbFunction,
+			pipe_info,
+			0,
+			request->registered.transfer_flags,
+			0,
+			transfer_buffer_mdl,
+			request->registered.length,
+			pipe_info->maximum_transfer_size,
+			request->registered.token,
+			0);
+
+	case LIBUSB_IOCTL_ISOCHRONOUS_READ_PACKETS:
+	case LIBUSB_IOCTL_ISOCHRONOUS_WRITE_PACKETS:
+
+		if (control_code == LIBUSB_IOCTL_ISOCHRONOUS_READ_PACKETS)
+		{
+			dispCtlCode = "ISOCHRONOUS_READ_PACKETS";
+			usbdDirection = USBD_TRANSFER_DIRECTION_IN;
+		}
+		else
+		{
+			dispCtlCode = "ISOCHRONOUS_WRITE_PACKETS";
+			usbdDirection = USBD_TRANSFER_DIRECTION_OUT;
+		}
+
+		if (!request || !transfer_buffer_mdl || input_buffer_length < sizeof(libusb_request))
+		{
+			USBERR("%s: invalid transfer request\n", dispCtlCode);
+			status = STATUS_INVALID_PARAMETER;
+			goto IOCTL_Done;
+		}
+
+		// check if the pipe exists and get the pipe information
+		TRANSFER_IOCTL_GET_PIPEINFO();
+
+		// must be an isochronous endpoint
+		if (!IS_ISOC_PIPE(pipe_info))
+		{
+			USBERR("%s: incorrect pipe type: %02Xh\n", 
+				dispCtlCode, pipe_info->pipe_type);
+			status = STATUS_INVALID_PARAMETER;
+			goto IOCTL_Done;
+		}
+
+		urbFunction = URB_FUNCTION_ISOCH_TRANSFER;
+		TRANSFER_IOCTL_CHECK_FUNCTION_AND_DIRECTION();
+
+		// the buffer must hold the data and a result for every packet
+		if (!request->iso_packets.packet_size || !request->iso_packets.packet_count
+			|| (ULONGLONG)request->iso_packets.packet_size
+				* request->iso_packets.packet_count > 0x7ffffff0
+			|| (ULONGLONG)LIBUSB_ISO_PACKETS_OFFSET(request->iso_packets.packet_size,
+				request->iso_packets.packet_count)
+				+ (ULONGLONG)request->iso_packets.packet_count * sizeof(libusb_iso_packet_t)
+				> output_buffer_length)
+		{
+			USBERR("%s: invalid packet size=%d count=%d for buffer length %d\n",
+				dispCtlCode, request->iso_packets.packet_size,
+				request->iso_packets.packet_count, output_buffer_length);
+			status = STATUS_INVALID_PARAMETER;
+			goto IOCTL_Done;
+		}
+
+		// Do not use large transfers/splitting for ISO.
+		return transfer(dev, irp,
+			usbdDirection,
+			urbFunction,
+			pipe_info,
+			request->iso_packets.packet_size,
+			request->iso_packets.transfer_flags,
+			request->iso_packets.iso_start_frame_latency,
+			transfer_buffer_mdl,
+			request->iso_packets.packet_size * request->iso_packets.packet_count,
+			0x7fffffff,
+			0,
+			LIBUSB_ISO_PACKETS_OFFSET(request->iso_packets.packet_size,
+				request->iso_packets.packet_count));
+
+	case LIBUSB_IOCTL_ISO_STREAM_READ:
+
+		dispCtlCode = "ISO_STREAM_READ";
+
+		if (!request || !transfer_buffer_mdl || input_buffer_length < sizeof(libusb_request))
+		{
+			USBERR("%s: invalid transfer request\n", dispCtlCode);
+			status = STATUS_INVALID_PARAMETER;
+			goto IOCTL_Done;
+		}
+
+		// completes or queues the irp and releases the remove lock
+		return iso_stream_read(dev, irp,
+			request->iso_packets.endpoint,
+			request->iso_packets.packet_size,
+			request->iso_packets.packet_count);
+
+	case LIBUSB_IOCTL_READ_TRACE:
+
+		status = trace_read(dev, transfer_buffer_mdl, transfer_buffer_length, &ret);
+		goto IOCTL_Done;
+
+	case LIBUSB_IOCTL_REGISTER_READ_BUFFER:
+	case LIBUSB_IOCTL_REGISTER_WRITE_BUFFER:
+
+		// the output buffer is the buffer to register, probed and locked by
+		// the I/O manager with the access the direction needs
+		if (!request || input_buffer_length < sizeof(libusb_request))
+		{
+			USBERR0("register_buffer: invalid request\n");
+			status = STATUS_INVALID_PARAMETER;
+			goto IOCTL_Done;
+		}
+
+		status = register_buffer(dev, stack_location->FileObject,
+			transfer_buffer_mdl,
+			control_code == LIBUSB_IOCTL_REGISTER_READ_BUFFER
+			? USBD_TRANSFER_DIRECTION_IN : USBD_TRANSFER_DIRECTION_OUT,
+			&request->buffer.token);
+		if (NT_SUCCESS(status))
+		{
+			// the locked pages now belong to the registered buffer, the
+			// I/O manager must not unlock them when the irp completes
+			irp->MdlAddress = NULL;
+			ret = (int)request->buffer.token;
+		}
+		goto IOCTL_Done;
 	}
 
 	///////////////////////////////////
@@ -518,6 +711,110 @@ NULL : input_buffer + sizeof(libusb_request),
 		ret = sizeof(libusb_request);
 		break;
 
+	case LIBUSB_IOCTL_UNREGISTER_BUFFER:
+
+		status = unregister_buffer(dev, stack_location->FileObject,
+			request->buffer.token);
+		break;
+
+	case LIBUSB_IOCTL_SET_ISO_STREAM:
+
+		if (request->iso_stream.urb_count)
+		{
+			status = iso_stream_start(dev, stack_location->FileObject,
+				request->iso_stream.endpoint,
+				request->iso_stream.packet_size,
+				request->iso_stream.packets_per_urb,
+				request->iso_stream.urb_count,
+				request->iso_stream.ring_packets);
+		}
+		else
+		{
+			status = iso_stream_stop(dev, request->iso_stream.endpoint);
+		}
+		break;
+
+	case LIBUSB_IOCTL_GET_ENDPOINT_INFO:
+
+		if (!output_buffer || output_buffer_length < sizeof(libusb_endpoint_info_t))
+		{
+			USBERR0("get_endpoint_info: invalid output buffer\n");
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		if (!get_pipe_info(dev, request->endpoint.endpoint, &pipe_info))
+		{
+			USBERR("get_endpoint_info: failed getting pipe info for endpoint: %02Xh\n",
+				request->endpoint.endpoint);
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+
+		{
+			/* the request shares the system buffer with the output */
+			libusb_endpoint_info_t *info = (libusb_endpoint_info_t *)output_buffer;
+
+			info->endpoint = pipe_info->address;
+			info->pipe_type = pipe_info->pipe_type;
+			info->interval = pipe_info->interval;
+			info->maximum_packet_size = pipe_info->maximum_packet_size;
+			info->maximum_transfer_size = pipe_info->maximum_transfer_size;
+			info->max_burst = pipe_info->max_burst;
+			info->mult = pipe_info->mult;
+			info->bytes_per_interval = pipe_info->bytes_per_interval;
+			info->speed = dev->speed;
+		}
+
+		ret = sizeof(libusb_endpoint_info_t);
+		break;
+
+	case LIBUSB_IOCTL_SET_TRACE:
+
+		if (request->trace.record_count)
+		{
+			status = trace_start(dev, request->trace.record_count);
+		}
+		else
+		{
+			trace_stop(dev);
+		}
+		break;
+
+	case LIBUSB_IOCTL_GET_STATISTICS:
+
+		if (!output_buffer || output_buffer_length < sizeof(libusb_endpoint_stats_t))
+		{
+			USBERR0("get_statistics: invalid output buffer\n");
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		/* the request shares the system buffer with the output */
+		status = stats_get(dev, request->statistics.endpoint,
+			(request->statistics.flags & LIBUSB_STATS_FLAG_RESET) ? TRUE : FALSE,
+			(libusb_endpoint_stats_t *)output_buffer);
+		if (NT_SUCCESS(status))
+		{
+			ret = sizeof(libusb_endpoint_stats_t);
+		}
+		break;
+
+	case LIBUSB_IOCTL_SET_READ_AHEAD:
+
+		if (request->read_ahead.urb_count)
+		{
+			status = read_ahead_start(dev, stack_location->FileObject,
+				request->read_ahead.endpoint,
+				request->read_ahead.urb_count,
+				request->read_ahead.ring_count);
+		}
+		else
+		{
+			status = read_ahead_stop(dev, request->read_ahead.endpoint);
+		}
+		break;
+
 	case LIBUSB_IOCTL_CLAIM_INTERFACE:
 		status = claim_interface(dev, stack_location->FileObject,
 			request->intf.interface_number);
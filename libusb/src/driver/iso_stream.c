@@ -0,0 +1,305 @@
+/* libusb-win32, Generic Windows USB Library
+ * Copyright (c) 2002-2005 Stephan Meyer <ste_meyer@web.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "libusb_driver.h"
+
+/* Isochronous IN streams.
+ *
+ * While a stream runs, a fixed set of iso urbs with preallocated buffers
+ * and MDLs is kept posted on the pipe, see urb_ring.c. They are sent with
+ * USBD_START_ISO_TRANSFER_ASAP and re-posted from their completion
+ * routine, so the host controller schedules them on contiguous frames
+ * without user space having to keep up.
+ *
+ * Completed packets are queued in a bounded ring, the oldest packets are
+ * dropped if it is full. LIBUSB_IOCTL_ISO_STREAM_READ returns the packets
+ * in the buffer layout of LIBUSB_IOCTL_ISOCHRONOUS_READ_PACKETS, one
+ * packet_size slot and one libusb_iso_packet_t per packet.
+ *
+ * A failing urb halts the stream, the next read re-arms it.
+ */
+
+/* urbs cover 8 frames by default */
+#define ISO_STREAM_DEFAULT_FRAMES_PER_URB 8
+
+static void iso_stream_build_urb(libusb_urb_ring_urb_t *entry);
+static bool_t iso_stream_push(libusb_urb_ring_urb_t *entry, NTSTATUS status);
+static NTSTATUS iso_stream_pop(libusb_urb_ring_t *stream, IRP *irp);
+
+static const libusb_urb_ring_ops_t iso_stream_ops =
+{
+	iso_stream_build_urb,
+	iso_stream_push,
+	iso_stream_pop
+};
+
+void iso_stream_initialize(libusb_device_t *dev)
+{
+	urb_ring_initialize(dev->iso_streams, LIBUSB_MAX_ISO_STREAMS);
+}
+
+NTSTATUS iso_stream_start(libusb_device_t *dev, FILE_OBJECT *file_object,
+						  int endpoint, int packet_size, int packets_per_urb,
+						  int urb_count, int ring_count)
+{
+	libusb_endpoint_t *pipe_info;
+	libusb_urb_ring_t *stream;
+	NTSTATUS status;
+	int packet_align;
+
+	if (!get_pipe_info(dev, endpoint, &pipe_info))
+	{
+		USBERR("failed getting pipe info for endpoint: %02Xh\n", endpoint);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (!IS_ISOC_PIPE(pipe_info) || !(pipe_info->address & 0x80))
+	{
+		USBERR("endpoint %02Xh is not an isochronous IN endpoint\n", endpoint);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (!packet_size)
+		packet_size = GetIsoPacketSize(pipe_info);
+
+	if (packet_size <= 0)
+	{
+		USBERR("invalid packet size %d for endpoint %02Xh\n", packet_size, endpoint);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	/* high speed urbs must cover whole frames of 8 microframes */
+	packet_align = (dev->speed >= HighSpeed) ? 8 : 1;
+
+	if (packets_per_urb <= 0)
+		packets_per_urb = ISO_STREAM_DEFAULT_FRAMES_PER_URB * packet_align;
+	else if (packets_per_urb > 255)
+		packets_per_urb = 255;
+	packets_per_urb -= packets_per_urb % packet_align;
+
+	if (urb_count > LIBUSB_MAX_ISO_STREAM_URBS)
+		urb_count = LIBUSB_MAX_ISO_STREAM_URBS;
+	if (GetTuningValue(dev, endpoint, max_pending_urbs) > 0
+		&& urb_count > GetTuningValue(dev, endpoint, max_pending_urbs))
+	{
+		urb_count = GetTuningValue(dev, endpoint, max_pending_urbs);
+	}
+
+	if (ring_count <= 0)
+		ring_count = LIBUSB_DEFAULT_ISO_STREAM_PACKETS;
+	if ((SIZE_T)ring_count * packet_size > LIBUSB_MAX_ISO_STREAM_RING_SIZE)
+		ring_count = LIBUSB_MAX_ISO_STREAM_RING_SIZE / packet_size;
+
+	if (ring_count < packets_per_urb)
+	{
+		USBERR("a ring of %d packets can not hold an urb of %d packets\n",
+			ring_count, packets_per_urb);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	/* restart with the new settings if the pipe already streams */
+	iso_stream_stop(dev, endpoint);
+
+	stream = urb_ring_claim(dev->iso_streams, LIBUSB_MAX_ISO_STREAMS, endpoint);
+	if (!stream)
+	{
+		USBERR("%d iso streams are already running\n", LIBUSB_MAX_ISO_STREAMS);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	stream->file_object = file_object;
+	stream->pipe_handle = pipe_info->handle;
+	stream->ops = &iso_stream_ops;
+	stream->packet_size = packet_size;
+	stream->packets_per_urb = packets_per_urb;
+	stream->urb_count = urb_count;
+	stream->ring_count = ring_count;
+
+	status = urb_ring_start(dev, stream, sizeof(struct _URB_ISOCH_TRANSFER)
+		+ sizeof(USBD_ISO_PACKET_DESCRIPTOR) * packets_per_urb);
+	if (NT_SUCCESS(status))
+	{
+		USBMSG("EP%02Xh urbs=%d packets-per-urb=%d packet-size=%d ring=%d\n",
+			endpoint, urb_count, packets_per_urb, packet_size, ring_count);
+	}
+
+	return status;
+}
+
+NTSTATUS iso_stream_stop(libusb_device_t *dev, int endpoint)
+{
+	return urb_ring_stop(dev, urb_ring_find(dev->iso_streams,
+		LIBUSB_MAX_ISO_STREAMS, endpoint), endpoint);
+}
+
+void iso_stream_stop_all(libusb_device_t *dev, FILE_OBJECT *file_object)
+{
+	urb_ring_stop_all(dev, dev->iso_streams, LIBUSB_MAX_ISO_STREAMS,
+		file_object);
+}
+
+void iso_stream_stop_interface(libusb_device_t *dev, int interface_number)
+{
+	urb_ring_stop_interface(dev, dev->iso_streams, LIBUSB_MAX_ISO_STREAMS,
+		interface_number);
+}
+
+void iso_stream_abort(libusb_device_t *dev, int endpoint)
+{
+	urb_ring_abort(dev, urb_ring_find(dev->iso_streams,
+		LIBUSB_MAX_ISO_STREAMS, endpoint), endpoint);
+}
+
+NTSTATUS iso_stream_read(libusb_device_t *dev, IRP *irp, int endpoint,
+						 int packet_size, int packet_count)
+{
+	IO_STACK_LOCATION *stack_location = IoGetCurrentIrpStackLocation(irp);
+	libusb_urb_ring_t *stream;
+	NTSTATUS status;
+	KIRQL irql;
+
+	stream = urb_ring_find(dev->iso_streams, LIBUSB_MAX_ISO_STREAMS, endpoint);
+
+	if (stream)
+	{
+		KeAcquireSpinLock(&stream->lock, &irql);
+		if (stream->address != endpoint || stream->stopping)
+		{
+			KeReleaseSpinLock(&stream->lock, irql);
+			stream = NULL;
+		}
+	}
+
+	if (!stream)
+	{
+		USBERR("no iso stream running on endpoint %02Xh\n", endpoint);
+		status = complete_irp(irp, STATUS_INVALID_DEVICE_STATE, 0);
+		remove_lock_release(dev);
+		return status;
+	}
+
+	/* the buffer layout is computed by the caller from the packet size */
+	if (packet_size != stream->packet_size || packet_count <= 0
+		|| (ULONGLONG)LIBUSB_ISO_PACKETS_OFFSET((ULONGLONG)packet_size, (ULONGLONG)packet_count)
+			+ (ULONGLONG)packet_count * sizeof(libusb_iso_packet_t)
+			> stack_location->Parameters.DeviceIoControl.OutputBufferLength)
+	{
+		KeReleaseSpinLock(&stream->lock, irql);
+
+		USBERR("invalid packet size=%d count=%d, stream packet size is %d\n",
+			packet_size, packet_count, stream->packet_size);
+		status = complete_irp(irp, STATUS_INVALID_PARAMETER, 0);
+		remove_lock_release(dev);
+		return status;
+	}
+
+	irp->Tail.Overlay.DriverContext[1] = (PVOID)(ULONG_PTR)packet_count;
+
+	return urb_ring_read(dev, stream, irp, irql);
+}
+
+static void iso_stream_build_urb(libusb_urb_ring_urb_t *entry)
+{
+	libusb_urb_ring_t *stream = entry->ring;
+	URB *urb = entry->urb;
+	int i;
+
+	/* packet lengths and status are written by the stack */
+	urb->UrbHeader.Function = URB_FUNCTION_ISOCH_TRANSFER;
+	urb->UrbIsochronousTransfer.PipeHandle = stream->pipe_handle;
+	urb->UrbIsochronousTransfer.TransferFlags = USBD_TRANSFER_DIRECTION_IN
+		| USBD_SHORT_TRANSFER_OK | USBD_START_ISO_TRANSFER_ASAP;
+	urb->UrbIsochronousTransfer.TransferBufferLength
+		= stream->packets_per_urb * stream->packet_size;
+	urb->UrbIsochronousTransfer.TransferBufferMDL = entry->mdl;
+	urb->UrbIsochronousTransfer.NumberOfPackets = stream->packets_per_urb;
+
+	for (i = 0; i < stream->packets_per_urb; i++)
+	{
+		urb->UrbIsochronousTransfer.IsoPacket[i].Offset = i * stream->packet_size;
+	}
+}
+
+static bool_t iso_stream_push(libusb_urb_ring_urb_t *entry, NTSTATUS status)
+{
+	libusb_urb_ring_t *stream = entry->ring;
+	URB *urb = entry->urb;
+	USBD_ISO_PACKET_DESCRIPTOR *packet;
+	ULONG i, length;
+
+	/* an urb where every packet failed still has valid packet results, */
+	/* missed frames are not a reason to stop streaming */
+	if (!NT_SUCCESS(status)
+		&& urb->UrbHeader.Status != USBD_STATUS_ISOCH_REQUEST_FAILED)
+		return FALSE;
+
+	for (i = 0; i < urb->UrbIsochronousTransfer.NumberOfPackets; i++)
+	{
+		packet = &urb->UrbIsochronousTransfer.IsoPacket[i];
+
+		length = USBD_SUCCESS(packet->Status) ? packet->Length : 0;
+		if (length > (ULONG)stream->packet_size)
+			length = stream->packet_size;
+
+		urb_ring_push(stream, entry->buffer + packet->Offset, length,
+			packet->Status);
+	}
+
+	return TRUE;
+}
+
+/* copies up to the requested number of packets and sets Information to */
+/* the packet count */
+static NTSTATUS iso_stream_pop(libusb_urb_ring_t *stream, IRP *irp)
+{
+	int packet_count = (int)(ULONG_PTR)irp->Tail.Overlay.DriverContext[1];
+	libusb_iso_packet_t *packets;
+	UCHAR *buffer;
+	int copied = 0;
+
+	irp->IoStatus.Information = 0;
+
+	buffer = MmGetSystemAddressForMdlSafe(irp->MdlAddress, NormalPagePriority);
+	if (!buffer)
+	{
+		USBERR0("MmGetSystemAddressForMdlSafe failed\n");
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	packets = (libusb_iso_packet_t *)(buffer
+		+ LIBUSB_ISO_PACKETS_OFFSET(stream->packet_size, packet_count));
+
+	while (stream->ring_used && copied < packet_count)
+	{
+		packets[copied].offset = copied * stream->packet_size;
+		packets[copied].length = stream->ring_slots[stream->ring_head].length;
+		packets[copied].status = stream->ring_slots[stream->ring_head].status;
+
+		RtlCopyMemory(buffer + packets[copied].offset,
+			stream->ring_data + stream->ring_head * stream->packet_size,
+			packets[copied].length);
+		copied++;
+
+		urb_ring_advance(stream);
+	}
+
+	irp->IoStatus.Information = copied;
+
+	return STATUS_SUCCESS;
+}
@@ -319,6 +319,13 @@ NTSTATUS DDKAPI add_device(DRIVER_OBJECT *driver_object,
 
 	clear_pipe_info(dev);
 
+	registered_buffers_initialize(dev);
+	read_ahead_initialize(dev);
+	iso_stream_initialize(dev);
+	frame_clock_initialize(dev);
+	stats_initialize(dev);
+	trace_initialize(dev);
+
 	remove_lock_initialize(dev);
 	
 	if (dev->device_interface_in_use)
@@ -509,7 +516,7 @@ NTSTATUS call_usbd_ex(libusb_device_t *dev, void *urb, ULONG control_code,
 		timeout = max_timeout;
 	}
 	if (timeout <= 0)
-		timeout = LIBUSB_MAX_CONTROL_TRANSFER_TIMEOUT;
+		timeout = GetDefaultTimeout(dev);
 
 	KeInitializeEvent(&event, NotificationEvent, FALSE);
 
@@ -705,6 +712,9 @@ bool_t update_pipe_info(libusb_device_t *dev,
     int number;
 	ULONG maxTransferSize;
 	USHORT maxPacketSize;
+	ULONG burstSize;
+	usb_ss_endpoint_companion_descriptor_t *companion;
+	libusb_endpoint_t *endpoint;
 
     if (!interface_info)
     {
@@ -735,6 +745,7 @@ bool_t update_pipe_info(libusb_device_t *dev,
         {
 			maxPacketSize = interface_info->Pipes[i].MaximumPacketSize;
 			maxTransferSize = interface_info->Pipes[i].MaximumTransferSize;
+			endpoint = &dev->config.interfaces[number].endpoints[i];
 
 			dev->config.interfaces[number].endpoints[i].handle  = interface_info->Pipes[i].PipeHandle;
             dev->config.interfaces[number].endpoints[i].address = interface_info->Pipes[i].EndpointAddress;
@@ -742,6 +753,30 @@ bool_t update_pipe_info(libusb_device_t *dev,
             dev->config.interfaces[number].endpoints[i].interval = interface_info->Pipes[i].Interval;
             dev->config.interfaces[number].endpoints[i].pipe_type = interface_info->Pipes[i].PipeType;
  			dev->config.interfaces[number].endpoints[i].pipe_flags = interface_info->Pipes[i].PipeFlags;
+
+			endpoint->max_burst = 0;
+			endpoint->mult = 0;
+			endpoint->bytes_per_interval = 0;
+
+			companion = NULL;
+			if (dev->speed >= SuperSpeed)
+			{
+				companion = find_ss_endpoint_companion_desc(dev->config.descriptor,
+					dev->config.total_size, interface_info->InterfaceNumber,
+					interface_info->AlternateSetting,
+					interface_info->Pipes[i].EndpointAddress);
+			}
+
+			if (companion)
+			{
+				endpoint->max_burst = companion->bMaxBurst;
+				if (interface_info->Pipes[i].PipeType == UsbdPipeTypeIsochronous)
+					endpoint->mult = companion->bmAttributes & 0x3;
+				endpoint->bytes_per_interval = companion->wBytesPerInterval;
+			}
+
+			// bytes moved by one full burst
+			burstSize = (ULONG)maxPacketSize * (endpoint->max_burst + 1);
           
       /* These are Windows new rules for max transfer sizes
        * Currently we take the speed into account but not the controller type
@@ -771,7 +806,11 @@ bool_t update_pipe_info(libusb_device_t *dev,
               switch (dev->speed)
               {
                   case SuperSpeed:
-                      // TODO: 1024 * wBytesPerInterval from USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR
+                      if (endpoint->bytes_per_interval)
+                      {
+                          maxTransferSize = 1024 * endpoint->bytes_per_interval;
+                          break;
+                      }
                   case HighSpeed:
                       maxTransferSize = 1024 * interface_info->Pipes[i].MaximumPacketSize;
                       break;
@@ -797,16 +836,32 @@ bool_t update_pipe_info(libusb_device_t *dev,
               break;
         }
 
+        // registry override, see reg_get_tuning()
+        if (GetTuningValue(dev, interface_info->Pipes[i].EndpointAddress, max_transfer_size) > 0)
+        {
+            maxTransferSize = GetTuningValue(dev, interface_info->Pipes[i].EndpointAddress, max_transfer_size);
+        }
+
         // set max the maximum transfer size default to an interval of max packet size.
-        if(maxPacketSize)
+        // iso transfers are sized in service intervals above. bulk transfers
+        // are kept to whole bursts so that no burst is cut short.
+        if (interface_info->Pipes[i].PipeType == UsbdPipeTypeBulk
+            && burstSize && maxTransferSize >= burstSize)
+        {
+            maxTransferSize = maxTransferSize - (maxTransferSize % burstSize);
+        }
+        else if(maxPacketSize)
         {
             maxTransferSize = maxTransferSize - (maxTransferSize % maxPacketSize);
         }
 
-        USBMSG("EP%02Xh maximum-packet-size=%d maximum-transfer-size=%d\n",
+        USBMSG("EP%02Xh maximum-packet-size=%d maximum-transfer-size=%d max-burst=%d mult=%d bytes-per-interval=%d\n",
           interface_info->Pipes[i].EndpointAddress,
           maxPacketSize,
-          maxTransferSize);
+          maxTransferSize,
+          endpoint->max_burst,
+          endpoint->mult,
+          endpoint->bytes_per_interval);
 
         dev->config.interfaces[number].endpoints[i].maximum_transfer_size = maxTransferSize;
 		}
@@ -1049,6 +1104,55 @@ find_endpoint_desc_by_index(USB_INTERFACE_DESCRIPTOR *interface_desc,
     return NULL;
 }
 
+usb_ss_endpoint_companion_descriptor_t *
+find_ss_endpoint_companion_desc(USB_CONFIGURATION_DESCRIPTOR *config_desc,
+                    unsigned int size, int interface_number, int altsetting,
+                    int endpoint_address)
+{
+    usb_descriptor_header_t *desc;
+    USB_INTERFACE_DESCRIPTOR *if_desc;
+    USB_ENDPOINT_DESCRIPTOR *ep_desc = NULL;
+    char *p;
+
+    if_desc = find_interface_desc(config_desc, size, interface_number, altsetting);
+    if (!if_desc)
+        return NULL;
+
+    /* find_interface_desc() checked size against wTotalLength */
+    size = config_desc->wTotalLength - (unsigned int)((char *)if_desc - (char *)config_desc);
+    p = (char *)if_desc;
+    desc = (usb_descriptor_header_t *)p;
+
+    size -= desc->length;
+    p += desc->length;
+    desc = (usb_descriptor_header_t *)p;
+
+    while (size >= sizeof(usb_descriptor_header_t) && desc->length
+        && desc->length <= size)
+    {
+        if (desc->type == USB_INTERFACE_DESCRIPTOR_TYPE)
+            break;
+
+        if (desc->type == USB_ENDPOINT_DESCRIPTOR_TYPE)
+        {
+            ep_desc = (USB_ENDPOINT_DESCRIPTOR *)desc;
+        }
+        else if (desc->type == LIBUSB_DT_SS_ENDPOINT_COMPANION
+            && ep_desc && ep_desc->bEndpointAddress == (UCHAR)endpoint_address)
+        {
+            if (desc->length < sizeof(usb_ss_endpoint_companion_descriptor_t))
+                return NULL;
+
+            return (usb_ss_endpoint_companion_descriptor_t *)desc;
+        }
+
+        size -= desc->length;
+        p += desc->length;
+        desc = (usb_descriptor_header_t *)p;
+    }
+
+    return NULL;
+}
 
 ULONG get_current_frame(IN PDEVICE_EXTENSION deviceExtension, IN PIRP Irp)
 /*++
@@ -1120,6 +1224,139 @@ Return Value:
     return urb.FrameNumber;
 }
 
+void frame_clock_initialize(libusb_device_t *dev)
+{
+	KeInitializeSpinLock(&dev->frame_clock.lock);
+	frame_clock_invalidate(dev);
+}
+
+void frame_clock_invalidate(libusb_device_t *dev)
+{
+	KIRQL irql;
+
+	KeAcquireSpinLock(&dev->frame_clock.lock, &irql);
+	dev->frame_clock.valid = FALSE;
+	memset(dev->frame_clock.chained, 0, sizeof(dev->frame_clock.chained));
+	KeReleaseSpinLock(&dev->frame_clock.lock, irql);
+}
+
+void frame_clock_reset_endpoint(libusb_device_t *dev, int endpoint)
+{
+	KIRQL irql;
+
+	KeAcquireSpinLock(&dev->frame_clock.lock, &irql);
+	dev->frame_clock.chained[endpoint & 0xFF] = FALSE;
+	KeReleaseSpinLock(&dev->frame_clock.lock, irql);
+}
+
+/* the frame number advances once per ms. it is extrapolated from the last */
+/* query and only re-queried from the bus when the estimate gets old. */
+static ULONG get_frame_clock(libusb_device_t *dev, IRP *irp)
+{
+	ULONGLONG now = query_precise_time();
+	ULONGLONG elapsed_ms;
+	ULONG frame;
+	KIRQL irql;
+
+	KeAcquireSpinLock(&dev->frame_clock.lock, &irql);
+	if (dev->frame_clock.valid)
+	{
+		/* time is in 100ns units */
+		elapsed_ms = (now - dev->frame_clock.time) / 10000;
+		if (elapsed_ms < LIBUSB_FRAME_CLOCK_REFRESH_MS)
+		{
+			frame = dev->frame_clock.frame + (ULONG)elapsed_ms;
+			KeReleaseSpinLock(&dev->frame_clock.lock, irql);
+			return frame;
+		}
+	}
+	KeReleaseSpinLock(&dev->frame_clock.lock, irql);
+
+	frame = get_current_frame(dev, irp);
+	if (frame == (ULONG)-1)
+		return frame;
+
+	KeAcquireSpinLock(&dev->frame_clock.lock, &irql);
+	dev->frame_clock.frame = frame;
+	dev->frame_clock.time = now;
+	dev->frame_clock.valid = TRUE;
+	KeReleaseSpinLock(&dev->frame_clock.lock, irql);
+
+	return frame;
+}
+
+/* frames covered by an iso urb of packets. an iso endpoint moves one */
+/* packet every 2^(bInterval-1) frames, or microframes on high speed */
+static ULONG get_iso_urb_frames(libusb_device_t *dev, int endpoint, int packets)
+{
+	libusb_endpoint_t *pipe_info;
+	ULONG periods;
+	int interval = 1;
+
+	if (get_pipe_info(dev, endpoint, &pipe_info) && pipe_info->interval > 1)
+		interval = (pipe_info->interval > 16) ? 16 : pipe_info->interval;
+
+	periods = (ULONG)packets << (interval - 1);
+
+	/* 8 microframes per frame */
+	return (dev->speed >= HighSpeed) ? (periods + 7) / 8 : periods;
+}
+
+ULONG get_iso_start_frame(libusb_device_t *dev, IRP *irp, int endpoint,
+						  int packets, int latency)
+{
+	ULONG current, start, frames;
+	int index = endpoint & 0xFF;
+	KIRQL irql;
+
+	current = get_frame_clock(dev, irp);
+	frames = get_iso_urb_frames(dev, endpoint, packets);
+
+	KeAcquireSpinLock(&dev->frame_clock.lock, &irql);
+	start = dev->frame_clock.next_frame[index];
+	if (!dev->frame_clock.chained[index]
+		|| (LONG)(start - current) <= 0
+		|| (LONG)(start - current) >= USBD_ISO_START_FRAME_RANGE)
+	{
+		/* first urb or the stream fell behind, start over */
+		start = current + latency;
+	}
+	dev->frame_clock.next_frame[index] = start + frames;
+	dev->frame_clock.chained[index] = TRUE;
+	KeReleaseSpinLock(&dev->frame_clock.lock, irql);
+
+	return start;
+}
+
+void release_iso_start_frame(libusb_device_t *dev, int endpoint, ULONG start,
+							 int packets)
+{
+	ULONG frames = get_iso_urb_frames(dev, endpoint, packets);
+	int index = endpoint & 0xFF;
+	KIRQL irql;
+
+	/* urbs chained after this one keep their frames */
+	KeAcquireSpinLock(&dev->frame_clock.lock, &irql);
+	if (dev->frame_clock.chained[index]
+		&& dev->frame_clock.next_frame[index] == start + frames)
+	{
+		dev->frame_clock.next_frame[index] = start;
+	}
+	KeReleaseSpinLock(&dev->frame_clock.lock, irql);
+}
+
+/* 100ns units like KeQueryInterruptTime(), which only advances once per */
+/* clock tick. the performance counter has sub-microsecond resolution */
+ULONGLONG query_precise_time(void)
+{
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter = KeQueryPerformanceCounter(&frequency);
+
+	return (ULONGLONG)(counter.QuadPart / frequency.QuadPart) * 10000000
+		+ (ULONGLONG)(counter.QuadPart % frequency.QuadPart) * 10000000
+		/ (ULONGLONG)frequency.QuadPart;
+}
+
 PVOID allocate_pool(SIZE_T bytes)
 {
     return ExAllocatePool(alloc_pool, bytes);
@@ -64,11 +64,45 @@
 #define LIBUSB_MAX_NUMBER_OF_ENDPOINTS  32
 #define LIBUSB_MAX_NUMBER_OF_INTERFACES 32
 #define LIBUSB_MAX_ENDPOINT_NO          0x100
+#define LIBUSB_MAX_REGISTERED_BUFFERS   64
+
+/* 64M */
+#define LIBUSB_MAX_REGISTERED_BUFFER_SIZE 0x4000000
+
+#define LIBUSB_MAX_READ_AHEAD_PIPES     4
+#define LIBUSB_MAX_READ_AHEAD_URBS      16
+#define LIBUSB_MAX_READ_AHEAD_REPORTS   1024
+#define LIBUSB_DEFAULT_READ_AHEAD_REPORTS 32
+
+#define LIBUSB_MAX_ISO_STREAMS          2
+#define LIBUSB_MAX_ISO_STREAM_URBS      32
+#define LIBUSB_DEFAULT_ISO_STREAM_PACKETS 1024
+
+/* 16M */
+#define LIBUSB_MAX_ISO_STREAM_RING_SIZE 0x1000000
+
+/* trace ring size in records, rounded up to a power of two */
+#define LIBUSB_DEFAULT_TRACE_RECORDS    4096
+#define LIBUSB_MAX_TRACE_RECORDS        65536
+
+/* per-cpu statistics slots, cpus above share slots */
+#define LIBUSB_MAX_STATS_CPUS           32
+
+/* re-query the bus frame number after this many ms */
+#define LIBUSB_FRAME_CLOCK_REFRESH_MS   1000
+
+#ifndef USBD_ISO_START_FRAME_RANGE
+#define USBD_ISO_START_FRAME_RANGE      1024
+#endif
 
 
 #define LIBUSB_DEFAULT_TIMEOUT 5000
 #define LIBUSB_MAX_CONTROL_TRANSFER_TIMEOUT 5000
 
+/* per-endpoint state indexed by direction and number */
+#define LIBUSB_ENDPOINT_SLOTS           32
+#define LIBUSB_ENDPOINT_SLOT(address)   ((((address) & 0x80) >> 3) | ((address) & 0x0F))
+
 
 #ifdef __GNUC__
 #define DDKAPI __stdcall
@@ -99,6 +133,14 @@ typedef int bool_t;
 
 #define GetMaxTransferSize(pipeInfo, reqMaxTransferSize) ((reqMaxTransferSize) ? reqMaxTransferSize : pipeInfo->maximum_transfer_size)
 
+// endpoint registry override if set, device registry override otherwise. 0 if neither is set.
+#define GetTuningValue(dev, address, field) ((dev)->tuning.endpoints[LIBUSB_ENDPOINT_SLOT(address)].field ? (dev)->tuning.endpoints[LIBUSB_ENDPOINT_SLOT(address)].field : (dev)->tuning.field)
+#define GetDefaultTimeout(dev) (((dev)->tuning.default_timeout > 0) ? (dev)->tuning.default_timeout : LIBUSB_DEFAULT_TIMEOUT)
+#define GetMaxControlTimeout(dev) (((dev)->tuning.max_control_timeout > 0) ? (dev)->tuning.max_control_timeout : LIBUSB_MAX_CONTROL_TRANSFER_TIMEOUT)
+
+// a SuperSpeed iso packet carries a whole service interval (all bursts)
+#define GetIsoPacketSize(pipeInfo) (((pipeInfo)->bytes_per_interval > (pipeInfo)->maximum_packet_size) ? (pipeInfo)->bytes_per_interval : (pipeInfo)->maximum_packet_size)
+
 #define UrbFunctionFromEndpoint(PipeInfo) ((IS_ISOC_PIPE(PipeInfo)) ? URB_FUNCTION_ISOCH_TRANSFER : URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER)
 #define UsbdDirectionFromEndpoint(PipeInfo) ((PipeInfo->address & 0x80) ? USBD_TRANSFER_DIRECTION_IN : USBD_TRANSFER_DIRECTION_OUT)
 
@@ -148,8 +190,66 @@ typedef struct
     unsigned char type;
 } usb_descriptor_header_t;
 
+/* follows every endpoint descriptor of a SuperSpeed configuration */
+#define LIBUSB_DT_SS_ENDPOINT_COMPANION 0x30
+
+typedef struct
+{
+    unsigned char bLength;
+    unsigned char bDescriptorType;
+    unsigned char bMaxBurst;
+    unsigned char bmAttributes;
+    unsigned short wBytesPerInterval;
+} usb_ss_endpoint_companion_descriptor_t;
+
 #include <poppack.h>
 
+/* transfer parameters read from the device's hardware key at start-device,
+ * see reg_get_tuning(). zero keeps the built-in default.
+ */
+typedef struct
+{
+	int max_transfer_size;      // MaxTransferSize
+	int max_pending_urbs;       // MaxPendingUrbs
+	int read_ahead_reports;     // ReadAheadDepth
+} libusb_endpoint_tuning_t;
+
+/* counters of one endpoint on one cpu, summed up by stats_get() */
+typedef struct
+{
+	LONGLONG irps;
+	LONGLONG urbs;
+	LONGLONG bytes;
+	LONGLONG short_transfers;
+	LONGLONG stalls;
+	LONGLONG cancels;
+	LONGLONG errors;
+	LONGLONG latency[LIBUSB_STATS_LATENCY_BUCKETS];
+} libusb_stats_slot_t;
+
+typedef struct
+{
+	libusb_stats_slot_t endpoints[LIBUSB_ENDPOINT_SLOTS];
+} libusb_stats_cpu_t;
+
+/* commit is the trace index + 1 once the record is complete */
+typedef struct
+{
+	volatile LONG commit;
+	LONG reserved;
+	libusb_trace_record_t record;
+} libusb_trace_entry_t;
+
+typedef struct
+{
+	int max_transfer_size;
+	int max_pending_urbs;
+	int read_ahead_reports;
+	int default_timeout;        // DefaultTimeout
+	int max_control_timeout;    // MaxControlTimeout
+	libusb_endpoint_tuning_t endpoints[LIBUSB_ENDPOINT_SLOTS];
+} libusb_tuning_t;
+
 
 typedef struct
 {
@@ -173,6 +273,11 @@ typedef struct
     int maximum_transfer_size; // Maximum size for a single request
                                // in bytes.
     int pipe_flags;
+
+    // from the SuperSpeed endpoint companion descriptor, zero otherwise
+    int max_burst;             // packets per burst minus one
+    int mult;                  // bursts per service interval minus one (iso)
+    int bytes_per_interval;    // bytes per service interval (iso, interrupt)
 } libusb_endpoint_t;
 
 typedef struct
@@ -183,6 +288,56 @@ typedef struct
 
 } libusb_interface_t;
 
+typedef struct
+{
+    FILE_OBJECT *file_object; /* file object this buffer is bound to */
+    PMDL mdl;                 /* locked user pages, NULL if the slot is free */
+    ULONG length;
+    int direction;            /* USBD_TRANSFER_DIRECTION_* it is locked for */
+    unsigned int token;
+    LONG ref_count;           /* registration + in-flight transfers */
+    bool_t unregistered;
+} libusb_registered_buffer_t;
+
+struct _libusb_urb_ring_urb;
+struct _libusb_urb_ring_ops;
+
+/* a report or packet held in a urb ring */
+typedef struct
+{
+    ULONG length;
+    USBD_STATUS status;
+} libusb_urb_ring_slot_t;
+
+/* an IN pipe kept busy by urbs the driver posts and re-posts itself, */
+/* see urb_ring.c. used by read-ahead and iso streams */
+typedef struct _libusb_urb_ring
+{
+    int address;              /* endpoint polled, 0 if the slot is free */
+    FILE_OBJECT *file_object; /* file object that started polling */
+    USBD_PIPE_HANDLE pipe_handle;
+    const struct _libusb_urb_ring_ops *ops;
+    KSPIN_LOCK lock;
+    LIST_ENTRY waiting_irps;  /* reads waiting for data */
+    KEVENT idle;              /* signalled while no urb is posted */
+    int posted;               /* urbs currently owned by the usb stack */
+    bool_t stopping;
+    bool_t halted;            /* an urb failed, re-armed by the next read */
+    int packet_size;
+    int packets_per_urb;
+    int urb_count;
+    struct _libusb_urb_ring_urb *urbs;
+
+    /* bounded ring of completed reports or packets */
+    int ring_count;
+    int ring_head;            /* oldest slot */
+    int ring_used;
+    libusb_urb_ring_slot_t *ring_slots;
+    UCHAR *ring_data;         /* packet_size bytes per slot */
+    ULONG overruns;           /* slots dropped because the ring was full */
+    ULONG truncated;          /* slots cut to fit the reading buffer */
+} libusb_urb_ring_t;
+
 typedef struct
 {
     DEVICE_OBJECT	*self;
@@ -220,13 +375,92 @@ typedef struct
 	int control_write_timeout;
 	int speed;
 
+	/* registry overrides of the transfer parameters */
+	libusb_tuning_t tuning;
+
 	/* Keep track of head pending request sequences on all endpoints
 	 * This housekeeping is here to make sure we do not sumbit read/writes out of order
 	 */
 	LONG pending_sequence[LIBUSB_MAX_ENDPOINT_NO];
 	LONG pending_busy[LIBUSB_MAX_ENDPOINT_NO];
+
+	/* user buffers locked once by LIBUSB_IOCTL_REGISTER_*_BUFFER */
+	struct
+	{
+		KSPIN_LOCK lock;
+		unsigned int generation;
+		libusb_registered_buffer_t slots[LIBUSB_MAX_REGISTERED_BUFFERS];
+	} registered_buffers;
+
+	/* interrupt IN pipes polled continuously by the driver */
+	libusb_urb_ring_t read_ahead[LIBUSB_MAX_READ_AHEAD_PIPES];
+
+	/* isochronous IN pipes streamed continuously by the driver */
+	libusb_urb_ring_t iso_streams[LIBUSB_MAX_ISO_STREAMS];
+
+	/* transfer counters, one libusb_stats_cpu_t per cpu. the queue depth */
+	/* is shared by all cpus */
+	struct
+	{
+		libusb_stats_cpu_t *cpus;
+		int cpu_count;
+		LONG pending[LIBUSB_ENDPOINT_SLOTS];
+		LONG max_pending[LIBUSB_ENDPOINT_SLOTS];
+	} stats;
+
+	/* binary transfer trace, see trace.c. the ring is kept until the */
+	/* device is removed */
+	struct
+	{
+		KSPIN_LOCK lock;             /* serializes readers and setup */
+		bool_t enabled;
+		libusb_trace_entry_t *entries;
+		ULONG mask;                  /* ring size - 1 */
+		volatile LONG head;          /* next index to write */
+		ULONG tail;                  /* next index to read */
+		ULONG lost;
+	} trace;
+
+	/* bus frame number extrapolated from the last query, used to schedule */
+	/* iso transfers with TRANSFER_FLAGS_ISO_SET_START_FRAME */
+	struct
+	{
+		KSPIN_LOCK lock;
+		bool_t valid;
+		ULONG frame;         /* frame number of the last query */
+		ULONGLONG time;      /* interrupt time of the last query */
+		ULONG next_frame[LIBUSB_MAX_ENDPOINT_NO]; /* frame after the last urb */
+		bool_t chained[LIBUSB_MAX_ENDPOINT_NO];
+	} frame_clock;
 } libusb_device_t, DEVICE_EXTENSION, *PDEVICE_EXTENSION;
 
+typedef struct _libusb_urb_ring_urb
+{
+    libusb_device_t *dev;
+    libusb_urb_ring_t *ring;
+    IRP *irp;
+    URB *urb;
+    int urb_size;
+    PMDL mdl;                 /* describes buffer */
+    UCHAR *buffer;            /* packets_per_urb * packet_size bytes */
+    bool_t posted;
+} libusb_urb_ring_urb_t;
+
+/* the pipe specific part of a urb ring */
+typedef struct _libusb_urb_ring_ops
+{
+    /* fills in the zeroed urb of entry before every post */
+    void (*build_urb)(libusb_urb_ring_urb_t *entry);
+
+    /* ring lock held. queues the data of a completed urb and returns TRUE, */
+    /* or returns FALSE if the urb failed and polling has to halt */
+    bool_t (*push)(libusb_urb_ring_urb_t *entry, NTSTATUS status);
+
+    /* ring lock held. fills irp from the ring, sets Information and */
+    /* returns the status of the read */
+    NTSTATUS (*pop)(libusb_urb_ring_t *ring, IRP *irp);
+} libusb_urb_ring_ops_t;
+
 
 NTSTATUS DDKAPI add_device(DRIVER_OBJECT *driver_object,
                            DEVICE_OBJECT *physical_device_object);
@@ -239,7 +473,7 @@ NTSTATUS dispatch_ioctl(libusb_device_t *dev, IRP *irp);
 NTSTATUS complete_irp(IRP *irp, NTSTATUS status, ULONG info);
 
 #define call_usbd(dev, urb, control_code, timeout) \
-	call_usbd_ex(dev, urb, control_code, timeout, LIBUSB_MAX_CONTROL_TRANSFER_TIMEOUT)
+	call_usbd_ex(dev, urb, control_code, timeout, GetMaxControlTimeout(dev))
 
 NTSTATUS call_usbd_ex(libusb_device_t *dev, 
 					  void *urb, 
@@ -317,6 +551,7 @@ bool_t reg_get_compatible_id(DEVICE_OBJECT *physical_device_object,
                            char *data, int size);
 
 bool_t reg_get_properties(libusb_device_t *dev);
+void reg_get_tuning(libusb_device_t *dev);
 
 
 void power_set_device_state(libusb_device_t *dev,
@@ -336,6 +571,11 @@ USB_ENDPOINT_DESCRIPTOR *
 find_endpoint_desc_by_index(USB_INTERFACE_DESCRIPTOR *interface_desc,
                     unsigned int size, int pipe_index);
 
+usb_ss_endpoint_companion_descriptor_t *
+find_ss_endpoint_companion_desc(USB_CONFIGURATION_DESCRIPTOR *config_desc,
+                    unsigned int size, int interface_number, int altsetting,
+                    int endpoint_address);
+
 /*
 Gets a device property for the device_object.
 
@@ -365,11 +605,29 @@ NTSTATUS transfer(libusb_device_t* dev,
 				  IN int isoLatency,
 				  IN PMDL mdlAddress,
 				  IN int totalLength,
-				  IN int maxTransferSize);
+				  IN int maxTransferSize,
+				  IN unsigned int bufferToken,
+				  IN int isoPacketsOffset);
 
 ULONG get_current_frame(IN PDEVICE_EXTENSION dev, IN PIRP Irp);
 
+void frame_clock_initialize(libusb_device_t *dev);
+void frame_clock_invalidate(libusb_device_t *dev);
+
+/* the next iso urb on endpoint starts a new chain */
+void frame_clock_reset_endpoint(libusb_device_t *dev, int endpoint);
+
+/* start frame for an iso urb of packets on endpoint. continues where the */
+/* previous urb on the endpoint ends if that frame is still ahead. */
+ULONG get_iso_start_frame(libusb_device_t *dev, IRP *irp, int endpoint,
+						  int packets, int latency);
+
+/* gives back the frames of an urb that could not be submitted */
+void release_iso_start_frame(libusb_device_t *dev, int endpoint, ULONG start,
+							 int packets);
+
 PVOID allocate_pool(SIZE_T bytes);
+ULONGLONG query_precise_time(void);
 
 NTSTATUS control_transfer(libusb_device_t* dev, 
 						 PIRP irp,
@@ -420,4 +678,130 @@ NTSTATUS get_interface_ex(libusb_device_t *dev,
                        int timeout);
 
 VOID set_filter_interface_key(libusb_device_t *dev, ULONG id);
+
+void registered_buffers_initialize(libusb_device_t *dev);
+
+NTSTATUS register_buffer(libusb_device_t *dev, FILE_OBJECT *file_object,
+						 PMDL mdl, int direction, unsigned int *token);
+
+NTSTATUS unregister_buffer(libusb_device_t *dev, FILE_OBJECT *file_object,
+						   unsigned int token);
+
+/* unregisters all buffers bound to file_object, or all buffers if NULL */
+void unregister_all_buffers(libusb_device_t *dev, FILE_OBJECT *file_object);
+
+NTSTATUS reference_registered_buffer(libusb_device_t *dev,
+									 FILE_OBJECT *file_object,
+									 unsigned int token,
+									 int direction,
+									 ULONG offset,
+									 ULONG length,
+									 PMDL *partial_mdl);
+
+void release_registered_buffer(libusb_device_t *dev, unsigned int token,
+							   PMDL partial_mdl);
+
+void urb_ring_initialize(libusb_urb_ring_t *rings, int count);
+libusb_urb_ring_t *urb_ring_find(libusb_urb_ring_t *rings, int count,
+								 int endpoint);
+
+/* claims a free slot for endpoint. it stays 'stopping' until started */
+libusb_urb_ring_t *urb_ring_claim(libusb_urb_ring_t *rings, int count,
+								  int endpoint);
+
+/* allocates the urbs and the ring of a claimed slot and posts the urbs. */
+/* the slot is released if this fails */
+NTSTATUS urb_ring_start(libusb_device_t *dev, libusb_urb_ring_t *ring,
+						int urb_size);
+NTSTATUS urb_ring_stop(libusb_device_t *dev, libusb_urb_ring_t *ring,
+					   int endpoint);
+void urb_ring_stop_all(libusb_device_t *dev, libusb_urb_ring_t *rings,
+					   int count, FILE_OBJECT *file_object);
+void urb_ring_stop_interface(libusb_device_t *dev, libusb_urb_ring_t *rings,
+							 int count, int interface_number);
+void urb_ring_abort(libusb_device_t *dev, libusb_urb_ring_t *ring,
+					int endpoint);
+
+/* must be called with the ring lock held, acquired at irql. releases it, */
+/* completes irp from the ring or queues it and returns the dispatch */
+/* return value */
+NTSTATUS urb_ring_read(libusb_device_t *dev, libusb_urb_ring_t *ring,
+					   IRP *irp, KIRQL irql);
+
+/* ring lock held */
+void urb_ring_push(libusb_urb_ring_t *ring, const UCHAR *data, ULONG length,
+				   USBD_STATUS status);
+void urb_ring_advance(libusb_urb_ring_t *ring);
+
+void read_ahead_initialize(libusb_device_t *dev);
+
+NTSTATUS read_ahead_start(libusb_device_t *dev, FILE_OBJECT *file_object,
+						  int endpoint, int urb_count, int ring_count);
+
+NTSTATUS read_ahead_stop(libusb_device_t *dev, int endpoint);
+
+/* stops read-ahead started by file_object, or on all pipes if NULL */
+void read_ahead_stop_all(libusb_device_t *dev, FILE_OBJECT *file_object);
+
+/* stops read-ahead on the pipes of interface_number */
+void read_ahead_stop_interface(libusb_device_t *dev, int interface_number);
+
+/* completes reads waiting on endpoint with STATUS_CANCELLED */
+void read_ahead_abort(libusb_device_t *dev, int endpoint);
+
+/* returns FALSE if read-ahead is not active on endpoint. otherwise the irp */
+/* has been completed or queued and status holds the dispatch return value */
+bool_t read_ahead_read(libusb_device_t *dev, IRP *irp, int endpoint,
+					   NTSTATUS *status);
+
+void iso_stream_initialize(libusb_device_t *dev);
+
+NTSTATUS iso_stream_start(libusb_device_t *dev, FILE_OBJECT *file_object,
+						  int endpoint, int packet_size, int packets_per_urb,
+						  int urb_count, int ring_count);
+
+NTSTATUS iso_stream_stop(libusb_device_t *dev, int endpoint);
+
+/* stops streams started by file_object, or all streams if NULL */
+void iso_stream_stop_all(libusb_device_t *dev, FILE_OBJECT *file_object);
+
+/* stops streams on the pipes of interface_number */
+void iso_stream_stop_interface(libusb_device_t *dev, int interface_number);
+
+/* completes reads waiting on endpoint with STATUS_CANCELLED */
+void iso_stream_abort(libusb_device_t *dev, int endpoint);
+
+/* completes or queues irp, returns the dispatch return value */
+NTSTATUS iso_stream_read(libusb_device_t *dev, IRP *irp, int endpoint,
+						 int packet_size, int packet_count);
+
+void trace_initialize(libusb_device_t *dev);
+NTSTATUS trace_start(libusb_device_t *dev, int record_count);
+void trace_stop(libusb_device_t *dev);
+void trace_free(libusb_device_t *dev);
+void trace_event(libusb_device_t *dev, int event, LONG sequence,
+				 int endpoint, int function, int length, NTSTATUS status,
+				 USBD_STATUS urb_status, const UCHAR *setup);
+NTSTATUS trace_read(libusb_device_t *dev, MDL *mdl, ULONG length, int *ret);
+
+/* no call at all while tracing is off */
+#define TRACE_EVENT(dev, event, sequence, endpoint, function, length, status, urb_status, setup) \
+	do { if ((dev)->trace.enabled) trace_event(dev, event, sequence, endpoint, function, length, status, urb_status, setup); } while (0)
+
+void stats_initialize(libusb_device_t *dev);
+void stats_free(libusb_device_t *dev);
+
+/* counts a request passed down, returns its start time for stats_irp_done() */
+ULONGLONG stats_irp_start(libusb_device_t *dev, int endpoint);
+void stats_urb_start(libusb_device_t *dev, int endpoint);
+void stats_irp_done(libusb_device_t *dev, int endpoint, ULONGLONG start_time,
+					NTSTATUS status, USBD_STATUS urb_status,
+					int requested, int transmitted);
+
+NTSTATUS stats_get(libusb_device_t *dev, int endpoint, bool_t reset,
+				   libusb_endpoint_stats_t *stats);
+
+/* binds file_object to the endpoint named by its file name, if any */
+NTSTATUS bind_endpoint_file(libusb_device_t *dev, FILE_OBJECT *file_object);
+NTSTATUS dispatch_read_write(libusb_device_t *dev, IRP *irp);
 #endif
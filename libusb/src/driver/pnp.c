@@ -70,9 +70,17 @@ NTSTATUS dispatch_pnp(libusb_device_t *dev, IRP *irp)
 
 		dev->is_started = FALSE;
 
+		/* read-ahead and stream urbs hold the remove lock until they */
+		/* are stopped */
+		read_ahead_stop_all(dev, NULL);
+		iso_stream_stop_all(dev, NULL);
+
 		/* wait until all outstanding requests are finished */
         remove_lock_release_and_wait(dev);
 
+		/* no transfers are left, unlock whatever is still registered */
+		unregister_all_buffers(dev, NULL);
+
 #ifdef LIBUSB_ENABLE_CONTRACT_VERSION_602
 		/* Close handle to USBD */
 		USBD_CloseHandle(dev->handle);
@@ -94,6 +102,8 @@ NTSTATUS dispatch_pnp(libusb_device_t *dev, IRP *irp)
 			RtlFreeUnicodeString(&dev->device_interface_name);
 		}
 		UpdateContextConfigDescriptor(dev,NULL,0,0,-1);
+		stats_free(dev);
+		trace_free(dev);
 
         /* delete the device object */
         IoDetachDevice(dev->next_stack_device);
@@ -104,6 +114,8 @@ NTSTATUS dispatch_pnp(libusb_device_t *dev, IRP *irp)
     case IRP_MN_SURPRISE_REMOVAL:
 
         dev->is_started = FALSE;
+		read_ahead_stop_all(dev, NULL);
+		iso_stream_stop_all(dev, NULL);
 		USBMSG("IRP_MN_SURPRISE_REMOVAL: is-filter=%c %s\n",
 			dev->is_filter ? 'Y' : 'N',
 			dev->device_id);
@@ -136,6 +148,10 @@ NTSTATUS dispatch_pnp(libusb_device_t *dev, IRP *irp)
 		// in the D0 state.
 		//
 		PoSetPowerState(dev->self, DevicePowerState, dev->power_state);
+
+		// the initial configuration below already uses the overrides
+		reg_get_tuning(dev);
+
 		if (dev->device_interface_in_use)
 		{
 			status = IoSetDeviceInterfaceState(&dev->device_interface_name, TRUE);
@@ -148,6 +164,8 @@ NTSTATUS dispatch_pnp(libusb_device_t *dev, IRP *irp)
 
     case IRP_MN_STOP_DEVICE:
         dev->is_started = FALSE;
+		read_ahead_stop_all(dev, NULL);
+		iso_stream_stop_all(dev, NULL);
 		USBDBG("IRP_MN_STOP_DEVICE: is-filter=%c %s\n",
 			dev->is_filter ? 'Y' : 'N',
 			dev->device_id);
@@ -231,7 +249,7 @@ on_start_complete(DEVICE_OBJECT *device_object, IRP *irp, void *context)
 					dev->initial_config_value, dev->device_id);
 			}
 
-			if(!NT_SUCCESS(set_configuration(dev, dev->initial_config_value, LIBUSB_DEFAULT_TIMEOUT)))
+			if(!NT_SUCCESS(set_configuration(dev, dev->initial_config_value, GetDefaultTimeout(dev))))
 			{
 				// we should always be able to apply the active configuration,
 				// even in the case of composite devices.
@@ -163,6 +163,9 @@ on_power_state_complete(DEVICE_OBJECT *device_object,
                 /* report device state to Power Manager */
                 PoSetPowerState(dev->self, DevicePowerState, power_state);
             }
+            /* the bus frame number is not continuous across power states */
+            frame_clock_invalidate(dev);
+
             /* save current device state */
             dev->power_state.DeviceState = power_state.DeviceState;
         }
@@ -212,6 +215,9 @@ on_filter_power_state_complete(DEVICE_OBJECT *device_object,
                 PoSetPowerState(dev->self, DevicePowerState, power_state);
             }
 
+            /* the bus frame number is not continuous across power states */
+            frame_clock_invalidate(dev);
+
             /* save current device state */
             dev->power_state.DeviceState = power_state.DeviceState;
         }
@@ -0,0 +1,239 @@
+/* libusb-win32, Generic Windows USB Library
+ * Copyright (c) 2002-2005 Stephan Meyer <ste_meyer@web.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "libusb_driver.h"
+
+/* Interrupt IN read-ahead.
+ *
+ * While enabled, a fixed number of urbs is kept posted on the pipe so the
+ * host controller polls it at every bInterval, see urb_ring.c. Completed
+ * reports are queued in a bounded ring and
+ * LIBUSB_IOCTL_INTERRUPT_OR_BULK_READ requests are satisfied from the ring.
+ * If the ring is full the oldest report is dropped. When an urb fails
+ * (stall, abort) polling is halted and the next read re-arms it.
+ */
+
+static void read_ahead_build_urb(libusb_urb_ring_urb_t *entry);
+static bool_t read_ahead_push(libusb_urb_ring_urb_t *entry, NTSTATUS status);
+static NTSTATUS read_ahead_pop(libusb_urb_ring_t *ra, IRP *irp);
+
+static const libusb_urb_ring_ops_t read_ahead_ops =
+{
+	read_ahead_build_urb,
+	read_ahead_push,
+	read_ahead_pop
+};
+
+void read_ahead_initialize(libusb_device_t *dev)
+{
+	urb_ring_initialize(dev->read_ahead, LIBUSB_MAX_READ_AHEAD_PIPES);
+}
+
+NTSTATUS read_ahead_start(libusb_device_t *dev, FILE_OBJECT *file_object,
+						  int endpoint, int urb_count, int ring_count)
+{
+	libusb_endpoint_t *pipe_info;
+	libusb_urb_ring_t *ra;
+	NTSTATUS status;
+
+	if (!get_pipe_info(dev, endpoint, &pipe_info))
+	{
+		USBERR("failed getting pipe info for endpoint: %02Xh\n", endpoint);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (!IS_INTR_PIPE(pipe_info) || !(pipe_info->address & 0x80))
+	{
+		USBERR("endpoint %02Xh is not an interrupt IN endpoint\n", endpoint);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (pipe_info->maximum_packet_size <= 0)
+	{
+		USBERR("wMaxPacketSize=0 for endpoint %02Xh\n", endpoint);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (urb_count > LIBUSB_MAX_READ_AHEAD_URBS)
+		urb_count = LIBUSB_MAX_READ_AHEAD_URBS;
+	if (GetTuningValue(dev, endpoint, max_pending_urbs) > 0
+		&& urb_count > GetTuningValue(dev, endpoint, max_pending_urbs))
+	{
+		urb_count = GetTuningValue(dev, endpoint, max_pending_urbs);
+	}
+
+	if (ring_count <= 0)
+		ring_count = GetTuningValue(dev, endpoint, read_ahead_reports);
+	if (ring_count <= 0)
+		ring_count = LIBUSB_DEFAULT_READ_AHEAD_REPORTS;
+	else if (ring_count > LIBUSB_MAX_READ_AHEAD_REPORTS)
+		ring_count = LIBUSB_MAX_READ_AHEAD_REPORTS;
+
+	/* restart with the new settings if the pipe is already polled */
+	read_ahead_stop(dev, endpoint);
+
+	ra = urb_ring_claim(dev->read_ahead, LIBUSB_MAX_READ_AHEAD_PIPES, endpoint);
+	if (!ra)
+	{
+		USBERR("read-ahead is already active on %d pipes\n",
+			LIBUSB_MAX_READ_AHEAD_PIPES);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	ra->file_object = file_object;
+	ra->pipe_handle = pipe_info->handle;
+	ra->ops = &read_ahead_ops;
+	ra->packet_size = pipe_info->maximum_packet_size;
+	ra->packets_per_urb = 1;
+	ra->urb_count = urb_count;
+	ra->ring_count = ring_count;
+
+	status = urb_ring_start(dev, ra, sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER));
+	if (NT_SUCCESS(status))
+	{
+		USBMSG("EP%02Xh urbs=%d reports=%d packet-size=%d\n",
+			endpoint, urb_count, ring_count, pipe_info->maximum_packet_size);
+	}
+
+	return status;
+}
+
+NTSTATUS read_ahead_stop(libusb_device_t *dev, int endpoint)
+{
+	return urb_ring_stop(dev, urb_ring_find(dev->read_ahead,
+		LIBUSB_MAX_READ_AHEAD_PIPES, endpoint), endpoint);
+}
+
+void read_ahead_stop_all(libusb_device_t *dev, FILE_OBJECT *file_object)
+{
+	urb_ring_stop_all(dev, dev->read_ahead, LIBUSB_MAX_READ_AHEAD_PIPES,
+		file_object);
+}
+
+void read_ahead_stop_interface(libusb_device_t *dev, int interface_number)
+{
+	urb_ring_stop_interface(dev, dev->read_ahead, LIBUSB_MAX_READ_AHEAD_PIPES,
+		interface_number);
+}
+
+void read_ahead_abort(libusb_device_t *dev, int endpoint)
+{
+	urb_ring_abort(dev, urb_ring_find(dev->read_ahead,
+		LIBUSB_MAX_READ_AHEAD_PIPES, endpoint), endpoint);
+}
+
+bool_t read_ahead_read(libusb_device_t *dev, IRP *irp, int endpoint,
+					   NTSTATUS *status)
+{
+	libusb_urb_ring_t *ra;
+	KIRQL irql;
+
+	ra = urb_ring_find(dev->read_ahead, LIBUSB_MAX_READ_AHEAD_PIPES, endpoint);
+	if (!ra)
+		return FALSE;
+
+	KeAcquireSpinLock(&ra->lock, &irql);
+	if (ra->address != endpoint || ra->stopping)
+	{
+		KeReleaseSpinLock(&ra->lock, irql);
+		return FALSE;
+	}
+
+	*status = urb_ring_read(dev, ra, irp, irql);
+	return TRUE;
+}
+
+static void read_ahead_build_urb(libusb_urb_ring_urb_t *entry)
+{
+	struct _URB_BULK_OR_INTERRUPT_TRANSFER *urb = &entry->urb->UrbBulkOrInterruptTransfer;
+
+	urb->Hdr.Function = URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER;
+	urb->PipeHandle = entry->ring->pipe_handle;
+	urb->TransferFlags = USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK;
+	urb->TransferBufferLength = entry->ring->packet_size;
+	urb->TransferBuffer = entry->buffer;
+}
+
+static bool_t read_ahead_push(libusb_urb_ring_urb_t *entry, NTSTATUS status)
+{
+	struct _URB_BULK_OR_INTERRUPT_TRANSFER *urb = &entry->urb->UrbBulkOrInterruptTransfer;
+
+	if (!NT_SUCCESS(status) || !USBD_SUCCESS(urb->Hdr.Status))
+		return FALSE;
+
+	urb_ring_push(entry->ring, entry->buffer, urb->TransferBufferLength,
+		urb->Hdr.Status);
+	return TRUE;
+}
+
+/* copies whole reports into the irp buffer the way a transfer would: */
+/* until a short report is copied or the next report does not fit. a */
+/* report larger than the whole buffer is cut and the read fails with */
+/* STATUS_BUFFER_OVERFLOW, like an urb babbling into a short buffer */
+static NTSTATUS read_ahead_pop(libusb_urb_ring_t *ra, IRP *irp)
+{
+	IO_STACK_LOCATION *stack_location = IoGetCurrentIrpStackLocation(irp);
+	ULONG size = (stack_location->MajorFunction == IRP_MJ_READ)
+		? stack_location->Parameters.Read.Length
+		: stack_location->Parameters.DeviceIoControl.OutputBufferLength;
+	ULONG copied = 0;
+	ULONG length;
+	UCHAR *buffer;
+	NTSTATUS status = STATUS_SUCCESS;
+
+	irp->IoStatus.Information = 0;
+
+	buffer = MmGetSystemAddressForMdlSafe(irp->MdlAddress, NormalPagePriority);
+	if (!buffer)
+	{
+		USBERR0("MmGetSystemAddressForMdlSafe failed\n");
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	while (ra->ring_used)
+	{
+		length = ra->ring_slots[ra->ring_head].length;
+
+		if (length > size - copied)
+		{
+			if (copied)
+				break;
+
+			/* the buffer is smaller than the report */
+			USBWRN("EP%02Xh report of %d bytes truncated to %d\n",
+				ra->address, length, size);
+			length = size;
+			ra->truncated++;
+			status = STATUS_BUFFER_OVERFLOW;
+		}
+
+		RtlCopyMemory(buffer + copied,
+			ra->ring_data + ra->ring_head * ra->packet_size, length);
+		copied += length;
+
+		urb_ring_advance(ra);
+
+		if (status != STATUS_SUCCESS || length < (ULONG)ra->packet_size)
+			break;
+	}
+
+	irp->IoStatus.Information = copied;
+
+	return status;
+}
@@ -0,0 +1,274 @@
+/* libusb-win32, Generic Windows USB Library
+ * Copyright (c) 2002-2005 Stephan Meyer <ste_meyer@web.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "libusb_driver.h"
+
+/* A token holds the slot index + 1 in the low byte and a generation count */
+/* above it, so a stale token of a re-used slot is never accepted. Tokens */
+/* are returned as the byte count of the irp, they stay below 2^31. */
+#define TOKEN_TO_SLOT(token) ((int)((token) & 0xFF) - 1)
+#define MAKE_TOKEN(slot, generation) \
+	((((generation) & 0x7FFFFF) << 8) | (unsigned int)((slot) + 1))
+
+static PMDL drop_reference(libusb_registered_buffer_t *buffer);
+static void free_locked_mdl(PMDL mdl);
+
+void registered_buffers_initialize(libusb_device_t *dev)
+{
+	KeInitializeSpinLock(&dev->registered_buffers.lock);
+	dev->registered_buffers.generation = 0;
+	memset(dev->registered_buffers.slots, 0, sizeof(dev->registered_buffers.slots));
+}
+
+/* mdl is the buffer of a LIBUSB_IOCTL_REGISTER_*_BUFFER request, probed and */
+/* locked by the I/O manager for the given direction. On success the buffer */
+/* owns it and the caller must detach it from the irp. */
+NTSTATUS register_buffer(libusb_device_t *dev, FILE_OBJECT *file_object,
+						 PMDL mdl, int direction, unsigned int *token)
+{
+	NTSTATUS status;
+	libusb_registered_buffer_t *buffer;
+	ULONG length;
+	KIRQL irql;
+	int i;
+
+	length = mdl ? MmGetMdlByteCount(mdl) : 0;
+	if (!length || mdl->Next || length > LIBUSB_MAX_REGISTERED_BUFFER_SIZE)
+	{
+		USBERR("invalid buffer length=%d\n", length);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	status = STATUS_INSUFFICIENT_RESOURCES;
+
+	KeAcquireSpinLock(&dev->registered_buffers.lock, &irql);
+	for (i = 0; i < LIBUSB_MAX_REGISTERED_BUFFERS; i++)
+	{
+		buffer = &dev->registered_buffers.slots[i];
+		if (buffer->mdl)
+			continue;
+
+		buffer->file_object = file_object;
+		buffer->mdl = mdl;
+		buffer->length = length;
+		buffer->direction = direction;
+		buffer->ref_count = 1;
+		buffer->unregistered = FALSE;
+		buffer->token = MAKE_TOKEN(i, ++dev->registered_buffers.generation);
+
+		*token = buffer->token;
+		status = STATUS_SUCCESS;
+		break;
+	}
+	KeReleaseSpinLock(&dev->registered_buffers.lock, irql);
+
+	if (!NT_SUCCESS(status))
+	{
+		USBERR("no free buffer slot, %d buffers already registered\n",
+			LIBUSB_MAX_REGISTERED_BUFFERS);
+		return status;
+	}
+
+	USBMSG("registered %s buffer token=%08Xh length=%d\n",
+		direction == USBD_TRANSFER_DIRECTION_IN ? "read" : "write",
+		*token, length);
+
+	return status;
+}
+
+NTSTATUS unregister_buffer(libusb_device_t *dev, FILE_OBJECT *file_object,
+						   unsigned int token)
+{
+	libusb_registered_buffer_t *buffer;
+	int slot = TOKEN_TO_SLOT(token);
+	PMDL mdl = NULL;
+	KIRQL irql;
+
+	if (slot < 0 || slot >= LIBUSB_MAX_REGISTERED_BUFFERS)
+	{
+		USBERR("invalid buffer token %08Xh\n", token);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	KeAcquireSpinLock(&dev->registered_buffers.lock, &irql);
+	buffer = &dev->registered_buffers.slots[slot];
+	if (!buffer->mdl || buffer->unregistered
+		|| buffer->token != token || buffer->file_object != file_object)
+	{
+		KeReleaseSpinLock(&dev->registered_buffers.lock, irql);
+		USBERR("invalid buffer token %08Xh\n", token);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	/* transfers still using the buffer keep it locked until they complete */
+	buffer->unregistered = TRUE;
+	mdl = drop_reference(buffer);
+	KeReleaseSpinLock(&dev->registered_buffers.lock, irql);
+
+	free_locked_mdl(mdl);
+
+	USBMSG("unregistered buffer token=%08Xh\n", token);
+
+	return STATUS_SUCCESS;
+}
+
+void unregister_all_buffers(libusb_device_t *dev, FILE_OBJECT *file_object)
+{
+	libusb_registered_buffer_t *buffer;
+	PMDL mdl;
+	KIRQL irql;
+	int i;
+
+	for (i = 0; i < LIBUSB_MAX_REGISTERED_BUFFERS; i++)
+	{
+		mdl = NULL;
+
+		KeAcquireSpinLock(&dev->registered_buffers.lock, &irql);
+		buffer = &dev->registered_buffers.slots[i];
+		if (buffer->mdl && !buffer->unregistered
+			&& (!file_object || buffer->file_object == file_object))
+		{
+			buffer->unregistered = TRUE;
+			mdl = drop_reference(buffer);
+		}
+		KeReleaseSpinLock(&dev->registered_buffers.lock, irql);
+
+		free_locked_mdl(mdl);
+	}
+}
+
+NTSTATUS reference_registered_buffer(libusb_device_t *dev,
+									 FILE_OBJECT *file_object,
+									 unsigned int token,
+									 int direction,
+									 ULONG offset,
+									 ULONG length,
+									 PMDL *partial_mdl)
+{
+	libusb_registered_buffer_t *buffer;
+	int slot = TOKEN_TO_SLOT(token);
+	PUCHAR virtual_address;
+	PMDL mdl;
+	KIRQL irql;
+
+	*partial_mdl = NULL;
+
+	if (slot < 0 || slot >= LIBUSB_MAX_REGISTERED_BUFFERS)
+	{
+		USBERR("invalid buffer token %08Xh\n", token);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	KeAcquireSpinLock(&dev->registered_buffers.lock, &irql);
+	buffer = &dev->registered_buffers.slots[slot];
+	if (!buffer->mdl || buffer->unregistered
+		|| buffer->token != token || buffer->file_object != file_object)
+	{
+		KeReleaseSpinLock(&dev->registered_buffers.lock, irql);
+		USBERR("invalid buffer token %08Xh\n", token);
+		return STATUS_INVALID_PARAMETER;
+	}
+	if (offset > buffer->length || length > buffer->length - offset)
+	{
+		KeReleaseSpinLock(&dev->registered_buffers.lock, irql);
+		USBERR("offset=%d length=%d exceeds buffer length %d\n",
+			offset, length, buffer->length);
+		return STATUS_INVALID_PARAMETER;
+	}
+	/* pages locked for read access must not be written by a read */
+	if (direction == USBD_TRANSFER_DIRECTION_IN
+		&& buffer->direction != USBD_TRANSFER_DIRECTION_IN)
+	{
+		KeReleaseSpinLock(&dev->registered_buffers.lock, irql);
+		USBERR("buffer token %08Xh is registered for writes only\n", token);
+		return STATUS_INVALID_PARAMETER;
+	}
+	buffer->ref_count++;
+	mdl = buffer->mdl;
+	KeReleaseSpinLock(&dev->registered_buffers.lock, irql);
+
+	/* zero-length packets do not need a buffer */
+	if (!length)
+		return STATUS_SUCCESS;
+
+	/* describe the requested window of the already locked pages */
+	virtual_address = (PUCHAR)MmGetMdlVirtualAddress(mdl) + offset;
+
+	*partial_mdl = IoAllocateMdl(virtual_address, length, FALSE, FALSE, NULL);
+	if (!*partial_mdl)
+	{
+		USBERR0("memory allocation error\n");
+		release_registered_buffer(dev, token, NULL);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	IoBuildPartialMdl(mdl, *partial_mdl, virtual_address, length);
+
+	return STATUS_SUCCESS;
+}
+
+void release_registered_buffer(libusb_device_t *dev, unsigned int token,
+							   PMDL partial_mdl)
+{
+	libusb_registered_buffer_t *buffer;
+	int slot = TOKEN_TO_SLOT(token);
+	PMDL mdl;
+	KIRQL irql;
+
+	if (partial_mdl)
+	{
+		IoFreeMdl(partial_mdl);
+	}
+
+	if (slot < 0 || slot >= LIBUSB_MAX_REGISTERED_BUFFERS)
+		return;
+
+	KeAcquireSpinLock(&dev->registered_buffers.lock, &irql);
+	buffer = &dev->registered_buffers.slots[slot];
+	mdl = (buffer->token == token) ? drop_reference(buffer) : NULL;
+	KeReleaseSpinLock(&dev->registered_buffers.lock, irql);
+
+	free_locked_mdl(mdl);
+}
+
+/* must be called with the registered_buffers lock held. returns the locked */
+/* MDL if this was the last reference; the slot is free again at that point. */
+static PMDL drop_reference(libusb_registered_buffer_t *buffer)
+{
+	PMDL mdl;
+
+	if (--buffer->ref_count > 0)
+		return NULL;
+
+	mdl = buffer->mdl;
+	buffer->mdl = NULL;
+	buffer->file_object = NULL;
+	buffer->length = 0;
+
+	return mdl;
+}
+
+static void free_locked_mdl(PMDL mdl)
+{
+	if (mdl)
+	{
+		MmUnlockPages(mdl);
+		IoFreeMdl(mdl);
+	}
+}
@@ -45,6 +45,9 @@ NTSTATUS reset_endpoint(libusb_device_t *dev, int endpoint, int timeout)
         return STATUS_INVALID_PARAMETER;
     }
 
+    /* a reset pipe does not continue the previous iso schedule */
+    frame_clock_reset_endpoint(dev, endpoint);
+
     status = call_usbd(dev, &urb, IOCTL_INTERNAL_USB_SUBMIT_URB, timeout);
 
     if (!NT_SUCCESS(status) || !USBD_SUCCESS(urb.UrbHeader.Status))
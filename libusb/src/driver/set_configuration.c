@@ -44,6 +44,11 @@ NTSTATUS set_configuration(libusb_device_t *dev,
         return STATUS_SUCCESS;
     }
 
+    /* the pipe handles polled by read-ahead and iso streams are about */
+    /* to become invalid */
+    read_ahead_stop_all(dev, NULL);
+    iso_stream_stop_all(dev, NULL);
+
     memset(&urb, 0, sizeof(URB));
 
     if (configuration == 0)
@@ -188,11 +193,14 @@ NTSTATUS set_configuration(libusb_device_t *dev,
 
     clear_pipe_info(dev);
 
+	// update_pipe_info() reads the endpoint companion descriptors from the
+	// cached configuration
+	UpdateContextConfigDescriptor(dev, configuration_descriptor, desc_size, configuration_descriptor->bConfigurationValue, config_index);
+
     for (i = 0; i < configuration_descriptor->bNumInterfaces; i++)
     {
         update_pipe_info(dev, interfaces[i].Interface);
     }
-	UpdateContextConfigDescriptor(dev, configuration_descriptor, desc_size, configuration_descriptor->bConfigurationValue, config_index);
 
 SetConfigurationDone:
     if (interfaces)
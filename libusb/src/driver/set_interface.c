@@ -52,6 +52,11 @@ NTSTATUS set_interface(libusb_device_t *dev,
 		return STATUS_NO_MORE_ENTRIES;
     }
 
+    /* the pipe handles of this interface polled by read-ahead and iso */
+    /* streams are about to become invalid */
+    read_ahead_stop_interface(dev, interface_number);
+    iso_stream_stop_interface(dev, interface_number);
+
     tmp_size = sizeof(struct _URB_SELECT_INTERFACE) + interface_descriptor->bNumEndpoints * sizeof(USBD_PIPE_INFORMATION);
 
     urb = allocate_pool(tmp_size);
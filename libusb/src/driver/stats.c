@@ -0,0 +1,202 @@
+/* libusb-win32, Generic Windows USB Library
+ * Copyright (c) 2002-2005 Stephan Meyer <ste_meyer@web.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "libusb_driver.h"
+
+/* Per-endpoint transfer counters.
+ *
+ * Every cpu updates its own copy of the counters, so the interlocked adds
+ * below do not bounce cache lines between cpus. LIBUSB_IOCTL_GET_STATISTICS
+ * sums up the copies. Only the queue depth is shared, its high-water mark
+ * needs a single current value.
+ *
+ * A thread may move to another cpu while it updates a counter. That only
+ * changes which copy is updated, the sum stays correct.
+ */
+
+#define STATS_ADD(counter, value) \
+	ExInterlockedAddLargeStatistic((PLARGE_INTEGER)&(counter), (ULONG)(value))
+
+static libusb_stats_slot_t *stats_slot(libusb_device_t *dev, int endpoint)
+{
+	ULONG cpu;
+
+	if (!dev->stats.cpus)
+		return NULL;
+
+	cpu = KeGetCurrentProcessorNumber() % (ULONG)dev->stats.cpu_count;
+
+	return &dev->stats.cpus[cpu].endpoints[LIBUSB_ENDPOINT_SLOT(endpoint)];
+}
+
+void stats_initialize(libusb_device_t *dev)
+{
+	SIZE_T size;
+	int cpu_count;
+
+	memset(dev->stats.pending, 0, sizeof(dev->stats.pending));
+	memset(dev->stats.max_pending, 0, sizeof(dev->stats.max_pending));
+
+	cpu_count = (int)KeQueryActiveProcessorCount(NULL);
+	if (cpu_count <= 0)
+		cpu_count = 1;
+	else if (cpu_count > LIBUSB_MAX_STATS_CPUS)
+		cpu_count = LIBUSB_MAX_STATS_CPUS;
+
+	size = cpu_count * sizeof(libusb_stats_cpu_t);
+
+	/* the counters are optional, the device works without them */
+	dev->stats.cpus = allocate_pool(size);
+	if (!dev->stats.cpus)
+	{
+		USBWRN("failed allocating %d bytes of statistics\n", (int)size);
+		dev->stats.cpu_count = 0;
+		return;
+	}
+
+	memset(dev->stats.cpus, 0, size);
+	dev->stats.cpu_count = cpu_count;
+}
+
+void stats_free(libusb_device_t *dev)
+{
+	if (dev->stats.cpus)
+	{
+		ExFreePool(dev->stats.cpus);
+		dev->stats.cpus = NULL;
+	}
+	dev->stats.cpu_count = 0;
+}
+
+ULONGLONG stats_irp_start(libusb_device_t *dev, int endpoint)
+{
+	libusb_stats_slot_t *slot = stats_slot(dev, endpoint);
+	int index = LIBUSB_ENDPOINT_SLOT(endpoint);
+	LONG pending, max_pending, prev;
+
+	if (!slot)
+		return 0;
+
+	STATS_ADD(slot->irps, 1);
+
+	pending = InterlockedIncrement(&dev->stats.pending[index]);
+
+	max_pending = dev->stats.max_pending[index];
+	while (pending > max_pending)
+	{
+		prev = InterlockedCompareExchange(&dev->stats.max_pending[index],
+			pending, max_pending);
+		if (prev == max_pending)
+			break;
+		max_pending = prev;
+	}
+
+	return query_precise_time();
+}
+
+void stats_urb_start(libusb_device_t *dev, int endpoint)
+{
+	libusb_stats_slot_t *slot = stats_slot(dev, endpoint);
+
+	if (slot)
+		STATS_ADD(slot->urbs, 1);
+}
+
+void stats_irp_done(libusb_device_t *dev, int endpoint, ULONGLONG start_time,
+					NTSTATUS status, USBD_STATUS urb_status,
+					int requested, int transmitted)
+{
+	libusb_stats_slot_t *slot = stats_slot(dev, endpoint);
+	ULONGLONG elapsed;
+	int bucket;
+
+	if (!slot)
+		return;
+
+	InterlockedDecrement(&dev->stats.pending[LIBUSB_ENDPOINT_SLOT(endpoint)]);
+
+	if (transmitted > 0)
+		STATS_ADD(slot->bytes, transmitted);
+
+	if (status == STATUS_CANCELLED)
+		STATS_ADD(slot->cancels, 1);
+	else if (urb_status == USBD_STATUS_STALL_PID)
+		STATS_ADD(slot->stalls, 1);
+	else if (!NT_SUCCESS(status) || !USBD_SUCCESS(urb_status))
+		STATS_ADD(slot->errors, 1);
+	else if (transmitted < requested)
+		STATS_ADD(slot->short_transfers, 1);
+
+	/* 100ns units */
+	elapsed = (query_precise_time() - start_time) / 10;
+	for (bucket = 0; elapsed > 1 && bucket < LIBUSB_STATS_LATENCY_BUCKETS - 1; bucket++)
+		elapsed >>= 1;
+
+	STATS_ADD(slot->latency[bucket], 1);
+}
+
+/* a reset races with transfers completing at the same time, counts of */
+/* those may be lost */
+NTSTATUS stats_get(libusb_device_t *dev, int endpoint, bool_t reset,
+				   libusb_endpoint_stats_t *stats)
+{
+	libusb_stats_slot_t *slot;
+	int index = LIBUSB_ENDPOINT_SLOT(endpoint);
+	int cpu, i;
+
+	if (!dev->stats.cpus)
+		return STATUS_NOT_SUPPORTED;
+
+	if (!(endpoint & USB_ENDPOINT_ADDRESS_MASK) || (endpoint & 0x70))
+	{
+		USBERR("invalid endpoint %02Xh\n", endpoint);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	stats->endpoint = endpoint;
+	stats->pending = (unsigned int)dev->stats.pending[index];
+	stats->max_pending = (unsigned int)dev->stats.max_pending[index];
+
+	for (cpu = 0; cpu < dev->stats.cpu_count; cpu++)
+	{
+		slot = &dev->stats.cpus[cpu].endpoints[index];
+
+		stats->irps += slot->irps;
+		stats->urbs += slot->urbs;
+		stats->bytes += slot->bytes;
+		stats->short_transfers += slot->short_transfers;
+		stats->stalls += slot->stalls;
+		stats->cancels += slot->cancels;
+		stats->errors += slot->errors;
+		for (i = 0; i < LIBUSB_STATS_LATENCY_BUCKETS; i++)
+			stats->latency[i] += slot->latency[i];
+
+		if (reset)
+			memset(slot, 0, sizeof(*slot));
+	}
+
+	if (reset)
+	{
+		InterlockedExchange(&dev->stats.max_pending[index],
+			dev->stats.pending[index]);
+	}
+
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,248 @@
+/* libusb-win32, Generic Windows USB Library
+ * Copyright (c) 2002-2005 Stephan Meyer <ste_meyer@web.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "libusb_driver.h"
+
+/* Binary transfer trace.
+ *
+ * While enabled, every request, urb and completion stores one fixed size
+ * record in a per-device ring. Nothing is formatted, the decoding is done
+ * in user space after LIBUSB_IOCTL_READ_TRACE.
+ *
+ * Writers never wait: a record index is reserved with one interlocked
+ * increment and the record is committed by storing index + 1 in the entry.
+ * When the ring is full the oldest records are overwritten. The reader
+ * skips entries that were overwritten and reports them as lost.
+ *
+ * The ring is allocated on the first LIBUSB_IOCTL_SET_TRACE and kept until
+ * the device is removed, because a writer may still be using it right
+ * after tracing was disabled.
+ */
+
+void trace_initialize(libusb_device_t *dev)
+{
+	KeInitializeSpinLock(&dev->trace.lock);
+	dev->trace.enabled = FALSE;
+	dev->trace.entries = NULL;
+	dev->trace.mask = 0;
+	dev->trace.head = 0;
+	dev->trace.tail = 0;
+	dev->trace.lost = 0;
+}
+
+NTSTATUS trace_start(libusb_device_t *dev, int record_count)
+{
+	libusb_trace_entry_t *entries;
+	ULONG size = 1;
+	SIZE_T bytes;
+	KIRQL irql;
+
+	if (record_count <= 0)
+		record_count = LIBUSB_DEFAULT_TRACE_RECORDS;
+	else if (record_count > LIBUSB_MAX_TRACE_RECORDS)
+		record_count = LIBUSB_MAX_TRACE_RECORDS;
+
+	while (size < (ULONG)record_count)
+		size <<= 1;
+
+	if (!dev->trace.entries)
+	{
+		bytes = size * sizeof(libusb_trace_entry_t);
+		entries = allocate_pool(bytes);
+		if (!entries)
+		{
+			USBERR("failed allocating %d trace records\n", size);
+			return STATUS_NO_MEMORY;
+		}
+		memset(entries, 0, bytes);
+
+		KeAcquireSpinLock(&dev->trace.lock, &irql);
+		if (!dev->trace.entries)
+		{
+			dev->trace.entries = entries;
+			dev->trace.mask = size - 1;
+			entries = NULL;
+		}
+		KeReleaseSpinLock(&dev->trace.lock, irql);
+
+		/* another thread was faster */
+		if (entries)
+			ExFreePool(entries);
+	}
+	else if (size != dev->trace.mask + 1)
+	{
+		USBWRN("trace ring size stays at %d records until the device is removed\n",
+			dev->trace.mask + 1);
+	}
+
+	/* start with an empty ring */
+	KeAcquireSpinLock(&dev->trace.lock, &irql);
+	dev->trace.tail = (ULONG)dev->trace.head;
+	dev->trace.lost = 0;
+	dev->trace.enabled = TRUE;
+	KeReleaseSpinLock(&dev->trace.lock, irql);
+
+	USBMSG("tracing %d records\n", dev->trace.mask + 1);
+
+	return STATUS_SUCCESS;
+}
+
+void trace_stop(libusb_device_t *dev)
+{
+	dev->trace.enabled = FALSE;
+}
+
+/* no transfers are left when this is called */
+void trace_free(libusb_device_t *dev)
+{
+	dev->trace.enabled = FALSE;
+
+	if (dev->trace.entries)
+	{
+		ExFreePool(dev->trace.entries);
+		dev->trace.entries = NULL;
+	}
+}
+
+void trace_event(libusb_device_t *dev, int event, LONG sequence,
+				 int endpoint, int function, int length, NTSTATUS status,
+				 USBD_STATUS urb_status, const UCHAR *setup)
+{
+	libusb_trace_entry_t *entry;
+	libusb_trace_entry_t *entries = dev->trace.entries;
+	ULONG index;
+
+	if (!entries)
+		return;
+
+	index = (ULONG)InterlockedIncrement(&dev->trace.head) - 1;
+	entry = &entries[index & dev->trace.mask];
+
+	/* the reader must not take the old record while this one is written */
+	InterlockedExchange(&entry->commit, 0);
+
+	entry->record.time = query_precise_time();
+	entry->record.sequence = (unsigned int)sequence;
+	entry->record.length = (unsigned int)length;
+	entry->record.status = status;
+	entry->record.urb_status = (unsigned int)urb_status;
+	entry->record.function = (unsigned short)function;
+	entry->record.event = (unsigned char)event;
+	entry->record.endpoint = (unsigned char)endpoint;
+	entry->record.reserved = 0;
+	if (setup)
+		RtlCopyMemory(entry->record.setup, setup, sizeof(entry->record.setup));
+	else
+		RtlZeroMemory(entry->record.setup, sizeof(entry->record.setup));
+
+	InterlockedExchange(&entry->commit, (LONG)(index + 1));
+}
+
+NTSTATUS trace_read(libusb_device_t *dev, MDL *mdl, ULONG length, int *ret)
+{
+	libusb_trace_record_t *records;
+	libusb_trace_entry_t *entry;
+	ULONG max_count, count = 0;
+	ULONG head, tail, commit;
+	KIRQL irql;
+
+	*ret = 0;
+
+	max_count = length / sizeof(libusb_trace_record_t);
+	if (!mdl || !max_count)
+	{
+		USBERR0("read_trace: invalid output buffer\n");
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	if (!dev->trace.entries)
+	{
+		USBERR0("read_trace: tracing was never enabled\n");
+		return STATUS_INVALID_DEVICE_STATE;
+	}
+
+	records = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
+	if (!records)
+	{
+		USBERR0("read_trace: MmGetSystemAddressForMdlSafe failed\n");
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	KeAcquireSpinLock(&dev->trace.lock, &irql);
+
+	head = (ULONG)dev->trace.head;
+	tail = dev->trace.tail;
+
+	/* writers lapped the reader */
+	if (head - tail > dev->trace.mask + 1)
+	{
+		dev->trace.lost += head - tail - (dev->trace.mask + 1);
+		tail = head - (dev->trace.mask + 1);
+	}
+
+	while (tail != head && count < max_count)
+	{
+		entry = &dev->trace.entries[tail & dev->trace.mask];
+		commit = (ULONG)entry->commit;
+
+		if (commit != tail + 1)
+		{
+			/* still being written, try again on the next read */
+			if ((LONG)(commit - (tail + 1)) < 0)
+				break;
+
+			/* overwritten by a newer record */
+			dev->trace.lost++;
+			tail++;
+			continue;
+		}
+
+		records[count] = entry->record;
+
+		/* overwritten while it was copied */
+		KeMemoryBarrier();
+		if ((ULONG)entry->commit != tail + 1)
+		{
+			dev->trace.lost++;
+			tail++;
+			continue;
+		}
+
+		count++;
+		tail++;
+	}
+
+	dev->trace.tail = tail;
+
+	if (dev->trace.lost && count < max_count)
+	{
+		memset(&records[count], 0, sizeof(libusb_trace_record_t));
+		records[count].time = query_precise_time();
+		records[count].event = LIBUSB_TRACE_LOST;
+		records[count].length = dev->trace.lost;
+		dev->trace.lost = 0;
+		count++;
+	}
+
+	KeReleaseSpinLock(&dev->trace.lock, irql);
+
+	*ret = (int)(count * sizeof(libusb_trace_record_t));
+
+	return STATUS_SUCCESS;
+}
@@ -20,6 +20,7 @@
 
 
 #include "libusb_driver.h"
+#include "transfer.h"
 
 typedef struct
 {
@@ -34,8 +35,53 @@ typedef struct
 	int maxTransferSize;
 	IN PMDL mdlAddress;
 	PMDL subMdl;
+	unsigned int bufferToken;
+	int isoPacketsOffset;
+	int requested;
+	ULONGLONG start_time;
 } context_t;
 
+/* an iso urb holds at most 255 packets. high speed urbs must cover whole */
+/* frames of 8 microframe packets, so larger requests are split at 248. */
+#define ISO_MAX_PACKETS_PER_URB      255
+#define ISO_MAX_PACKETS_PER_URB_HS   248
+
+#define ISO_PACKETS_PER_URB(dev) (((dev)->speed >= HighSpeed) \
+	? ISO_MAX_PACKETS_PER_URB_HS : ISO_MAX_PACKETS_PER_URB)
+
+struct _iso_chain;
+
+typedef struct
+{
+	IRP *irp;
+	URB *urb;
+	PMDL mdl;
+	int offset;              /* of the urb data in the user buffer */
+	int first_packet;
+	struct _iso_chain *chain;
+} iso_chain_urb_t;
+
+/* an iso request split into back-to-back urbs, each sent on its own irp */
+typedef struct _iso_chain
+{
+	libusb_device_t *dev;
+	IRP *irp;
+	LONG sequence;
+	LONG pending;            /* urbs in flight + the submitting thread */
+	LONG ref_count;          /* completion path + cancel routine */
+	NTSTATUS status;         /* first failure */
+	USBD_STATUS urb_status;  /* urb status of the first failure */
+	LONG information;
+	int address;
+	int requested;
+	ULONGLONG start_time;
+	PMDL mdlAddress;
+	unsigned int bufferToken;
+	int isoPacketsOffset;
+	int count;
+	iso_chain_urb_t urbs[1];
+} iso_chain_t;
+
 static LONG sequence = 0;
 
 static const char* read_pipe_display_names[]  = {"ctrl-read", "iso-read", "bulk-read", "int-read"};
@@ -43,6 +89,9 @@ static const char* write_pipe_display_names[] = {"ctrl-write","iso-write","bulk-
 
 static const char* GetPipeDisplayName(libusb_endpoint_t* endpoint);
 
+static void copy_iso_packet_results(PMDL mdl, int results_offset, URB *urb,
+									int first_packet, int data_offset);
+
 NTSTATUS DDKAPI transfer_complete(DEVICE_OBJECT* device_object,
 								  IRP *irp,
 								  void *context);
@@ -59,14 +108,49 @@ static NTSTATUS create_urb(libusb_device_t *dev,
 void set_urb_transfer_flags(libusb_device_t* dev,
 							PIRP irp,
 							PURB subUrb,
+							int address,
 							int transfer_flags,
 							int isoLatency);
+
+static NTSTATUS transfer_iso_chain(libusb_device_t* dev,
+								   IN PIRP irp,
+								   IN int direction,
+								   IN libusb_endpoint_t* endpoint,
+								   IN int packetSize,
+								   IN int transferFlags,
+								   IN int isoLatency,
+								   IN PMDL mdlAddress,
+								   IN int totalLength,
+								   IN unsigned int bufferToken,
+								   IN int isoPacketsOffset,
+								   IN LONG sequenceID);
 static NTSTATUS transfer_next(libusb_device_t* dev,
 	IN PIRP irp,
 	context_t* context)
 {
 	NTSTATUS status;
 	IO_STACK_LOCATION* stack_location = NULL;
+	int address = context->address;
+	int sequence = context->sequence;
+	ULONG start_frame = 0;
+	int start_packets = 0;
+
+	// Set the transfer flags before the irp stack location is set up.
+	// If this is an iso transfer, set_urb_transfer_flags() might need
+	// to get the start frame, which uses the next stack location of irp.
+	//
+	set_urb_transfer_flags(dev, irp, context->urb, context->address,
+		context->transferFlags, context->isoLatency);
+
+	// context is gone once the urb completes, remember the frames taken
+	// from the frame clock in case it can not be submitted.
+	if (context->urb->UrbHeader.Function == URB_FUNCTION_ISOCH_TRANSFER
+		&& (context->transferFlags & TRANSFER_FLAGS_ISO_SET_START_FRAME))
+	{
+		start_frame = context->urb->UrbIsochronousTransfer.StartFrame;
+		start_packets = context->urb->UrbIsochronousTransfer.NumberOfPackets;
+	}
+
 	stack_location = IoGetNextIrpStackLocation(irp);
 
 	stack_location->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
@@ -75,16 +159,21 @@ static NTSTATUS transfer_next(libusb_device_t* dev,
 
 	IoSetCompletionRoutine(irp, transfer_complete, context, TRUE, TRUE, TRUE);
 
-	// Set the transfer flags just before we call the irp down.
-	// If this is an iso transfer, set_urb_transfer_flags() might need
-	// to get the start frame and set latency.
-	//
-	set_urb_transfer_flags(dev, irp, context->urb, context->transferFlags, context->isoLatency);
+	stats_urb_start(dev, context->address);
+	TRACE_EVENT(dev, LIBUSB_TRACE_URB_SUBMIT, context->sequence, context->address,
+		context->urb->UrbHeader.Function,
+		(context->urb->UrbHeader.Function == URB_FUNCTION_ISOCH_TRANSFER)
+			? context->urb->UrbIsochronousTransfer.TransferBufferLength
+			: context->urb->UrbBulkOrInterruptTransfer.TransferBufferLength,
+		STATUS_SUCCESS, USBD_STATUS_SUCCESS, NULL);
 
 	status = IoCallDriver(dev->target_device, irp);
 	if (!NT_SUCCESS(status))
 	{
-		USBERR("xfer failed. sequence %d\n", context->sequence);
+		USBERR("xfer failed. sequence %d\n", sequence);
+
+		if (start_packets)
+			release_iso_start_frame(dev, address, start_frame, start_packets);
 	}
 	return status;
 }
@@ -99,7 +188,9 @@ NTSTATUS transfer(libusb_device_t* dev,
 				  IN int isoLatency,
 				  IN PMDL mdlAddress,
 				  IN int totalLength,
-				  IN int maxTransferSize)
+				  IN int maxTransferSize,
+				  IN unsigned int bufferToken,
+				  IN int isoPacketsOffset)
 {
 	context_t *context = NULL;
 	NTSTATUS status = STATUS_SUCCESS;
@@ -112,12 +203,23 @@ NTSTATUS transfer(libusb_device_t* dev,
 	// status = reset_endpoint(dev,endpoint->address, LIBUSB_DEFAULT_TIMEOUT);
 	//
 	if (!packetSize)
-		packetSize = endpoint->maximum_packet_size;
+	{
+		packetSize = (urbFunction == URB_FUNCTION_ISOCH_TRANSFER)
+			? GetIsoPacketSize(endpoint) : endpoint->maximum_packet_size;
+	}
 
 	if (urbFunction == URB_FUNCTION_ISOCH_TRANSFER)
 	{
 		USBMSG("[%s #%d] EP%02Xh packet-size=%d length=%d reset-status=%08Xh\n",
 			dispTransfer, sequenceID, endpoint->address, packetSize, totalLength, status);
+
+		/* more packets than fit into one urb */
+		if (packetSize > 0 && totalLength / packetSize > ISO_PACKETS_PER_URB(dev))
+		{
+			return transfer_iso_chain(dev, irp, direction, endpoint, packetSize,
+				transferFlags, isoLatency, mdlAddress, totalLength, bufferToken,
+				isoPacketsOffset, sequenceID);
+		}
 	}
 	else
 	{
@@ -125,8 +227,10 @@ NTSTATUS transfer(libusb_device_t* dev,
 			dispTransfer, sequenceID, endpoint->address, totalLength, packetSize, maxTransferSize);
 	}
 
-	/* Check if another transfer is on-going on same endpoint */
-	pending_busy = InterlockedCompareExchange(&dev->pending_busy[endpoint->address], 1, 0);
+	/* Check if another transfer is on-going on same endpoint. The owner's */
+	/* sequence is stored, so that an urb completing during the send can */
+	/* tell that the endpoint is held by its own request */
+	pending_busy = InterlockedCompareExchange(&dev->pending_busy[endpoint->address], sequenceID, 0);
 	if(pending_busy)
 	{
 		USBMSG("sequence %d send aborted due to pending conflict\n", sequenceID);
@@ -155,21 +259,46 @@ NTSTATUS transfer(libusb_device_t* dev,
 	context->information = 0;
 	context->maxTransferSize = maxTransferSize;
 	context->address = endpoint->address;
+	context->bufferToken = bufferToken;
+	context->isoPacketsOffset = isoPacketsOffset;
+
+	/* the packet results follow the data in the same buffer, the urb */
+	/* only gets the data part */
+	if (isoPacketsOffset)
+	{
+		context->subMdl = IoAllocateMdl(MmGetMdlVirtualAddress(mdlAddress),
+			totalLength, FALSE, FALSE, NULL);
+		if (!context->subMdl)
+		{
+			USBERR("[#%d] failed allocating subMdl\n", sequenceID);
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			goto transfer_free;
+		}
+		IoBuildPartialMdl(mdlAddress, context->subMdl,
+			MmGetMdlVirtualAddress(mdlAddress), totalLength);
+	}
 
-	first_size = (totalLength > context->maxTransferSize) ? context->maxTransferSize : totalLength;
+	first_size = TRANSFER_CHUNK_SIZE(totalLength, context->maxTransferSize);
 
 	status = create_urb(dev, &context->urb, direction, urbFunction,
-		endpoint, packetSize, mdlAddress, first_size);
+		endpoint, packetSize, context->subMdl ? context->subMdl : mdlAddress,
+		first_size);
 	if (!NT_SUCCESS(status))
 	{
 		goto transfer_free;
 	}
 
+	context->requested = totalLength;
+	context->start_time = stats_irp_start(dev, endpoint->address);
+	TRACE_EVENT(dev, LIBUSB_TRACE_SUBMIT, sequenceID, endpoint->address,
+		urbFunction, totalLength, STATUS_SUCCESS, USBD_STATUS_SUCCESS, NULL);
+
 	/* Do not check this status code, as the request might complete during call,
      so we do *not* want to free anything here as that would lead to double-free */
   status = transfer_next(dev, irp, context);
 
-	InterlockedExchange(&dev->pending_busy[endpoint->address], 0);
+	/* the completion routine already released it if the request completed */
+	InterlockedCompareExchange(&dev->pending_busy[endpoint->address], 0, sequenceID);
 	return status;
 
 transfer_free:
@@ -183,8 +312,17 @@ transfer_free:
 		{
 			ExFreePool(context->urb);
 		}
+		if(context->subMdl)
+		{
+			IoFreeMdl(context->subMdl);
+		}
 		ExFreePool(context);
 	}
+	if (bufferToken)
+	{
+		/* mdlAddress is our partial MDL of a registered buffer */
+		release_registered_buffer(dev, bufferToken, mdlAddress);
+	}
 	remove_lock_release(dev);
 	return complete_irp(irp, status, 0);
 }
@@ -234,8 +372,19 @@ NTSTATUS DDKAPI transfer_complete(DEVICE_OBJECT *device_object, IRP *irp,
 		}
 	}
 
+	TRACE_EVENT(dev, LIBUSB_TRACE_URB_COMPLETE, c->sequence, c->address,
+		c->urb->UrbHeader.Function, transmitted, irp->IoStatus.Status,
+		c->urb->UrbHeader.Status, NULL);
+
+	/* the packet status is also valid if the urb failed */
+	if (c->isoPacketsOffset
+		&& c->urb->UrbHeader.Function == URB_FUNCTION_ISOCH_TRANSFER)
+	{
+		copy_iso_packet_results(c->mdlAddress, c->isoPacketsOffset, c->urb, 0, 0);
+	}
+
 	/* Calculate size remaining */
-	c->totalLength = (transmitted < c->totalLength) ? (c->totalLength - transmitted) : 0;
+	c->totalLength = TRANSFER_REMAINING(c->totalLength, transmitted);
 
 	/* Update transferred size */
 	c->information += transmitted;
@@ -252,21 +401,23 @@ NTSTATUS DDKAPI transfer_complete(DEVICE_OBJECT *device_object, IRP *irp,
 	if(NT_SUCCESS(irp->IoStatus.Status)
 		&& USBD_SUCCESS(c->urb->UrbHeader.Status)
 		&& (c->urb->UrbHeader.Function == URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER)
-		&& !(transmitted % c->maximum_packet_size)
-		&& (transmitted == c->maxTransferSize)
-		&& c->totalLength)
+		&& TRANSFER_NEEDS_NEXT_CHUNK(transmitted, c->totalLength,
+			c->maximum_packet_size, c->maxTransferSize))
 	{
 		PUCHAR virtualAddress;
-		int next_size = (c->totalLength > c->maxTransferSize) ? c->maxTransferSize : c->totalLength;
-
-		/* Check if another transfer is on-going on same endpoint */
-		pending_busy = InterlockedCompareExchange(&dev->pending_busy[c->address], 1, 0);
-		if(pending_busy)
+		int next_size = TRANSFER_CHUNK_SIZE(c->totalLength, c->maxTransferSize);
+		int address = c->address;
+		int sequence = c->sequence;
+
+		/* Check if another transfer is on-going on same endpoint, unless */
+		/* it is this request which is sending the urb that completed */
+		pending_busy = InterlockedCompareExchange(&dev->pending_busy[c->address], c->sequence, 0);
+		if(pending_busy && pending_busy != c->sequence)
 		{
 			USBMSG("sequence %d resend aborted due to pending conflict\n", c->sequence);
 			goto transfer_free;
 		}
-		pending_busy_taken = TRUE;
+		pending_busy_taken = !pending_busy;
 
 		/* Check if a newer sequence is pending */
 		if(InterlockedAdd(&dev->pending_sequence[c->address], 0) != c->sequence)
@@ -286,6 +437,13 @@ NTSTATUS DDKAPI transfer_complete(DEVICE_OBJECT *device_object, IRP *irp,
 		/* Skip used address space */
 		virtualAddress += c->information;
 
+		/* the partial mdl of the previous chunk is not used anymore */
+		if(c->subMdl)
+		{
+			IoFreeMdl(c->subMdl);
+			c->subMdl = NULL;
+		}
+
 		c->subMdl = IoAllocateMdl((PVOID)(virtualAddress),
 			next_size, FALSE, FALSE, NULL);
 		if(c->subMdl == NULL)
@@ -295,19 +453,21 @@ NTSTATUS DDKAPI transfer_complete(DEVICE_OBJECT *device_object, IRP *irp,
 			goto transfer_free;
 		}
 
-		IoBuildPartialMdl(irp->MdlAddress, c->subMdl, (PVOID)virtualAddress, next_size);
+		IoBuildPartialMdl(c->mdlAddress, c->subMdl, (PVOID)virtualAddress, next_size);
 
 		/* Re-use URB for another reception */
 		c->urb->UrbBulkOrInterruptTransfer.TransferBufferLength = next_size;
 		c->urb->UrbBulkOrInterruptTransfer.TransferBufferMDL = c->subMdl;
 
-		status = transfer_next(dev, irp, c);
-		if(!NT_SUCCESS(status))
+		/* The urb might complete during the call, then c is freed already. */
+		/* A failed urb completes through here as well, so do not check the */
+		/* status code */
+		transfer_next(dev, irp, c);
+
+		if(pending_busy_taken)
 		{
-			goto transfer_free;
+			InterlockedCompareExchange(&dev->pending_busy[address], 0, sequence);
 		}
-
-		InterlockedExchange(&dev->pending_busy[c->address], 0);
 		return STATUS_MORE_PROCESSING_REQUIRED;
 	}
 
@@ -318,10 +478,19 @@ transfer_free:
 		InterlockedExchange(&dev->pending_busy[c->address], 0);
 	}
 	irp->IoStatus.Information = c->information;
+	stats_irp_done(dev, c->address, c->start_time, irp->IoStatus.Status,
+		c->urb->UrbHeader.Status, c->requested, c->information);
+	TRACE_EVENT(dev, LIBUSB_TRACE_COMPLETE, c->sequence, c->address,
+		c->urb->UrbHeader.Function, c->information, irp->IoStatus.Status,
+		c->urb->UrbHeader.Status, NULL);
 	if(c->subMdl)
 	{
 		IoFreeMdl(c->subMdl);
 	}
+	if(c->bufferToken)
+	{
+		release_registered_buffer(dev, c->bufferToken, c->mdlAddress);
+	}
 	ExFreePool(c->urb);
 	ExFreePool(c);
 
@@ -330,6 +499,308 @@ transfer_free:
 	return status;
 }
 
+/* gives back the start frames of urbs that are not sent, the last urb */
+/* first so each one ends the chain of the endpoint when it is released */
+static void iso_chain_release_frames(iso_chain_t *chain, int transferFlags)
+{
+	URB *urb;
+	int i;
+
+	if (!(transferFlags & TRANSFER_FLAGS_ISO_SET_START_FRAME))
+		return;
+
+	for (i = chain->count - 1; i >= 0; i--)
+	{
+		urb = chain->urbs[i].urb;
+		if (urb)
+		{
+			release_iso_start_frame(chain->dev, chain->address,
+				urb->UrbIsochronousTransfer.StartFrame,
+				urb->UrbIsochronousTransfer.NumberOfPackets);
+		}
+	}
+}
+
+static void iso_chain_free(iso_chain_t *chain)
+{
+	int i;
+
+	for (i = 0; i < chain->count; i++)
+	{
+		if (chain->urbs[i].irp)
+			IoFreeIrp(chain->urbs[i].irp);
+		if (chain->urbs[i].urb)
+			ExFreePool(chain->urbs[i].urb);
+		if (chain->urbs[i].mdl)
+			IoFreeMdl(chain->urbs[i].mdl);
+	}
+	ExFreePool(chain);
+}
+
+/* the last reference completes the user irp */
+static void iso_chain_release(iso_chain_t *chain)
+{
+	libusb_device_t *dev = chain->dev;
+	IRP *irp = chain->irp;
+	NTSTATUS status;
+	ULONG information;
+
+	if (InterlockedDecrement(&chain->ref_count))
+		return;
+
+	status = chain->status;
+	information = (ULONG)chain->information;
+
+	USBMSG("sequence %d: %d bytes transmitted in %d urbs, status: 0x%x\n",
+		chain->sequence, information, chain->count, status);
+
+	stats_irp_done(dev, chain->address, chain->start_time, status,
+		chain->urb_status, chain->requested, (int)information);
+	TRACE_EVENT(dev, LIBUSB_TRACE_COMPLETE, chain->sequence, chain->address,
+		URB_FUNCTION_ISOCH_TRANSFER, (int)information, status,
+		chain->urb_status, NULL);
+
+	if (chain->bufferToken)
+	{
+		release_registered_buffer(dev, chain->bufferToken, chain->mdlAddress);
+	}
+	iso_chain_free(chain);
+
+	complete_irp(irp, status, information);
+	remove_lock_release(dev);
+}
+
+/* called once per urb and once by the submitting thread */
+static void iso_chain_urb_done(iso_chain_t *chain)
+{
+	if (InterlockedDecrement(&chain->pending))
+		return;
+
+	/* the cancel routine drops its own reference if it already runs */
+	if (IoSetCancelRoutine(chain->irp, NULL))
+	{
+		iso_chain_release(chain);
+	}
+	iso_chain_release(chain);
+}
+
+static VOID DDKAPI iso_chain_cancel(DEVICE_OBJECT *device_object, IRP *irp)
+{
+	iso_chain_t *chain = irp->Tail.Overlay.DriverContext[0];
+	int i;
+
+	UNREFERENCED_PARAMETER(device_object);
+
+	IoReleaseCancelSpinLock(irp->CancelIrql);
+
+	/* the sub irps are only freed with the last reference */
+	for (i = 0; i < chain->count; i++)
+	{
+		IoCancelIrp(chain->urbs[i].irp);
+	}
+
+	iso_chain_release(chain);
+}
+
+static NTSTATUS DDKAPI iso_chain_complete(DEVICE_OBJECT *device_object,
+										  IRP *irp, void *context)
+{
+	iso_chain_urb_t *entry = context;
+	iso_chain_t *chain = entry->chain;
+	NTSTATUS status = irp->IoStatus.Status;
+
+	UNREFERENCED_PARAMETER(device_object);
+
+	TRACE_EVENT(chain->dev, LIBUSB_TRACE_URB_COMPLETE, chain->sequence,
+		chain->address, URB_FUNCTION_ISOCH_TRANSFER,
+		entry->urb->UrbIsochronousTransfer.TransferBufferLength, status,
+		entry->urb->UrbHeader.Status, NULL);
+
+	if (chain->isoPacketsOffset)
+	{
+		copy_iso_packet_results(chain->mdlAddress, chain->isoPacketsOffset,
+			entry->urb, entry->first_packet, entry->offset);
+	}
+
+	if (NT_SUCCESS(status) && USBD_SUCCESS(entry->urb->UrbHeader.Status))
+	{
+		InterlockedExchangeAdd(&chain->information,
+			entry->urb->UrbIsochronousTransfer.TransferBufferLength);
+	}
+	else
+	{
+		USBERR("sequence %d: iso urb failed: status: 0x%x, urb-status: 0x%x\n",
+			chain->sequence, status, entry->urb->UrbHeader.Status);
+
+		if (NT_SUCCESS(status))
+			status = STATUS_UNSUCCESSFUL;
+		if (InterlockedCompareExchange(&chain->status, status, STATUS_SUCCESS) == STATUS_SUCCESS)
+			chain->urb_status = entry->urb->UrbHeader.Status;
+	}
+
+	iso_chain_urb_done(chain);
+
+	/* the irp is ours, it is freed with the chain */
+	return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+static NTSTATUS transfer_iso_chain(libusb_device_t* dev,
+								   IN PIRP irp,
+								   IN int direction,
+								   IN libusb_endpoint_t* endpoint,
+								   IN int packetSize,
+								   IN int transferFlags,
+								   IN int isoLatency,
+								   IN PMDL mdlAddress,
+								   IN int totalLength,
+								   IN unsigned int bufferToken,
+								   IN int isoPacketsOffset,
+								   IN LONG sequenceID)
+{
+	iso_chain_t *chain = NULL;
+	iso_chain_urb_t *entry;
+	IO_STACK_LOCATION *stack_location;
+	NTSTATUS status = STATUS_SUCCESS;
+	PUCHAR virtualAddress;
+	int packets_per_urb, urb_size, offset, count, i;
+	LONG pending_busy_taken = FALSE;
+
+	packets_per_urb = ISO_PACKETS_PER_URB(dev);
+	urb_size = packets_per_urb * packetSize;
+	count = (totalLength / packetSize + packets_per_urb - 1) / packets_per_urb;
+
+	if (InterlockedCompareExchange(&dev->pending_busy[endpoint->address], sequenceID, 0))
+	{
+		USBMSG("sequence %d send aborted due to pending conflict\n", sequenceID);
+		goto transfer_free;
+	}
+	pending_busy_taken = TRUE;
+
+	InterlockedExchange(&dev->pending_sequence[endpoint->address], sequenceID);
+
+	chain = allocate_pool(sizeof(iso_chain_t) + sizeof(iso_chain_urb_t) * (count - 1));
+	if (!chain)
+	{
+		USBERR0("memory allocation error\n");
+		status = STATUS_NO_MEMORY;
+		goto transfer_free;
+	}
+	memset(chain, 0, sizeof(iso_chain_t) + sizeof(iso_chain_urb_t) * (count - 1));
+
+	chain->dev = dev;
+	chain->irp = irp;
+	chain->sequence = sequenceID;
+	chain->pending = count + 1;
+	chain->ref_count = 2;
+	chain->status = STATUS_SUCCESS;
+	chain->mdlAddress = mdlAddress;
+	chain->bufferToken = bufferToken;
+	chain->isoPacketsOffset = isoPacketsOffset;
+	chain->count = count;
+	chain->address = endpoint->address;
+	chain->requested = totalLength;
+
+	virtualAddress = (PUCHAR)MmGetMdlVirtualAddress(mdlAddress);
+
+	USBMSG("[#%d] splitting %d packets into %d urbs\n",
+		sequenceID, totalLength / packetSize, count);
+
+	for (i = 0, offset = 0; i < count; i++, offset += urb_size)
+	{
+		int size = (totalLength - offset > urb_size) ? urb_size : totalLength - offset;
+
+		entry = &chain->urbs[i];
+		entry->chain = chain;
+		entry->offset = offset;
+		entry->first_packet = i * packets_per_urb;
+
+		entry->mdl = IoAllocateMdl(virtualAddress + offset, size, FALSE, FALSE, NULL);
+		entry->irp = IoAllocateIrp(dev->target_device->StackSize, FALSE);
+		if (!entry->mdl || !entry->irp)
+		{
+			USBERR0("memory allocation error\n");
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			goto transfer_free;
+		}
+		IoBuildPartialMdl(mdlAddress, entry->mdl, virtualAddress + offset, size);
+
+		status = create_urb(dev, &entry->urb, direction, URB_FUNCTION_ISOCH_TRANSFER,
+			endpoint, packetSize, entry->mdl, size);
+		if (!NT_SUCCESS(status))
+		{
+			goto transfer_free;
+		}
+
+		/* start frames of consecutive urbs are chained by the frame clock. */
+		/* the user irp is only used to query the frame, it is not sent down. */
+		set_urb_transfer_flags(dev, irp, entry->urb, endpoint->address,
+			transferFlags, isoLatency);
+
+		stack_location = IoGetNextIrpStackLocation(entry->irp);
+		stack_location->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+		stack_location->Parameters.Others.Argument1 = entry->urb;
+		stack_location->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+
+		IoSetCompletionRoutine(entry->irp, iso_chain_complete, entry, TRUE, TRUE, TRUE);
+	}
+
+	IoMarkIrpPending(irp);
+	irp->Tail.Overlay.DriverContext[0] = chain;
+
+	IoSetCancelRoutine(irp, iso_chain_cancel);
+	if (irp->Cancel && IoSetCancelRoutine(irp, NULL))
+	{
+		/* cancelled before anything was sent */
+		InterlockedCompareExchange(&dev->pending_busy[endpoint->address], 0, sequenceID);
+		if (bufferToken)
+		{
+			release_registered_buffer(dev, bufferToken, mdlAddress);
+		}
+		iso_chain_release_frames(chain, transferFlags);
+		iso_chain_free(chain);
+		complete_irp(irp, STATUS_CANCELLED, 0);
+		remove_lock_release(dev);
+		return STATUS_PENDING;
+	}
+
+	chain->start_time = stats_irp_start(dev, endpoint->address);
+	TRACE_EVENT(dev, LIBUSB_TRACE_SUBMIT, sequenceID, endpoint->address,
+		URB_FUNCTION_ISOCH_TRANSFER, totalLength, STATUS_SUCCESS,
+		USBD_STATUS_SUCCESS, NULL);
+
+	for (i = 0; i < count; i++)
+	{
+		stats_urb_start(dev, endpoint->address);
+		TRACE_EVENT(dev, LIBUSB_TRACE_URB_SUBMIT, sequenceID, endpoint->address,
+			URB_FUNCTION_ISOCH_TRANSFER,
+			chain->urbs[i].urb->UrbIsochronousTransfer.TransferBufferLength,
+			STATUS_SUCCESS, USBD_STATUS_SUCCESS, NULL);
+		IoCallDriver(dev->target_device, chain->urbs[i].irp);
+	}
+
+	InterlockedCompareExchange(&dev->pending_busy[endpoint->address], 0, sequenceID);
+
+	iso_chain_urb_done(chain);
+	return STATUS_PENDING;
+
+transfer_free:
+	if (pending_busy_taken)
+	{
+		InterlockedCompareExchange(&dev->pending_busy[endpoint->address], 0, sequenceID);
+	}
+	if (chain)
+	{
+		iso_chain_release_frames(chain, transferFlags);
+		iso_chain_free(chain);
+	}
+	if (bufferToken)
+	{
+		release_registered_buffer(dev, bufferToken, mdlAddress);
+	}
+	remove_lock_release(dev);
+	return complete_irp(irp, status, 0);
+}
+
 static NTSTATUS create_urb(libusb_device_t *dev, URB **urb, int direction,
 						   int urbFunction, libusb_endpoint_t* endpoint, int packetSize,
 						   MDL *buffer, int size)
@@ -416,6 +887,32 @@ static NTSTATUS create_urb(libusb_device_t *dev, URB **urb, int direction,
 	return STATUS_SUCCESS;
 }
 
+static void copy_iso_packet_results(PMDL mdl, int results_offset, URB *urb,
+									int first_packet, int data_offset)
+{
+	libusb_iso_packet_t *packets;
+	UCHAR *buffer;
+	ULONG i;
+
+	buffer = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
+	if (!buffer)
+	{
+		USBERR0("MmGetSystemAddressForMdlSafe failed\n");
+		return;
+	}
+
+	packets = (libusb_iso_packet_t *)(buffer + results_offset) + first_packet;
+
+	/* the stack does not update the length of OUT packets, */
+	/* it stays at the length that was sent */
+	for (i = 0; i < urb->UrbIsochronousTransfer.NumberOfPackets; i++)
+	{
+		packets[i].offset = data_offset + urb->UrbIsochronousTransfer.IsoPacket[i].Offset;
+		packets[i].length = urb->UrbIsochronousTransfer.IsoPacket[i].Length;
+		packets[i].status = urb->UrbIsochronousTransfer.IsoPacket[i].Status;
+	}
+}
+
 static const char* GetPipeDisplayName(libusb_endpoint_t* endpoint)
 {
 	if (endpoint->address & 0x80)
@@ -424,7 +921,7 @@ static const char* GetPipeDisplayName(libusb_endpoint_t* endpoint)
 		return write_pipe_display_names[(endpoint->pipe_type & 3)];
 }
 
-void set_urb_transfer_flags(libusb_device_t* dev, PIRP irp, PURB subUrb,int transfer_flags, int isoLatency)
+void set_urb_transfer_flags(libusb_device_t* dev, PIRP irp, PURB subUrb, int address, int transfer_flags, int isoLatency)
 {
 	if (subUrb->UrbHeader.Function == URB_FUNCTION_ISOCH_TRANSFER)
 	{
@@ -439,9 +936,11 @@ void set_urb_transfer_flags(libusb_device_t* dev, PIRP irp, PURB subUrb,int tran
 			subUrb->UrbIsochronousTransfer.TransferFlags |= USBD_START_ISO_TRANSFER_ASAP;
 		else
 		{
-			subUrb->UrbIsochronousTransfer.StartFrame = get_current_frame(dev, irp);
-			if (transfer_flags & TRANSFER_FLAGS_ISO_ADD_LATENCY)
-				subUrb->UrbIsochronousTransfer.StartFrame += isoLatency;
+			// consecutive urbs on the endpoint are scheduled back-to-back,
+			// the latency only applies when the stream (re)starts.
+			subUrb->UrbIsochronousTransfer.StartFrame = get_iso_start_frame(dev, irp, address,
+				subUrb->UrbIsochronousTransfer.NumberOfPackets,
+				(transfer_flags & TRANSFER_FLAGS_ISO_ADD_LATENCY) ? isoLatency : 0);
 		}
 	}
 
@@ -483,6 +982,7 @@ NTSTATUS control_transfer(libusb_device_t* dev,
 {
     NTSTATUS status = STATUS_SUCCESS;
     URB urb;
+    LONG sequenceID = dev->trace.enabled ? InterlockedIncrement(&sequence) : 0;
 
     UNREFERENCED_PARAMETER(irp);
 
@@ -512,9 +1012,19 @@ NTSTATUS control_transfer(libusb_device_t* dev,
 		(usbd_direction==USBD_TRANSFER_DIRECTION_IN) ? "read" : "write",
 		timeout, request_type, request, value, index, length);
 
+    TRACE_EVENT(dev, LIBUSB_TRACE_SUBMIT, sequenceID, 0,
+        URB_FUNCTION_CONTROL_TRANSFER, size, STATUS_SUCCESS,
+        USBD_STATUS_SUCCESS, urb.UrbControlTransfer.SetupPacket);
+
 	// no maximum timeout check for control request.
     status = call_usbd_ex(dev, &urb, IOCTL_INTERNAL_USB_SUBMIT_URB, timeout, 0);
 
+    TRACE_EVENT(dev, LIBUSB_TRACE_COMPLETE, sequenceID, 0,
+        URB_FUNCTION_CONTROL_TRANSFER,
+        (NT_SUCCESS(status) && USBD_SUCCESS(urb.UrbHeader.Status))
+            ? urb.UrbControlTransfer.TransferBufferLength : 0,
+        status, urb.UrbHeader.Status, urb.UrbControlTransfer.SetupPacket);
+
     if (!NT_SUCCESS(status) || !USBD_SUCCESS(urb.UrbHeader.Status))
     {
         USBERR("request failed: status: 0x%x, urb-status: 0x%x\n", status, urb.UrbHeader.Status);
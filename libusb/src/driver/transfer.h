@@ -0,0 +1,42 @@
+/* libusb-win32, Generic Windows USB Library
+ * Copyright (c) 2002-2005 Stephan Meyer <ste_meyer@web.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef __LIBUSB_TRANSFER_H__
+#define __LIBUSB_TRANSFER_H__
+
+/* Chunking rules of transfer.c. They only use plain integers so they */
+/* can be built and checked outside the kernel. */
+
+/* size of the next urb of a bulk or interrupt transfer */
+#define TRANSFER_CHUNK_SIZE(remaining, max_transfer_size) \
+	(((remaining) > (max_transfer_size)) ? (max_transfer_size) : (remaining))
+
+/* bytes left after an urb transmitted 'transmitted' of 'remaining' */
+#define TRANSFER_REMAINING(remaining, transmitted) \
+	(((transmitted) < (remaining)) ? ((remaining) - (transmitted)) : 0)
+
+/* another urb follows only a full chunk of full packets, see the ZLP */
+/* note in transfer_complete() */
+#define TRANSFER_NEEDS_NEXT_CHUNK(transmitted, remaining, \
+								  max_packet_size, max_transfer_size) \
+	(!((transmitted) % (max_packet_size)) \
+	 && ((transmitted) == (max_transfer_size)) \
+	 && (remaining))
+
+#endif
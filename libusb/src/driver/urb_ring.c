@@ -0,0 +1,591 @@
+/* libusb-win32, Generic Windows USB Library
+ * Copyright (c) 2002-2005 Stephan Meyer <ste_meyer@web.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "libusb_driver.h"
+
+/* URB rings.
+ *
+ * A urb ring keeps a fixed number of urbs with preallocated buffers posted
+ * on an IN pipe. Each urb is re-posted from its completion routine after
+ * its data has been queued in a bounded ring, reads are satisfied from the
+ * ring or wait in a cancel-safe queue until data arrives. When an urb
+ * fails polling is halted and the next read re-arms it.
+ *
+ * How urbs are built and how data moves in and out of the ring is up to
+ * the user of the ring, see read_ahead.c and iso_stream.c.
+ */
+
+/* interval used to re-cancel urbs while waiting for a pipe to go idle */
+#define URB_RING_STOP_POLL_MS 50
+
+static NTSTATUS DDKAPI urb_ring_complete(DEVICE_OBJECT *device_object,
+										 IRP *irp, void *context);
+static VOID DDKAPI urb_ring_cancel(DEVICE_OBJECT *device_object, IRP *irp);
+
+static void urb_ring_arm(libusb_device_t *dev, libusb_urb_ring_t *ring);
+static void urb_ring_post(libusb_device_t *dev, libusb_urb_ring_urb_t *entry);
+static void urb_ring_free(libusb_urb_ring_t *ring);
+static void urb_ring_release(libusb_urb_ring_t *ring);
+static void take_waiting_irps(libusb_urb_ring_t *ring, LIST_ENTRY *irps,
+							  bool_t only_satisfiable);
+static void complete_irp_list(libusb_device_t *dev, LIST_ENTRY *irps,
+							  NTSTATUS status);
+
+void urb_ring_initialize(libusb_urb_ring_t *rings, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		memset(&rings[i], 0, sizeof(rings[i]));
+		KeInitializeSpinLock(&rings[i].lock);
+		InitializeListHead(&rings[i].waiting_irps);
+		KeInitializeEvent(&rings[i].idle, NotificationEvent, TRUE);
+	}
+}
+
+libusb_urb_ring_t *urb_ring_find(libusb_urb_ring_t *rings, int count,
+								 int endpoint)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (rings[i].address == endpoint)
+			return &rings[i];
+	}
+
+	return NULL;
+}
+
+libusb_urb_ring_t *urb_ring_claim(libusb_urb_ring_t *rings, int count,
+								  int endpoint)
+{
+	libusb_urb_ring_t *ring = NULL;
+	KIRQL irql;
+	int i;
+
+	for (i = 0; i < count && !ring; i++)
+	{
+		KeAcquireSpinLock(&rings[i].lock, &irql);
+		if (!rings[i].address)
+		{
+			ring = &rings[i];
+			ring->address = endpoint;
+			ring->stopping = TRUE;
+		}
+		KeReleaseSpinLock(&rings[i].lock, irql);
+	}
+
+	return ring;
+}
+
+NTSTATUS urb_ring_start(libusb_device_t *dev, libusb_urb_ring_t *ring,
+						int urb_size)
+{
+	libusb_urb_ring_urb_t *entry;
+	int buffer_size = ring->packets_per_urb * ring->packet_size;
+	SIZE_T size;
+	KIRQL irql;
+	int i;
+
+	ring->ring_head = 0;
+	ring->ring_used = 0;
+	ring->overruns = 0;
+	ring->truncated = 0;
+	ring->halted = FALSE;
+
+	/* urb entries and ring slots share one allocation */
+	size = ring->urb_count * sizeof(libusb_urb_ring_urb_t)
+		+ ring->ring_count * sizeof(libusb_urb_ring_slot_t);
+
+	ring->urbs = allocate_pool(size);
+	if (!ring->urbs)
+	{
+		USBERR0("memory allocation error\n");
+		goto start_failed;
+	}
+	memset(ring->urbs, 0, size);
+
+	ring->ring_slots = (libusb_urb_ring_slot_t *)(ring->urbs + ring->urb_count);
+
+	ring->ring_data = allocate_pool((SIZE_T)ring->ring_count * ring->packet_size);
+	if (!ring->ring_data)
+	{
+		USBERR0("memory allocation error\n");
+		goto start_failed;
+	}
+
+	for (i = 0; i < ring->urb_count; i++)
+	{
+		entry = &ring->urbs[i];
+		entry->dev = dev;
+		entry->ring = ring;
+		entry->urb_size = urb_size;
+
+		entry->irp = IoAllocateIrp(dev->target_device->StackSize, FALSE);
+		entry->urb = allocate_pool(urb_size);
+		entry->buffer = allocate_pool(buffer_size);
+		if (!entry->irp || !entry->urb || !entry->buffer)
+		{
+			USBERR0("memory allocation error\n");
+			goto start_failed;
+		}
+
+		entry->mdl = IoAllocateMdl(entry->buffer, buffer_size, FALSE, FALSE, NULL);
+		if (!entry->mdl)
+		{
+			USBERR0("memory allocation error\n");
+			goto start_failed;
+		}
+		MmBuildMdlForNonPagedPool(entry->mdl);
+	}
+
+	KeAcquireSpinLock(&ring->lock, &irql);
+	ring->stopping = FALSE;
+	KeReleaseSpinLock(&ring->lock, irql);
+
+	urb_ring_arm(dev, ring);
+
+	return STATUS_SUCCESS;
+
+start_failed:
+	urb_ring_free(ring);
+	urb_ring_release(ring);
+
+	return STATUS_INSUFFICIENT_RESOURCES;
+}
+
+NTSTATUS urb_ring_stop(libusb_device_t *dev, libusb_urb_ring_t *ring,
+					   int endpoint)
+{
+	LIST_ENTRY irps;
+	LARGE_INTEGER timeout;
+	KIRQL irql;
+	int i;
+
+	if (!ring)
+		return STATUS_SUCCESS;
+
+	KeAcquireSpinLock(&ring->lock, &irql);
+	if (ring->address != endpoint || ring->stopping)
+	{
+		KeReleaseSpinLock(&ring->lock, irql);
+		return STATUS_SUCCESS;
+	}
+	ring->stopping = TRUE;
+	KeReleaseSpinLock(&ring->lock, irql);
+
+	/* an urb can be between completion and re-post when it is cancelled. */
+	/* IoReuseIrp() clears the cancel flag, so keep cancelling until idle */
+	timeout.QuadPart = -(URB_RING_STOP_POLL_MS * 10000);
+	do
+	{
+		for (i = 0; i < ring->urb_count; i++)
+		{
+			if (ring->urbs[i].posted)
+				IoCancelIrp(ring->urbs[i].irp);
+		}
+	} while (KeWaitForSingleObject(&ring->idle, Executive, KernelMode,
+		FALSE, &timeout) == STATUS_TIMEOUT);
+
+	/* hand out what is left in the ring, then cancel the remaining reads */
+	InitializeListHead(&irps);
+
+	KeAcquireSpinLock(&ring->lock, &irql);
+	take_waiting_irps(ring, &irps, TRUE);
+	KeReleaseSpinLock(&ring->lock, irql);
+
+	complete_irp_list(dev, &irps, STATUS_SUCCESS);
+
+	KeAcquireSpinLock(&ring->lock, &irql);
+	take_waiting_irps(ring, &irps, FALSE);
+	KeReleaseSpinLock(&ring->lock, irql);
+
+	complete_irp_list(dev, &irps, STATUS_CANCELLED);
+
+	USBMSG("EP%02Xh stopped, %d dropped, %d truncated\n", endpoint,
+		ring->overruns, ring->truncated);
+
+	urb_ring_free(ring);
+	urb_ring_release(ring);
+
+	return STATUS_SUCCESS;
+}
+
+void urb_ring_stop_all(libusb_device_t *dev, libusb_urb_ring_t *rings,
+					   int count, FILE_OBJECT *file_object)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (rings[i].address
+			&& (!file_object || rings[i].file_object == file_object))
+		{
+			urb_ring_stop(dev, &rings[i], rings[i].address);
+		}
+	}
+}
+
+void urb_ring_stop_interface(libusb_device_t *dev, libusb_urb_ring_t *rings,
+							 int count, int interface_number)
+{
+	libusb_interface_t *interface;
+	int i, address;
+
+	if (interface_number < 0
+		|| interface_number >= LIBUSB_MAX_NUMBER_OF_INTERFACES)
+		return;
+
+	interface = &dev->config.interfaces[interface_number];
+	if (!interface->valid)
+		return;
+
+	for (i = 0; i < LIBUSB_MAX_NUMBER_OF_ENDPOINTS; i++)
+	{
+		address = interface->endpoints[i].address;
+		if (address)
+			urb_ring_stop(dev, urb_ring_find(rings, count, address), address);
+	}
+}
+
+void urb_ring_abort(libusb_device_t *dev, libusb_urb_ring_t *ring,
+					int endpoint)
+{
+	LIST_ENTRY irps;
+	KIRQL irql;
+
+	if (!ring)
+		return;
+
+	InitializeListHead(&irps);
+
+	KeAcquireSpinLock(&ring->lock, &irql);
+	if (ring->address == endpoint)
+	{
+		take_waiting_irps(ring, &irps, FALSE);
+	}
+	KeReleaseSpinLock(&ring->lock, irql);
+
+	complete_irp_list(dev, &irps, STATUS_CANCELLED);
+}
+
+NTSTATUS urb_ring_read(libusb_device_t *dev, libusb_urb_ring_t *ring,
+					   IRP *irp, KIRQL irql)
+{
+	NTSTATUS status;
+	bool_t halted = ring->halted;
+
+	/* data is already waiting, complete right away */
+	if (ring->ring_used && IsListEmpty(&ring->waiting_irps))
+	{
+		status = ring->ops->pop(ring, irp);
+		KeReleaseSpinLock(&ring->lock, irql);
+
+		status = complete_irp(irp, status, (ULONG)irp->IoStatus.Information);
+		remove_lock_release(dev);
+
+		if (halted)
+			urb_ring_arm(dev, ring);
+
+		return status;
+	}
+
+	IoMarkIrpPending(irp);
+	irp->Tail.Overlay.DriverContext[0] = ring;
+
+	IoSetCancelRoutine(irp, urb_ring_cancel);
+	if (irp->Cancel && IoSetCancelRoutine(irp, NULL))
+	{
+		KeReleaseSpinLock(&ring->lock, irql);
+
+		complete_irp(irp, STATUS_CANCELLED, 0);
+		remove_lock_release(dev);
+
+		return STATUS_PENDING;
+	}
+
+	InsertTailList(&ring->waiting_irps, &irp->Tail.Overlay.ListEntry);
+	KeReleaseSpinLock(&ring->lock, irql);
+
+	if (halted)
+		urb_ring_arm(dev, ring);
+
+	return STATUS_PENDING;
+}
+
+void urb_ring_push(libusb_urb_ring_t *ring, const UCHAR *data, ULONG length,
+				   USBD_STATUS status)
+{
+	int tail;
+
+	if (ring->ring_used == ring->ring_count)
+	{
+		/* drop the oldest slot */
+		urb_ring_advance(ring);
+		ring->overruns++;
+	}
+
+	tail = (ring->ring_head + ring->ring_used) % ring->ring_count;
+
+	ring->ring_slots[tail].length = length;
+	ring->ring_slots[tail].status = status;
+	RtlCopyMemory(ring->ring_data + tail * ring->packet_size, data, length);
+	ring->ring_used++;
+}
+
+void urb_ring_advance(libusb_urb_ring_t *ring)
+{
+	ring->ring_head = (ring->ring_head + 1) % ring->ring_count;
+	ring->ring_used--;
+}
+
+static void urb_ring_arm(libusb_device_t *dev, libusb_urb_ring_t *ring)
+{
+	libusb_urb_ring_urb_t *entry;
+	KIRQL irql;
+	int i;
+
+	for (i = 0; i < ring->urb_count; i++)
+	{
+		entry = &ring->urbs[i];
+
+		KeAcquireSpinLock(&ring->lock, &irql);
+		if (ring->stopping || entry->posted)
+		{
+			KeReleaseSpinLock(&ring->lock, irql);
+			continue;
+		}
+
+		/* every posted urb holds the remove lock until it is not re-posted */
+		if (!NT_SUCCESS(remove_lock_acquire(dev)))
+		{
+			KeReleaseSpinLock(&ring->lock, irql);
+			break;
+		}
+
+		entry->posted = TRUE;
+		ring->posted++;
+		ring->halted = FALSE;
+		KeClearEvent(&ring->idle);
+		KeReleaseSpinLock(&ring->lock, irql);
+
+		urb_ring_post(dev, entry);
+	}
+}
+
+static void urb_ring_post(libusb_device_t *dev, libusb_urb_ring_urb_t *entry)
+{
+	IO_STACK_LOCATION *stack_location;
+	IRP *irp = entry->irp;
+
+	IoReuseIrp(irp, STATUS_SUCCESS);
+
+	memset(entry->urb, 0, entry->urb_size);
+	entry->urb->UrbHeader.Length = (USHORT)entry->urb_size;
+	entry->ring->ops->build_urb(entry);
+
+	stack_location = IoGetNextIrpStackLocation(irp);
+	stack_location->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+	stack_location->Parameters.Others.Argument1 = entry->urb;
+	stack_location->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+
+	IoSetCompletionRoutine(irp, urb_ring_complete, entry, TRUE, TRUE, TRUE);
+
+	IoCallDriver(dev->target_device, irp);
+}
+
+static NTSTATUS DDKAPI urb_ring_complete(DEVICE_OBJECT *device_object,
+										 IRP *irp, void *context)
+{
+	libusb_urb_ring_urb_t *entry = (libusb_urb_ring_urb_t *)context;
+	libusb_urb_ring_t *ring = entry->ring;
+	libusb_device_t *dev = entry->dev;
+	LIST_ENTRY irps, failed_irps;
+	NTSTATUS halt_status = STATUS_SUCCESS;
+	bool_t repost = FALSE;
+	KIRQL irql;
+
+	UNREFERENCED_PARAMETER(device_object);
+
+	InitializeListHead(&irps);
+	InitializeListHead(&failed_irps);
+
+	KeAcquireSpinLock(&ring->lock, &irql);
+
+	if (ring->ops->push(entry, irp->IoStatus.Status))
+	{
+		repost = !ring->stopping;
+	}
+	else if (!ring->stopping)
+	{
+		USBWRN("EP%02Xh polling halted: status: 0x%x, urb-status: 0x%x\n",
+			ring->address, irp->IoStatus.Status, entry->urb->UrbHeader.Status);
+		ring->halted = TRUE;
+		halt_status = NT_SUCCESS(irp->IoStatus.Status) ?
+			STATUS_UNSUCCESSFUL : irp->IoStatus.Status;
+	}
+
+	take_waiting_irps(ring, &irps, TRUE);
+
+	if (!repost)
+	{
+		entry->posted = FALSE;
+		if (--ring->posted == 0)
+		{
+			KeSetEvent(&ring->idle, IO_NO_INCREMENT, FALSE);
+
+			/* nothing polls the pipe anymore, fail the reads still */
+			/* waiting the way a normal transfer would have failed */
+			if (ring->halted && halt_status != STATUS_SUCCESS)
+				take_waiting_irps(ring, &failed_irps, FALSE);
+		}
+	}
+
+	KeReleaseSpinLock(&ring->lock, irql);
+
+	complete_irp_list(dev, &irps, STATUS_SUCCESS);
+	complete_irp_list(dev, &failed_irps, halt_status);
+
+	if (repost)
+	{
+		urb_ring_post(dev, entry);
+	}
+	else
+	{
+		remove_lock_release(dev);
+	}
+
+	/* the irp belongs to us, it is re-used until the ring stops */
+	return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+static VOID DDKAPI urb_ring_cancel(DEVICE_OBJECT *device_object, IRP *irp)
+{
+	libusb_device_t *dev = device_object->DeviceExtension;
+	libusb_urb_ring_t *ring = irp->Tail.Overlay.DriverContext[0];
+	KIRQL irql;
+
+	IoReleaseCancelSpinLock(irp->CancelIrql);
+
+	KeAcquireSpinLock(&ring->lock, &irql);
+	RemoveEntryList(&irp->Tail.Overlay.ListEntry);
+	KeReleaseSpinLock(&ring->lock, irql);
+
+	complete_irp(irp, STATUS_CANCELLED, 0);
+	remove_lock_release(dev);
+}
+
+static void urb_ring_free(libusb_urb_ring_t *ring)
+{
+	libusb_urb_ring_urb_t *entry;
+	int i;
+
+	if (ring->urbs)
+	{
+		for (i = 0; i < ring->urb_count; i++)
+		{
+			entry = &ring->urbs[i];
+
+			if (entry->irp)
+				IoFreeIrp(entry->irp);
+			if (entry->mdl)
+				IoFreeMdl(entry->mdl);
+			if (entry->urb)
+				ExFreePool(entry->urb);
+			if (entry->buffer)
+				ExFreePool(entry->buffer);
+		}
+		ExFreePool(ring->urbs);
+	}
+
+	if (ring->ring_data)
+		ExFreePool(ring->ring_data);
+
+	ring->urbs = NULL;
+	ring->urb_count = 0;
+	ring->ring_slots = NULL;
+	ring->ring_data = NULL;
+	ring->ring_used = 0;
+}
+
+/* frees the slot for urb_ring_claim() */
+static void urb_ring_release(libusb_urb_ring_t *ring)
+{
+	KIRQL irql;
+
+	KeAcquireSpinLock(&ring->lock, &irql);
+	ring->address = 0;
+	ring->stopping = FALSE;
+	KeReleaseSpinLock(&ring->lock, irql);
+}
+
+/* must be called with the ring lock held. moves waiting irps to irps */
+/* and, if only_satisfiable is set, fills them from the ring on the way */
+static void take_waiting_irps(libusb_urb_ring_t *ring, LIST_ENTRY *irps,
+							  bool_t only_satisfiable)
+{
+	LIST_ENTRY *list_entry;
+	IRP *irp;
+
+	while (!IsListEmpty(&ring->waiting_irps))
+	{
+		if (only_satisfiable && !ring->ring_used)
+			break;
+
+		list_entry = RemoveHeadList(&ring->waiting_irps);
+		irp = CONTAINING_RECORD(list_entry, IRP, Tail.Overlay.ListEntry);
+
+		if (!IoSetCancelRoutine(irp, NULL))
+		{
+			/* the cancel routine owns this irp. keep its RemoveEntryList() */
+			/* harmless and let it complete the irp */
+			InitializeListHead(&irp->Tail.Overlay.ListEntry);
+			continue;
+		}
+
+		if (only_satisfiable)
+			irp->IoStatus.Status = ring->ops->pop(ring, irp);
+		else
+			irp->IoStatus.Information = 0;
+
+		InsertTailList(irps, &irp->Tail.Overlay.ListEntry);
+	}
+}
+
+/* completes irps taken by take_waiting_irps(). status is used for irps */
+/* that have not been filled from the ring */
+static void complete_irp_list(libusb_device_t *dev, LIST_ENTRY *irps,
+							  NTSTATUS status)
+{
+	LIST_ENTRY *list_entry;
+	IRP *irp;
+
+	while (!IsListEmpty(irps))
+	{
+		list_entry = RemoveHeadList(irps);
+		irp = CONTAINING_RECORD(list_entry, IRP, Tail.Overlay.ListEntry);
+
+		complete_irp(irp,
+			(status == STATUS_SUCCESS) ? irp->IoStatus.Status : status,
+			(ULONG)irp->IoStatus.Information);
+		remove_lock_release(dev);
+	}
+}
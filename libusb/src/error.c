@@ -31,7 +31,12 @@
 #if IS_DRIVER
 	#include <ntddk.h>
 #else
-	#include <windows.h>
+	#include <stdlib.h>
+	#include "usbi_os.h"
+#endif
+
+#if !IS_DRIVER && defined(_WIN32)
+	#include "thread_buffer.h"
 #endif
 
 #define USB_ERROR_BEGIN			500000
@@ -51,6 +56,7 @@ void usb_dbg_v	(const char* function, const char* format, va_list args);
 void usb_log_v	(enum USB_LOG_LEVEL level, const char* function, const char* format, va_list args);
 void _usb_log	(enum USB_LOG_LEVEL level, const char* app_name, const char* function, const char* format, ...);
 void _usb_log_v	(enum USB_LOG_LEVEL level, const char* app_name, const char* function, const char* format, va_list args);
+static void usb_log_format(enum USB_LOG_LEVEL level, const char* app_name, const char* function, const char* format, va_list args);
 
 static int usb_log_def_handler(enum USB_LOG_LEVEL level, 
 								const char* app_name, 
@@ -81,7 +87,16 @@ static const char *skipped_function_prefix_list[] =
 	NULL
 };
 
-int usb_error_errno = 0;
+#if IS_DRIVER
+	#define USB_THREAD_LOCAL
+#elif defined(_MSC_VER)
+	#define USB_THREAD_LOCAL __declspec(thread)
+#else
+	#define USB_THREAD_LOCAL __thread
+#endif
+
+// every thread sees its own last error, see usb_strerror_r()
+USB_THREAD_LOCAL int usb_error_errno = 0;
 log_hander_t user_log_hander = NULL;
 
 #if (defined(_DEBUG) || defined(DEBUG) || defined(DBG))
@@ -90,13 +105,13 @@ int __usb_log_level = LOG_LEVEL_MAX;
 int __usb_log_level = LOG_OFF;
 #endif
 
-usb_error_type_t usb_error_type = USB_ERROR_TYPE_NONE;
+USB_THREAD_LOCAL usb_error_type_t usb_error_type = USB_ERROR_TYPE_NONE;
 
 const char** skipped_function_prefix = skipped_function_prefix_list;
 
 #if !IS_DRIVER
 
-char usb_error_str[LOGBUF_SIZE] = "";
+USB_THREAD_LOCAL char usb_error_str[LOGBUF_SIZE] = "";
 
 char *usb_strerror(void)
 {
@@ -117,10 +132,31 @@ char *usb_strerror(void)
     return "Unknown error";
 }
 
+int usb_strerror_r(char *buffer, int size)
+{
+    const char *message;
+    int length;
+
+    if (!buffer || size <= 0)
+        return -EINVAL;
+
+    message = usb_strerror();
+    length = (int)strlen(message);
+    if (length > size - 1)
+        length = size - 1;
+
+    memcpy(buffer, message, length);
+    buffer[length] = '\0';
+
+    return length;
+}
+
+#ifdef _WIN32
+
 /* returns Windows' last error in a human readable form */
 const char *usb_win_error_to_string(void)
 {
-    static char tmp[LOGBUF_SIZE];
+    static USB_THREAD_LOCAL char tmp[LOGBUF_SIZE];
 
     FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(),
                   LANG_USER_DEFAULT, tmp, sizeof(tmp) - 1, NULL);
@@ -147,8 +183,549 @@ int usb_win_error_to_errno(void)
     }
 }
 
+#endif /* _WIN32 */
+
 #endif
 
+#if !IS_DRIVER && defined(_WIN32)
+
+/* Deferred formatting of log messages.
+ *
+ * While enabled, warnings, infos and debug messages are not formatted by
+ * the calling thread. The format pointer and a copy of the arguments (the
+ * contents of %s arguments included) are stored in a per-thread ring, see
+ * thread_buffer.h, and a background thread formats and outputs them. When a ring is full the message is dropped and counted.
+ *
+ * The format and function strings are only referenced, all log macros pass
+ * literals. Formats that can not be copied safely (%n, '*' widths, wide
+ * strings, too many arguments) and all errors, which usb_strerror() must
+ * see before the call returns, are formatted synchronously.
+ */
+
+#define LOG_ASYNC_RECORDS       256     /* per thread, power of 2 */
+#define LOG_ASYNC_MAX_ARGS      12
+#define LOG_ASYNC_STRING_SIZE   128
+#define LOG_ASYNC_INTERVAL      20      /* ms */
+#define LOG_ASYNC_MAX_SPEC      32
+
+enum LOG_ARG_TYPE
+{
+    LOG_ARG_NONE,
+    LOG_ARG_INT,
+    LOG_ARG_INT64,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_POINTER,
+    LOG_ARG_STRING,
+};
+
+typedef union
+{
+    int i;
+    __int64 i64;
+    double d;
+    const void *p;
+} log_arg_t;
+
+typedef struct
+{
+    enum USB_LOG_LEVEL level;
+    const char *app_name;
+    const char *function;
+    const char *format;
+    int arg_count;
+    log_arg_t args[LOG_ASYNC_MAX_ARGS];
+    char strings[LOG_ASYNC_STRING_SIZE];
+} log_record_t;
+
+typedef struct
+{
+    usbi_thread_buffer_t header;    /* head and tail count records */
+    log_record_t records[LOG_ASYNC_RECORDS];
+} log_buffer_t;
+
+static volatile LONG log_async_enabled = 0;
+/* the lock also protects the log thread */
+static usbi_thread_buffers_t log_async_buffers = { TLS_OUT_OF_INDEXES };
+static HANDLE log_async_thread = NULL;
+static HANDLE log_async_stop_event = NULL;
+
+/* parses the conversion after a '%', returns its length or -1 if it */
+/* can not be deferred */
+static int log_parse_spec(const char *spec, enum LOG_ARG_TYPE *type)
+{
+    const char *p = spec;
+    int is_64 = FALSE;
+    int is_wide = FALSE;
+
+    while (*p && strchr("-+ #0", *p))
+        p++;
+    if (*p == '*')
+        return -1;
+    while (*p >= '0' && *p <= '9')
+        p++;
+    if (*p == '.')
+    {
+        p++;
+        if (*p == '*')
+            return -1;
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+
+    switch (*p)
+    {
+    case 'h':
+        p++;
+        if (*p == 'h')
+            p++;
+        break;
+    case 'l':
+        p++;
+        if (*p == 'l')
+        {
+            p++;
+            is_64 = TRUE;
+        }
+        else
+        {
+            is_wide = TRUE;
+        }
+        break;
+    case 'w':
+        p++;
+        is_wide = TRUE;
+        break;
+    case 'L':
+        p++;
+        break;
+    case 'I':
+        if (p[1] == '6' && p[2] == '4')
+        {
+            p += 3;
+            is_64 = TRUE;
+        }
+        else if (p[1] == '3' && p[2] == '2')
+        {
+            p += 3;
+        }
+        else
+        {
+            p++;
+            is_64 = sizeof(void *) == 8;
+        }
+        break;
+    case 'z':
+    case 't':
+        p++;
+        is_64 = sizeof(size_t) == 8;
+        break;
+    case 'j':
+        p++;
+        is_64 = TRUE;
+        break;
+    default:
+        break;
+    }
+
+    switch (*p)
+    {
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'o':
+    case 'c':
+        *type = is_64 ? LOG_ARG_INT64 : LOG_ARG_INT;
+        break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        *type = LOG_ARG_DOUBLE;
+        break;
+    case 'p':
+        *type = LOG_ARG_POINTER;
+        break;
+    case 's':
+        if (is_wide)
+            return -1;
+        *type = LOG_ARG_STRING;
+        break;
+    case '%':
+        *type = LOG_ARG_NONE;
+        break;
+    default:
+        return -1;
+    }
+
+    if (p - spec + 2 > LOG_ASYNC_MAX_SPEC)
+        return -1;
+
+    return (int)(p - spec) + 1;
+}
+
+static int log_capture(log_record_t *record, const char *format, va_list args)
+{
+    const char *p = format;
+    const char *string;
+    enum LOG_ARG_TYPE type;
+    log_arg_t *arg;
+    int length, used = 0;
+
+    record->arg_count = 0;
+
+    while ((p = strchr(p, '%')) != NULL)
+    {
+        length = log_parse_spec(p + 1, &type);
+        if (length < 0)
+            return FALSE;
+        p += length + 1;
+
+        if (type == LOG_ARG_NONE)
+            continue;
+
+        if (record->arg_count == LOG_ASYNC_MAX_ARGS)
+            return FALSE;
+
+        arg = &record->args[record->arg_count++];
+
+        switch (type)
+        {
+        case LOG_ARG_INT:
+            arg->i = va_arg(args, int);
+            break;
+        case LOG_ARG_INT64:
+            arg->i64 = va_arg(args, __int64);
+            break;
+        case LOG_ARG_DOUBLE:
+            arg->d = va_arg(args, double);
+            break;
+        case LOG_ARG_POINTER:
+            arg->p = va_arg(args, const void *);
+            break;
+        case LOG_ARG_STRING:
+            string = va_arg(args, const char *);
+            if (!string)
+                string = "(null)";
+
+            /* long strings are truncated */
+            if (used >= LOG_ASYNC_STRING_SIZE)
+                return FALSE;
+            length = (int)strlen(string);
+            if (length > LOG_ASYNC_STRING_SIZE - 1 - used)
+                length = LOG_ASYNC_STRING_SIZE - 1 - used;
+
+            memcpy(record->strings + used, string, length);
+            record->strings[used + length] = '\0';
+            arg->i = used;
+            used += length + 1;
+            break;
+        default:
+            break;
+        }
+    }
+
+    return TRUE;
+}
+
+static int log_replay(const log_record_t *record, char *buffer, int size)
+{
+    const char *p = record->format;
+    const char *next;
+    const log_arg_t *arg = record->args;
+    char spec[LOG_ASYNC_MAX_SPEC];
+    enum LOG_ARG_TYPE type;
+    int length, count = 0, total = 0;
+
+    while (*p && total < size - 1)
+    {
+        next = strchr(p, '%');
+        if (!next)
+            next = p + strlen(p);
+
+        length = (int)(next - p);
+        if (length > size - 1 - total)
+            length = size - 1 - total;
+        memcpy(buffer + total, p, length);
+        total += length;
+
+        if (!*next || total >= size - 1)
+            break;
+
+        /* the format was checked by log_capture() */
+        length = log_parse_spec(next + 1, &type);
+        p = next + length + 1;
+
+        if (type == LOG_ARG_NONE)
+        {
+            buffer[total++] = '%';
+            continue;
+        }
+
+        memcpy(spec, next, length + 1);
+        spec[length + 1] = '\0';
+
+        switch (type)
+        {
+        case LOG_ARG_INT:
+            count = _snprintf(buffer + total, size - 1 - total, spec, arg->i);
+            break;
+        case LOG_ARG_INT64:
+            count = _snprintf(buffer + total, size - 1 - total, spec, arg->i64);
+            break;
+        case LOG_ARG_DOUBLE:
+            count = _snprintf(buffer + total, size - 1 - total, spec, arg->d);
+            break;
+        case LOG_ARG_POINTER:
+            count = _snprintf(buffer + total, size - 1 - total, spec, arg->p);
+            break;
+        case LOG_ARG_STRING:
+            count = _snprintf(buffer + total, size - 1 - total, spec,
+                              record->strings + arg->i);
+            break;
+        default:
+            count = 0;
+            break;
+        }
+        arg++;
+
+        if (count < 0)
+        {
+            total = size - 1;
+            break;
+        }
+        total += count;
+    }
+
+    buffer[total] = '\0';
+
+    return total;
+}
+
+/* returns FALSE if the message must be formatted synchronously */
+static int log_defer(enum USB_LOG_LEVEL level, const char *app_name,
+                     const char *function, const char *format, va_list args)
+{
+    log_buffer_t *buffer;
+    log_record_t *record;
+    va_list args_copy;
+    ULONG head;
+    int ret;
+
+    buffer = (log_buffer_t *)usbi_thread_buffer_get(&log_async_buffers);
+    if (!buffer)
+        return FALSE;
+
+    head = buffer->header.head;
+    if (head - buffer->header.tail >= LOG_ASYNC_RECORDS)
+    {
+        buffer->header.dropped++;
+        return TRUE;
+    }
+
+    record = &buffer->records[head & (LOG_ASYNC_RECORDS - 1)];
+    record->level = level;
+    record->app_name = app_name;
+    record->function = function;
+    record->format = format;
+
+    va_copy(args_copy, args);
+    ret = log_capture(record, format, args_copy);
+    va_end(args_copy);
+
+    if (!ret)
+        return FALSE;
+
+    /* publish the record after its contents */
+    MemoryBarrier();
+    buffer->header.head = head + 1;
+
+    return TRUE;
+}
+
+static void log_deliver(enum USB_LOG_LEVEL level, const char *app_name,
+                        const char *function, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    usb_log_format(level, app_name, function, format, args);
+    va_end(args);
+}
+
+static void log_output(usbi_thread_buffer_t *header, ULONG tail, ULONG head)
+{
+    log_buffer_t *buffer = (log_buffer_t *)header;
+    log_record_t *record;
+    char message[LOGBUF_SIZE];
+
+    for (; tail != head; tail++)
+    {
+        record = &buffer->records[tail & (LOG_ASYNC_RECORDS - 1)];
+        log_replay(record, message, sizeof(message));
+        log_deliver(record->level, record->app_name, record->function,
+                    "%s", message);
+    }
+}
+
+/* the lock is held */
+static void log_drain(void)
+{
+    LONG dropped_total;
+
+    dropped_total = usbi_thread_buffers_drain(&log_async_buffers, log_output);
+    if (dropped_total)
+    {
+        log_deliver(LOG_WARNING, LOG_APPNAME, __FUNCTION__,
+                    "%d log messages dropped\n", dropped_total);
+    }
+}
+
+static DWORD WINAPI log_async_thread_proc(LPVOID param)
+{
+    int stop;
+
+    UNREFERENCED_PARAMETER(param);
+
+    do
+    {
+        stop = WaitForSingleObject(log_async_stop_event, LOG_ASYNC_INTERVAL)
+               == WAIT_OBJECT_0;
+
+        EnterCriticalSection(&log_async_buffers.lock);
+        log_drain();
+        LeaveCriticalSection(&log_async_buffers.lock);
+    }
+    while (!stop);
+
+    return 0;
+}
+
+int usb_log_set_async(int enable)
+{
+    HANDLE thread;
+    int ret = 0;
+
+    if (!usbi_thread_buffers_available(&log_async_buffers))
+        return -ENOMEM;
+
+    EnterCriticalSection(&log_async_buffers.lock);
+
+    if (!enable)
+    {
+        thread = log_async_thread;
+        log_async_thread = NULL;
+        InterlockedExchange(&log_async_enabled, 0);
+        LeaveCriticalSection(&log_async_buffers.lock);
+
+        if (thread)
+        {
+            /* the thread drains the buffers a last time */
+            SetEvent(log_async_stop_event);
+            WaitForSingleObject(thread, INFINITE);
+            CloseHandle(thread);
+            CloseHandle(log_async_stop_event);
+            log_async_stop_event = NULL;
+        }
+
+        EnterCriticalSection(&log_async_buffers.lock);
+        usbi_thread_buffers_reap(&log_async_buffers);
+        LeaveCriticalSection(&log_async_buffers.lock);
+        return 0;
+    }
+
+    if (!log_async_thread)
+    {
+        usbi_thread_buffers_reset(&log_async_buffers);
+
+        log_async_stop_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (log_async_stop_event)
+        {
+            log_async_thread = CreateThread(NULL, 0, log_async_thread_proc,
+                                            NULL, 0, NULL);
+        }
+
+        if (log_async_thread)
+        {
+            InterlockedExchange(&log_async_enabled, 1);
+        }
+        else
+        {
+            ret = -usb_win_error_to_errno();
+            if (log_async_stop_event)
+            {
+                CloseHandle(log_async_stop_event);
+                log_async_stop_event = NULL;
+            }
+        }
+    }
+
+    LeaveCriticalSection(&log_async_buffers.lock);
+
+    return ret;
+}
+
+int usb_log_get_async(void)
+{
+    return log_async_enabled;
+}
+
+void usb_log_init(void)
+{
+    usbi_thread_buffers_init(&log_async_buffers, sizeof(log_buffer_t));
+}
+
+/* called from DllMain, the thread wrote its last message */
+void usb_log_thread_exit(void)
+{
+    usbi_thread_buffer_exit(&log_async_buffers);
+}
+
+/* the lock is held, the process exits */
+static void log_flush(void)
+{
+    InterlockedExchange(&log_async_enabled, 0);
+    log_drain();
+}
+
+/* called from DllMain, usb_set_debug_async(0) must be called before the */
+/* dll is unloaded while the process keeps running */
+void usb_log_deinit(void)
+{
+    usbi_thread_buffers_deinit(&log_async_buffers, log_flush);
+}
+
+#elif !IS_DRIVER
+
+/* deferred formatting is only implemented for Windows, messages are */
+/* formatted by the calling thread on other hosts */
+int usb_log_set_async(int enable)
+{
+    return enable ? -ENOSYS : 0;
+}
+
+int usb_log_get_async(void)
+{
+    return 0;
+}
+
+void usb_log_init(void)
+{
+}
+
+void usb_log_thread_exit(void)
+{
+}
+
+void usb_log_deinit(void)
+{
+}
+
+#endif /* !IS_DRIVER */
+
 void usb_err(const char* function, const char* format, ...)
 {
     va_list args;
@@ -227,6 +804,25 @@ void _usb_log_v(enum USB_LOG_LEVEL level,
                 const char* format,
                 va_list args)
 {
+    int masked_level = GetLogLevel(level);
+
+    if (__usb_log_level < masked_level && masked_level != LOG_ERROR) return;
+
+#if !IS_DRIVER && defined(_WIN32)
+    if (log_async_enabled && masked_level != LOG_ERROR
+            && log_defer(level, app_name, function, format, args))
+        return;
+#endif
+
+    usb_log_format(level, app_name, function, format, args);
+}
+
+static void usb_log_format(enum USB_LOG_LEVEL level,
+                           const char* app_name,
+                           const char* function,
+                           const char* format,
+                           va_list args)
+{
 
     char local_buffer[LOGBUF_SIZE];
     int totalCount, count;
@@ -239,9 +835,9 @@ void _usb_log_v(enum USB_LOG_LEVEL level,
 	const char** skip_list = NULL;
 #endif
 
+	/* the level has been checked by _usb_log_v() */
 	masked_level = GetLogLevel(level);
 
-    if (__usb_log_level < masked_level && masked_level != LOG_ERROR) return;
     buffer = local_buffer;
     totalCount = 0;
     count = 0;
@@ -168,15 +168,28 @@ typedef enum
 typedef int (*log_hander_t)(enum USB_LOG_LEVEL level, const char*,const char*,const char*, int, char*, int);
  
 #if (!IS_DRIVER)
+#ifdef _WIN32
 	const char *usb_win_error_to_string(void);
 	int usb_win_error_to_errno(void);
 #endif
+#endif
 
 void usb_log_set_level(enum USB_LOG_LEVEL level);
 int usb_log_get_level(void);
 void usb_log_set_handler(log_hander_t log_hander);
 log_hander_t usb_log_get_handler(void);
 
+#if (!IS_DRIVER)
+	// formats messages below LOG_ERROR on a background thread
+	int usb_log_set_async(int enable);
+	int usb_log_get_async(void);
+
+	// called from DllMain
+	void usb_log_init(void);
+	void usb_log_thread_exit(void);
+	void usb_log_deinit(void);
+#endif
+
 // these are the core logging functions used by the logging macros
 // (not used directly)
 void usb_err	(const char* function, const char* format, ...);
@@ -80,6 +80,23 @@ typedef int (*usb_reap_async_t)(void *context, int timeout);
 typedef int (*usb_free_async_t)(void **context);
 typedef int (*usb_cancel_async_t)(void *context);
 typedef int (*usb_reap_async_nocancel_t)(void *context, int timeout);
+typedef int (*usb_register_buffer_t)(usb_dev_handle *dev, int ep, void *bytes, int size, unsigned int *token);
+typedef int (*usb_unregister_buffer_t)(usb_dev_handle *dev, unsigned int token);
+typedef int (*usb_submit_async_registered_t)(void *context, unsigned int token, int offset, int size);
+typedef int (*usb_set_read_ahead_t)(usb_dev_handle *dev, int ep, int urb_count, int report_count);
+typedef HANDLE (*usb_open_endpoint_np_t)(usb_dev_handle *dev, int ep, unsigned int flags);
+typedef int (*usb_submit_async_iso_t)(void *context, char *bytes, int packet_count);
+typedef int (*usb_set_iso_stream_t)(usb_dev_handle *dev, int ep, int packet_size, int packets_per_urb, int urb_count, int ring_packets);
+typedef int (*usb_iso_stream_read_t)(usb_dev_handle *dev, int ep, char *bytes, int packet_size, int packet_count, int timeout);
+typedef int (*usb_get_endpoint_info_t)(usb_dev_handle *dev, int ep, struct usb_endpoint_info *info);
+typedef int (*usb_get_endpoint_stats_t)(usb_dev_handle *dev, int ep, struct usb_endpoint_stats *stats, unsigned int flags);
+typedef int (*usb_set_trace_t)(usb_dev_handle *dev, int record_count);
+typedef int (*usb_read_trace_t)(usb_dev_handle *dev, struct usb_trace_record *records, int count);
+typedef int (*usb_capture_start_t)(const char *filename, int snaplen);
+typedef int (*usb_capture_stop_t)(void);
+typedef int (*usb_set_debug_async_t)(int enable);
+typedef int (*usb_strerror_r_t)(char *buffer, int size);
+typedef int (*usb_set_altinterface_ex_t)(usb_dev_handle *dev, int interface, int alternate);
 
 static usb_open_t _usb_open = NULL;
 static usb_close_t _usb_close = NULL;
@@ -119,6 +136,23 @@ static usb_reap_async_t _usb_reap_async = NULL;
 static usb_free_async_t _usb_free_async = NULL;
 static usb_cancel_async_t _usb_cancel_async = NULL;
 static usb_reap_async_nocancel_t _usb_reap_async_nocancel = NULL;
+static usb_register_buffer_t _usb_register_buffer = NULL;
+static usb_unregister_buffer_t _usb_unregister_buffer = NULL;
+static usb_submit_async_registered_t _usb_submit_async_registered = NULL;
+static usb_set_read_ahead_t _usb_set_read_ahead = NULL;
+static usb_open_endpoint_np_t _usb_open_endpoint_np = NULL;
+static usb_submit_async_iso_t _usb_submit_async_iso = NULL;
+static usb_set_iso_stream_t _usb_set_iso_stream = NULL;
+static usb_iso_stream_read_t _usb_iso_stream_read = NULL;
+static usb_get_endpoint_info_t _usb_get_endpoint_info = NULL;
+static usb_get_endpoint_stats_t _usb_get_endpoint_stats = NULL;
+static usb_set_trace_t _usb_set_trace = NULL;
+static usb_read_trace_t _usb_read_trace = NULL;
+static usb_capture_start_t _usb_capture_start = NULL;
+static usb_capture_stop_t _usb_capture_stop = NULL;
+static usb_set_debug_async_t _usb_set_debug_async = NULL;
+static usb_strerror_r_t _usb_strerror_r = NULL;
+static usb_set_altinterface_ex_t _usb_set_altinterface_ex = NULL;
 
 
 void usb_init(void)
@@ -204,6 +238,40 @@ void usb_init(void)
                       GetProcAddress(libusb_dll, "usb_cancel_async");
     _usb_reap_async_nocancel = (usb_reap_async_nocancel_t)
                     GetProcAddress(libusb_dll, "usb_reap_async_nocancel");
+    _usb_register_buffer = (usb_register_buffer_t)
+                    GetProcAddress(libusb_dll, "usb_register_buffer");
+    _usb_unregister_buffer = (usb_unregister_buffer_t)
+                    GetProcAddress(libusb_dll, "usb_unregister_buffer");
+    _usb_submit_async_registered = (usb_submit_async_registered_t)
+                    GetProcAddress(libusb_dll, "usb_submit_async_registered");
+    _usb_set_read_ahead = (usb_set_read_ahead_t)
+                    GetProcAddress(libusb_dll, "usb_set_read_ahead");
+    _usb_open_endpoint_np = (usb_open_endpoint_np_t)
+                    GetProcAddress(libusb_dll, "usb_open_endpoint_np");
+    _usb_submit_async_iso = (usb_submit_async_iso_t)
+                    GetProcAddress(libusb_dll, "usb_submit_async_iso");
+    _usb_set_iso_stream = (usb_set_iso_stream_t)
+                    GetProcAddress(libusb_dll, "usb_set_iso_stream");
+    _usb_iso_stream_read = (usb_iso_stream_read_t)
+                    GetProcAddress(libusb_dll, "usb_iso_stream_read");
+    _usb_get_endpoint_info = (usb_get_endpoint_info_t)
+                    GetProcAddress(libusb_dll, "usb_get_endpoint_info");
+    _usb_get_endpoint_stats = (usb_get_endpoint_stats_t)
+                    GetProcAddress(libusb_dll, "usb_get_endpoint_stats");
+    _usb_set_trace = (usb_set_trace_t)
+                    GetProcAddress(libusb_dll, "usb_set_trace");
+    _usb_read_trace = (usb_read_trace_t)
+                    GetProcAddress(libusb_dll, "usb_read_trace");
+    _usb_capture_start = (usb_capture_start_t)
+                    GetProcAddress(libusb_dll, "usb_capture_start");
+    _usb_capture_stop = (usb_capture_stop_t)
+                    GetProcAddress(libusb_dll, "usb_capture_stop");
+    _usb_set_debug_async = (usb_set_debug_async_t)
+                    GetProcAddress(libusb_dll, "usb_set_debug_async");
+    _usb_strerror_r = (usb_strerror_r_t)
+                    GetProcAddress(libusb_dll, "usb_strerror_r");
+    _usb_set_altinterface_ex = (usb_set_altinterface_ex_t)
+                    GetProcAddress(libusb_dll, "usb_set_altinterface_ex");
 
     if (_usb_init)
         _usb_init();
@@ -516,4 +584,140 @@ int usb_reap_async_nocancel(void *context, int timeout)
         return _usb_reap_async_nocancel(context, timeout);
     else
         return -ENOFILE;
-}
\ No newline at end of file
+}
+
+int usb_register_buffer(usb_dev_handle *dev, int ep, void *bytes, int size, unsigned int *token)
+{
+    if (_usb_register_buffer)
+        return _usb_register_buffer(dev, ep, bytes, size, token);
+    else
+        return -ENOFILE;
+}
+
+int usb_unregister_buffer(usb_dev_handle *dev, unsigned int token)
+{
+    if (_usb_unregister_buffer)
+        return _usb_unregister_buffer(dev, token);
+    else
+        return -ENOFILE;
+}
+
+int usb_submit_async_registered(void *context, unsigned int token, int offset, int size)
+{
+    if (_usb_submit_async_registered)
+        return _usb_submit_async_registered(context, token, offset, size);
+    else
+        return -ENOFILE;
+}
+
+int usb_set_read_ahead(usb_dev_handle *dev, int ep, int urb_count, int report_count)
+{
+    if (_usb_set_read_ahead)
+        return _usb_set_read_ahead(dev, ep, urb_count, report_count);
+    else
+        return -ENOFILE;
+}
+
+HANDLE usb_open_endpoint_np(usb_dev_handle *dev, int ep, unsigned int flags)
+{
+    if (_usb_open_endpoint_np)
+        return _usb_open_endpoint_np(dev, ep, flags);
+    else
+        return INVALID_HANDLE_VALUE;
+}
+
+int usb_submit_async_iso(void *context, char *bytes, int packet_count)
+{
+    if (_usb_submit_async_iso)
+        return _usb_submit_async_iso(context, bytes, packet_count);
+    else
+        return -ENOFILE;
+}
+
+int usb_set_iso_stream(usb_dev_handle *dev, int ep, int packet_size, int packets_per_urb, int urb_count, int ring_packets)
+{
+    if (_usb_set_iso_stream)
+        return _usb_set_iso_stream(dev, ep, packet_size, packets_per_urb, urb_count, ring_packets);
+    else
+        return -ENOFILE;
+}
+
+int usb_iso_stream_read(usb_dev_handle *dev, int ep, char *bytes, int packet_size, int packet_count, int timeout)
+{
+    if (_usb_iso_stream_read)
+        return _usb_iso_stream_read(dev, ep, bytes, packet_size, packet_count, timeout);
+    else
+        return -ENOFILE;
+}
+
+int usb_get_endpoint_info(usb_dev_handle *dev, int ep, struct usb_endpoint_info *info)
+{
+    if (_usb_get_endpoint_info)
+        return _usb_get_endpoint_info(dev, ep, info);
+    else
+        return -ENOFILE;
+}
+
+int usb_get_endpoint_stats(usb_dev_handle *dev, int ep, struct usb_endpoint_stats *stats, unsigned int flags)
+{
+    if (_usb_get_endpoint_stats)
+        return _usb_get_endpoint_stats(dev, ep, stats, flags);
+    else
+        return -ENOFILE;
+}
+
+int usb_set_trace(usb_dev_handle *dev, int record_count)
+{
+    if (_usb_set_trace)
+        return _usb_set_trace(dev, record_count);
+    else
+        return -ENOFILE;
+}
+
+int usb_read_trace(usb_dev_handle *dev, struct usb_trace_record *records, int count)
+{
+    if (_usb_read_trace)
+        return _usb_read_trace(dev, records, count);
+    else
+        return -ENOFILE;
+}
+
+int usb_capture_start(const char *filename, int snaplen)
+{
+    if (_usb_capture_start)
+        return _usb_capture_start(filename, snaplen);
+    else
+        return -ENOFILE;
+}
+
+int usb_capture_stop(void)
+{
+    if (_usb_capture_stop)
+        return _usb_capture_stop();
+    else
+        return -ENOFILE;
+}
+
+int usb_set_debug_async(int enable)
+{
+    if (_usb_set_debug_async)
+        return _usb_set_debug_async(enable);
+    else
+        return -ENOFILE;
+}
+
+int usb_strerror_r(char *buffer, int size)
+{
+    if (_usb_strerror_r)
+        return _usb_strerror_r(buffer, size);
+    else
+        return -ENOFILE;
+}
+
+int usb_set_altinterface_ex(usb_dev_handle *dev, int interface, int alternate)
+{
+    if (_usb_set_altinterface_ex)
+        return _usb_set_altinterface_ex(dev, interface, alternate);
+    else
+        return -ENOFILE;
+}
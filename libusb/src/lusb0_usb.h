@@ -20,7 +20,14 @@
 #define __USB_H__
 
 #include <stdlib.h>
+#ifdef _WIN32
 #include <windows.h>
+#else
+/* the core and the simulated backend also build on other hosts, */
+/* see 'make host-check' */
+typedef unsigned long long ULONGLONG;
+typedef void *HANDLE;
+#endif
 
 /*
  * 'interface' is defined somewhere in the Windows header files. This macro
@@ -85,7 +92,11 @@
 
 
 /* ensure byte-packed structures */
+#ifdef _WIN32
 #include <pshpack1.h>
+#else
+#pragma pack(push, 1)
+#endif
 
 
 /* All standard descriptors have these 2 fields in common */
@@ -322,6 +333,83 @@ struct usb_version
     } driver;
 };
 
+/* Result of one isochronous packet, Windows specific */
+struct usb_iso_packet_desc
+{
+    unsigned int offset;    /* of the packet in the data */
+    unsigned int length;    /* bytes received or sent */
+    unsigned int status;    /* USBD status, 0 on success */
+};
+
+/* buffer layout for usb_submit_async_iso() */
+#define USB_ISO_PACKETS_OFFSET(packet_size, packet_count) \
+    ((((packet_size) * (packet_count)) + 3) & ~3)
+#define USB_ISO_BUFFER_SIZE(packet_size, packet_count) \
+    (USB_ISO_PACKETS_OFFSET(packet_size, packet_count) \
+     + (packet_count) * sizeof(struct usb_iso_packet_desc))
+#define USB_ISO_PACKETS(bytes, packet_size, packet_count) \
+    ((struct usb_iso_packet_desc *)((char *)(bytes) \
+     + USB_ISO_PACKETS_OFFSET(packet_size, packet_count)))
+
+/* Pipe information of an endpoint of the active configuration, */
+/* Windows specific */
+struct usb_endpoint_info
+{
+    unsigned int endpoint;
+    unsigned int type;                  /* USB_ENDPOINT_TYPE_* */
+    unsigned int interval;
+    unsigned int max_packet_size;
+    unsigned int max_transfer_size;     /* largest single urb */
+    /* SuperSpeed endpoint companion descriptor, zero below SuperSpeed */
+    unsigned int max_burst;             /* packets per burst - 1 */
+    unsigned int mult;                  /* iso bursts per interval - 1 */
+    unsigned int bytes_per_interval;    /* iso packet size for a full burst */
+    unsigned int speed;                 /* 1 low, 2 full, 3 high, 4 super */
+};
+
+/* Transfer counters of an endpoint kept by the driver, Windows specific */
+#define USB_STATS_LATENCY_BUCKETS 24
+
+struct usb_endpoint_stats
+{
+    unsigned int endpoint;
+    unsigned int pending;               /* requests in the driver now */
+    unsigned int max_pending;           /* high-water mark of pending */
+    ULONGLONG irps;                     /* requests passed to the bus */
+    ULONGLONG urbs;                     /* urbs sent, more if split */
+    ULONGLONG bytes;
+    ULONGLONG short_transfers;          /* less data than requested */
+    ULONGLONG stalls;
+    ULONGLONG cancels;                  /* cancelled or timed out */
+    ULONGLONG errors;                   /* other failures */
+    /* completions taking [2^n, 2^(n+1)) microseconds */
+    ULONGLONG latency[USB_STATS_LATENCY_BUCKETS];
+};
+
+/* flags of usb_get_endpoint_stats() */
+#define USB_STATS_RESET 1
+
+/* Binary transfer trace record of the driver, Windows specific */
+#define USB_TRACE_SUBMIT        1   /* request accepted, length requested */
+#define USB_TRACE_URB_SUBMIT    2   /* urb sent, length of the urb */
+#define USB_TRACE_URB_COMPLETE  3   /* urb done, length transferred */
+#define USB_TRACE_COMPLETE      4   /* request done, length transferred */
+#define USB_TRACE_LOST          0xFF /* length records were overwritten */
+
+struct usb_trace_record
+{
+    ULONGLONG time;                 /* 100ns units */
+    unsigned int sequence;          /* same for all events of a request */
+    unsigned int length;
+    int status;                     /* NTSTATUS of completions */
+    unsigned int urb_status;        /* USBD_STATUS of completions */
+    unsigned short function;        /* URB_FUNCTION_* */
+    unsigned char event;            /* USB_TRACE_* */
+    unsigned char endpoint;         /* 0 for control transfers */
+    unsigned char setup[8];         /* setup packet of control transfers */
+    unsigned int reserved;
+};
+
 
 struct usb_dev_handle;
 typedef struct usb_dev_handle usb_dev_handle;
@@ -333,7 +421,11 @@ typedef struct usb_dev_handle usb_dev_handle;
 
 
 
+#ifdef _WIN32
 #include <poppack.h>
+#else
+#pragma pack(pop)
+#endif
 
 
 #ifdef __cplusplus
@@ -374,15 +466,35 @@ extern "C"
     int usb_claim_interface(usb_dev_handle *dev, int interface);
     int usb_release_interface(usb_dev_handle *dev, int interface);
     int usb_set_altinterface(usb_dev_handle *dev, int alternate);
+
+    /* a handle can claim several interfaces. usb_set_altinterface() */
+    /* changes the one claimed last, usb_set_altinterface_ex() any of them */
+#define LIBUSB_HAS_SET_ALTINTERFACE_EX 1
+    int usb_set_altinterface_ex(usb_dev_handle *dev, int interface,
+                                int alternate);
+
     int usb_resetep(usb_dev_handle *dev, unsigned int ep);
     int usb_clear_halt(usb_dev_handle *dev, unsigned int ep);
     int usb_reset(usb_dev_handle *dev);
     int usb_reset_ex(usb_dev_handle *dev, unsigned int reset_type);
 
+    /* the last error of the calling thread. usb_strerror_r() copies it */
+    /* and returns its length */
     char *usb_strerror(void);
+#define LIBUSB_HAS_STRERROR_R 1
+    int usb_strerror_r(char *buffer, int size);
 
+    /* USB_BACKEND=sim replaces the driver with simulated benchmark */
+    /* devices, the USB_SIM_XXX variables are described in sim.c */
     void usb_init(void);
     void usb_set_debug(int level);
+
+    /* formats debug messages on a background thread instead of the */
+    /* calling one, errors stay synchronous. USB_DEBUG_ASYNC=1 enables it */
+    /* in usb_init() */
+#define LIBUSB_HAS_DEBUG_ASYNC 1
+    int usb_set_debug_async(int enable);
+
     int usb_find_busses(void);
     int usb_find_devices(void);
     struct usb_device *usb_device(usb_dev_handle *dev);
@@ -391,6 +503,7 @@ extern "C"
 
     /* Windows specific functions */
 
+#ifdef _WIN32
 #define LIBUSB_HAS_INSTALL_SERVICE_NP 1
     int usb_install_service_np(void);
     void CALLBACK usb_install_service_np_rundll(HWND wnd, HINSTANCE instance,
@@ -420,6 +533,7 @@ extern "C"
 	#define usb_install_np usb_install_npA
     void CALLBACK usb_install_np_rundll(HWND wnd, HINSTANCE instance, 
             LPSTR cmd_line, int cmd_show);
+#endif
 
     const struct usb_version *usb_get_version(void);
 
@@ -436,6 +550,72 @@ extern "C"
     int usb_cancel_async(void *context);
     int usb_free_async(void **context);
 
+    /* buffers locked once by the driver, used by bulk and interrupt */
+    /* contexts through usb_submit_async_registered(). the direction bit */
+    /* of ep selects the access: a buffer registered for an OUT endpoint */
+    /* may be read-only but can't be used for reads */
+#define LIBUSB_HAS_REGISTER_BUFFER 1
+    int usb_register_buffer(usb_dev_handle *dev, int ep, void *bytes,
+                            int size, unsigned int *token);
+    int usb_unregister_buffer(usb_dev_handle *dev, unsigned int token);
+    int usb_submit_async_registered(void *context, unsigned int token,
+                                    int offset, int size);
+
+    /* keeps urb_count urbs posted on an interrupt IN endpoint and buffers */
+    /* up to report_count reports in the driver. urb_count 0 disables it */
+#define LIBUSB_HAS_READ_AHEAD 1
+    int usb_set_read_ahead(usb_dev_handle *dev, int ep, int urb_count,
+                           int report_count);
+
+    /* opens a handle bound to one endpoint for ReadFile()/WriteFile(). */
+    /* flags are passed to CreateFile(), e.g. FILE_FLAG_OVERLAPPED. */
+    /* close it with CloseHandle() before usb_close() */
+#define LIBUSB_HAS_OPEN_ENDPOINT_NP 1
+    HANDLE usb_open_endpoint_np(usb_dev_handle *dev, int ep,
+                                unsigned int flags);
+
+    /* isochronous transfers reporting every packet. bytes holds */
+    /* packet_count packets of the context's packet size, followed by */
+    /* packet_count descriptors at USB_ISO_PACKETS(). the descriptors are */
+    /* valid once usb_reap_async() returns */
+#define LIBUSB_HAS_ISO_PACKETS 1
+    int usb_submit_async_iso(void *context, char *bytes, int packet_count);
+
+    /* keeps urb_count iso urbs posted on an iso IN endpoint and buffers */
+    /* up to ring_packets packets in the driver. urb_count 0 stops it. */
+    /* usb_iso_stream_read() returns the number of packets copied into */
+    /* bytes, in the layout of usb_submit_async_iso() */
+#define LIBUSB_HAS_ENDPOINT_INFO 1
+    int usb_get_endpoint_info(usb_dev_handle *dev, int ep,
+                              struct usb_endpoint_info *info);
+
+    /* returns the counters and optionally resets them */
+#define LIBUSB_HAS_ENDPOINT_STATS 1
+    int usb_get_endpoint_stats(usb_dev_handle *dev, int ep,
+                               struct usb_endpoint_stats *stats,
+                               unsigned int flags);
+
+    /* record_count 0 stops the trace. usb_read_trace() drains up to */
+    /* count records and returns the number of records read */
+#define LIBUSB_HAS_TRACE 1
+    int usb_set_trace(usb_dev_handle *dev, int record_count);
+    int usb_read_trace(usb_dev_handle *dev, struct usb_trace_record *records,
+                       int count);
+
+    /* writes all transfers of this process to a pcapng file with the */
+    /* USBPcap link type. snaplen limits the payload stored per packet, */
+    /* 0 selects 256 bytes. usb_init() starts it when USB_CAPTURE is set */
+#define LIBUSB_HAS_CAPTURE 1
+    int usb_capture_start(const char *filename, int snaplen);
+    int usb_capture_stop(void);
+
+#define LIBUSB_HAS_ISO_STREAM 1
+    int usb_set_iso_stream(usb_dev_handle *dev, int ep, int packet_size,
+                           int packets_per_urb, int urb_count,
+                           int ring_packets);
+    int usb_iso_stream_read(usb_dev_handle *dev, int ep, char *bytes,
+                            int packet_size, int packet_count, int timeout);
+
 
 #ifdef __cplusplus
 }
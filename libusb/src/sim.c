@@ -0,0 +1,1000 @@
+/* libusb-win32, Generic Windows USB Library
+ * Copyright (c) 2002-2005 Stephan Meyer <ste_meyer@web.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Simulated backend, selected with USB_BACKEND=sim. It emulates devices */
+/* running the benchmark firmware without the driver or any hardware: */
+/*   USB_SIM_DEVICES      number of devices (1..SIM_MAX_DEVICES)        */
+/*   USB_SIM_VID/PID      device ids (default 0x0666/0x0001)            */
+/*   USB_SIM_MODE         bench: IN endpoints source the benchmark      */
+/*                        pattern, OUT endpoints sink. loop: IN         */
+/*                        endpoints return the data written to OUT ones */
+/*   USB_SIM_INTERFACES   interfaces and endpoints of the configuration */
+/*                        (default 0x81:bulk,0x01:bulk). interfaces are */
+/*                        separated by ';', endpoints by ',', each one  */
+/*                        is address:type[:packet size[:interval]] with */
+/*                        type bulk, int or iso, e.g. for a composite   */
+/*                        device: 0x81:bulk,0x02:bulk;0x83:int:8:10     */
+/*   USB_SIM_PACKET_SIZE  default wMaxPacketSize of the endpoints       */
+/*   USB_SIM_LATENCY      completion latency of a transfer in us        */
+/*   USB_SIM_BANDWIDTH    bytes per second of each bulk endpoint,       */
+/*                        interrupt and iso endpoints move one packet   */
+/*                        every interval frames of 1 ms                 */
+/* There is one configuration and alternate setting 0 only. */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "lusb0_usb.h"
+#include "error.h"
+#include "usbi.h"
+
+#define SIM_BUS_NAME "bus-sim"
+#define SIM_MAX_DEVICES 8
+#define SIM_MAX_INTERFACES 4
+#define SIM_MAX_ENDPOINTS 16
+#define SIM_LOOP_BUFFER_SIZE (64 * 1024)
+
+#define SIM_DEFAULT_INTERFACES "0x81:bulk,0x01:bulk"
+
+/* vendor requests of the benchmark firmware */
+#define SIM_SET_TEST 0x0E
+#define SIM_GET_TEST 0x0F
+
+typedef struct
+{
+    usbi_mutex_t lock;
+
+    unsigned char test_type;
+    unsigned char key;
+
+    /* loop mode, data written to the OUT endpoints */
+    char loop_buffer[SIM_LOOP_BUFFER_SIZE];
+    int loop_head;
+    int loop_count;
+
+    /* the bus is serialized per endpoint, indexed like sim.endpoints */
+    LONGLONG busy_until[SIM_MAX_ENDPOINTS];
+} sim_device_t;
+
+typedef struct
+{
+    unsigned char address;
+    unsigned char type;      /* USB_ENDPOINT_TYPE_* */
+    int packet_size;
+    int interval;            /* frames, interrupt and iso only */
+    int interface;
+} sim_endpoint_t;
+
+typedef struct
+{
+    usb_dev_handle *dev; /* must be first, see usb_context_t */
+    sim_device_t *sim;
+    unsigned char ep;
+    int endpoint;        /* index into sim.endpoints */
+    char *bytes;
+    int size;
+    int transferred;
+    int submitted;
+    LONGLONG due;
+} sim_context_t;
+
+static struct
+{
+    int initialized;
+    int loop;
+    int device_count;
+    unsigned short vid;
+    unsigned short pid;
+    int packet_size;
+    int interface_count;
+    int endpoint_count;
+    sim_endpoint_t endpoints[SIM_MAX_ENDPOINTS];
+    LONGLONG latency;   /* usbi_clock() ticks */
+    LONGLONG bandwidth; /* bytes per second */
+    LONGLONG frequency;
+    sim_device_t devices[SIM_MAX_DEVICES];
+} sim;
+
+static const char *sim_strings[] =
+{
+    "libusb-win32",
+    "Simulated Benchmark Device",
+    "SIM0000",
+};
+
+
+static int sim_env(const char *name, int def)
+{
+    const char *value = getenv(name);
+
+    return value ? (int)strtol(value, NULL, 0) : def;
+}
+
+static LONGLONG sim_now(void)
+{
+    return usbi_clock();
+}
+
+/* sleeps until the clock reaches the given value, the last millisecond */
+/* is spent yielding to keep the completion times accurate */
+static void sim_wait_until(LONGLONG until)
+{
+    LONGLONG left;
+
+    while ((left = until - sim_now()) > 0)
+    {
+        if (left * 1000 / sim.frequency > 1)
+            usbi_sleep_ms((DWORD)(left * 1000 / sim.frequency) - 1);
+        else
+            usbi_yield();
+    }
+}
+
+static int sim_find_endpoint(unsigned char address)
+{
+    int i;
+
+    for (i = 0; i < sim.endpoint_count; i++)
+    {
+        if (sim.endpoints[i].address == address)
+            return i;
+    }
+
+    return -1;
+}
+
+/* parses USB_SIM_INTERFACES, see the top of this file */
+static int sim_parse_interfaces(const char *spec)
+{
+    static const struct
+    {
+        const char *name;
+        unsigned char type;
+    } types[] =
+    {
+        { "bulk", USB_ENDPOINT_TYPE_BULK },
+        { "int", USB_ENDPOINT_TYPE_INTERRUPT },
+        { "iso", USB_ENDPOINT_TYPE_ISOCHRONOUS },
+    };
+    const char *p = spec;
+    char *end;
+    sim_endpoint_t *ep;
+    int interface = 0;
+    int i;
+
+    sim.endpoint_count = 0;
+
+    while (*p)
+    {
+        if (*p == ';')
+        {
+            if (++interface == SIM_MAX_INTERFACES)
+                return -1;
+            p++;
+            continue;
+        }
+
+        if (sim.endpoint_count == SIM_MAX_ENDPOINTS)
+            return -1;
+
+        ep = &sim.endpoints[sim.endpoint_count];
+        ep->interface = interface;
+
+        ep->address = (unsigned char)strtol(p, &end, 0);
+        if (end == p || *end != ':' || !(ep->address & USB_ENDPOINT_ADDRESS_MASK)
+                || (ep->address & ~(USB_ENDPOINT_DIR_MASK | USB_ENDPOINT_ADDRESS_MASK))
+                || sim_find_endpoint(ep->address) >= 0)
+            return -1;
+        p = end + 1;
+
+        for (i = 0; i < (int)(sizeof(types) / sizeof(types[0])); i++)
+        {
+            if (!strncmp(p, types[i].name, strlen(types[i].name)))
+                break;
+        }
+        if (i == (int)(sizeof(types) / sizeof(types[0])))
+            return -1;
+        ep->type = types[i].type;
+        p += strlen(types[i].name);
+
+        ep->packet_size = sim.packet_size;
+        ep->interval = (ep->type == USB_ENDPOINT_TYPE_BULK) ? 0 : 1;
+
+        if (*p == ':')
+        {
+            ep->packet_size = (int)strtol(p + 1, &end, 0);
+            if (end == p + 1 || ep->packet_size < 1 || ep->packet_size > 1024)
+                return -1;
+            p = end;
+        }
+
+        if (*p == ':' && ep->type != USB_ENDPOINT_TYPE_BULK)
+        {
+            ep->interval = (int)strtol(p + 1, &end, 0);
+            if (end == p + 1 || ep->interval < 1 || ep->interval > 255)
+                return -1;
+            p = end;
+        }
+
+        sim.endpoint_count++;
+
+        if (*p == ',')
+            p++;
+        else if (*p && *p != ';')
+            return -1;
+    }
+
+    sim.interface_count = interface + 1;
+
+    return 0;
+}
+
+static void sim_init(void)
+{
+    const char *interfaces;
+    const char *mode;
+    int i;
+
+    if (sim.initialized)
+        return;
+
+    sim.frequency = usbi_clock_frequency();
+
+    mode = getenv("USB_SIM_MODE");
+    sim.loop = mode && !strcmp(mode, "loop");
+
+    sim.device_count = sim_env("USB_SIM_DEVICES", 1);
+    if (sim.device_count < 1)
+        sim.device_count = 1;
+    if (sim.device_count > SIM_MAX_DEVICES)
+        sim.device_count = SIM_MAX_DEVICES;
+
+    sim.vid = (unsigned short)sim_env("USB_SIM_VID", 0x0666);
+    sim.pid = (unsigned short)sim_env("USB_SIM_PID", 0x0001);
+
+    sim.packet_size = sim_env("USB_SIM_PACKET_SIZE", 512);
+    if (sim.packet_size < 8 || sim.packet_size > 1024)
+        sim.packet_size = 512;
+
+    interfaces = getenv("USB_SIM_INTERFACES");
+    if (!interfaces || sim_parse_interfaces(interfaces) < 0)
+    {
+        if (interfaces)
+        {
+            USBERR("invalid USB_SIM_INTERFACES '%s', using %s\n",
+                   interfaces, SIM_DEFAULT_INTERFACES);
+        }
+        sim_parse_interfaces(SIM_DEFAULT_INTERFACES);
+    }
+
+    sim.latency = (LONGLONG)sim_env("USB_SIM_LATENCY", 125)
+                  * sim.frequency / 1000000;
+    sim.bandwidth = sim_env("USB_SIM_BANDWIDTH", 40 * 1000 * 1000);
+    if (sim.bandwidth <= 0)
+        sim.bandwidth = 40 * 1000 * 1000;
+
+    for (i = 0; i < SIM_MAX_DEVICES; i++)
+    {
+        usbi_mutex_init(&sim.devices[i].lock);
+    }
+
+    sim.initialized = TRUE;
+
+    USBMSG("simulating %d device(s) %04x:%04x, %s mode, %d interface(s), "
+           "%d endpoint(s)\n", sim.device_count, sim.vid, sim.pid,
+           sim.loop ? "loop" : "bench", sim.interface_count,
+           sim.endpoint_count);
+}
+
+static int sim_device_descriptor(unsigned char *buffer)
+{
+    memset(buffer, 0, USB_DT_DEVICE_SIZE);
+
+    buffer[0] = USB_DT_DEVICE_SIZE;
+    buffer[1] = USB_DT_DEVICE;
+    buffer[2] = 0x00; /* bcdUSB 2.00 */
+    buffer[3] = 0x02;
+    buffer[7] = 64;   /* bMaxPacketSize0 */
+    buffer[8] = (unsigned char)(sim.vid & 0xFF);
+    buffer[9] = (unsigned char)(sim.vid >> 8);
+    buffer[10] = (unsigned char)(sim.pid & 0xFF);
+    buffer[11] = (unsigned char)(sim.pid >> 8);
+    buffer[12] = 0x00; /* bcdDevice 1.00 */
+    buffer[13] = 0x01;
+    buffer[14] = 1;   /* iManufacturer */
+    buffer[15] = 2;   /* iProduct */
+    buffer[16] = 3;   /* iSerialNumber */
+    buffer[17] = 1;   /* bNumConfigurations */
+
+    return USB_DT_DEVICE_SIZE;
+}
+
+/* fits into the 256 byte buffer of sim_control_msg() with the limits */
+/* of SIM_MAX_INTERFACES and SIM_MAX_ENDPOINTS */
+static int sim_config_descriptor(unsigned char *buffer)
+{
+    unsigned char *p = buffer;
+    int total = USB_DT_CONFIG_SIZE + sim.interface_count * USB_DT_INTERFACE_SIZE
+                + sim.endpoint_count * USB_DT_ENDPOINT_SIZE;
+    sim_endpoint_t *ep;
+    int interface, i;
+
+    memset(buffer, 0, total);
+
+    p[0] = USB_DT_CONFIG_SIZE;
+    p[1] = USB_DT_CONFIG;
+    p[2] = (unsigned char)(total & 0xFF);
+    p[3] = (unsigned char)(total >> 8);
+    p[4] = (unsigned char)sim.interface_count; /* bNumInterfaces */
+    p[5] = 1;    /* bConfigurationValue */
+    p[7] = 0x80; /* bus powered */
+    p[8] = 50;   /* 100mA */
+    p += USB_DT_CONFIG_SIZE;
+
+    for (interface = 0; interface < sim.interface_count; interface++)
+    {
+        p[0] = USB_DT_INTERFACE_SIZE;
+        p[1] = USB_DT_INTERFACE;
+        p[2] = (unsigned char)interface;
+        p[5] = USB_CLASS_VENDOR_SPEC;
+
+        for (i = 0; i < sim.endpoint_count; i++)
+        {
+            if (sim.endpoints[i].interface == interface)
+                p[4]++; /* bNumEndpoints */
+        }
+        p += USB_DT_INTERFACE_SIZE;
+
+        for (i = 0; i < sim.endpoint_count; i++)
+        {
+            ep = &sim.endpoints[i];
+            if (ep->interface != interface)
+                continue;
+
+            p[0] = USB_DT_ENDPOINT_SIZE;
+            p[1] = USB_DT_ENDPOINT;
+            p[2] = ep->address;
+            p[3] = ep->type;
+            p[4] = (unsigned char)(ep->packet_size & 0xFF);
+            p[5] = (unsigned char)(ep->packet_size >> 8);
+            p[6] = (unsigned char)ep->interval;
+            p += USB_DT_ENDPOINT_SIZE;
+        }
+    }
+
+    return total;
+}
+
+static int sim_string_descriptor(usb_dev_handle *dev, int index,
+                                 unsigned char *buffer)
+{
+    char serial[16];
+    const char *s;
+    int i, length;
+
+    if (index == 0)
+    {
+        buffer[0] = 4;
+        buffer[1] = USB_DT_STRING;
+        buffer[2] = 0x09; /* english (US) */
+        buffer[3] = 0x04;
+        return 4;
+    }
+
+    if (index > (int)(sizeof(sim_strings) / sizeof(sim_strings[0])))
+        return -EPIPE;
+
+    s = sim_strings[index - 1];
+    if (index == 3)
+    {
+        /* every device gets its own serial number */
+        _snprintf(serial, sizeof(serial) - 1, "SIM%04d",
+                  dev->device->devnum);
+        serial[sizeof(serial) - 1] = 0;
+        s = serial;
+    }
+
+    length = (int)strlen(s);
+    buffer[0] = (unsigned char)(2 + 2 * length);
+    buffer[1] = USB_DT_STRING;
+    for (i = 0; i < length; i++)
+    {
+        buffer[2 + 2 * i] = (unsigned char)s[i];
+        buffer[3 + 2 * i] = 0;
+    }
+
+    return 2 + 2 * length;
+}
+
+/* the pattern checked by VerifyData() of the benchmark application, */
+/* zero and a running key followed by 2, 3, .. 255, 1, 2, .. */
+static void sim_fill_pattern(sim_device_t *sim_dev, char *bytes, int size,
+                             int packet_size)
+{
+    int offset, i;
+    unsigned char value;
+
+    for (offset = 0; offset < size; offset += packet_size)
+    {
+        value = 0;
+        for (i = 0; i < packet_size && offset + i < size; i++)
+        {
+            bytes[offset + i] = (char)value++;
+            if (value == 0)
+                value = 1;
+        }
+
+        if (offset + 1 < size)
+            bytes[offset + 1] = (char)sim_dev->key;
+        sim_dev->key++;
+    }
+}
+
+static void sim_schedule(sim_context_t *c)
+{
+    sim_device_t *sim_dev = c->sim;
+    sim_endpoint_t *ep = &sim.endpoints[c->endpoint];
+    LONGLONG *busy_until = &sim_dev->busy_until[c->endpoint];
+    LONGLONG start = sim_now();
+    LONGLONG duration;
+
+    if (ep->type == USB_ENDPOINT_TYPE_BULK)
+    {
+        duration = (LONGLONG)c->size * sim.frequency / sim.bandwidth;
+    }
+    else
+    {
+        duration = (LONGLONG)((c->size + ep->packet_size - 1) / ep->packet_size)
+                   * ep->interval * sim.frequency / 1000;
+    }
+
+    usbi_mutex_lock(&sim_dev->lock);
+    if (*busy_until > start)
+        start = *busy_until;
+    *busy_until = start + duration;
+    c->due = *busy_until + sim.latency;
+    usbi_mutex_unlock(&sim_dev->lock);
+}
+
+/* moves the data of a due transfer, returns TRUE when it is complete */
+static int sim_transfer(sim_context_t *c)
+{
+    sim_device_t *sim_dev = c->sim;
+    int length, tail;
+
+    usbi_mutex_lock(&sim_dev->lock);
+
+    if (!sim.loop)
+    {
+        if (c->ep & USB_ENDPOINT_IN)
+        {
+            sim_fill_pattern(sim_dev, c->bytes, c->size,
+                             sim.endpoints[c->endpoint].packet_size);
+        }
+        c->transferred = c->size;
+    }
+    else if (c->ep & USB_ENDPOINT_IN)
+    {
+        /* like a device, return whatever is there once there is data */
+        length = min(c->size, sim_dev->loop_count);
+        for (tail = 0; tail < length; tail++)
+        {
+            c->bytes[tail] = sim_dev->loop_buffer[sim_dev->loop_head];
+            sim_dev->loop_head = (sim_dev->loop_head + 1) % SIM_LOOP_BUFFER_SIZE;
+        }
+        sim_dev->loop_count -= length;
+        c->transferred = length;
+    }
+    else
+    {
+        /* the endpoint naks while the loop buffer is full */
+        length = min(c->size - c->transferred,
+                     SIM_LOOP_BUFFER_SIZE - sim_dev->loop_count);
+        tail = (sim_dev->loop_head + sim_dev->loop_count) % SIM_LOOP_BUFFER_SIZE;
+        sim_dev->loop_count += length;
+        while (length--)
+        {
+            sim_dev->loop_buffer[tail] = c->bytes[c->transferred++];
+            tail = (tail + 1) % SIM_LOOP_BUFFER_SIZE;
+        }
+    }
+
+    usbi_mutex_unlock(&sim_dev->lock);
+
+    if (!sim.loop || !c->size)
+        return TRUE;
+
+    if (c->ep & USB_ENDPOINT_IN)
+        return c->transferred > 0;
+
+    return c->transferred == c->size;
+}
+
+static int sim_find_busses(struct usb_bus **busses)
+{
+    struct usb_bus *bus;
+
+    bus = malloc(sizeof(struct usb_bus));
+    if (!bus)
+    {
+        USBERR0("memory allocation failed\n");
+        return -ENOMEM;
+    }
+
+    memset(bus, 0, sizeof(*bus));
+    strcpy(bus->dirname, SIM_BUS_NAME);
+
+    *busses = bus;
+
+    return 0;
+}
+
+static int sim_find_devices(struct usb_bus *bus, struct usb_device **devices)
+{
+    struct usb_device *dev, *fdev = NULL;
+    int i;
+
+    for (i = 1; i <= sim.device_count; i++)
+    {
+        if (!(dev = malloc(sizeof(*dev))))
+        {
+            USBERR0("memory allocation failed\n");
+            return -ENOMEM;
+        }
+
+        memset(dev, 0, sizeof(*dev));
+        dev->bus = bus;
+        dev->devnum = (unsigned char)i;
+
+        sim_device_descriptor((unsigned char *)&dev->descriptor);
+
+        _snprintf(dev->filename, LIBUSB_PATH_MAX - 1,
+                  "sim-%04d--0x%04x-0x%04x", i, sim.vid, sim.pid);
+
+        LIST_ADD(fdev, dev);
+
+        USBMSG("found %s on %s\n", dev->filename, bus->dirname);
+    }
+
+    *devices = fdev;
+
+    return 0;
+}
+
+static int sim_determine_children(struct usb_bus *bus)
+{
+    return 0;
+}
+
+static int sim_open(usb_dev_handle *dev)
+{
+    int devnum = dev->device->devnum;
+
+    /* keeps the extensions that talk to the driver from using the handle */
+    dev->impl_info = INVALID_HANDLE_VALUE;
+
+    if (devnum < 1 || devnum > sim.device_count)
+    {
+        USBERR("invalid file name %s\n", dev->device->filename);
+        return -ENOENT;
+    }
+
+    dev->backend_info = &sim.devices[devnum - 1];
+    dev->config = 1;
+    dev->interface = -1;
+    dev->altsetting = -1;
+
+    return 0;
+}
+
+static int sim_close(usb_dev_handle *dev)
+{
+    dev->backend_info = NULL;
+
+    return 0;
+}
+
+static int sim_set_configuration(usb_dev_handle *dev, int configuration)
+{
+    if (!dev->backend_info)
+    {
+        USBERR0("error: device not open\n");
+        return -EINVAL;
+    }
+
+    if (configuration != 0 && configuration != 1)
+    {
+        USBERR("could not set config %d: no such configuration\n",
+               configuration);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int sim_claim_interface(usb_dev_handle *dev, int interface)
+{
+    if (!dev->backend_info)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
+
+    if (dev->config != 1 || interface < 0 || interface >= sim.interface_count)
+    {
+        USBERR("could not claim interface %d: no such interface\n",
+               interface);
+        return -ENOENT;
+    }
+
+    return 0;
+}
+
+static int sim_release_interface(usb_dev_handle *dev, int interface)
+{
+    if (!dev->backend_info)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int sim_set_altinterface(usb_dev_handle *dev, int interface,
+                                int alternate)
+{
+    if (!dev->backend_info)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
+
+    if (interface < 0 || interface >= sim.interface_count || alternate != 0)
+    {
+        USBERR("could not set alt interface %d/%d: no such setting\n",
+               interface, alternate);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int sim_control_msg(usb_dev_handle *dev, int requesttype, int request,
+                           int value, int index, char *bytes, int size,
+                           int timeout)
+{
+    sim_device_t *sim_dev = dev->backend_info;
+    unsigned char buffer[256];
+    int ret = 0;
+
+    if (!sim_dev)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
+
+    sim_wait_until(sim_now() + sim.latency);
+
+    switch (requesttype & (0x03 << 5))
+    {
+    case USB_TYPE_STANDARD:
+        switch (request)
+        {
+        case USB_REQ_GET_STATUS:
+            memset(buffer, 0, 2);
+            ret = 2;
+            break;
+
+        case USB_REQ_GET_DESCRIPTOR:
+            switch ((value >> 8) & 0xFF)
+            {
+            case USB_DT_DEVICE:
+                ret = sim_device_descriptor(buffer);
+                break;
+            case USB_DT_CONFIG:
+                ret = (value & 0xFF) ? -EPIPE : sim_config_descriptor(buffer);
+                break;
+            case USB_DT_STRING:
+                ret = sim_string_descriptor(dev, value & 0xFF, buffer);
+                break;
+            default:
+                ret = -EPIPE;
+                break;
+            }
+            break;
+
+        case USB_REQ_GET_CONFIGURATION:
+            buffer[0] = (unsigned char)(dev->config > 0 ? dev->config : 0);
+            ret = 1;
+            break;
+
+        case USB_REQ_GET_INTERFACE:
+            buffer[0] = 0;
+            ret = 1;
+            break;
+
+        case USB_REQ_CLEAR_FEATURE:
+        case USB_REQ_SET_FEATURE:
+        case USB_REQ_SET_CONFIGURATION:
+        case USB_REQ_SET_INTERFACE:
+            break;
+
+        default:
+            USBERR("invalid request 0x%x", request);
+            return -EINVAL;
+        }
+        break;
+
+    case USB_TYPE_VENDOR:
+        switch (request)
+        {
+        case SIM_SET_TEST:
+            sim_dev->test_type = (unsigned char)value;
+            /* fall through */
+        case SIM_GET_TEST:
+            buffer[0] = sim_dev->test_type;
+            ret = 1;
+            break;
+
+        default:
+            ret = -EPIPE;
+            break;
+        }
+        break;
+
+    default:
+        ret = -EPIPE;
+        break;
+    }
+
+    if (ret < 0)
+    {
+        USBERR("control request 0x%02x/0x%02x stalled\n", requesttype, request);
+        return ret;
+    }
+
+    if (!(requesttype & USB_ENDPOINT_IN))
+        return size;
+
+    if (ret > size)
+        ret = size;
+    memcpy(bytes, buffer, ret);
+
+    return ret;
+}
+
+static int sim_setup_async(usb_dev_handle *dev, void **context, int type,
+                           unsigned char ep, int pktsize)
+{
+    sim_context_t **c = (sim_context_t **)context;
+    int endpoint = sim_find_endpoint(ep);
+
+    if (!dev->backend_info)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
+
+    /* like the driver, bulk and interrupt requests go to either pipe type */
+    if (endpoint < 0
+            || (type == USB_ENDPOINT_TYPE_ISOCHRONOUS)
+            != (sim.endpoints[endpoint].type == USB_ENDPOINT_TYPE_ISOCHRONOUS))
+    {
+        USBERR("invalid endpoint 0x%02x\n", ep);
+        return -EINVAL;
+    }
+
+    *c = malloc(sizeof(sim_context_t));
+
+    if (!*c)
+    {
+        USBERR0("memory allocation error\n");
+        return -ENOMEM;
+    }
+
+    memset(*c, 0, sizeof(sim_context_t));
+
+    (*c)->dev = dev;
+    (*c)->sim = dev->backend_info;
+    (*c)->ep = ep;
+    (*c)->endpoint = endpoint;
+
+    return 0;
+}
+
+static int sim_submit_async(void *context, char *bytes, int size)
+{
+    sim_context_t *c = (sim_context_t *)context;
+
+    if (!c)
+    {
+        USBERR0("invalid context");
+        return -EINVAL;
+    }
+
+    if (!c->dev->backend_info)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
+
+    if (c->dev->config <= 0)
+    {
+        USBERR("invalid configuration %d\n", c->dev->config);
+        return -EINVAL;
+    }
+
+    if (!c->dev->claimed_interfaces)
+    {
+        USBERR0("no interface claimed\n");
+        return -EINVAL;
+    }
+
+    c->bytes = bytes;
+    c->size = size;
+    c->transferred = 0;
+    c->submitted = TRUE;
+
+    sim_schedule(c);
+
+    return 0;
+}
+
+static int sim_reap_async(void *context, int timeout, int cancel)
+{
+    sim_context_t *c = (sim_context_t *)context;
+    LONGLONG deadline;
+
+    if (!c)
+    {
+        USBERR0("invalid context\n");
+        return -EINVAL;
+    }
+
+    if (!c->submitted)
+    {
+        USBERR0("reaping request failed, the request was cancelled\n");
+        return -ETRANSFER_TIMEDOUT;
+    }
+
+    deadline = timeout < 0 ? -1
+               : sim_now() + (LONGLONG)timeout * sim.frequency / 1000;
+
+    for (;;)
+    {
+        if (deadline >= 0 && c->due > deadline)
+        {
+            sim_wait_until(deadline);
+            break;
+        }
+
+        sim_wait_until(c->due);
+
+        if (sim_transfer(c))
+        {
+            c->submitted = FALSE;
+            return c->transferred;
+        }
+
+        /* loop mode, poll the other endpoint like the host controller */
+        c->due = sim_now() + sim.frequency / 1000;
+    }
+
+    if (cancel)
+        c->submitted = FALSE;
+
+    USBERR0("timeout error\n");
+    return -ETRANSFER_TIMEDOUT;
+}
+
+static int sim_cancel_async(void *context)
+{
+    sim_context_t *c = (sim_context_t *)context;
+
+    if (!c)
+    {
+        USBERR0("invalid context\n");
+        return -EINVAL;
+    }
+
+    c->submitted = FALSE;
+
+    return 0;
+}
+
+static int sim_free_async(void **context)
+{
+    sim_context_t **c = (sim_context_t **)context;
+
+    if (!*c)
+    {
+        USBERR0("invalid context\n");
+        return -EINVAL;
+    }
+
+    free(*c);
+    *c = NULL;
+
+    return 0;
+}
+
+static int sim_clear_halt(usb_dev_handle *dev, unsigned int ep)
+{
+    if (!dev->backend_info)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int sim_reset(usb_dev_handle *dev)
+{
+    sim_device_t *sim_dev = dev->backend_info;
+
+    if (!sim_dev)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
+
+    usbi_mutex_lock(&sim_dev->lock);
+    sim_dev->test_type = 0;
+    sim_dev->key = 0;
+    sim_dev->loop_head = 0;
+    sim_dev->loop_count = 0;
+    usbi_mutex_unlock(&sim_dev->lock);
+
+    return 0;
+}
+
+static int sim_reset_ex(usb_dev_handle *dev, unsigned int reset_type)
+{
+    return sim_reset(dev);
+}
+
+const struct usb_os_backend usb_sim_backend =
+{
+    "sim",
+    sim_init,
+    sim_find_busses,
+    sim_find_devices,
+    sim_determine_children,
+    sim_open,
+    sim_close,
+    sim_set_configuration,
+    sim_claim_interface,
+    sim_release_interface,
+    sim_set_altinterface,
+    sim_control_msg,
+    sim_setup_async,
+    sim_submit_async,
+    sim_reap_async,
+    sim_cancel_async,
+    sim_free_async,
+    sim_clear_halt,
+    sim_clear_halt,
+    sim_reset,
+    sim_reset_ex
+};
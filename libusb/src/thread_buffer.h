@@ -0,0 +1,235 @@
+/* libusb-win32, Generic Windows USB Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _THREAD_BUFFER_H_
+#define _THREAD_BUFFER_H_
+
+/* Per-thread buffers drained by a background thread, used by the deferred
+ * logger (error.c) and the packet capture (capture.c).
+ *
+ * Each thread gets its own buffer on first use, only this thread advances
+ * head and only the draining thread advances tail, so writers never take
+ * a lock. The user's data follows usbi_thread_buffer_t in the same
+ * allocation. The lock protects the list of buffers, the draining thread
+ * holds it while it runs.
+ *
+ * usbi_thread_buffer_exit() is called from DllMain with the loader lock
+ * held. It must not take the lock: the draining thread holds it while it
+ * calls application code (the log handler) or the C runtime. The buffer
+ * is only flagged, and usbi_thread_buffers_drain() or
+ * usbi_thread_buffers_reap() frees it later.
+ */
+
+#include <stdlib.h>
+#include <windows.h>
+
+typedef struct _usbi_thread_buffer_t
+{
+    struct _usbi_thread_buffer_t *next;
+    volatile ULONG head;            /* written by the owning thread */
+    volatile ULONG tail;            /* written by the draining thread */
+    volatile LONG dropped;          /* written by the owning thread */
+    LONG dropped_seen;
+    volatile LONG exited;
+} usbi_thread_buffer_t;
+
+/* static instances start as { TLS_OUT_OF_INDEXES } */
+typedef struct
+{
+    DWORD tls;
+    CRITICAL_SECTION lock;
+    usbi_thread_buffer_t *buffers;
+    size_t size;                    /* of a buffer and the data after it */
+} usbi_thread_buffers_t;
+
+/* moves the data between tail and head of a buffer */
+typedef void (*usbi_thread_buffer_drain_t)(usbi_thread_buffer_t *buffer,
+                                           ULONG tail, ULONG head);
+
+/* called from DllMain */
+static __inline void usbi_thread_buffers_init(usbi_thread_buffers_t *list,
+                                              size_t size)
+{
+    InitializeCriticalSection(&list->lock);
+    list->tls = TlsAlloc();
+    list->buffers = NULL;
+    list->size = size;
+}
+
+static __inline int usbi_thread_buffers_available(usbi_thread_buffers_t *list)
+{
+    return list->tls != TLS_OUT_OF_INDEXES;
+}
+
+/* the calling thread's buffer, NULL if it can not be allocated */
+static __inline usbi_thread_buffer_t *
+usbi_thread_buffer_get(usbi_thread_buffers_t *list)
+{
+    usbi_thread_buffer_t *buffer;
+
+    buffer = TlsGetValue(list->tls);
+    if (buffer)
+        return buffer;
+
+    /* the data part does not need to be cleared */
+    buffer = malloc(list->size);
+    if (!buffer)
+        return NULL;
+
+    buffer->head = 0;
+    buffer->tail = 0;
+    buffer->dropped = 0;
+    buffer->dropped_seen = 0;
+    buffer->exited = 0;
+
+    EnterCriticalSection(&list->lock);
+    buffer->next = list->buffers;
+    list->buffers = buffer;
+    LeaveCriticalSection(&list->lock);
+
+    TlsSetValue(list->tls, buffer);
+
+    return buffer;
+}
+
+/* called from DllMain, the thread wrote its last data. see above */
+static __inline void usbi_thread_buffer_exit(usbi_thread_buffers_t *list)
+{
+    usbi_thread_buffer_t *buffer;
+
+    if (!usbi_thread_buffers_available(list))
+        return;
+
+    buffer = TlsGetValue(list->tls);
+    if (!buffer)
+        return;
+
+    TlsSetValue(list->tls, NULL);
+
+    InterlockedExchange(&buffer->exited, 1);
+}
+
+/* the lock is held. passes the new data of every buffer to drain, frees */
+/* the buffers of exited threads and returns the number of newly dropped */
+/* entries */
+static __inline LONG usbi_thread_buffers_drain(usbi_thread_buffers_t *list,
+                                               usbi_thread_buffer_drain_t drain)
+{
+    usbi_thread_buffer_t **link = &list->buffers;
+    usbi_thread_buffer_t *buffer;
+    ULONG head, tail;
+    LONG exited, dropped;
+    LONG dropped_total = 0;
+
+    while ((buffer = *link) != NULL)
+    {
+        /* everything an exited thread wrote is visible */
+        exited = buffer->exited;
+        MemoryBarrier();
+        head = buffer->head;
+        tail = buffer->tail;
+
+        if (head != tail)
+            drain(buffer, tail, head);
+
+        MemoryBarrier();
+        buffer->tail = head;
+
+        dropped = buffer->dropped;
+        dropped_total += dropped - buffer->dropped_seen;
+        buffer->dropped_seen = dropped;
+
+        if (exited)
+        {
+            *link = buffer->next;
+            free(buffer);
+        }
+        else
+        {
+            link = &buffer->next;
+        }
+    }
+
+    return dropped_total;
+}
+
+/* the lock is held. frees the buffers of exited threads that were left */
+/* behind while no draining thread was running */
+static __inline void usbi_thread_buffers_reap(usbi_thread_buffers_t *list)
+{
+    usbi_thread_buffer_t **link = &list->buffers;
+    usbi_thread_buffer_t *buffer;
+
+    while ((buffer = *link) != NULL)
+    {
+        if (buffer->exited)
+        {
+            *link = buffer->next;
+            free(buffer);
+        }
+        else
+        {
+            link = &buffer->next;
+        }
+    }
+}
+
+/* the lock is held, a draining thread is about to start. forgets what */
+/* was written while none was running */
+static __inline void usbi_thread_buffers_reset(usbi_thread_buffers_t *list)
+{
+    usbi_thread_buffer_t *buffer;
+
+    usbi_thread_buffers_reap(list);
+
+    for (buffer = list->buffers; buffer; buffer = buffer->next)
+    {
+        buffer->tail = buffer->head;
+        buffer->dropped_seen = buffer->dropped;
+    }
+}
+
+/* Called from DllMain. Other threads are gone when the process exits, the */
+/* draining thread must be stopped before the dll is unloaded otherwise. */
+/* flush is called with the lock held before the buffers are freed */
+static __inline void usbi_thread_buffers_deinit(usbi_thread_buffers_t *list,
+                                                void (*flush)(void))
+{
+    usbi_thread_buffer_t *buffer;
+
+    if (!usbi_thread_buffers_available(list))
+        return;
+
+    /* the draining thread may have been killed while holding the lock */
+    if (!TryEnterCriticalSection(&list->lock))
+        return;
+
+    flush();
+
+    while ((buffer = list->buffers) != NULL)
+    {
+        list->buffers = buffer->next;
+        free(buffer);
+    }
+
+    LeaveCriticalSection(&list->lock);
+
+    TlsFree(list->tls);
+    list->tls = TLS_OUT_OF_INDEXES;
+}
+
+#endif /* _THREAD_BUFFER_H_ */
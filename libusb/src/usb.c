@@ -18,12 +18,19 @@
 int usb_debug = 0;
 struct usb_bus *_usb_busses = NULL;
 
+#ifdef _WIN32
+const struct usb_os_backend *usb_os_backend = &usb_windows_backend;
+#else
+/* only the simulated backend is built on other hosts */
+const struct usb_os_backend *usb_os_backend = &usb_sim_backend;
+#endif
+
 int usb_find_busses(void)
 {
     struct usb_bus *busses, *bus;
     int ret, changes = 0;
 
-    ret = usb_os_find_busses(&busses);
+    ret = usb_os_backend->find_busses(&busses);
     if (ret < 0)
         return ret;
 
@@ -103,7 +110,7 @@ int usb_find_devices(void)
         struct usb_device *devices, *dev;
 
         /* Find all of the devices and put them into a temporary list */
-        ret = usb_os_find_devices(bus, &devices);
+        ret = usb_os_backend->find_devices(bus, &devices);
         if (ret < 0)
             return ret;
 
@@ -191,7 +198,7 @@ int usb_find_devices(void)
             dev = tdev;
         }
 
-        usb_os_determine_children(bus);
+        usb_os_backend->determine_children(bus);
     }
 
     return changes;
@@ -199,10 +206,26 @@ int usb_find_devices(void)
 
 void usb_init(void)
 {
+    /* USB_BACKEND=sim runs against a simulated device, see sim.c */
+    if (getenv("USB_BACKEND") && !strcmp(getenv("USB_BACKEND"), "sim"))
+        usb_os_backend = &usb_sim_backend;
+
     if (getenv("USB_DEBUG"))
         usb_set_debug(atoi(getenv("USB_DEBUG")));
+    if (getenv("USB_DEBUG_ASYNC"))
+        usb_set_debug_async(atoi(getenv("USB_DEBUG_ASYNC")));
+
+#ifdef _WIN32
+    /* USB_CAPTURE=<file.pcapng>, USB_CAPTURE_SNAPLEN=<bytes> */
+    if (getenv("USB_CAPTURE") && !_usb_capture_enabled)
+    {
+        usb_capture_start(getenv("USB_CAPTURE"),
+                          getenv("USB_CAPTURE_SNAPLEN")
+                          ? atoi(getenv("USB_CAPTURE_SNAPLEN")) : 0);
+    }
+#endif
 
-    usb_os_init();
+    usb_os_backend->init();
 }
 
 usb_dev_handle *usb_open(struct usb_device *dev)
@@ -217,8 +240,10 @@ usb_dev_handle *usb_open(struct usb_device *dev)
     udev->device = dev;
     udev->bus = dev->bus;
     udev->config = udev->interface = udev->altsetting = -1;
+    udev->claimed_interfaces = 0;
+    udev->backend_info = NULL;
 
-    if (usb_os_open(udev) < 0)
+    if (usb_os_backend->open(udev) < 0)
     {
         free(udev);
         return NULL;
@@ -287,14 +312,296 @@ int usb_get_string_simple(usb_dev_handle *dev, int index, char *buf, size_t bufl
 
 int usb_close(usb_dev_handle *dev)
 {
-    int ret;
+    int ret, i;
 
-    ret = usb_os_close(dev);
+    for (i = 0; dev->claimed_interfaces && i < USB_MAXINTERFACES; i++)
+    {
+        if (dev->claimed_interfaces & (1U << i))
+            usb_release_interface(dev, i);
+    }
+
+    ret = usb_os_backend->close(dev);
     free(dev);
 
     return ret;
 }
 
+int usb_set_configuration(usb_dev_handle *dev, int configuration)
+{
+    int ret;
+
+    if (dev->config == configuration)
+        return 0;
+
+    if (dev->claimed_interfaces)
+    {
+        USBERR0("can't change configuration, an interface is still in use (claimed)\n");
+        return -EINVAL;
+    }
+
+    ret = usb_os_backend->set_configuration(dev, configuration);
+    if (ret < 0)
+        return ret;
+
+    dev->config = configuration;
+    dev->interface = -1;
+    dev->altsetting = -1;
+
+    return 0;
+}
+
+int usb_claim_interface(usb_dev_handle *dev, int interface)
+{
+    int ret;
+
+    if (!dev->config)
+    {
+        USBERR("could not claim interface %d, invalid configuration %d\n", interface, dev->config);
+        return -EINVAL;
+    }
+
+    if (interface < 0 || interface >= USB_MAXINTERFACES)
+    {
+        USBERR("invalid interface %d\n", interface);
+        return -EINVAL;
+    }
+
+    /* already claimed, it becomes the interface of usb_set_altinterface() */
+    if (dev->claimed_interfaces & (1U << interface))
+    {
+        dev->interface = interface;
+        dev->altsetting = dev->altsettings[interface];
+        return 0;
+    }
+
+    ret = usb_os_backend->claim_interface(dev, interface);
+    if (ret < 0)
+        return ret;
+
+    dev->claimed_interfaces |= 1U << interface;
+    dev->altsettings[interface] = 0;
+    dev->interface = interface;
+    dev->altsetting = 0;
+
+    return 0;
+}
+
+int usb_release_interface(usb_dev_handle *dev, int interface)
+{
+    int ret, i;
+
+    if (!dev->config)
+    {
+        USBERR("could not release interface %d, invalid configuration %d\n", interface, dev->config);
+        return -EINVAL;
+    }
+
+    if (interface < 0 || interface >= USB_MAXINTERFACES)
+    {
+        USBERR("invalid interface %d\n", interface);
+        return -EINVAL;
+    }
+
+    ret = usb_os_backend->release_interface(dev, interface);
+    if (ret < 0)
+        return ret;
+
+    dev->claimed_interfaces &= ~(1U << interface);
+
+    if (dev->interface == interface)
+    {
+        /* fall back to another interface that is still claimed */
+        dev->interface = -1;
+        dev->altsetting = -1;
+        for (i = USB_MAXINTERFACES - 1; i >= 0; i--)
+        {
+            if (dev->claimed_interfaces & (1U << i))
+            {
+                dev->interface = i;
+                dev->altsetting = dev->altsettings[i];
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int usb_set_altinterface(usb_dev_handle *dev, int alternate)
+{
+    if (dev->interface < 0)
+    {
+        USBERR("could not set alt interface %d: no interface claimed\n", alternate);
+        return -EINVAL;
+    }
+
+    return usb_set_altinterface_ex(dev, dev->interface, alternate);
+}
+
+int usb_set_altinterface_ex(usb_dev_handle *dev, int interface, int alternate)
+{
+    int ret;
+
+    if (dev->config <= 0)
+    {
+        USBERR("could not set alt interface %d: invalid configuration %d\n", alternate, dev->config);
+        return -EINVAL;
+    }
+
+    if (interface < 0 || interface >= USB_MAXINTERFACES
+            || !(dev->claimed_interfaces & (1U << interface)))
+    {
+        USBERR("could not set alt interface %d: interface %d not claimed\n",
+               alternate, interface);
+        return -EINVAL;
+    }
+
+    ret = usb_os_backend->set_altinterface(dev, interface, alternate);
+    if (ret < 0)
+        return ret;
+
+    dev->altsettings[interface] = alternate;
+    if (dev->interface == interface)
+        dev->altsetting = alternate;
+
+    return 0;
+}
+
+int usb_control_msg(usb_dev_handle *dev, int requesttype, int request,
+                    int value, int index, char *bytes, int size, int timeout)
+{
+    return usb_os_backend->control_msg(dev, requesttype, request, value,
+                                       index, bytes, size, timeout);
+}
+
+int usb_isochronous_setup_async(usb_dev_handle *dev, void **context,
+                                unsigned char ep, int pktsize)
+{
+    return usb_os_backend->setup_async(dev, context,
+                                       USB_ENDPOINT_TYPE_ISOCHRONOUS,
+                                       ep, pktsize);
+}
+
+int usb_bulk_setup_async(usb_dev_handle *dev, void **context, unsigned char ep)
+{
+    return usb_os_backend->setup_async(dev, context, USB_ENDPOINT_TYPE_BULK,
+                                       ep, 0);
+}
+
+int usb_interrupt_setup_async(usb_dev_handle *dev, void **context,
+                              unsigned char ep)
+{
+    return usb_os_backend->setup_async(dev, context,
+                                       USB_ENDPOINT_TYPE_INTERRUPT, ep, 0);
+}
+
+int usb_submit_async(void *context, char *bytes, int size)
+{
+    return usb_os_backend->submit_async(context, bytes, size);
+}
+
+int usb_reap_async(void *context, int timeout)
+{
+    return usb_os_backend->reap_async(context, timeout, TRUE);
+}
+
+int usb_reap_async_nocancel(void *context, int timeout)
+{
+    return usb_os_backend->reap_async(context, timeout, FALSE);
+}
+
+int usb_cancel_async(void *context)
+{
+    return usb_os_backend->cancel_async(context);
+}
+
+int usb_free_async(void **context)
+{
+    return usb_os_backend->free_async(context);
+}
+
+static int _usb_transfer_sync(usb_dev_handle *dev, int type, int ep,
+                              int read, char *bytes, int size, int timeout)
+{
+    void *context = NULL;
+    int transmitted = 0;
+    int ret;
+
+    /* the backends take the direction from the endpoint address */
+    if (!(ep & USB_ENDPOINT_IN) != !read)
+    {
+        USBERR("invalid endpoint 0x%02x\n", ep);
+        return -EINVAL;
+    }
+
+    if (!timeout)
+        timeout = INFINITE;
+
+    ret = usb_os_backend->setup_async(dev, &context, type,
+                                      (unsigned char)ep, 0);
+    if (ret < 0)
+        return ret;
+
+    ret = usb_submit_async(context, bytes, size);
+    if (ret >= 0)
+    {
+        ret = usb_reap_async(context, timeout);
+        transmitted = ret;
+    }
+
+    usb_free_async(&context);
+
+    return transmitted;
+}
+
+int usb_bulk_write(usb_dev_handle *dev, int ep, char *bytes, int size,
+                   int timeout)
+{
+    return _usb_transfer_sync(dev, USB_ENDPOINT_TYPE_BULK,
+                              ep, FALSE, bytes, size, timeout);
+}
+
+int usb_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size,
+                  int timeout)
+{
+    return _usb_transfer_sync(dev, USB_ENDPOINT_TYPE_BULK,
+                              ep, TRUE, bytes, size, timeout);
+}
+
+int usb_interrupt_write(usb_dev_handle *dev, int ep, char *bytes, int size,
+                        int timeout)
+{
+    return _usb_transfer_sync(dev, USB_ENDPOINT_TYPE_INTERRUPT,
+                              ep, FALSE, bytes, size, timeout);
+}
+
+int usb_interrupt_read(usb_dev_handle *dev, int ep, char *bytes, int size,
+                       int timeout)
+{
+    return _usb_transfer_sync(dev, USB_ENDPOINT_TYPE_INTERRUPT,
+                              ep, TRUE, bytes, size, timeout);
+}
+
+int usb_clear_halt(usb_dev_handle *dev, unsigned int ep)
+{
+    return usb_os_backend->clear_halt(dev, ep);
+}
+
+int usb_resetep(usb_dev_handle *dev, unsigned int ep)
+{
+    return usb_os_backend->resetep(dev, ep);
+}
+
+int usb_reset(usb_dev_handle *dev)
+{
+    return usb_os_backend->reset(dev);
+}
+
+int usb_reset_ex(usb_dev_handle *dev, unsigned int reset_type)
+{
+    return usb_os_backend->reset_ex(dev, reset_type);
+}
+
 struct usb_device *usb_device(usb_dev_handle *dev)
 {
     return dev->device;
@@ -317,3 +624,16 @@ void usb_free_bus(struct usb_bus *bus)
     free(bus);
 }
 
+
+#ifndef _WIN32
+/* windows.c also passes the level to the driver */
+void usb_set_debug(int level)
+{
+    usb_log_set_level(level);
+}
+
+int usb_set_debug_async(int enable)
+{
+    return usb_log_set_async(enable);
+}
+#endif
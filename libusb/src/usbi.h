@@ -1,6 +1,7 @@
 #ifndef _USBI_H_
 #define _USBI_H_
 
+#include "usbi_os.h"
 #include "lusb0_usb.h"
 
 #include "error.h"
@@ -53,8 +54,16 @@ struct usb_dev_handle
     int interface;
     int altsetting;
 
+    /* all interfaces claimed through this handle and their alternate */
+    /* settings. interface and altsetting above are the last one claimed */
+    unsigned int claimed_interfaces;
+    int altsettings[USB_MAXINTERFACES];
+
     /* Added by RMT so implementations can store other per-open-device data */
     void *impl_info;
+
+    /* per-open-device data of backends that don't use impl_info */
+    void *backend_info;
 };
 
 /* descriptors.c */
@@ -64,13 +73,65 @@ int usb_parse_configuration(struct usb_config_descriptor *config,
 void usb_fetch_and_parse_descriptors(usb_dev_handle *udev);
 void usb_destroy_configuration(struct usb_device *dev);
 
-/* OS specific routines */
-int usb_os_find_busses(struct usb_bus **busses);
-int usb_os_find_devices(struct usb_bus *bus, struct usb_device **devices);
-int usb_os_determine_children(struct usb_bus *bus);
-void usb_os_init(void);
-int usb_os_open(usb_dev_handle *dev);
-int usb_os_close(usb_dev_handle *dev);
+/* OS specific routines. usb.c does the argument checks and the interface */
+/* bookkeeping and then calls the selected backend. windows.c talks to */
+/* the driver, sim.c simulates a device in process (USB_BACKEND=sim) */
+struct usb_os_backend
+{
+    const char *name;
+
+    void (*init)(void);
+    int (*find_busses)(struct usb_bus **busses);
+    int (*find_devices)(struct usb_bus *bus, struct usb_device **devices);
+    int (*determine_children)(struct usb_bus *bus);
+
+    int (*open)(usb_dev_handle *dev);
+    int (*close)(usb_dev_handle *dev);
+    int (*set_configuration)(usb_dev_handle *dev, int configuration);
+    int (*claim_interface)(usb_dev_handle *dev, int interface);
+    int (*release_interface)(usb_dev_handle *dev, int interface);
+    int (*set_altinterface)(usb_dev_handle *dev, int interface,
+                            int alternate);
+    int (*control_msg)(usb_dev_handle *dev, int requesttype, int request,
+                       int value, int index, char *bytes, int size,
+                       int timeout);
+
+    /* type is one of USB_ENDPOINT_TYPE_XXX, the direction comes from ep */
+    int (*setup_async)(usb_dev_handle *dev, void **context, int type,
+                       unsigned char ep, int pktsize);
+    int (*submit_async)(void *context, char *bytes, int size);
+    int (*reap_async)(void *context, int timeout, int cancel);
+    int (*cancel_async)(void *context);
+    int (*free_async)(void **context);
+
+    int (*clear_halt)(usb_dev_handle *dev, unsigned int ep);
+    int (*resetep)(usb_dev_handle *dev, unsigned int ep);
+    int (*reset)(usb_dev_handle *dev);
+    int (*reset_ex)(usb_dev_handle *dev, unsigned int reset_type);
+};
+
+extern const struct usb_os_backend *usb_os_backend;
+
+/* windows.c */
+extern const struct usb_os_backend usb_windows_backend;
+
+/* sim.c */
+extern const struct usb_os_backend usb_sim_backend;
+
+/* capture.c */
+extern volatile LONG _usb_capture_enabled;
+
+void _usb_capture_init(void);
+void _usb_capture_thread_exit(void);
+void _usb_capture_deinit(void);
+void _usb_capture_transfer(usb_dev_handle *dev, void *id,
+                           unsigned int control_code, int endpoint,
+                           int complete, int ret,
+                           const void *data, int length);
+int _usb_capture_control_id(void);
+void _usb_capture_control(usb_dev_handle *dev, int id, int requesttype,
+                          int request, int value, int index, int complete,
+                          int ret, const void *data, int length);
 
 void usb_free_dev(struct usb_device *dev);
 void usb_free_bus(struct usb_bus *bus);
@@ -0,0 +1,156 @@
+/* libusb-win32, Generic Windows USB Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _USBI_OS_H_
+#define _USBI_OS_H_
+
+/* Locks, threads and time for the library core (usb.c, descriptors.c, */
+/* error.c) and the simulated backend. They also build on non-Windows */
+/* hosts, see 'make host-check'. The rest of the dll uses Win32 directly */
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+typedef CRITICAL_SECTION usbi_mutex_t;
+
+#define usbi_mutex_init(mutex)    InitializeCriticalSection(mutex)
+#define usbi_mutex_destroy(mutex) DeleteCriticalSection(mutex)
+#define usbi_mutex_lock(mutex)    EnterCriticalSection(mutex)
+#define usbi_mutex_unlock(mutex)  LeaveCriticalSection(mutex)
+
+typedef HANDLE usbi_thread_t;
+
+/* defines a thread function, it ends with USBI_THREAD_RETURN */
+#define USBI_THREAD_PROC(name, arg) DWORD WINAPI name(LPVOID arg)
+#define USBI_THREAD_RETURN return 0
+
+static __inline int usbi_thread_create(usbi_thread_t *thread,
+                                       LPTHREAD_START_ROUTINE proc,
+                                       void *arg)
+{
+    *thread = CreateThread(NULL, 0, proc, arg, 0, NULL);
+    return *thread ? 0 : -1;
+}
+
+static __inline void usbi_thread_join(usbi_thread_t thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+#define usbi_sleep_ms(ms) Sleep(ms)
+#define usbi_yield()      SwitchToThread()
+
+/* a monotonic clock running at usbi_clock_frequency() ticks per second */
+static __inline LONGLONG usbi_clock(void)
+{
+    LARGE_INTEGER counter;
+
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+static __inline LONGLONG usbi_clock_frequency(void)
+{
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceFrequency(&frequency);
+    return frequency.QuadPart;
+}
+
+#else /* !_WIN32 */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef int LONG;
+typedef long long LONGLONG;
+typedef unsigned long DWORD;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define INVALID_HANDLE_VALUE ((HANDLE)(long)-1)
+
+#define INFINITE 0xFFFFFFFF
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+
+#define _snprintf  snprintf
+#define _vsnprintf vsnprintf
+
+typedef pthread_mutex_t usbi_mutex_t;
+
+#define usbi_mutex_init(mutex)    pthread_mutex_init(mutex, NULL)
+#define usbi_mutex_destroy(mutex) pthread_mutex_destroy(mutex)
+#define usbi_mutex_lock(mutex)    pthread_mutex_lock(mutex)
+#define usbi_mutex_unlock(mutex)  pthread_mutex_unlock(mutex)
+
+typedef pthread_t usbi_thread_t;
+
+#define USBI_THREAD_PROC(name, arg) void *name(void *arg)
+#define USBI_THREAD_RETURN return NULL
+
+static inline int usbi_thread_create(usbi_thread_t *thread,
+                                     void *(*proc)(void *), void *arg)
+{
+    return pthread_create(thread, NULL, proc, arg) ? -1 : 0;
+}
+
+static inline void usbi_thread_join(usbi_thread_t thread)
+{
+    pthread_join(thread, NULL);
+}
+
+static inline void usbi_sleep_ms(DWORD ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+}
+
+#define usbi_yield() sched_yield()
+
+static inline LONGLONG usbi_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (LONGLONG)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline LONGLONG usbi_clock_frequency(void)
+{
+    return 1000000000;
+}
+
+#endif /* _WIN32 */
+
+#endif /* _USBI_OS_H_ */
@@ -65,9 +65,6 @@ static struct usb_version _usb_version =
 static int _usb_setup_async(usb_dev_handle *dev, void **context,
                             DWORD control_code,
                             unsigned char ep, int pktsize);
-static int _usb_transfer_sync(usb_dev_handle *dev, int control_code,
-                              int ep, int pktsize, char *bytes, int size,
-                              int timeout);
 
 static int usb_get_configuration(usb_dev_handle *dev, bool_t cached);
 static int _usb_cancel_io(usb_context_t *context);
@@ -75,7 +72,6 @@ static int _usb_abort_ep(usb_dev_handle *dev, unsigned int ep);
 
 static int _usb_io_sync(HANDLE dev, unsigned int code, void *in, int in_size,
                         void *out, int out_size, int *ret);
-static int _usb_reap_async(void *context, int timeout, int cancel);
 static int _usb_add_virtual_hub(struct usb_bus *bus);
 
 static void _usb_free_bus_list(struct usb_bus *bus);
@@ -88,13 +84,19 @@ BOOL WINAPI DllMain(HANDLE module, DWORD reason, LPVOID reserved)
     switch (reason)
     {
     case DLL_PROCESS_ATTACH:
+        usb_log_init();
+        _usb_capture_init();
         break;
     case DLL_PROCESS_DETACH:
         _usb_deinit();
+        _usb_capture_deinit();
+        usb_log_deinit();
         break;
     case DLL_THREAD_ATTACH:
         break;
     case DLL_THREAD_DETACH:
+        _usb_capture_thread_exit();
+        usb_log_thread_exit();
         break;
     default:
         break;
@@ -139,7 +141,7 @@ static int usb_get_configuration(usb_dev_handle *dev, bool_t cached)
 	return config;
 }
 
-int usb_os_open(usb_dev_handle *dev)
+static int win_open(usb_dev_handle *dev)
 {
 	char dev_name[LIBUSB_PATH_MAX];
 	char *p;
@@ -190,25 +192,18 @@ int usb_os_open(usb_dev_handle *dev)
 	return 0;
 }
 
-int usb_os_close(usb_dev_handle *dev)
+static int win_close(usb_dev_handle *dev)
 {
     if (dev->impl_info != INVALID_HANDLE_VALUE)
     {
-        if (dev->interface >= 0)
-        {
-            usb_release_interface(dev, dev->interface);
-        }
-
         CloseHandle(dev->impl_info);
         dev->impl_info = INVALID_HANDLE_VALUE;
-        dev->interface = -1;
-        dev->altsetting = -1;
     }
 
     return 0;
 }
 
-int usb_set_configuration(usb_dev_handle *dev, int configuration)
+static int win_set_configuration(usb_dev_handle *dev, int configuration)
 {
     libusb_request req;
 
@@ -218,17 +213,6 @@ int usb_set_configuration(usb_dev_handle *dev, int configuration)
         return -EINVAL;
     }
 
-    if (dev->config == configuration)
-    {
-        return 0;
-    }
-
-    if (dev->interface >= 0)
-    {
-        USBERR0("can't change configuration, an interface is still in use (claimed)\n");
-        return -EINVAL;
-    }
-
     req.configuration.configuration = configuration;
     req.timeout = LIBUSB_DEFAULT_TIMEOUT;
 
@@ -240,14 +224,10 @@ int usb_set_configuration(usb_dev_handle *dev, int configuration)
         return -usb_win_error_to_errno();
     }
 
-    dev->config = configuration;
-    dev->interface = -1;
-    dev->altsetting = -1;
-
     return 0;
 }
 
-int usb_claim_interface(usb_dev_handle *dev, int interface)
+static int win_claim_interface(usb_dev_handle *dev, int interface)
 {
     libusb_request req;
 
@@ -257,17 +237,6 @@ int usb_claim_interface(usb_dev_handle *dev, int interface)
         return -EINVAL;
     }
 
-    if (!dev->config)
-    {
-        USBERR("could not claim interface %d, invalid configuration %d\n", interface, dev->config);
-        return -EINVAL;
-    }
-
-    if (dev->interface == interface)
-    {
-        return 0;
-    }
-
     req.intf.interface_number = interface;
 
     if (!_usb_io_sync(dev->impl_info, LIBUSB_IOCTL_CLAIM_INTERFACE,
@@ -277,15 +246,11 @@ int usb_claim_interface(usb_dev_handle *dev, int interface)
                   "win error: %s", interface, usb_win_error_to_string());
         return -usb_win_error_to_errno();
     }
-    else
-    {
-        dev->interface = interface;
-        dev->altsetting = 0;
-        return 0;
-    }
+
+    return 0;
 }
 
-int usb_release_interface(usb_dev_handle *dev, int interface)
+static int win_release_interface(usb_dev_handle *dev, int interface)
 {
     libusb_request req;
 
@@ -295,12 +260,6 @@ int usb_release_interface(usb_dev_handle *dev, int interface)
         return -EINVAL;
     }
 
-    if (!dev->config)
-    {
-        USBERR("could not release interface %d, invalid configuration %d\n", interface, dev->config);
-        return -EINVAL;
-    }
-
     req.intf.interface_number = interface;
 
     if (!_usb_io_sync(dev->impl_info, LIBUSB_IOCTL_RELEASE_INTERFACE,
@@ -310,16 +269,12 @@ int usb_release_interface(usb_dev_handle *dev, int interface)
                   "win error: %s", interface, usb_win_error_to_string());
         return -usb_win_error_to_errno();
     }
-    else
-    {
-        dev->interface = -1;
-        dev->altsetting = -1;
 
-        return 0;
-    }
+    return 0;
 }
 
-int usb_set_altinterface(usb_dev_handle *dev, int alternate)
+static int win_set_altinterface(usb_dev_handle *dev, int interface,
+                                int alternate)
 {
     libusb_request req;
 
@@ -329,19 +284,7 @@ int usb_set_altinterface(usb_dev_handle *dev, int alternate)
         return -EINVAL;
     }
 
-    if (dev->config <= 0)
-    {
-        USBERR("could not set alt interface %d: invalid configuration %d\n", alternate, dev->config);
-        return -EINVAL;
-    }
-
-    if (dev->interface < 0)
-    {
-        USBERR("could not set alt interface %d: no interface claimed\n", alternate);
-        return -EINVAL;
-    }
-
-    req.intf.interface_number = dev->interface;
+    req.intf.interface_number = interface;
     req.intf.altsetting_number = alternate;
     req.timeout = LIBUSB_DEFAULT_TIMEOUT;
 
@@ -351,12 +294,10 @@ int usb_set_altinterface(usb_dev_handle *dev, int alternate)
     {
         USBERR("could not set alt interface "
                   "%d/%d: win error: %s",
-                  dev->interface, alternate, usb_win_error_to_string());
+                  interface, alternate, usb_win_error_to_string());
         return -usb_win_error_to_errno();
     }
 
-    dev->altsetting = alternate;
-
     return 0;
 }
 
@@ -411,7 +352,28 @@ static int _usb_setup_async(usb_dev_handle *dev, void **context,
     return 0;
 }
 
-int usb_submit_async(void *context, char *bytes, int size)
+static int win_setup_async(usb_dev_handle *dev, void **context, int type,
+                           unsigned char ep, int pktsize)
+{
+    DWORD control_code;
+
+    if (type == USB_ENDPOINT_TYPE_ISOCHRONOUS)
+    {
+        control_code = (ep & USB_ENDPOINT_IN)
+                       ? LIBUSB_IOCTL_ISOCHRONOUS_READ
+                       : LIBUSB_IOCTL_ISOCHRONOUS_WRITE;
+    }
+    else
+    {
+        control_code = (ep & USB_ENDPOINT_IN)
+                       ? LIBUSB_IOCTL_INTERRUPT_OR_BULK_READ
+                       : LIBUSB_IOCTL_INTERRUPT_OR_BULK_WRITE;
+    }
+
+    return _usb_setup_async(dev, context, control_code, ep, pktsize);
+}
+
+static int win_submit_async(void *context, char *bytes, int size)
 {
     usb_context_t *c = (usb_context_t *)context;
 
@@ -433,9 +395,9 @@ int usb_submit_async(void *context, char *bytes, int size)
         return -EINVAL;
     }
 
-    if (c->dev->interface < 0)
+    if (!c->dev->claimed_interfaces)
     {
-        USBERR("invalid interface %d\n", c->dev->interface);
+        USBERR0("no interface claimed\n");
         return -EINVAL;
     }
 
@@ -445,6 +407,13 @@ int usb_submit_async(void *context, char *bytes, int size)
     c->bytes = bytes;
     c->size = size;
 
+    if (_usb_capture_enabled)
+    {
+        _usb_capture_transfer(c->dev, c, c->control_code,
+                              c->req.endpoint.endpoint, FALSE, 0,
+                              c->bytes, c->size);
+    }
+
     ResetEvent(c->ol.hEvent);
 
     if (!DeviceIoControl(c->dev->impl_info,
@@ -464,60 +433,155 @@ int usb_submit_async(void *context, char *bytes, int size)
     return 0;
 }
 
-static int _usb_reap_async(void *context, int timeout, int cancel)
+int usb_register_buffer(usb_dev_handle *dev, int ep, void *bytes, int size,
+                        unsigned int *token)
 {
-    usb_context_t *c = (usb_context_t *)context;
-    ULONG ret = 0;
+    libusb_request req;
+    int ret;
 
-    if (!c)
+    if (dev->impl_info == INVALID_HANDLE_VALUE)
     {
-        USBERR0("invalid context\n");
+        USBERR0("device not open\n");
         return -EINVAL;
     }
 
-    if (WaitForSingleObject(c->ol.hEvent, timeout) == WAIT_TIMEOUT)
+    if (!bytes || size <= 0 || !token)
     {
-        /* request timed out */
-        if (cancel)
-        {
-            _usb_cancel_io(c);
-        }
-
-        USBERR0("timeout error\n");
-        return -ETRANSFER_TIMEDOUT;
+        USBERR("invalid buffer %p size %d\n", bytes, size);
+        return -EINVAL;
     }
 
-    if (!GetOverlappedResult(c->dev->impl_info, &c->ol, &ret, TRUE))
+    memset(&req, 0, sizeof(req));
+
+    /* the driver returns the token as the byte count */
+    if (!_usb_io_sync(dev->impl_info,
+                      (ep & USB_ENDPOINT_DIR_MASK)
+                      ? LIBUSB_IOCTL_REGISTER_READ_BUFFER
+                      : LIBUSB_IOCTL_REGISTER_WRITE_BUFFER,
+                      &req, sizeof(libusb_request),
+                      bytes, size, &ret))
     {
-        USBERR("reaping request failed, win error: %s\n",usb_win_error_to_string());
+        USBERR("could not register buffer, win error: %s\n", usb_win_error_to_string());
         return -usb_win_error_to_errno();
     }
 
-    return ret;
+    *token = (unsigned int)ret;
+
+    return 0;
 }
 
-int usb_reap_async(void *context, int timeout)
+int usb_unregister_buffer(usb_dev_handle *dev, unsigned int token)
 {
-    return _usb_reap_async(context, timeout, TRUE);
+    libusb_request req;
+
+    if (dev->impl_info == INVALID_HANDLE_VALUE)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.buffer.token = token;
+
+    if (!_usb_io_sync(dev->impl_info, LIBUSB_IOCTL_UNREGISTER_BUFFER,
+                      &req, sizeof(libusb_request), NULL, 0, NULL))
+    {
+        USBERR("could not unregister buffer %08x, win error: %s\n",
+               token, usb_win_error_to_string());
+        return -usb_win_error_to_errno();
+    }
+
+    return 0;
 }
 
-int usb_reap_async_nocancel(void *context, int timeout)
+int usb_submit_async_registered(void *context, unsigned int token,
+                                int offset, int size)
 {
-    return _usb_reap_async(context, timeout, FALSE);
-}
+    usb_context_t *c = (usb_context_t *)context;
+    libusb_request req;
+    DWORD control_code;
 
+    if (!c)
+    {
+        USBERR0("invalid context");
+        return -EINVAL;
+    }
 
-int usb_cancel_async(void *context)
-{
-    /* NOTE that this function will cancel all pending URBs */
-    /* on the same endpoint as this particular context, or even */
-    /* all pending URBs for this particular device. */
+    if (c->dev->impl_info == INVALID_HANDLE_VALUE)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
 
+    if (c->control_code == LIBUSB_IOCTL_INTERRUPT_OR_BULK_READ)
+    {
+        control_code = LIBUSB_IOCTL_REGISTERED_BUFFER_READ;
+    }
+    else if (c->control_code == LIBUSB_IOCTL_INTERRUPT_OR_BULK_WRITE)
+    {
+        control_code = LIBUSB_IOCTL_REGISTERED_BUFFER_WRITE;
+    }
+    else
+    {
+        USBERR0("registered buffers require a bulk or interrupt context\n");
+        return -EINVAL;
+    }
+
+    if (offset < 0 || size < 0)
+    {
+        USBERR("invalid offset %d size %d\n", offset, size);
+        return -EINVAL;
+    }
+
+    /* the request is copied by the I/O manager, it can live on the stack */
+    memset(&req, 0, sizeof(req));
+    req.registered.endpoint = c->req.endpoint.endpoint;
+    req.registered.token = token;
+    req.registered.offset = offset;
+    req.registered.length = size;
+    req.registered.transfer_flags = c->req.endpoint.transfer_flags;
+
+    c->ol.Offset = 0;
+    c->ol.OffsetHigh = 0;
+    c->bytes = NULL;
+    c->size = size;
+
+    /* the payload lives in the registered buffer, only the lengths */
+    /* are recorded */
+    if (_usb_capture_enabled)
+    {
+        _usb_capture_transfer(c->dev, c, c->control_code,
+                              c->req.endpoint.endpoint, FALSE, 0,
+                              NULL, c->size);
+    }
+
+    ResetEvent(c->ol.hEvent);
+
+    if (!DeviceIoControl(c->dev->impl_info, control_code,
+                         &req, sizeof(libusb_request),
+                         NULL, 0, NULL, &c->ol))
+    {
+        if (GetLastError() != ERROR_IO_PENDING)
+        {
+            USBERR("submitting request failed, "
+                      "win error: %s", usb_win_error_to_string());
+            return -usb_win_error_to_errno();
+        }
+    }
+
+    return 0;
+}
+
+int usb_submit_async_iso(void *context, char *bytes, int packet_count)
+{
     usb_context_t *c = (usb_context_t *)context;
+    libusb_request req;
+    DWORD control_code;
+    int packet_size;
 
     if (!c)
     {
-        USBERR0("invalid context\n");
+        USBERR0("invalid context");
         return -EINVAL;
     }
 
@@ -527,124 +591,556 @@ int usb_cancel_async(void *context)
         return -EINVAL;
     }
 
-    _usb_cancel_io(c);
+    if (c->control_code == LIBUSB_IOCTL_ISOCHRONOUS_READ)
+    {
+        control_code = LIBUSB_IOCTL_ISOCHRONOUS_READ_PACKETS;
+    }
+    else if (c->control_code == LIBUSB_IOCTL_ISOCHRONOUS_WRITE)
+    {
+        control_code = LIBUSB_IOCTL_ISOCHRONOUS_WRITE_PACKETS;
+    }
+    else
+    {
+        USBERR0("packet results require an isochronous context\n");
+        return -EINVAL;
+    }
+
+    /* the buffer layout depends on it, the driver can not pick a default */
+    packet_size = c->req.endpoint.packet_size;
+
+    if (!bytes || packet_size <= 0 || packet_count <= 0
+            || packet_count > (0x7ffffff0 / packet_size))
+    {
+        USBERR("invalid packet size %d count %d\n", packet_size, packet_count);
+        return -EINVAL;
+    }
+
+    /* the request is copied by the I/O manager, it can live on the stack */
+    memset(&req, 0, sizeof(req));
+    req.iso_packets.endpoint = c->req.endpoint.endpoint;
+    req.iso_packets.packet_size = packet_size;
+    req.iso_packets.packet_count = packet_count;
+    req.iso_packets.transfer_flags = c->req.endpoint.transfer_flags;
+    req.iso_packets.iso_start_frame_latency = c->req.endpoint.iso_start_frame_latency;
+
+    c->ol.Offset = 0;
+    c->ol.OffsetHigh = 0;
+    c->bytes = bytes;
+    c->size = USB_ISO_BUFFER_SIZE(packet_size, packet_count);
+
+    if (_usb_capture_enabled)
+    {
+        _usb_capture_transfer(c->dev, c, control_code,
+                              c->req.endpoint.endpoint, FALSE, 0,
+                              c->bytes, c->size);
+    }
+
+    ResetEvent(c->ol.hEvent);
+
+    if (!DeviceIoControl(c->dev->impl_info, control_code,
+                         &req, sizeof(libusb_request),
+                         c->bytes, c->size, NULL, &c->ol))
+    {
+        if (GetLastError() != ERROR_IO_PENDING)
+        {
+            USBERR("submitting request failed, "
+                      "win error: %s", usb_win_error_to_string());
+            return -usb_win_error_to_errno();
+        }
+    }
 
     return 0;
 }
 
-int usb_free_async(void **context)
+int usb_set_read_ahead(usb_dev_handle *dev, int ep, int urb_count,
+                       int report_count)
 {
-    usb_context_t **c = (usb_context_t **)context;
+    libusb_request req;
 
-    if (!*c)
+    if (dev->impl_info == INVALID_HANDLE_VALUE)
     {
-        USBERR0("invalid context\n");
+        USBERR0("device not open\n");
         return -EINVAL;
     }
 
-    if (!CloseHandle((*c)->ol.hEvent))
+    if (!(ep & USB_ENDPOINT_IN) || urb_count < 0 || report_count < 0)
     {
-      USBERR("close event failed: win error: %s", usb_win_error_to_string());
-      return -usb_win_error_to_errno();
+        USBERR("invalid read-ahead settings ep=0x%02x urbs=%d reports=%d\n",
+               ep, urb_count, report_count);
+        return -EINVAL;
     }
 
-    free(*c);
-    *c = NULL;
+    memset(&req, 0, sizeof(req));
+    req.timeout = LIBUSB_DEFAULT_TIMEOUT;
+    req.read_ahead.endpoint = ep;
+    req.read_ahead.urb_count = urb_count;
+    req.read_ahead.ring_count = report_count;
+
+    if (!_usb_io_sync(dev->impl_info, LIBUSB_IOCTL_SET_READ_AHEAD,
+                      &req, sizeof(libusb_request), NULL, 0, NULL))
+    {
+        USBERR("could not set read-ahead on ep 0x%02x, win error: %s\n",
+               ep, usb_win_error_to_string());
+        return -usb_win_error_to_errno();
+    }
 
     return 0;
 }
 
-static int _usb_transfer_sync(usb_dev_handle *dev, int control_code,
-                              int ep, int pktsize, char *bytes, int size,
-                              int timeout)
+int usb_get_endpoint_info(usb_dev_handle *dev, int ep,
+                          struct usb_endpoint_info *info)
 {
-    void *context = NULL;
-    int transmitted = 0;
-    int ret;
+    libusb_request req;
+    libusb_endpoint_info_t pipe;
+    int ret = 0;
 
-	if (!timeout) timeout=INFINITE;
-    ret = _usb_setup_async(dev, &context, control_code, (unsigned char )ep,
-                           pktsize);
+    if (dev->impl_info == INVALID_HANDLE_VALUE)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
 
-    if (ret < 0)
+    if (!info)
     {
-        return ret;
+        USBERR0("invalid info pointer\n");
+        return -EINVAL;
     }
 
-    ret = usb_submit_async(context, bytes, size);
-    if(ret >= 0)
+    memset(&req, 0, sizeof(req));
+    memset(&pipe, 0, sizeof(pipe));
+    req.timeout = LIBUSB_DEFAULT_TIMEOUT;
+    req.endpoint.endpoint = ep;
+
+    if (!_usb_io_sync(dev->impl_info, LIBUSB_IOCTL_GET_ENDPOINT_INFO,
+                      &req, sizeof(libusb_request), &pipe, sizeof(pipe), &ret)
+            || ret != sizeof(pipe))
     {
-      ret = usb_reap_async(context, timeout);
-      transmitted = ret;
+        USBERR("could not get info of ep 0x%02x, win error: %s\n",
+               ep, usb_win_error_to_string());
+        return -usb_win_error_to_errno();
     }
 
-    usb_free_async(&context);
+    /* USBD_PIPE_TYPE has the same values as bmAttributes */
+    info->endpoint = pipe.endpoint;
+    info->type = pipe.pipe_type;
+    info->interval = pipe.interval;
+    info->max_packet_size = pipe.maximum_packet_size;
+    info->max_transfer_size = pipe.maximum_transfer_size;
+    info->max_burst = pipe.max_burst;
+    info->mult = pipe.mult;
+    info->bytes_per_interval = pipe.bytes_per_interval;
+    info->speed = pipe.speed;
 
-    return transmitted;
+    return 0;
 }
 
-int usb_bulk_write(usb_dev_handle *dev, int ep, char *bytes, int size,
-                   int timeout)
+int usb_get_endpoint_stats(usb_dev_handle *dev, int ep,
+                           struct usb_endpoint_stats *stats,
+                           unsigned int flags)
 {
-    return _usb_transfer_sync(dev, LIBUSB_IOCTL_INTERRUPT_OR_BULK_WRITE,
-                              ep, 0, bytes, size, timeout);
+    libusb_request req;
+    libusb_endpoint_stats_t counters;
+    int ret = 0, i;
+
+    if (dev->impl_info == INVALID_HANDLE_VALUE)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
+
+    if (!stats)
+    {
+        USBERR0("invalid stats pointer\n");
+        return -EINVAL;
+    }
+
+    memset(&req, 0, sizeof(req));
+    memset(&counters, 0, sizeof(counters));
+    req.timeout = LIBUSB_DEFAULT_TIMEOUT;
+    req.statistics.endpoint = ep;
+    req.statistics.flags = (flags & USB_STATS_RESET) ? LIBUSB_STATS_FLAG_RESET : 0;
+
+    if (!_usb_io_sync(dev->impl_info, LIBUSB_IOCTL_GET_STATISTICS,
+                      &req, sizeof(libusb_request),
+                      &counters, sizeof(counters), &ret)
+            || ret != sizeof(counters))
+    {
+        USBERR("could not get statistics of ep 0x%02x, win error: %s\n",
+               ep, usb_win_error_to_string());
+        return -usb_win_error_to_errno();
+    }
+
+    stats->endpoint = counters.endpoint;
+    stats->pending = counters.pending;
+    stats->max_pending = counters.max_pending;
+    stats->irps = counters.irps;
+    stats->urbs = counters.urbs;
+    stats->bytes = counters.bytes;
+    stats->short_transfers = counters.short_transfers;
+    stats->stalls = counters.stalls;
+    stats->cancels = counters.cancels;
+    stats->errors = counters.errors;
+    for (i = 0; i < USB_STATS_LATENCY_BUCKETS && i < LIBUSB_STATS_LATENCY_BUCKETS; i++)
+        stats->latency[i] = counters.latency[i];
+
+    return 0;
 }
 
-int usb_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size,
-                  int timeout)
+int usb_set_trace(usb_dev_handle *dev, int record_count)
 {
-    return _usb_transfer_sync(dev, LIBUSB_IOCTL_INTERRUPT_OR_BULK_READ,
-                              ep, 0, bytes, size, timeout);
+    libusb_request req;
+
+    if (dev->impl_info == INVALID_HANDLE_VALUE)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
+
+    if (record_count < 0)
+    {
+        USBERR("invalid trace record count %d\n", record_count);
+        return -EINVAL;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.timeout = LIBUSB_DEFAULT_TIMEOUT;
+    req.trace.record_count = record_count;
+
+    if (!_usb_io_sync(dev->impl_info, LIBUSB_IOCTL_SET_TRACE,
+                      &req, sizeof(libusb_request), NULL, 0, NULL))
+    {
+        USBERR("could not set trace, win error: %s\n",
+               usb_win_error_to_string());
+        return -usb_win_error_to_errno();
+    }
+
+    return 0;
 }
 
-int usb_interrupt_write(usb_dev_handle *dev, int ep, char *bytes, int size,
-                        int timeout)
+int usb_read_trace(usb_dev_handle *dev, struct usb_trace_record *records,
+                   int count)
 {
-    return _usb_transfer_sync(dev, LIBUSB_IOCTL_INTERRUPT_OR_BULK_WRITE,
-                              ep, 0, bytes, size, timeout);
+    libusb_request req;
+    int ret = 0;
+
+    if (dev->impl_info == INVALID_HANDLE_VALUE)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
+
+    if (!records || count <= 0
+            || count > (int)(0x7fffffff / sizeof(struct usb_trace_record)))
+    {
+        USBERR("invalid trace buffer, count=%d\n", count);
+        return -EINVAL;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.timeout = LIBUSB_DEFAULT_TIMEOUT;
+
+    /* struct usb_trace_record has the layout of libusb_trace_record_t */
+    if (!_usb_io_sync(dev->impl_info, LIBUSB_IOCTL_READ_TRACE,
+                      &req, sizeof(libusb_request),
+                      records, count * sizeof(struct usb_trace_record), &ret))
+    {
+        USBERR("could not read trace, win error: %s\n",
+               usb_win_error_to_string());
+        return -usb_win_error_to_errno();
+    }
+
+    return ret / (int)sizeof(struct usb_trace_record);
 }
 
-int usb_interrupt_read(usb_dev_handle *dev, int ep, char *bytes, int size,
-                       int timeout)
+int usb_set_iso_stream(usb_dev_handle *dev, int ep, int packet_size,
+                       int packets_per_urb, int urb_count, int ring_packets)
 {
-    return _usb_transfer_sync(dev, LIBUSB_IOCTL_INTERRUPT_OR_BULK_READ,
-                              ep, 0, bytes, size, timeout);
+    libusb_request req;
+
+    if (dev->impl_info == INVALID_HANDLE_VALUE)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
+
+    if (!(ep & USB_ENDPOINT_IN) || packet_size < 0 || packets_per_urb < 0
+            || urb_count < 0 || ring_packets < 0)
+    {
+        USBERR("invalid iso stream settings ep=0x%02x packet-size=%d "
+               "packets-per-urb=%d urbs=%d packets=%d\n",
+               ep, packet_size, packets_per_urb, urb_count, ring_packets);
+        return -EINVAL;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.timeout = LIBUSB_DEFAULT_TIMEOUT;
+    req.iso_stream.endpoint = ep;
+    req.iso_stream.packet_size = packet_size;
+    req.iso_stream.packets_per_urb = packets_per_urb;
+    req.iso_stream.urb_count = urb_count;
+    req.iso_stream.ring_packets = ring_packets;
+
+    if (!_usb_io_sync(dev->impl_info, LIBUSB_IOCTL_SET_ISO_STREAM,
+                      &req, sizeof(libusb_request), NULL, 0, NULL))
+    {
+        USBERR("could not set iso stream on ep 0x%02x, win error: %s\n",
+               ep, usb_win_error_to_string());
+        return -usb_win_error_to_errno();
+    }
+
+    return 0;
 }
 
-int usb_isochronous_setup_async(usb_dev_handle *dev, void **context,
-                                unsigned char ep, int pktsize)
+typedef BOOL (WINAPI * cancel_io_ex_t)(HANDLE, LPOVERLAPPED);
+
+/* CancelIoEx() only exists on Vista and later, older systems can only */
+/* cancel all requests the calling thread issued on the handle */
+static void _usb_cancel_overlapped(HANDLE handle, OVERLAPPED *ol)
 {
-    if (ep & 0x80)
-        return _usb_setup_async(dev, context, LIBUSB_IOCTL_ISOCHRONOUS_READ,
-                                ep, pktsize);
+    static cancel_io_ex_t cancel_io_ex = NULL;
+    static bool_t cancel_io_ex_loaded = FALSE;
+    HMODULE kernel_dll;
+
+    if (!cancel_io_ex_loaded)
+    {
+        kernel_dll = GetModuleHandleA("kernel32.dll");
+        if (kernel_dll)
+        {
+            cancel_io_ex = (cancel_io_ex_t) GetProcAddress(kernel_dll,
+                                                           "CancelIoEx");
+        }
+        cancel_io_ex_loaded = TRUE;
+    }
+
+    if (cancel_io_ex)
+        cancel_io_ex(handle, ol);
     else
-        return _usb_setup_async(dev, context, LIBUSB_IOCTL_ISOCHRONOUS_WRITE,
-                                ep, pktsize);
+        CancelIo(handle);
 }
 
-int usb_bulk_setup_async(usb_dev_handle *dev, void **context, unsigned char ep)
+int usb_iso_stream_read(usb_dev_handle *dev, int ep, char *bytes,
+                        int packet_size, int packet_count, int timeout)
 {
-    if (ep & 0x80)
-        return _usb_setup_async(dev, context, LIBUSB_IOCTL_INTERRUPT_OR_BULK_READ,
-                                ep, 0);
-    else
-        return _usb_setup_async(dev, context, LIBUSB_IOCTL_INTERRUPT_OR_BULK_WRITE,
-                                ep, 0);
+    libusb_request req;
+    OVERLAPPED ol;
+    DWORD ret = 0;
+
+    if (dev->impl_info == INVALID_HANDLE_VALUE)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
+
+    if (!bytes || packet_size <= 0 || packet_count <= 0
+            || packet_count > (0x7ffffff0 / packet_size))
+    {
+        USBERR("invalid packet size %d count %d\n", packet_size, packet_count);
+        return -EINVAL;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.iso_packets.endpoint = ep;
+    req.iso_packets.packet_size = packet_size;
+    req.iso_packets.packet_count = packet_count;
+
+    memset(&ol, 0, sizeof(ol));
+    ol.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    if (!ol.hEvent)
+    {
+        USBERR("creating event failed: win error: %s",
+               usb_win_error_to_string());
+        return -usb_win_error_to_errno();
+    }
+
+    if (!DeviceIoControl(dev->impl_info, LIBUSB_IOCTL_ISO_STREAM_READ,
+                         &req, sizeof(libusb_request),
+                         bytes, USB_ISO_BUFFER_SIZE(packet_size, packet_count),
+                         NULL, &ol))
+    {
+        if (GetLastError() != ERROR_IO_PENDING)
+        {
+            USBERR("reading iso stream failed, win error: %s\n",
+                   usb_win_error_to_string());
+            CloseHandle(ol.hEvent);
+            return -usb_win_error_to_errno();
+        }
+    }
+
+    if (!timeout)
+        timeout = INFINITE;
+
+    /* aborting the endpoint would stop the stream, only cancel this read, */
+    /* not other requests on the handle. the buffer is in use until the */
+    /* request has completed */
+    if (WaitForSingleObject(ol.hEvent, timeout) == WAIT_TIMEOUT)
+    {
+        _usb_cancel_overlapped(dev->impl_info, &ol);
+        GetOverlappedResult(dev->impl_info, &ol, &ret, TRUE);
+        CloseHandle(ol.hEvent);
+
+        USBERR0("timeout error\n");
+        return -ETRANSFER_TIMEDOUT;
+    }
+
+    if (!GetOverlappedResult(dev->impl_info, &ol, &ret, TRUE))
+    {
+        USBERR("reading iso stream failed, win error: %s\n",
+               usb_win_error_to_string());
+        CloseHandle(ol.hEvent);
+        return -usb_win_error_to_errno();
+    }
+
+    CloseHandle(ol.hEvent);
+
+    /* the driver returns the number of packets */
+    return (int)ret;
 }
 
-int usb_interrupt_setup_async(usb_dev_handle *dev, void **context,
-                              unsigned char ep)
+HANDLE usb_open_endpoint_np(usb_dev_handle *dev, int ep, unsigned int flags)
 {
-    if (ep & 0x80)
-        return _usb_setup_async(dev, context, LIBUSB_IOCTL_INTERRUPT_OR_BULK_READ,
-                                ep, 0);
-    else
-        return _usb_setup_async(dev, context, LIBUSB_IOCTL_INTERRUPT_OR_BULK_WRITE,
-                                ep, 0);
+    char dev_name[LIBUSB_PATH_MAX];
+    char *p;
+    HANDLE handle;
+
+    if (!dev || !(ep & USB_ENDPOINT_ADDRESS_MASK))
+    {
+        USBERR("invalid endpoint 0x%02x\n", ep);
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    /* same file name as usb_os_open() with the endpoint appended */
+    strcpy(dev_name, dev->device->filename);
+
+    p = strstr(dev_name, "--");
+
+    if (!p)
+    {
+        USBERR("invalid file name %s\n", dev->device->filename);
+        SetLastError(ERROR_FILE_NOT_FOUND);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    sprintf(p, "\\ep%02x", ep & 0xff);
+
+    handle = CreateFile(dev_name, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                        OPEN_EXISTING, flags, NULL);
+
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        USBERR("failed to open %s: win error: %s",
+               dev_name, usb_win_error_to_string());
+    }
+
+    return handle;
+}
+
+static int win_reap_async(void *context, int timeout, int cancel)
+{
+    usb_context_t *c = (usb_context_t *)context;
+    ULONG ret = 0;
+    int error;
+
+    if (!c)
+    {
+        USBERR0("invalid context\n");
+        return -EINVAL;
+    }
+
+    if (WaitForSingleObject(c->ol.hEvent, timeout) == WAIT_TIMEOUT)
+    {
+        /* request timed out */
+        if (cancel)
+        {
+            _usb_cancel_io(c);
+
+            if (_usb_capture_enabled)
+            {
+                _usb_capture_transfer(c->dev, c, c->control_code,
+                                      c->req.endpoint.endpoint, TRUE,
+                                      -ETRANSFER_TIMEDOUT, NULL, 0);
+            }
+        }
+
+        USBERR0("timeout error\n");
+        return -ETRANSFER_TIMEDOUT;
+    }
+
+    if (!GetOverlappedResult(c->dev->impl_info, &c->ol, &ret, TRUE))
+    {
+        USBERR("reaping request failed, win error: %s\n",usb_win_error_to_string());
+        if (_usb_capture_enabled)
+        {
+            error = -usb_win_error_to_errno();
+            _usb_capture_transfer(c->dev, c, c->control_code,
+                                  c->req.endpoint.endpoint, TRUE,
+                                  error, NULL, 0);
+            return error;
+        }
+        return -usb_win_error_to_errno();
+    }
+
+    if (_usb_capture_enabled)
+    {
+        _usb_capture_transfer(c->dev, c, c->control_code,
+                              c->req.endpoint.endpoint, TRUE, (int)ret,
+                              c->bytes, (int)ret);
+    }
+
+    return ret;
 }
 
-int usb_control_msg(usb_dev_handle *dev, int requesttype, int request,
-                    int value, int index, char *bytes, int size, int timeout)
+static int win_cancel_async(void *context)
+{
+    /* NOTE that this function will cancel all pending URBs */
+    /* on the same endpoint as this particular context, or even */
+    /* all pending URBs for this particular device. */
+
+    usb_context_t *c = (usb_context_t *)context;
+
+    if (!c)
+    {
+        USBERR0("invalid context\n");
+        return -EINVAL;
+    }
+
+    if (c->dev->impl_info == INVALID_HANDLE_VALUE)
+    {
+        USBERR0("device not open\n");
+        return -EINVAL;
+    }
+
+    _usb_cancel_io(c);
+
+    return 0;
+}
+
+static int win_free_async(void **context)
+{
+    usb_context_t **c = (usb_context_t **)context;
+
+    if (!*c)
+    {
+        USBERR0("invalid context\n");
+        return -EINVAL;
+    }
+
+    if (!CloseHandle((*c)->ol.hEvent))
+    {
+      USBERR("close event failed: win error: %s", usb_win_error_to_string());
+      return -usb_win_error_to_errno();
+    }
+
+    free(*c);
+    *c = NULL;
+
+    return 0;
+}
+
+static int win_control_msg(usb_dev_handle *dev, int requesttype, int request,
+                           int value, int index, char *bytes, int size,
+                           int timeout)
 {
     int read = 0;
     libusb_request req;
@@ -653,6 +1149,7 @@ int usb_control_msg(usb_dev_handle *dev, int requesttype, int request,
     void *in = bytes;
     int in_size = size;
     int code;
+    int capture_id = 0;
 
     if (dev->impl_info == INVALID_HANDLE_VALUE)
     {
@@ -769,6 +1266,13 @@ int usb_control_msg(usb_dev_handle *dev, int requesttype, int request,
         in_size = 0;
     }
 
+    if (_usb_capture_enabled)
+    {
+        capture_id = _usb_capture_control_id();
+        _usb_capture_control(dev, capture_id, requesttype, request, value,
+                             index, FALSE, 0, bytes, size);
+    }
+
     if (!_usb_io_sync(dev->impl_info, code, out, out_size, in, in_size, &read))
     {
         USBERR("sending control message failed, win error: %s\n", usb_win_error_to_string());
@@ -776,9 +1280,22 @@ int usb_control_msg(usb_dev_handle *dev, int requesttype, int request,
         {
             free(out);
         }
+        if (capture_id)
+        {
+            read = -usb_win_error_to_errno();
+            _usb_capture_control(dev, capture_id, requesttype, request,
+                                 value, index, TRUE, read, NULL, 0);
+            return read;
+        }
         return -usb_win_error_to_errno();
     }
 
+    if (capture_id)
+    {
+        _usb_capture_control(dev, capture_id, requesttype, request, value,
+                             index, TRUE, read, bytes, read);
+    }
+
     /* out request? */
     if (!(requesttype & USB_ENDPOINT_IN))
     {
@@ -790,7 +1307,7 @@ int usb_control_msg(usb_dev_handle *dev, int requesttype, int request,
 }
 
 
-int usb_os_find_busses(struct usb_bus **busses)
+static int win_find_busses(struct usb_bus **busses)
 {
     struct usb_bus *bus = NULL;
 
@@ -814,7 +1331,7 @@ int usb_os_find_busses(struct usb_bus **busses)
     return 0;
 }
 
-int usb_os_find_devices(struct usb_bus *bus, struct usb_device **devices)
+static int win_find_devices(struct usb_bus *bus, struct usb_device **devices)
 {
     int i;
     struct usb_device *dev, *fdev = NULL;
@@ -884,7 +1401,7 @@ int usb_os_find_devices(struct usb_bus *bus, struct usb_device **devices)
 }
 
 
-void usb_os_init(void)
+static void win_init(void)
 {
     HANDLE dev;
     libusb_request req;
@@ -949,7 +1466,7 @@ void usb_os_init(void)
 }
 
 
-int usb_resetep(usb_dev_handle *dev, unsigned int ep)
+static int win_resetep(usb_dev_handle *dev, unsigned int ep)
 {
     libusb_request req;
 
@@ -979,7 +1496,7 @@ int usb_resetep(usb_dev_handle *dev, unsigned int ep)
     return 0;
 }
 
-int usb_clear_halt(usb_dev_handle *dev, unsigned int ep)
+static int win_clear_halt(usb_dev_handle *dev, unsigned int ep)
 {
     libusb_request req;
 
@@ -1003,7 +1520,7 @@ int usb_clear_halt(usb_dev_handle *dev, unsigned int ep)
     return 0;
 }
 
-int usb_reset(usb_dev_handle *dev)
+static int win_reset(usb_dev_handle *dev)
 {
     libusb_request req;
 
@@ -1025,7 +1542,7 @@ int usb_reset(usb_dev_handle *dev)
     return 0;
 }
 
-int usb_reset_ex(usb_dev_handle *dev, unsigned int reset_type)
+static int win_reset_ex(usb_dev_handle *dev, unsigned int reset_type)
 {
     libusb_request req;
 
@@ -1100,7 +1617,24 @@ void usb_set_debug(int level)
     }
 }
 
-int usb_os_determine_children(struct usb_bus *bus)
+int usb_set_debug_async(int enable)
+{
+    int ret;
+
+    ret = usb_log_set_async(enable);
+    if (ret < 0)
+    {
+        USBERR("failed %s asynchronous logging\n",
+               enable ? "enabling" : "disabling");
+        return ret;
+    }
+
+    USBMSG("asynchronous logging %s\n", enable ? "on" : "off");
+
+    return 0;
+}
+
+static int win_determine_children(struct usb_bus *bus)
 {
     struct usb_device *dev;
     int i = 0;
@@ -1127,6 +1661,31 @@ int usb_os_determine_children(struct usb_bus *bus)
     return 0;
 }
 
+const struct usb_os_backend usb_windows_backend =
+{
+    "windows",
+    win_init,
+    win_find_busses,
+    win_find_devices,
+    win_determine_children,
+    win_open,
+    win_close,
+    win_set_configuration,
+    win_claim_interface,
+    win_release_interface,
+    win_set_altinterface,
+    win_control_msg,
+    win_setup_async,
+    win_submit_async,
+    win_reap_async,
+    win_cancel_async,
+    win_free_async,
+    win_clear_halt,
+    win_resetep,
+    win_reset,
+    win_reset_ex
+};
+
 static int _usb_cancel_io(usb_context_t *context)
 {
     int ret;
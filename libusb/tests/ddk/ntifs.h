@@ -0,0 +1,275 @@
+/* libusb-win32, Generic Windows USB Library
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Minimal stand-in for the kernel headers, just enough to build */
+/* driver/transfer.c on the host for tests/transfer_harness.c. The */
+/* I/O manager routines are implemented by the harness. Only the fields */
+/* the driver touches exist, the layouts do not match the DDK. */
+
+#ifndef __HOST_NTIFS_H__
+#define __HOST_NTIFS_H__
+
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+#define IN
+#define OUT
+#define OPTIONAL
+#define VOID void
+#define __stdcall
+#define NTAPI
+
+typedef char CHAR, CCHAR;
+typedef unsigned char UCHAR, BOOLEAN, *PUCHAR;
+typedef short SHORT;
+typedef unsigned short USHORT, WCHAR;
+typedef int LONG;
+typedef unsigned int ULONG, *PULONG;
+typedef long long LONGLONG, __int64;
+typedef unsigned long long ULONGLONG, ULONG64;
+typedef size_t SIZE_T, ULONG_PTR;
+typedef void *PVOID;
+typedef LONG NTSTATUS;
+typedef UCHAR KIRQL;
+typedef ULONG_PTR KSPIN_LOCK;
+
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+
+#define NT_SUCCESS(status) ((NTSTATUS)(status) >= 0)
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000)
+#define STATUS_PENDING                  ((NTSTATUS)0x00000103)
+#define STATUS_MORE_PROCESSING_REQUIRED ((NTSTATUS)0xC0000016)
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS)0xC0000001)
+#define STATUS_NOT_SUPPORTED            ((NTSTATUS)0xC00000BB)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000D)
+#define STATUS_NO_MEMORY                ((NTSTATUS)0xC0000017)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009A)
+#define STATUS_CANCELLED                ((NTSTATUS)0xC0000120)
+
+#define CTL_CODE(type, function, method, access) \
+	(((type) << 16) | ((access) << 14) | ((function) << 2) | (method))
+#define METHOD_BUFFERED   0
+#define METHOD_IN_DIRECT  1
+#define METHOD_OUT_DIRECT 2
+#define METHOD_NEITHER    3
+#define FILE_ANY_ACCESS   0
+#define FILE_DEVICE_UNKNOWN 0x22
+#define FILE_DEVICE_USB     FILE_DEVICE_UNKNOWN
+
+#define IRP_MJ_INTERNAL_DEVICE_CONTROL 0x0F
+#define IO_NO_INCREMENT 0
+#define SL_PENDING_RETURNED 0x01
+
+typedef struct _LIST_ENTRY
+{
+	struct _LIST_ENTRY *Flink;
+	struct _LIST_ENTRY *Blink;
+} LIST_ENTRY;
+
+typedef struct
+{
+	LONG signaled;
+} KEVENT;
+
+typedef struct
+{
+	USHORT Length;
+	USHORT MaximumLength;
+	WCHAR *Buffer;
+} UNICODE_STRING;
+
+typedef struct
+{
+	ULONG Data1;
+	USHORT Data2;
+	USHORT Data3;
+	UCHAR Data4[8];
+} GUID;
+
+typedef enum
+{
+	PowerDeviceUnspecified,
+	PowerDeviceD0,
+	PowerDeviceD1,
+	PowerDeviceD2,
+	PowerDeviceD3,
+	PowerDeviceMaximum
+} DEVICE_POWER_STATE;
+
+typedef enum
+{
+	PowerSystemUnspecified,
+	PowerSystemWorking,
+	PowerSystemSleeping1,
+	PowerSystemSleeping2,
+	PowerSystemSleeping3,
+	PowerSystemHibernate,
+	PowerSystemShutdown,
+	PowerSystemMaximum
+} SYSTEM_POWER_STATE;
+
+typedef union
+{
+	SYSTEM_POWER_STATE SystemState;
+	DEVICE_POWER_STATE DeviceState;
+} POWER_STATE;
+
+typedef struct _MDL
+{
+	struct _MDL *Next;
+	PVOID StartVa;
+	ULONG ByteCount;
+} MDL, *PMDL;
+
+struct _IRP;
+struct _DEVICE_OBJECT;
+
+typedef NTSTATUS (*PIO_COMPLETION_ROUTINE)(struct _DEVICE_OBJECT *device_object,
+										   struct _IRP *irp, PVOID context);
+typedef VOID (*PDRIVER_CANCEL)(struct _DEVICE_OBJECT *device_object,
+							   struct _IRP *irp);
+
+typedef struct _DRIVER_OBJECT
+{
+	/* the dispatch routine of the simulated lower driver */
+	NTSTATUS (*dispatch)(struct _DEVICE_OBJECT *device_object,
+						 struct _IRP *irp);
+} DRIVER_OBJECT;
+
+typedef struct _DEVICE_OBJECT
+{
+	DRIVER_OBJECT *DriverObject;
+	PVOID DeviceExtension;
+	CCHAR StackSize;
+} DEVICE_OBJECT, *PDEVICE_OBJECT;
+
+typedef struct
+{
+	PVOID FsContext;
+} FILE_OBJECT;
+
+typedef struct
+{
+	UCHAR MajorFunction;
+	UCHAR Control;
+	union
+	{
+		struct
+		{
+			PVOID Argument1;
+			PVOID Argument2;
+			PVOID Argument3;
+			PVOID Argument4;
+		} Others;
+		struct
+		{
+			ULONG_PTR OutputBufferLength;
+			ULONG_PTR InputBufferLength;
+			ULONG IoControlCode;
+			PVOID Type3InputBuffer;
+		} DeviceIoControl;
+	} Parameters;
+	DEVICE_OBJECT *DeviceObject;
+	PIO_COMPLETION_ROUTINE CompletionRoutine;
+	PVOID Context;
+} IO_STACK_LOCATION, *PIO_STACK_LOCATION;
+
+typedef struct
+{
+	NTSTATUS Status;
+	ULONG_PTR Information;
+} IO_STATUS_BLOCK;
+
+/* stack locations are numbered 1..StackCount from the bottom, a new irp */
+/* is at StackCount + 1 */
+typedef struct _IRP
+{
+	IO_STATUS_BLOCK IoStatus;
+	BOOLEAN PendingReturned;
+	volatile BOOLEAN Cancel;
+	KIRQL CancelIrql;
+	PDRIVER_CANCEL volatile CancelRoutine;
+	CCHAR StackCount;
+	CCHAR CurrentLocation;
+	union
+	{
+		struct
+		{
+			PVOID DriverContext[4];
+			IO_STACK_LOCATION *CurrentStackLocation;
+		} Overlay;
+	} Tail;
+	IO_STACK_LOCATION *Stack;
+} IRP, *PIRP;
+
+#define IoGetCurrentIrpStackLocation(irp) ((irp)->Tail.Overlay.CurrentStackLocation)
+#define IoGetNextIrpStackLocation(irp) ((irp)->Tail.Overlay.CurrentStackLocation - 1)
+
+#define IoSetCompletionRoutine(irp, routine, context, success, error, cancel) \
+	do { \
+		IO_STACK_LOCATION *_next = IoGetNextIrpStackLocation(irp); \
+		_next->CompletionRoutine = (routine); \
+		_next->Context = (context); \
+	} while (0)
+
+#define IoMarkIrpPending(irp) \
+	(IoGetCurrentIrpStackLocation(irp)->Control |= SL_PENDING_RETURNED)
+
+static inline PDRIVER_CANCEL IoSetCancelRoutine(IRP *irp,
+												PDRIVER_CANCEL routine)
+{
+	return __atomic_exchange_n(&irp->CancelRoutine, routine, __ATOMIC_SEQ_CST);
+}
+
+#define MmGetMdlVirtualAddress(mdl) ((mdl)->StartVa)
+#define MmGetSystemAddressForMdlSafe(mdl, priority) ((mdl)->StartVa)
+#define NormalPagePriority 16
+
+#define InterlockedIncrement(p)        __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p)        __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedAdd(p, v)           __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(p, v)   __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchange(p, v)      __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+
+static inline LONG InterlockedCompareExchange(volatile LONG *target,
+											  LONG exchange, LONG comparand)
+{
+	__atomic_compare_exchange_n(target, &comparand, exchange, 0,
+								__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return comparand;
+}
+
+#define DbgPrint printf
+#define _snprintf snprintf
+#define _vsnprintf vsnprintf
+
+/* implemented by the harness */
+NTSTATUS IoCallDriver(DEVICE_OBJECT *device_object, IRP *irp);
+VOID IoCompleteRequest(IRP *irp, CCHAR priority_boost);
+BOOLEAN IoCancelIrp(IRP *irp);
+VOID IoReleaseCancelSpinLock(KIRQL irql);
+IRP *IoAllocateIrp(CCHAR stack_size, BOOLEAN charge_quota);
+VOID IoFreeIrp(IRP *irp);
+PMDL IoAllocateMdl(PVOID address, ULONG length, BOOLEAN secondary,
+				   BOOLEAN charge_quota, IRP *irp);
+VOID IoBuildPartialMdl(PMDL source, PMDL target, PVOID address, ULONG length);
+VOID IoFreeMdl(PMDL mdl);
+VOID ExFreePool(PVOID p);
+
+#endif
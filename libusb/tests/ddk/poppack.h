@@ -0,0 +1,2 @@
+/* host build of the driver, see ntifs.h */
+#pragma pack(pop)
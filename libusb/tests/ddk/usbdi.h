@@ -0,0 +1,179 @@
+/* libusb-win32, Generic Windows USB Library
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* URB stand-in for the host build of driver/transfer.c, see ntifs.h */
+
+#ifndef __HOST_USBDI_H__
+#define __HOST_USBDI_H__
+
+typedef PVOID USBD_PIPE_HANDLE;
+typedef PVOID USBD_CONFIGURATION_HANDLE;
+typedef LONG USBD_STATUS;
+
+#define USBD_SUCCESS(status) ((USBD_STATUS)(status) >= 0)
+
+#define USBD_STATUS_SUCCESS     ((USBD_STATUS)0x00000000)
+#define USBD_STATUS_STALL_PID   ((USBD_STATUS)0xC0000004)
+#define USBD_STATUS_CANCELED    ((USBD_STATUS)0xC0010000)
+
+typedef enum
+{
+	UsbdPipeTypeControl,
+	UsbdPipeTypeIsochronous,
+	UsbdPipeTypeBulk,
+	UsbdPipeTypeInterrupt
+} USBD_PIPE_TYPE;
+
+#define URB_FUNCTION_CONTROL_TRANSFER           0x0008
+#define URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER 0x0009
+#define URB_FUNCTION_ISOCH_TRANSFER             0x000A
+
+#define USBD_TRANSFER_DIRECTION_OUT   0
+#define USBD_TRANSFER_DIRECTION_IN    1
+#define USBD_SHORT_TRANSFER_OK        0x02
+#define USBD_START_ISO_TRANSFER_ASAP  0x04
+#define USBD_DEFAULT_PIPE_TRANSFER    0x08
+
+#define IOCTL_INTERNAL_USB_SUBMIT_URB \
+	CTL_CODE(FILE_DEVICE_USB, 0, METHOD_NEITHER, FILE_ANY_ACCESS)
+
+typedef struct
+{
+	ULONG Offset;
+	ULONG Length;
+	USBD_STATUS Status;
+} USBD_ISO_PACKET_DESCRIPTOR;
+
+struct _URB_HEADER
+{
+	USHORT Length;
+	USHORT Function;
+	USBD_STATUS Status;
+};
+
+struct _URB_CONTROL_TRANSFER
+{
+	struct _URB_HEADER Hdr;
+	USBD_PIPE_HANDLE PipeHandle;
+	ULONG TransferFlags;
+	ULONG TransferBufferLength;
+	PVOID TransferBuffer;
+	PMDL TransferBufferMDL;
+	UCHAR SetupPacket[8];
+};
+
+struct _URB_BULK_OR_INTERRUPT_TRANSFER
+{
+	struct _URB_HEADER Hdr;
+	USBD_PIPE_HANDLE PipeHandle;
+	ULONG TransferFlags;
+	ULONG TransferBufferLength;
+	PVOID TransferBuffer;
+	PMDL TransferBufferMDL;
+};
+
+struct _URB_ISOCH_TRANSFER
+{
+	struct _URB_HEADER Hdr;
+	USBD_PIPE_HANDLE PipeHandle;
+	ULONG TransferFlags;
+	ULONG TransferBufferLength;
+	PVOID TransferBuffer;
+	PMDL TransferBufferMDL;
+	ULONG StartFrame;
+	ULONG NumberOfPackets;
+	ULONG ErrorCount;
+	USBD_ISO_PACKET_DESCRIPTOR IsoPacket[1];
+};
+
+typedef struct _URB
+{
+	union
+	{
+		struct _URB_HEADER UrbHeader;
+		struct _URB_CONTROL_TRANSFER UrbControlTransfer;
+		struct _URB_BULK_OR_INTERRUPT_TRANSFER UrbBulkOrInterruptTransfer;
+		struct _URB_ISOCH_TRANSFER UrbIsochronousTransfer;
+	};
+} URB, *PURB;
+
+#pragma pack(push, 1)
+
+typedef struct
+{
+	UCHAR bLength;
+	UCHAR bDescriptorType;
+	USHORT bcdUSB;
+	UCHAR bDeviceClass;
+	UCHAR bDeviceSubClass;
+	UCHAR bDeviceProtocol;
+	UCHAR bMaxPacketSize0;
+	USHORT idVendor;
+	USHORT idProduct;
+	USHORT bcdDevice;
+	UCHAR iManufacturer;
+	UCHAR iProduct;
+	UCHAR iSerialNumber;
+	UCHAR bNumConfigurations;
+} USB_DEVICE_DESCRIPTOR;
+
+typedef struct
+{
+	UCHAR bLength;
+	UCHAR bDescriptorType;
+	USHORT wTotalLength;
+	UCHAR bNumInterfaces;
+	UCHAR bConfigurationValue;
+	UCHAR iConfiguration;
+	UCHAR bmAttributes;
+	UCHAR MaxPower;
+} USB_CONFIGURATION_DESCRIPTOR, *PUSB_CONFIGURATION_DESCRIPTOR;
+
+typedef struct
+{
+	UCHAR bLength;
+	UCHAR bDescriptorType;
+	UCHAR bInterfaceNumber;
+	UCHAR bAlternateSetting;
+	UCHAR bNumEndpoints;
+	UCHAR bInterfaceClass;
+	UCHAR bInterfaceSubClass;
+	UCHAR bInterfaceProtocol;
+	UCHAR iInterface;
+} USB_INTERFACE_DESCRIPTOR;
+
+typedef struct
+{
+	UCHAR bLength;
+	UCHAR bDescriptorType;
+	UCHAR bEndpointAddress;
+	UCHAR bmAttributes;
+	USHORT wMaxPacketSize;
+	UCHAR bInterval;
+} USB_ENDPOINT_DESCRIPTOR;
+
+#pragma pack(pop)
+
+typedef struct
+{
+	USHORT Length;
+	UCHAR InterfaceNumber;
+	UCHAR AlternateSetting;
+	ULONG NumberOfPipes;
+} USBD_INTERFACE_INFORMATION;
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * sim_throughput.c
+ *
+ *  Throughput check of the library core against the simulated backend.
+ *  Reads the benchmark pattern from ep 0x81 with queued async transfers
+ *  while a second thread writes to ep 0x01, verifies the data and fails
+ *  when either direction reaches less than half of USB_SIM_BANDWIDTH.
+ *  Built and run by 'make host-check'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lusb0_usb.h"
+#include "usbi_os.h"
+
+#define EP_IN  0x81
+#define EP_OUT 0x01
+
+#define TRANSFER_SIZE   (64 * 1024)
+#define QUEUE_DEPTH     4
+#define DURATION_MS     500
+#define TIMEOUT_MS      5000
+#define BANDWIDTH       (40 * 1000 * 1000)  /* sim.c default */
+
+static usb_dev_handle *dev;
+static volatile int write_error;
+static LONGLONG write_bytes;
+static LONGLONG write_ticks;
+
+static double elapsed(LONGLONG start)
+{
+    return (double)(usbi_clock() - start) / usbi_clock_frequency();
+}
+
+/* see sim_fill_pattern(), zero and a running key followed by */
+/* 2, 3, .. 255, 1, 2, .. in every packet */
+static int verify(const unsigned char *data, int size, int packet_size,
+                  unsigned char *key)
+{
+    int offset, i;
+
+    for (offset = 0; offset < size; offset += packet_size)
+    {
+        for (i = 0; i < packet_size && offset + i < size; i++)
+        {
+            unsigned char expected;
+
+            if (i == 0)
+                expected = 0;
+            else if (i == 1)
+                expected = *key;
+            else
+                expected = (unsigned char)((i - 1) % 255 + 1);
+
+            if (data[offset + i] != expected)
+            {
+                fprintf(stderr, "data error at %d: 0x%02x, expected 0x%02x\n",
+                        offset + i, data[offset + i], expected);
+                return -1;
+            }
+        }
+        (*key)++;
+    }
+
+    return 0;
+}
+
+static USBI_THREAD_PROC(write_thread, arg)
+{
+    static char buffer[TRANSFER_SIZE];
+    LONGLONG start = usbi_clock();
+    int ret;
+
+    UNREFERENCED_PARAMETER(arg);
+
+    memset(buffer, 0x55, sizeof(buffer));
+
+    while (elapsed(start) * 1000 < DURATION_MS)
+    {
+        ret = usb_bulk_write(dev, EP_OUT, buffer, sizeof(buffer), TIMEOUT_MS);
+        if (ret != sizeof(buffer))
+        {
+            fprintf(stderr, "write failed: %d\n", ret);
+            write_error = 1;
+            break;
+        }
+        write_bytes += ret;
+    }
+
+    write_ticks = usbi_clock() - start;
+
+    USBI_THREAD_RETURN;
+}
+
+static int read_loop(int packet_size, double *rate)
+{
+    static char buffers[QUEUE_DEPTH][TRANSFER_SIZE];
+    void *contexts[QUEUE_DEPTH];
+    unsigned char key = 0;
+    LONGLONG bytes = 0;
+    LONGLONG start;
+    int i, ret = 0;
+
+    for (i = 0; i < QUEUE_DEPTH; i++)
+    {
+        contexts[i] = NULL;
+        if (usb_bulk_setup_async(dev, &contexts[i], EP_IN) < 0
+                || usb_submit_async(contexts[i], buffers[i], TRANSFER_SIZE) < 0)
+        {
+            fprintf(stderr, "submit failed: %s\n", usb_strerror());
+            ret = -1;
+            goto out;
+        }
+    }
+
+    start = usbi_clock();
+
+    /* transfers complete in submission order */
+    for (i = 0; elapsed(start) * 1000 < DURATION_MS; i = (i + 1) % QUEUE_DEPTH)
+    {
+        ret = usb_reap_async(contexts[i], TIMEOUT_MS);
+        if (ret != TRANSFER_SIZE)
+        {
+            fprintf(stderr, "read failed: %d\n", ret);
+            ret = -1;
+            goto out;
+        }
+
+        if (verify((unsigned char *)buffers[i], ret, packet_size, &key) < 0)
+        {
+            ret = -1;
+            goto out;
+        }
+        bytes += ret;
+
+        if (usb_submit_async(contexts[i], buffers[i], TRANSFER_SIZE) < 0)
+        {
+            fprintf(stderr, "submit failed: %s\n", usb_strerror());
+            ret = -1;
+            goto out;
+        }
+    }
+
+    *rate = bytes / elapsed(start);
+    ret = 0;
+
+out:
+    for (i = 0; i < QUEUE_DEPTH; i++)
+    {
+        if (contexts[i])
+        {
+            usb_cancel_async(contexts[i]);
+            usb_free_async(&contexts[i]);
+        }
+    }
+
+    return ret;
+}
+
+int main(void)
+{
+    struct usb_bus *bus;
+    struct usb_device *device = NULL;
+    usbi_thread_t thread;
+    double read_rate = 0, write_rate;
+    int packet_size, bandwidth, ret;
+
+    if (!getenv("USB_BACKEND"))
+        putenv("USB_BACKEND=sim");
+
+    usb_init();
+    usb_find_busses();
+    usb_find_devices();
+
+    for (bus = usb_get_busses(); bus && !device; bus = bus->next)
+        device = bus->devices;
+
+    if (!device || !device->config)
+    {
+        fprintf(stderr, "no simulated device\n");
+        return 1;
+    }
+
+    packet_size = device->config->interface->altsetting->endpoint->wMaxPacketSize;
+
+    dev = usb_open(device);
+    if (!dev || usb_set_configuration(dev, 1) < 0
+            || usb_claim_interface(dev, 0) < 0)
+    {
+        fprintf(stderr, "open failed: %s\n", usb_strerror());
+        return 1;
+    }
+
+    if (usbi_thread_create(&thread, write_thread, NULL) < 0)
+    {
+        fprintf(stderr, "thread creation failed\n");
+        return 1;
+    }
+
+    ret = read_loop(packet_size, &read_rate);
+    usbi_thread_join(thread);
+
+    usb_release_interface(dev, 0);
+    usb_close(dev);
+
+    if (ret < 0 || write_error)
+        return 1;
+
+    write_rate = (double)write_bytes * usbi_clock_frequency() / write_ticks;
+
+    printf("read  %.1f MB/s\n", read_rate / 1000000);
+    printf("write %.1f MB/s\n", write_rate / 1000000);
+
+    bandwidth = getenv("USB_SIM_BANDWIDTH")
+                ? atoi(getenv("USB_SIM_BANDWIDTH")) : BANDWIDTH;
+
+    if (read_rate < bandwidth / 2 || write_rate < bandwidth / 2)
+    {
+        fprintf(stderr, "throughput below %.1f MB/s\n", bandwidth / 2000000.0);
+        return 1;
+    }
+
+    return 0;
+}
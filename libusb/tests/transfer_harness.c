@@ -0,0 +1,971 @@
+/*
+ * transfer_harness.c
+ *
+ *  Runs driver/transfer.c on the host. The kernel headers are replaced by
+ *  the stubs in tests/ddk, the I/O manager routines the driver calls are
+ *  implemented below and the usb stack is simulated: it completes urbs
+ *  inline or when the harness says so, and can return short packets,
+ *  stall or cancel. The checks cover the chunking rules of transfer.h,
+ *  bulk chunking, ZLPs, stalls, cancellation, the pending sequence
+ *  ordering and iso chains. The benchmark measures the chunks per second
+ *  and the latency of the completion path.
+ *  Built and run by 'make host-check'.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "libusb_driver.h"
+#include "transfer.h"
+
+#define EP_BULK_IN   0x81
+#define EP_BULK_OUT  0x01
+#define EP_ISO_IN    0x82
+
+#define PACKET_SIZE         512
+#define ISO_PACKET_SIZE     1024
+#define MAX_TRANSFER_SIZE   (64 * 1024)
+#define USBD_QUEUE_SIZE     64
+#define USBD_ALL            0x7FFFFFFF
+
+#define BENCH_REQUESTS      2000
+#define BENCH_REQUEST_SIZE  (1024 * 1024)
+#define BENCH_CHUNK_SIZE    (16 * 1024)
+
+#define CHECK(cond) \
+	do { if (!(cond)) { failures++; \
+		fprintf(stderr, "%s:%d: %s: check failed: %s\n", \
+				__FILE__, __LINE__, scenario, #cond); } } while (0)
+
+/* a user request as the I/O manager hands it to the driver */
+typedef struct
+{
+	IRP irp;                  /* must be first */
+	IO_STACK_LOCATION stack[2];
+	MDL mdl;
+	UCHAR *buffer;
+	int length;
+	int completions;
+	int order;                /* completion order within the scenario */
+} request_t;
+
+typedef struct
+{
+	IRP *irp;
+	int index;                /* urb number since usbd_reset() */
+} usbd_entry_t;
+
+/* simulated usb stack below the driver */
+static struct
+{
+	bool_t inline_completion; /* complete in IoCallDriver */
+	bool_t fill;              /* move data, off for the benchmark */
+	int short_at;             /* urb that completes short, 1 based */
+	int short_length;
+	int stall_at;             /* urb that stalls, 1 based */
+	int urbs;
+	ULONG stream;             /* bytes transferred on bulk pipes */
+	usbd_entry_t queue[USBD_QUEUE_SIZE];
+	int queued;
+	double *latencies;        /* completion path timing, us */
+	int latency_count;
+} usbd;
+
+static const char *scenario = "";
+static int failures = 0;
+static int completion_order = 0;
+
+/* allocations still held by the driver */
+static int pools = 0;
+static int mdls = 0;
+static int irps = 0;
+static int buffer_refs = 0;
+
+static DRIVER_OBJECT usbd_driver;
+static DEVICE_OBJECT usbd_device;
+static DEVICE_OBJECT self;
+static libusb_device_t *dev;
+static libusb_endpoint_t bulk_in, bulk_out, iso_in;
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* I/O manager */
+
+NTSTATUS IoCallDriver(DEVICE_OBJECT *device_object, IRP *irp)
+{
+	irp->CurrentLocation--;
+	irp->Tail.Overlay.CurrentStackLocation--;
+	IoGetCurrentIrpStackLocation(irp)->DeviceObject = device_object;
+	IoGetCurrentIrpStackLocation(irp)->Control = 0;
+
+	return device_object->DriverObject->dispatch(device_object, irp);
+}
+
+/* walks up the stack calling the completion routines */
+VOID IoCompleteRequest(IRP *irp, CCHAR priority_boost)
+{
+	IO_STACK_LOCATION *stack_location;
+	PIO_COMPLETION_ROUTINE routine;
+	DEVICE_OBJECT *device_object;
+	request_t *request;
+
+	UNREFERENCED_PARAMETER(priority_boost);
+
+	while (irp->CurrentLocation <= irp->StackCount)
+	{
+		stack_location = IoGetCurrentIrpStackLocation(irp);
+		routine = stack_location->CompletionRoutine;
+		stack_location->CompletionRoutine = NULL;
+		irp->PendingReturned = (stack_location->Control & SL_PENDING_RETURNED) != 0;
+
+		irp->CurrentLocation++;
+		irp->Tail.Overlay.CurrentStackLocation++;
+
+		if (routine)
+		{
+			device_object = (irp->CurrentLocation <= irp->StackCount)
+				? IoGetCurrentIrpStackLocation(irp)->DeviceObject : NULL;
+			if (routine(device_object, irp, stack_location->Context)
+					== STATUS_MORE_PROCESSING_REQUIRED)
+				return;
+		}
+		else if (irp->PendingReturned && irp->CurrentLocation <= irp->StackCount)
+		{
+			IoMarkIrpPending(irp);
+		}
+	}
+
+	/* only user requests get here, the driver keeps its own irps. they */
+	/* have a location for the driver and one for the usb stack */
+	CHECK(irp->StackCount == 2);
+	if (irp->StackCount != 2)
+		return;
+
+	request = (request_t *)irp;
+	request->completions++;
+	request->order = ++completion_order;
+}
+
+VOID IoReleaseCancelSpinLock(KIRQL irql)
+{
+	UNREFERENCED_PARAMETER(irql);
+}
+
+static bool_t usbd_cancel(IRP *irp);
+
+BOOLEAN IoCancelIrp(IRP *irp)
+{
+	PDRIVER_CANCEL routine;
+
+	irp->Cancel = TRUE;
+
+	routine = IoSetCancelRoutine(irp, NULL);
+	if (routine)
+	{
+		irp->CancelIrql = 0;
+		routine(IoGetCurrentIrpStackLocation(irp)->DeviceObject, irp);
+		return TRUE;
+	}
+
+	/* the usb stack owns it */
+	return usbd_cancel(irp);
+}
+
+IRP *IoAllocateIrp(CCHAR stack_size, BOOLEAN charge_quota)
+{
+	IRP *irp;
+
+	UNREFERENCED_PARAMETER(charge_quota);
+
+	irp = calloc(1, sizeof(IRP) + sizeof(IO_STACK_LOCATION) * stack_size);
+	if (!irp)
+		return NULL;
+
+	irp->Stack = (IO_STACK_LOCATION *)(irp + 1);
+	irp->StackCount = stack_size;
+	irp->CurrentLocation = stack_size + 1;
+	irp->Tail.Overlay.CurrentStackLocation = irp->Stack + stack_size;
+	irps++;
+
+	return irp;
+}
+
+VOID IoFreeIrp(IRP *irp)
+{
+	irps--;
+	free(irp);
+}
+
+PMDL IoAllocateMdl(PVOID address, ULONG length, BOOLEAN secondary,
+				   BOOLEAN charge_quota, IRP *irp)
+{
+	PMDL mdl;
+
+	UNREFERENCED_PARAMETER(secondary);
+	UNREFERENCED_PARAMETER(charge_quota);
+	UNREFERENCED_PARAMETER(irp);
+
+	mdl = calloc(1, sizeof(MDL));
+	if (!mdl)
+		return NULL;
+
+	mdl->StartVa = address;
+	mdl->ByteCount = length;
+	mdls++;
+
+	return mdl;
+}
+
+VOID IoBuildPartialMdl(PMDL source, PMDL target, PVOID address, ULONG length)
+{
+	/* the partial mdl must lie within the source */
+	CHECK((UCHAR *)address >= (UCHAR *)source->StartVa);
+	CHECK((UCHAR *)address + length
+		  <= (UCHAR *)source->StartVa + source->ByteCount);
+
+	target->StartVa = address;
+	target->ByteCount = length;
+}
+
+VOID IoFreeMdl(PMDL mdl)
+{
+	mdls--;
+	free(mdl);
+}
+
+VOID ExFreePool(PVOID p)
+{
+	pools--;
+	free(p);
+}
+
+/* the parts of the driver transfer.c depends on */
+
+PVOID allocate_pool(SIZE_T bytes)
+{
+	PVOID p = malloc(bytes);
+
+	if (p)
+		pools++;
+	return p;
+}
+
+NTSTATUS complete_irp(IRP *irp, NTSTATUS status, ULONG info)
+{
+	irp->IoStatus.Status = status;
+	irp->IoStatus.Information = info;
+	IoCompleteRequest(irp, IO_NO_INCREMENT);
+
+	return status;
+}
+
+void remove_lock_release(libusb_device_t *dev)
+{
+	InterlockedDecrement(&dev->remove_lock.usage_count);
+}
+
+void release_registered_buffer(libusb_device_t *dev, unsigned int token,
+							   PMDL partial_mdl)
+{
+	UNREFERENCED_PARAMETER(dev);
+	UNREFERENCED_PARAMETER(token);
+	UNREFERENCED_PARAMETER(partial_mdl);
+
+	buffer_refs--;
+}
+
+ULONGLONG stats_irp_start(libusb_device_t *dev, int endpoint)
+{
+	UNREFERENCED_PARAMETER(dev);
+	UNREFERENCED_PARAMETER(endpoint);
+
+	return 0;
+}
+
+void stats_urb_start(libusb_device_t *dev, int endpoint)
+{
+	UNREFERENCED_PARAMETER(dev);
+	UNREFERENCED_PARAMETER(endpoint);
+}
+
+void stats_irp_done(libusb_device_t *dev, int endpoint, ULONGLONG start_time,
+					NTSTATUS status, USBD_STATUS urb_status,
+					int requested, int transmitted)
+{
+	UNREFERENCED_PARAMETER(dev);
+	UNREFERENCED_PARAMETER(endpoint);
+	UNREFERENCED_PARAMETER(start_time);
+	UNREFERENCED_PARAMETER(status);
+	UNREFERENCED_PARAMETER(urb_status);
+	UNREFERENCED_PARAMETER(requested);
+	UNREFERENCED_PARAMETER(transmitted);
+}
+
+void trace_event(libusb_device_t *dev, int event, LONG sequence,
+				 int endpoint, int function, int length, NTSTATUS status,
+				 USBD_STATUS urb_status, const UCHAR *setup)
+{
+	UNREFERENCED_PARAMETER(dev);
+	UNREFERENCED_PARAMETER(event);
+	UNREFERENCED_PARAMETER(sequence);
+	UNREFERENCED_PARAMETER(endpoint);
+	UNREFERENCED_PARAMETER(function);
+	UNREFERENCED_PARAMETER(length);
+	UNREFERENCED_PARAMETER(status);
+	UNREFERENCED_PARAMETER(urb_status);
+	UNREFERENCED_PARAMETER(setup);
+}
+
+ULONG get_iso_start_frame(libusb_device_t *dev, IRP *irp, int endpoint,
+						  int packets, int latency)
+{
+	UNREFERENCED_PARAMETER(dev);
+	UNREFERENCED_PARAMETER(irp);
+	UNREFERENCED_PARAMETER(endpoint);
+	UNREFERENCED_PARAMETER(packets);
+	UNREFERENCED_PARAMETER(latency);
+
+	return 0;
+}
+
+void release_iso_start_frame(libusb_device_t *dev, int endpoint, ULONG start,
+							 int packets)
+{
+	UNREFERENCED_PARAMETER(dev);
+	UNREFERENCED_PARAMETER(endpoint);
+	UNREFERENCED_PARAMETER(start);
+	UNREFERENCED_PARAMETER(packets);
+}
+
+NTSTATUS call_usbd_ex(libusb_device_t *dev, void *urb, ULONG control_code,
+					  int timeout, int max_timeout)
+{
+	UNREFERENCED_PARAMETER(dev);
+	UNREFERENCED_PARAMETER(urb);
+	UNREFERENCED_PARAMETER(control_code);
+	UNREFERENCED_PARAMETER(timeout);
+	UNREFERENCED_PARAMETER(max_timeout);
+
+	return STATUS_NOT_SUPPORTED;
+}
+
+/* simulated usb stack */
+
+static void usbd_reset(bool_t inline_completion)
+{
+	memset(&usbd, 0, sizeof(usbd));
+	usbd.inline_completion = inline_completion;
+	usbd.fill = TRUE;
+}
+
+static void usbd_complete_bulk(URB *urb, int index, bool_t cancelled,
+							   NTSTATUS *status)
+{
+	struct _URB_BULK_OR_INTERRUPT_TRANSFER *bulk = &urb->UrbBulkOrInterruptTransfer;
+	UCHAR *data = MmGetMdlVirtualAddress(bulk->TransferBufferMDL);
+	ULONG length = bulk->TransferBufferLength;
+	ULONG i;
+
+	CHECK(bulk->TransferBufferMDL->ByteCount >= length);
+
+	if (cancelled)
+	{
+		bulk->Hdr.Status = USBD_STATUS_CANCELED;
+		bulk->TransferBufferLength = 0;
+		*status = STATUS_CANCELLED;
+		return;
+	}
+
+	if (index == usbd.stall_at)
+	{
+		bulk->Hdr.Status = USBD_STATUS_STALL_PID;
+		bulk->TransferBufferLength = 0;
+		*status = STATUS_UNSUCCESSFUL;
+		return;
+	}
+
+	if (index == usbd.short_at)
+		length = usbd.short_length;
+
+	/* IN pipes source a running byte count, OUT pipes check it */
+	if (usbd.fill)
+	{
+		for (i = 0; i < length; i++, usbd.stream++)
+		{
+			if (bulk->TransferFlags & USBD_TRANSFER_DIRECTION_IN)
+				data[i] = (UCHAR)usbd.stream;
+			else
+				CHECK(data[i] == (UCHAR)usbd.stream);
+		}
+	}
+
+	bulk->Hdr.Status = USBD_STATUS_SUCCESS;
+	bulk->TransferBufferLength = length;
+	*status = STATUS_SUCCESS;
+}
+
+static void usbd_complete_iso(URB *urb, bool_t cancelled, NTSTATUS *status)
+{
+	struct _URB_ISOCH_TRANSFER *iso = &urb->UrbIsochronousTransfer;
+	ULONG i;
+
+	CHECK(iso->NumberOfPackets <= 255);
+	CHECK(iso->TransferBufferMDL->ByteCount >= iso->TransferBufferLength);
+
+	for (i = 0; i < iso->NumberOfPackets; i++)
+	{
+		iso->IsoPacket[i].Status = cancelled
+			? USBD_STATUS_CANCELED : USBD_STATUS_SUCCESS;
+	}
+
+	iso->Hdr.Status = cancelled ? USBD_STATUS_CANCELED : USBD_STATUS_SUCCESS;
+	*status = cancelled ? STATUS_CANCELLED : STATUS_SUCCESS;
+}
+
+static void usbd_complete(IRP *irp, int index, bool_t cancelled)
+{
+	URB *urb = IoGetCurrentIrpStackLocation(irp)->Parameters.Others.Argument1;
+	NTSTATUS status;
+	double start;
+
+	if (urb->UrbHeader.Function == URB_FUNCTION_ISOCH_TRANSFER)
+		usbd_complete_iso(urb, cancelled, &status);
+	else
+		usbd_complete_bulk(urb, index, cancelled, &status);
+
+	irp->IoStatus.Status = status;
+	irp->IoStatus.Information = 0;
+
+	if (usbd.latencies)
+	{
+		start = now_us();
+		IoCompleteRequest(irp, IO_NO_INCREMENT);
+		usbd.latencies[usbd.latency_count++] = now_us() - start;
+	}
+	else
+	{
+		IoCompleteRequest(irp, IO_NO_INCREMENT);
+	}
+}
+
+static NTSTATUS usbd_dispatch(DEVICE_OBJECT *device_object, IRP *irp)
+{
+	IO_STACK_LOCATION *stack_location = IoGetCurrentIrpStackLocation(irp);
+	NTSTATUS status;
+
+	UNREFERENCED_PARAMETER(device_object);
+
+	CHECK(stack_location->MajorFunction == IRP_MJ_INTERNAL_DEVICE_CONTROL);
+	CHECK(stack_location->Parameters.DeviceIoControl.IoControlCode
+		  == IOCTL_INTERNAL_USB_SUBMIT_URB);
+
+	usbd.urbs++;
+
+	if (usbd.inline_completion)
+	{
+		usbd_complete(irp, usbd.urbs, FALSE);
+		return irp->IoStatus.Status;
+	}
+
+	if (usbd.queued == USBD_QUEUE_SIZE)
+	{
+		CHECK(usbd.queued < USBD_QUEUE_SIZE);
+		return complete_irp(irp, STATUS_INSUFFICIENT_RESOURCES, 0);
+	}
+
+	usbd.queue[usbd.queued].irp = irp;
+	usbd.queue[usbd.queued].index = usbd.urbs;
+	usbd.queued++;
+
+	IoMarkIrpPending(irp);
+	status = STATUS_PENDING;
+	return status;
+}
+
+static usbd_entry_t usbd_dequeue(int i)
+{
+	usbd_entry_t entry = usbd.queue[i];
+
+	usbd.queued--;
+	memmove(&usbd.queue[i], &usbd.queue[i + 1],
+			sizeof(usbd_entry_t) * (usbd.queued - i));
+	return entry;
+}
+
+/* completes the oldest count urbs, each pipe completes in order */
+static void usbd_run(int count)
+{
+	usbd_entry_t entry;
+
+	while (count-- > 0 && usbd.queued)
+	{
+		entry = usbd_dequeue(0);
+		usbd_complete(entry.irp, entry.index, FALSE);
+	}
+}
+
+static bool_t usbd_cancel(IRP *irp)
+{
+	usbd_entry_t entry;
+	int i;
+
+	for (i = 0; i < usbd.queued; i++)
+	{
+		if (usbd.queue[i].irp == irp)
+		{
+			entry = usbd_dequeue(i);
+			usbd_complete(entry.irp, entry.index, TRUE);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* harness */
+
+static void endpoint_init(libusb_endpoint_t *endpoint, int address,
+						  USBD_PIPE_TYPE type, int packet_size)
+{
+	memset(endpoint, 0, sizeof(*endpoint));
+	endpoint->address = address;
+	endpoint->handle = endpoint;
+	endpoint->maximum_packet_size = packet_size;
+	endpoint->pipe_type = type;
+	endpoint->maximum_transfer_size = MAX_TRANSFER_SIZE;
+}
+
+static void device_init(void)
+{
+	usbd_driver.dispatch = usbd_dispatch;
+	usbd_device.DriverObject = &usbd_driver;
+	usbd_device.StackSize = 1;
+
+	dev = calloc(1, sizeof(libusb_device_t));
+	if (!dev)
+	{
+		fprintf(stderr, "memory allocation error\n");
+		exit(1);
+	}
+
+	self.DeviceExtension = dev;
+	self.StackSize = 2;
+	dev->self = &self;
+	dev->target_device = &usbd_device;
+	dev->speed = HighSpeed;
+
+	endpoint_init(&bulk_in, EP_BULK_IN, UsbdPipeTypeBulk, PACKET_SIZE);
+	endpoint_init(&bulk_out, EP_BULK_OUT, UsbdPipeTypeBulk, PACKET_SIZE);
+	endpoint_init(&iso_in, EP_ISO_IN, UsbdPipeTypeIsochronous, ISO_PACKET_SIZE);
+}
+
+/* sets up the irp as the I/O manager passes it to the driver */
+static void request_reset(request_t *request)
+{
+	memset(&request->irp, 0, sizeof(IRP));
+	memset(request->stack, 0, sizeof(request->stack));
+	request->irp.Stack = request->stack;
+	request->irp.StackCount = 2;
+	request->irp.CurrentLocation = 2;
+	request->irp.Tail.Overlay.CurrentStackLocation = &request->stack[1];
+	request->stack[1].DeviceObject = &self;
+	request->completions = 0;
+}
+
+static request_t *request_create(int length)
+{
+	request_t *request = calloc(1, sizeof(request_t));
+	int i;
+
+	if (!request || !(request->buffer = malloc(length ? length : 1)))
+	{
+		fprintf(stderr, "memory allocation error\n");
+		exit(1);
+	}
+
+	/* the data OUT pipes expect */
+	for (i = 0; i < length; i++)
+		request->buffer[i] = (UCHAR)(usbd.stream + i);
+
+	request->length = length;
+	request->mdl.StartVa = request->buffer;
+	request->mdl.ByteCount = length;
+	request_reset(request);
+
+	return request;
+}
+
+static void request_free(request_t *request)
+{
+	free(request->buffer);
+	free(request);
+}
+
+/* what dispatch_read_write() does after validating the request */
+static NTSTATUS request_submit(request_t *request, libusb_endpoint_t *endpoint,
+							   int max_transfer_size)
+{
+	InterlockedIncrement(&dev->remove_lock.usage_count);
+
+	return transfer(dev, &request->irp,
+		(endpoint->address & 0x80)
+			? USBD_TRANSFER_DIRECTION_IN : USBD_TRANSFER_DIRECTION_OUT,
+		UrbFunctionFromEndpoint(endpoint), endpoint, 0, 0, 0,
+		&request->mdl, request->length, max_transfer_size, 0, 0);
+}
+
+static bool_t request_data_ok(request_t *request, ULONG first)
+{
+	ULONG i;
+
+	for (i = 0; i < request->irp.IoStatus.Information; i++)
+	{
+		if (request->buffer[i] != (UCHAR)(first + i))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* nothing may be left behind once all requests are completed */
+static void check_released(void)
+{
+	CHECK(usbd.queued == 0);
+	CHECK(pools == 0);
+	CHECK(mdls == 0);
+	CHECK(irps == 0);
+	CHECK(buffer_refs == 0);
+	CHECK(dev->remove_lock.usage_count == 0);
+	CHECK(dev->pending_busy[EP_BULK_IN] == 0);
+	CHECK(dev->pending_busy[EP_BULK_OUT] == 0);
+	CHECK(dev->pending_busy[EP_ISO_IN] == 0);
+}
+
+static int chunk_count(int length, int max_transfer_size)
+{
+	return length ? (length + max_transfer_size - 1) / max_transfer_size : 1;
+}
+
+/* checks */
+
+static void check_macros(void)
+{
+	int length, max_transfer_size, remaining, chunk, chunks, total;
+
+	scenario = "macros";
+
+	CHECK(TRANSFER_CHUNK_SIZE(100, 64) == 64);
+	CHECK(TRANSFER_CHUNK_SIZE(64, 64) == 64);
+	CHECK(TRANSFER_CHUNK_SIZE(10, 64) == 10);
+	CHECK(TRANSFER_CHUNK_SIZE(0, 64) == 0);
+
+	CHECK(TRANSFER_REMAINING(100, 64) == 36);
+	CHECK(TRANSFER_REMAINING(100, 100) == 0);
+	CHECK(TRANSFER_REMAINING(100, 120) == 0);
+
+	/* full chunk of full packets with data left */
+	CHECK(TRANSFER_NEEDS_NEXT_CHUNK(64, 36, 16, 64));
+	/* nothing left */
+	CHECK(!TRANSFER_NEEDS_NEXT_CHUNK(64, 0, 16, 64));
+	/* short chunk of full packets, ended by a ZLP */
+	CHECK(!TRANSFER_NEEDS_NEXT_CHUNK(48, 52, 16, 64));
+	/* short packet */
+	CHECK(!TRANSFER_NEEDS_NEXT_CHUNK(63, 37, 16, 64));
+	/* a chunk that is not made of whole packets ends the transfer */
+	CHECK(!TRANSFER_NEEDS_NEXT_CHUNK(64, 36, 48, 64));
+
+	/* the loop of transfer_complete() with every urb filled */
+	for (max_transfer_size = 512; max_transfer_size <= 4096; max_transfer_size *= 2)
+	{
+		for (length = 0; length < 5 * max_transfer_size; length += 97)
+		{
+			remaining = length;
+			chunks = 0;
+			total = 0;
+			do
+			{
+				chunk = TRANSFER_CHUNK_SIZE(remaining, max_transfer_size);
+				remaining = TRANSFER_REMAINING(remaining, chunk);
+				total += chunk;
+				chunks++;
+			}
+			while (TRANSFER_NEEDS_NEXT_CHUNK(chunk, remaining, PACKET_SIZE,
+											 max_transfer_size));
+
+			CHECK(total == length);
+			CHECK(chunks == chunk_count(length, max_transfer_size));
+		}
+	}
+}
+
+static void check_bulk(const char *name, bool_t inline_completion,
+					   libusb_endpoint_t *endpoint, int length)
+{
+	request_t *request;
+	NTSTATUS status;
+
+	scenario = name;
+	usbd_reset(inline_completion);
+
+	request = request_create(length);
+	status = request_submit(request, endpoint, MAX_TRANSFER_SIZE);
+	usbd_run(USBD_ALL);
+
+	CHECK(status == (inline_completion ? STATUS_SUCCESS : STATUS_PENDING));
+	CHECK(request->completions == 1);
+	CHECK(request->irp.IoStatus.Status == STATUS_SUCCESS);
+	CHECK(request->irp.IoStatus.Information == (ULONG)length);
+	CHECK(usbd.urbs == chunk_count(length, MAX_TRANSFER_SIZE));
+	CHECK(request_data_ok(request, 0));
+	check_released();
+
+	request_free(request);
+}
+
+static void check_short(const char *name, int short_at, int short_length)
+{
+	request_t *request;
+
+	scenario = name;
+	usbd_reset(FALSE);
+	usbd.short_at = short_at;
+	usbd.short_length = short_length;
+
+	request = request_create(8 * MAX_TRANSFER_SIZE);
+	request_submit(request, &bulk_in, MAX_TRANSFER_SIZE);
+	usbd_run(USBD_ALL);
+
+	CHECK(request->completions == 1);
+	CHECK(request->irp.IoStatus.Status == STATUS_SUCCESS);
+	CHECK(request->irp.IoStatus.Information
+		  == (ULONG)((short_at - 1) * MAX_TRANSFER_SIZE + short_length));
+	CHECK(usbd.urbs == short_at);
+	CHECK(request_data_ok(request, 0));
+	check_released();
+
+	request_free(request);
+}
+
+static void check_stall(const char *name, bool_t inline_completion)
+{
+	request_t *request;
+
+	scenario = name;
+	usbd_reset(inline_completion);
+	usbd.stall_at = 2;
+
+	request = request_create(4 * MAX_TRANSFER_SIZE);
+	request_submit(request, &bulk_in, MAX_TRANSFER_SIZE);
+	usbd_run(USBD_ALL);
+
+	CHECK(request->completions == 1);
+	CHECK(request->irp.IoStatus.Status == STATUS_UNSUCCESSFUL);
+	CHECK(request->irp.IoStatus.Information == MAX_TRANSFER_SIZE);
+	CHECK(usbd.urbs == 2);
+	check_released();
+
+	request_free(request);
+}
+
+static void check_cancel(void)
+{
+	request_t *request;
+
+	scenario = "cancel";
+	usbd_reset(FALSE);
+
+	request = request_create(4 * MAX_TRANSFER_SIZE);
+	request_submit(request, &bulk_in, MAX_TRANSFER_SIZE);
+	usbd_run(1);
+
+	CHECK(request->completions == 0);
+	CHECK(IoCancelIrp(&request->irp));
+
+	CHECK(request->completions == 1);
+	CHECK(request->irp.IoStatus.Status == STATUS_CANCELLED);
+	CHECK(request->irp.IoStatus.Information == MAX_TRANSFER_SIZE);
+	CHECK(usbd.urbs == 2);
+	check_released();
+
+	request_free(request);
+}
+
+/* a newer request on the pipe stops the older one after its current urb, */
+/* so data is never delivered out of order */
+static void check_pending_sequence(void)
+{
+	request_t *older, *newer;
+
+	scenario = "pending sequence";
+	usbd_reset(FALSE);
+
+	older = request_create(4 * MAX_TRANSFER_SIZE);
+	newer = request_create(MAX_TRANSFER_SIZE);
+	request_submit(older, &bulk_in, MAX_TRANSFER_SIZE);
+	request_submit(newer, &bulk_in, MAX_TRANSFER_SIZE);
+	usbd_run(USBD_ALL);
+
+	CHECK(older->completions == 1 && newer->completions == 1);
+	CHECK(older->order < newer->order);
+	CHECK(older->irp.IoStatus.Status == STATUS_SUCCESS);
+	CHECK(older->irp.IoStatus.Information == MAX_TRANSFER_SIZE);
+	CHECK(newer->irp.IoStatus.Information == MAX_TRANSFER_SIZE);
+	CHECK(request_data_ok(older, 0));
+	CHECK(request_data_ok(newer, MAX_TRANSFER_SIZE));
+	CHECK(usbd.urbs == 2);
+	check_released();
+
+	request_free(older);
+	request_free(newer);
+}
+
+/* more packets than fit into one urb are split into a chain, at high */
+/* speed already above 248 */
+static void check_iso_chain(const char *name, int packets,
+							bool_t inline_completion, bool_t cancel)
+{
+	int per_urb = 248;       /* high speed */
+	request_t *request;
+	NTSTATUS status;
+
+	scenario = name;
+	usbd_reset(inline_completion);
+
+	request = request_create(packets * ISO_PACKET_SIZE);
+	status = request_submit(request, &iso_in, 0);
+	CHECK(status == STATUS_PENDING);
+	CHECK(usbd.urbs == (packets + per_urb - 1) / per_urb);
+
+	if (cancel)
+	{
+		usbd_run(1);
+		CHECK(request->completions == 0);
+		CHECK(IoCancelIrp(&request->irp));
+
+		CHECK(request->irp.IoStatus.Status == STATUS_CANCELLED);
+		CHECK(request->irp.IoStatus.Information
+			  == (ULONG)(per_urb * ISO_PACKET_SIZE));
+	}
+	else
+	{
+		usbd_run(USBD_ALL);
+
+		CHECK(request->irp.IoStatus.Status == STATUS_SUCCESS);
+		CHECK(request->irp.IoStatus.Information
+			  == (ULONG)(packets * ISO_PACKET_SIZE));
+	}
+
+	CHECK(request->completions == 1);
+	check_released();
+
+	request_free(request);
+}
+
+/* benchmark */
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(double *sorted, int count, double p)
+{
+	int i = (int)(p * (count - 1) + 0.5);
+
+	return sorted[i];
+}
+
+/* bulk reads split into chunks, the stack completes one urb at a time */
+static void benchmark(int requests)
+{
+	int chunks = BENCH_REQUEST_SIZE / BENCH_CHUNK_SIZE;
+	request_t *request;
+	double start, elapsed;
+	int i;
+
+	scenario = "benchmark";
+	usbd_reset(FALSE);
+	usbd.fill = FALSE;
+	usbd.latencies = malloc(sizeof(double) * requests * chunks);
+	if (!usbd.latencies)
+	{
+		fprintf(stderr, "memory allocation error\n");
+		exit(1);
+	}
+
+	request = request_create(BENCH_REQUEST_SIZE);
+
+	start = now_us();
+	for (i = 0; i < requests; i++)
+	{
+		request_reset(request);
+		request_submit(request, &bulk_in, BENCH_CHUNK_SIZE);
+		usbd_run(chunks);
+		CHECK(request->completions == 1);
+	}
+	elapsed = now_us() - start;
+
+	CHECK(usbd.latency_count == requests * chunks);
+	check_released();
+
+	qsort(usbd.latencies, usbd.latency_count, sizeof(double), compare_double);
+
+	printf("%d requests of %d bytes in %d byte chunks\n",
+		   requests, BENCH_REQUEST_SIZE, BENCH_CHUNK_SIZE);
+	printf("%.0f chunks/s\n", usbd.latency_count / elapsed * 1e6);
+	printf("completion latency us: p50 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+		   percentile(usbd.latencies, usbd.latency_count, 0.5),
+		   percentile(usbd.latencies, usbd.latency_count, 0.99),
+		   percentile(usbd.latencies, usbd.latency_count, 0.999),
+		   usbd.latencies[usbd.latency_count - 1]);
+
+	free(usbd.latencies);
+	usbd.latencies = NULL;
+	request_free(request);
+}
+
+int main(int argc, char **argv)
+{
+	int requests = (argc > 1) ? atoi(argv[1]) : BENCH_REQUESTS;
+
+	device_init();
+
+	check_macros();
+	check_bulk("bulk read", FALSE, &bulk_in, 10 * MAX_TRANSFER_SIZE + 1000);
+	check_bulk("bulk read inline", TRUE, &bulk_in, 10 * MAX_TRANSFER_SIZE + 1000);
+	check_bulk("bulk read exact", FALSE, &bulk_in, 4 * MAX_TRANSFER_SIZE);
+	check_bulk("bulk read empty", FALSE, &bulk_in, 0);
+	check_bulk("bulk write", FALSE, &bulk_out, 6 * MAX_TRANSFER_SIZE + 7);
+	check_bulk("bulk write inline", TRUE, &bulk_out, 6 * MAX_TRANSFER_SIZE + 7);
+	check_short("short packet", 3, 1000);
+	check_short("zlp", 2, 0);
+	check_stall("stall", FALSE);
+	check_stall("stall inline", TRUE);
+	check_cancel();
+	check_pending_sequence();
+	check_iso_chain("iso chain", 600, FALSE, FALSE);
+	check_iso_chain("iso chain inline", 600, TRUE, FALSE);
+	check_iso_chain("iso chain cancel", 600, FALSE, TRUE);
+	check_iso_chain("iso chain partial frame", 250, FALSE, FALSE);
+
+	if (failures)
+	{
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("transfer checks passed\n");
+
+	if (requests > 0)
+		benchmark(requests);
+
+	free(dev);
+
+	return failures ? 1 : 0;
+}